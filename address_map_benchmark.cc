@@ -0,0 +1,317 @@
+// Benchmark for the maps that track live allocations by address.
+//
+// Measures insert, find and erase throughput, per-operation latency and
+// memory use per entry for each backend, over several address distributions
+// and map sizes. Results are printed as one table row per operation.
+//
+// Usage: address_map_benchmark [MAX_ENTRIES]
+//
+// MAX_ENTRIES defaults to 10^7. Map sizes go up by powers of ten from 10^4.
+// Latencies are in CycleClock ticks.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include <gperftools/custom_allocator.h>
+
+#include "base/cycleclock.h"
+#include "base/hash.h"
+#include "compact_address_map.h"
+#include "latency_histogram.h"
+#include "stl_allocator.h"
+
+namespace {
+
+// An allocation to be recorded in the map.
+struct Allocation {
+  uintptr_t address;
+  uint32_t size;
+};
+
+//------------------------------------------------------------------------------
+// Address distributions.
+//------------------------------------------------------------------------------
+
+// Objects of one size packed back to back, as in a bump or slab allocator.
+void GenerateSequential(size_t count, std::mt19937_64* rng,
+                        std::vector<Allocation>* result) {
+  const uintptr_t kBase = 0x7f1000000000ULL;
+  const uint32_t kObjectSize = 32;
+  for (size_t i = 0; i < count; ++i)
+    result->push_back({kBase + i * kObjectSize, kObjectSize});
+}
+
+// Objects carved out of 8 KiB spans, one size class per span, as in tcmalloc.
+// Small size classes are more common than large ones.
+void GenerateSizeClassSpans(size_t count, std::mt19937_64* rng,
+                            std::vector<Allocation>* result) {
+  const uintptr_t kBase = 0x55d000000000ULL;
+  const uint32_t kSpanSize = 8192;
+  const uint32_t kSizeClasses[] = {
+    16, 32, 48, 64, 80, 96, 128, 160, 192, 256, 384, 512, 1024, 2048, 4096,
+  };
+  const int kNumSizeClasses = sizeof(kSizeClasses) / sizeof(kSizeClasses[0]);
+
+  // The current span of each size class, and the next unused span.
+  uintptr_t span_cursor[kNumSizeClasses] = {};
+  uintptr_t span_end[kNumSizeClasses] = {};
+  uintptr_t next_span = kBase;
+
+  std::geometric_distribution<int> size_class_dist(0.25);
+  for (size_t i = 0; i < count; ++i) {
+    int size_class = size_class_dist(*rng) % kNumSizeClasses;
+    uint32_t size = kSizeClasses[size_class];
+    if (span_cursor[size_class] + size > span_end[size_class]) {
+      // Large objects get spans of several pages.
+      uintptr_t span_size = std::max(kSpanSize, size * 8);
+      span_cursor[size_class] = next_span;
+      span_end[size_class] = next_span + span_size;
+      next_span += span_size;
+    }
+    result->push_back({span_cursor[size_class], size});
+    span_cursor[size_class] += size;
+  }
+}
+
+// Objects bump-allocated in 2 MiB regions that are mapped at random places in
+// a 47-bit address space.
+void GenerateRandomRegions(size_t count, std::mt19937_64* rng,
+                           std::vector<Allocation>* result) {
+  const uintptr_t kRegionSize = 2 << 20;
+  const uintptr_t kNumRegionSlots = (1ULL << 47) / kRegionSize;
+  std::uniform_int_distribution<uintptr_t> slot_dist(1, kNumRegionSlots - 1);
+  std::uniform_int_distribution<uint32_t> size_dist(1, 64);
+
+  std::vector<uintptr_t> used_slots;
+  uintptr_t cursor = 0;
+  uintptr_t end = 0;
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t size = size_dist(*rng) * 16;
+    if (cursor + size > end) {
+      uintptr_t slot;
+      do {
+        slot = slot_dist(*rng);
+      } while (std::find(used_slots.begin(), used_slots.end(), slot) !=
+               used_slots.end());
+      used_slots.push_back(slot);
+      cursor = slot * kRegionSize;
+      end = cursor + kRegionSize;
+    }
+    result->push_back({cursor, size});
+    cursor += size;
+  }
+}
+
+struct Distribution {
+  const char* name;
+  void (*generate)(size_t count, std::mt19937_64* rng,
+                   std::vector<Allocation>* result);
+};
+
+const Distribution kDistributions[] = {
+  { "sequential", GenerateSequential },
+  { "size_class_spans", GenerateSizeClassSpans },
+  { "random_regions", GenerateRandomRegions },
+};
+
+//------------------------------------------------------------------------------
+// Backends. Each one must provide:
+//   Insert(uintptr_t address, size_t size, uint32_t hash);
+//   bool Find(uintptr_t address);
+//   bool Erase(uintptr_t address);
+// and allocate all of its memory from CustomAllocator::kAddressMapArena.
+//------------------------------------------------------------------------------
+
+// The map used by LeakDetectorImpl.
+class UnorderedMapBackend {
+ public:
+  UnorderedMapBackend()
+      : map_(0, AddressHash(), std::equal_to<uintptr_t>(),
+             Allocator(CustomAllocator::kAddressMapArena)) {}
+
+  void Insert(uintptr_t address, size_t size, uint32_t hash) {
+    Value& value = map_[address];
+    value.size = size;
+    value.call_stack = reinterpret_cast<const void*>(hash);
+  }
+  bool Find(uintptr_t address) {
+    return map_.find(address) != map_.end();
+  }
+  bool Erase(uintptr_t address) {
+    return map_.erase(address);
+  }
+
+ private:
+  // Same layout as LeakDetectorImpl::AllocInfo.
+  struct Value {
+    size_t size;
+    const void* call_stack;
+  };
+
+  struct AddressHash {
+    size_t operator() (uintptr_t addr) const {
+      return base::Hash(reinterpret_cast<const char*>(&addr), sizeof(addr));
+    }
+  };
+
+  using Allocator =
+      STL_Allocator<std::pair<const uintptr_t, Value>, CustomAllocator>;
+
+  std::unordered_map<uintptr_t, Value, AddressHash, std::equal_to<uintptr_t>,
+                     Allocator> map_;
+};
+
+template <int kFlags>
+class CompactAddressMapBackend {
+ public:
+  CompactAddressMapBackend() : map_(kFlags) {}
+
+  void Insert(uintptr_t address, size_t size, uint32_t hash) {
+    map_.Insert(reinterpret_cast<const void*>(address), size, &hash);
+  }
+  bool Find(uintptr_t address) {
+    CompactAddressMap::Entry entry;
+    return map_.Find(reinterpret_cast<const void*>(address), &entry);
+  }
+  bool Erase(uintptr_t address) {
+    CompactAddressMap::Entry entry;
+    return map_.FindAndRemove(reinterpret_cast<const void*>(address), &entry);
+  }
+
+ private:
+  CompactAddressMap map_;
+};
+
+//------------------------------------------------------------------------------
+// Measurement.
+//------------------------------------------------------------------------------
+
+double NowSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+size_t AddressMapBytesInUse() {
+  CustomAllocator::Stats stats;
+  CustomAllocator::GetStats(CustomAllocator::kAddressMapArena, &stats);
+  return stats.bytes_in_use;
+}
+
+void PrintHeader() {
+  printf("%-17s %-15s %10s %-6s %9s %7s %7s %7s %11s\n",
+         "distribution", "backend", "entries", "op", "Mops/s",
+         "p50", "p99", "p99.9", "bytes/entry");
+}
+
+void PrintRow(const char* distribution, const char* backend, size_t entries,
+              const char* op, size_t num_ops, double seconds,
+              const LatencyHistogram& latencies, double bytes_per_entry) {
+  printf("%-17s %-15s %10zu %-6s %9.2f %7" PRIu64 " %7" PRIu64 " %7" PRIu64
+         " %11.1f\n",
+         distribution, backend, entries, op, num_ops / seconds / 1e6,
+         latencies.Quantile(0.5), latencies.Quantile(0.99),
+         latencies.Quantile(0.999), bytes_per_entry);
+}
+
+// Used to keep the compiler from optimizing away lookups.
+size_t g_num_found;
+
+// Time |op| on each allocation in |allocations|.
+template <class Op>
+double TimeOps(const std::vector<Allocation>& allocations, Op op,
+               LatencyHistogram* latencies) {
+  double start = NowSeconds();
+  for (const Allocation& allocation : allocations) {
+    int64_t op_start = CycleClock::Now();
+    op(allocation);
+    latencies->Add(CycleClock::Now() - op_start);
+  }
+  return NowSeconds() - start;
+}
+
+template <class Backend>
+void RunBenchmark(const char* backend_name,
+                  const char* distribution,
+                  const std::vector<Allocation>& allocations,
+                  const std::vector<Allocation>& shuffled) {
+  const size_t count = allocations.size();
+  const size_t initial_bytes = AddressMapBytesInUse();
+  Backend backend;
+
+  // Allocations are recorded in the order they were made, but are looked up
+  // and freed in a random order.
+  LatencyHistogram insert_latencies;
+  double insert_seconds = TimeOps(allocations,
+      [&backend](const Allocation& allocation) {
+        backend.Insert(allocation.address, allocation.size,
+                        allocation.address >> 4);
+      }, &insert_latencies);
+  double bytes_per_entry =
+      static_cast<double>(AddressMapBytesInUse() - initial_bytes) / count;
+
+  LatencyHistogram find_latencies;
+  double find_seconds = TimeOps(shuffled,
+      [&backend](const Allocation& allocation) {
+        g_num_found += backend.Find(allocation.address);
+      }, &find_latencies);
+
+  LatencyHistogram erase_latencies;
+  double erase_seconds = TimeOps(shuffled,
+      [&backend](const Allocation& allocation) {
+        g_num_found += backend.Erase(allocation.address);
+      }, &erase_latencies);
+
+  PrintRow(distribution, backend_name, count, "insert", count,
+           insert_seconds, insert_latencies, bytes_per_entry);
+  PrintRow(distribution, backend_name, count, "find", count, find_seconds,
+           find_latencies, bytes_per_entry);
+  PrintRow(distribution, backend_name, count, "erase", count, erase_seconds,
+           erase_latencies, bytes_per_entry);
+  fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  size_t max_entries = 10000000;
+  if (argc > 1)
+    max_entries = strtoull(argv[1], NULL, 0);
+
+  CustomAllocator::Initialize();
+  PrintHeader();
+
+  for (const Distribution& distribution : kDistributions) {
+    for (size_t count = 10000; count <= max_entries; count *= 10) {
+      std::mt19937_64 rng(count);
+      std::vector<Allocation> allocations;
+      allocations.reserve(count);
+      distribution.generate(count, &rng, &allocations);
+      std::vector<Allocation> shuffled(allocations);
+      std::shuffle(shuffled.begin(), shuffled.end(), rng);
+
+      g_num_found = 0;
+      RunBenchmark<UnorderedMapBackend>(
+          "unordered_map", distribution.name, allocations, shuffled);
+      RunBenchmark<CompactAddressMapBackend<0>>(
+          "compact_map", distribution.name, allocations, shuffled);
+      RunBenchmark<CompactAddressMapBackend<CompactAddressMap::kConcurrent>>(
+          "compact_map_mt", distribution.name, allocations, shuffled);
+      if (g_num_found != 3 * 2 * count) {
+        fprintf(stderr, "Lookups failed for %s with %zu entries.\n",
+                distribution.name, count);
+        return 1;
+      }
+    }
+  }
+
+  CustomAllocator::Shutdown();
+  return 0;
+}
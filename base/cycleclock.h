@@ -0,0 +1,34 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef BASE_CYCLECLOCK_H_
+#define BASE_CYCLECLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// A cheap, monotonic-enough tick counter for measuring short intervals, such as
+// the time a lock is held. Uses the CPU timestamp counter where available and
+// falls back to clock_gettime() elsewhere. The tick rate is not specified.
+struct CycleClock {
+  static inline int64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return static_cast<int64_t>(__rdtsc());
+#elif defined(__aarch64__)
+    int64_t virtual_timer_value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(virtual_timer_value));
+    return virtual_timer_value;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+  }
+};
+
+#endif  // BASE_CYCLECLOCK_H_
@@ -2,9 +2,13 @@
 #include <stddef.h>
 
 #include "base/low_level_alloc.h"
+#include "base/cycleclock.h"
 #include "base/logging.h"
 #include "base/macros.h"
+#include "base/spinlock.h"
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/mman.h>
 
@@ -142,10 +146,16 @@ static void LLA_SkiplistDelete(AllocList *head, AllocList *e,
 // Arena implementation
 
 struct LowLevelAlloc::Arena {
-  Arena() {} // does nothing; for static init
-  explicit Arena(int) : pagesize(0) {}  // set pagesize to zero explicitly
-                                        // for non-static init
-
+  Arena() : mu(SpinLock::LINKER_INITIALIZED) {} // does nothing; for static init
+  explicit Arena(int)                   // set pagesize to zero explicitly
+      : pagesize(0),                    // for non-static init
+        num_acquisitions(0),
+        num_contended_acquisitions(0),
+        cycles_held(0),
+        cycles_waited(0) {}
+
+  SpinLock mu;            // protects freelist, allocation_count,
+                          // pagesize, roundup, min_size and lock stats
   AllocList freelist;     // head of free list; sorted by addr (under mu)
   int32_t allocation_count; // count of allocated blocks (under mu)
   int32_t flags;            // flags passed to NewArena (ro after init)
@@ -154,6 +164,13 @@ struct LowLevelAlloc::Arena {
                           // (init under mu, then ro)
   size_t min_size;        // smallest allocation block size
                           // (init under mu, then ro)
+
+  // Lock statistics (under mu).
+  int64_t num_acquisitions;           // times mu was acquired
+  int64_t num_contended_acquisitions; // ... and was already held by another
+  int64_t cycles_held;                // CycleClock ticks mu was held for
+  int64_t cycles_waited;              // CycleClock ticks spent waiting for mu
+  int64_t acquired_at;                // CycleClock time of last acquisition
 };
 
 // The default arena, which is used when 0 is passed instead of an Arena
@@ -170,42 +187,55 @@ static struct LowLevelAlloc::Arena unhooked_async_sig_safe_arena;
 static const intptr_t kMagicAllocated = 0x4c833e95;
 static const intptr_t kMagicUnallocated = ~kMagicAllocated;
 
+// Acquire and release arena->mu, keeping track of lock statistics.
+// L < arena->mu
+static void LockArena(LowLevelAlloc::Arena *arena) {
+  if (arena->mu.TryLock()) {
+    arena->acquired_at = CycleClock::Now();
+  } else {
+    int64_t wait_start = CycleClock::Now();
+    arena->mu.Lock();
+    arena->acquired_at = CycleClock::Now();
+    arena->num_contended_acquisitions++;
+    arena->cycles_waited += arena->acquired_at - wait_start;
+  }
+  arena->num_acquisitions++;
+}
+
+// L >= arena->mu
+static void UnlockArena(LowLevelAlloc::Arena *arena) {
+  arena->cycles_held += CycleClock::Now() - arena->acquired_at;
+  arena->mu.Unlock();
+}
+
 namespace {
   class ArenaLock {
    public:
     explicit ArenaLock(LowLevelAlloc::Arena *arena)
         : left_(false), mask_valid_(false), arena_(arena) {
       if ((arena->flags & LowLevelAlloc::kAsyncSignalSafe) != 0) {
-      // We've decided not to support async-signal-safe arena use until
-      // there a demonstrated need.  Here's how one could do it though
-      // (would need to be made more portable).
-#if 0
+        // Block all signals while inside the arena, so that a signal handler
+        // that allocates from the same arena can never interrupt a thread
+        // that is in the middle of modifying the freelist.
         sigset_t all;
         sigfillset(&all);
         this->mask_valid_ =
             (pthread_sigmask(SIG_BLOCK, &all, &this->mask_) == 0);
-#else
-        RAW_CHECK(false, "We do not yet support async-signal-safe arena.");
-#endif
       }
-//      this->arena_->mu.Lock();
+      LockArena(this->arena_);
     }
     ~ArenaLock() { RAW_CHECK(this->left_, "haven't left Arena region"); }
     void Leave() /*UNLOCK_FUNCTION()*/ {
-//      this->arena_->mu.Unlock();
-#if 0
+      UnlockArena(this->arena_);
       if (this->mask_valid_) {
         pthread_sigmask(SIG_SETMASK, &this->mask_, 0);
       }
-#endif
       this->left_ = true;
     }
    private:
     bool left_;       // whether left region
     bool mask_valid_;
-#if 0
     sigset_t mask_;   // old mask of blocked signals
-#endif
     LowLevelAlloc::Arena *arena_;
     DISALLOW_COPY_AND_ASSIGN(ArenaLock);
   };
@@ -412,7 +442,7 @@ static void *DoAllocWithArena(size_t request, LowLevelAlloc::Arena *arena) {
       }
       // we unlock before mmap() both because mmap() may call a callback hook,
       // and because it may be slow.
-      //arena->mu.Unlock();
+      UnlockArena(arena);
       // mmap generous 64K chunks to decrease
       // the chances/impact of fragmentation:
       size_t new_pages_size = RoundUp(req_rnd, arena->pagesize * 16);
@@ -427,7 +457,7 @@ static void *DoAllocWithArena(size_t request, LowLevelAlloc::Arena *arena) {
             PROT_WRITE|PROT_READ, MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
       }
       RAW_CHECK(new_pages != MAP_FAILED, "mmap error");
-//      arena->mu.Lock();
+      LockArena(arena);
       s = reinterpret_cast<AllocList *>(new_pages);
       s->header.size = new_pages_size;
       // Pretend the block is allocated; call AddToFreelist() to free it.
@@ -481,3 +511,15 @@ void *LowLevelAlloc::AllocWithArena(size_t request, Arena *arena) {
 LowLevelAlloc::Arena *LowLevelAlloc::DefaultArena() {
   return &default_arena;
 }
+
+void LowLevelAlloc::GetLockStats(Arena *arena, LockStats *stats) {
+  RAW_CHECK(arena != 0, "must pass a valid arena");
+  // Through ArenaLock, so that a signal handler that allocates from the arena
+  // cannot interrupt this thread while it holds the lock.
+  ArenaLock section(arena);
+  stats->num_acquisitions = arena->num_acquisitions;
+  stats->num_contended_acquisitions = arena->num_contended_acquisitions;
+  stats->cycles_held = arena->cycles_held;
+  stats->cycles_waited = arena->cycles_waited;
+  section.Leave();
+}
@@ -100,6 +100,16 @@ class LowLevelAlloc {
   // The default arena that always exists.
   static Arena *DefaultArena();
 
+  // Statistics about the lock that guards an arena. Times are in CycleClock
+  // ticks.
+  struct LockStats {
+    int64_t num_acquisitions;
+    int64_t num_contended_acquisitions;  // had to wait for another thread
+    int64_t cycles_held;
+    int64_t cycles_waited;
+  };
+  static void GetLockStats(Arena *arena, LockStats *stats);
+
  private:
   LowLevelAlloc();      // no instances
 };
@@ -0,0 +1,61 @@
+#include "base/low_level_alloc.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+LowLevelAlloc::Arena* g_arena = nullptr;
+std::atomic<int> g_num_handler_allocs(0);
+
+// Allocates from |g_arena|, which the interrupted thread may be allocating
+// from too.
+void AllocatingHandler(int /* signum */) {
+  void* ptr = LowLevelAlloc::AllocWithArena(64, g_arena);
+  memset(ptr, 0xab, 64);
+  LowLevelAlloc::Free(ptr);
+  ++g_num_handler_allocs;
+}
+
+}  // namespace
+
+TEST(LowLevelAllocTest, AllocFromSignalHandler) {
+  g_arena = LowLevelAlloc::NewArena(LowLevelAlloc::kAsyncSignalSafe,
+                                    LowLevelAlloc::DefaultArena());
+  struct sigaction action, old_action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &AllocatingHandler;
+  sigemptyset(&action.sa_mask);
+  ASSERT_EQ(0, sigaction(SIGUSR2, &action, &old_action));
+
+  // Interrupt this thread with the handler as often as possible while it
+  // allocates. Without blocking signals inside the arena, a handler that
+  // lands in the middle of an allocation spins on the arena lock forever.
+  std::atomic<bool> done(false);
+  pthread_t main_thread = pthread_self();
+  std::thread signaler([&]() {
+    while (!done)
+      pthread_kill(main_thread, SIGUSR2);
+  });
+  LowLevelAlloc::LockStats stats;
+  for (int i = 0; i < 200000; ++i) {
+    void* ptr = LowLevelAlloc::AllocWithArena(16 + i % 256, g_arena);
+    memset(ptr, 0, 16);
+    LowLevelAlloc::GetLockStats(g_arena, &stats);
+    LowLevelAlloc::Free(ptr);
+  }
+  done = true;
+  signaler.join();
+
+  sigaction(SIGUSR2, &old_action, nullptr);
+  EXPECT_GT(g_num_handler_allocs, 0);
+  LowLevelAlloc::GetLockStats(g_arena, &stats);
+  EXPECT_GT(stats.num_acquisitions, 2 * 200000);
+  EXPECT_TRUE(LowLevelAlloc::DeleteArena(g_arena));
+}
@@ -0,0 +1,48 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "base/spinlock.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// Number of times to poll the lock word before going to sleep.
+const int kSpinIterations = 1000;
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
+
+}  // namespace
+
+void SpinLock::SlowLock() {
+  // Spin for a while in case the holder is about to release the lock.
+  for (int i = 0; i < kSpinIterations; ++i) {
+    if (__atomic_load_n(&lockword_, __ATOMIC_RELAXED) == kSpinLockFree &&
+        TryLock()) {
+      return;
+    }
+    CpuRelax();
+  }
+
+  // Mark the lock as having sleepers and wait until it is released. Once a
+  // thread has slept it must acquire the lock as kSpinLockSleeper, since it
+  // cannot tell whether other threads are still sleeping.
+  while (__atomic_exchange_n(&lockword_, kSpinLockSleeper, __ATOMIC_ACQUIRE) !=
+         kSpinLockFree) {
+    syscall(SYS_futex, &lockword_, FUTEX_WAIT_PRIVATE, kSpinLockSleeper,
+            nullptr, nullptr, 0);
+  }
+}
+
+void SpinLock::SlowUnlock() {
+  syscall(SYS_futex, &lockword_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
@@ -0,0 +1,84 @@
+// Copyright 2015 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef BASE_SPINLOCK_H_
+#define BASE_SPINLOCK_H_
+
+#include "base/macros.h"
+
+// A lock that does not allocate memory and does not depend on any other
+// library state, so that it can be used inside the memory allocator and the
+// allocation hooks. Waiters spin briefly, then sleep on a futex.
+class SpinLock {
+ public:
+  SpinLock() : lockword_(kSpinLockFree) {}
+
+  // Special constructor for objects with static storage duration, whose
+  // zero-initialized lock word is already valid. Does not write the lock word,
+  // so that it cannot race with uses of the lock before static initializers
+  // have run.
+  enum LinkerInitialized { LINKER_INITIALIZED };
+  explicit SpinLock(LinkerInitialized) {}
+
+  inline void Lock() {
+    if (!TryLock())
+      SlowLock();
+  }
+
+  // Acquires the lock if it is free and returns true, otherwise returns false
+  // without blocking.
+  inline bool TryLock() {
+    int expected = kSpinLockFree;
+    return __atomic_compare_exchange_n(&lockword_, &expected, kSpinLockHeld,
+                                       false, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED);
+  }
+
+  inline void Unlock() {
+    if (__atomic_exchange_n(&lockword_, kSpinLockFree, __ATOMIC_RELEASE) ==
+        kSpinLockSleeper) {
+      SlowUnlock();
+    }
+  }
+
+  // Returns true if the lock is held by some thread. Only useful for
+  // assertions.
+  inline bool IsHeld() const {
+    return __atomic_load_n(&lockword_, __ATOMIC_RELAXED) != kSpinLockFree;
+  }
+
+ private:
+  enum {
+    kSpinLockFree = 0,
+    kSpinLockHeld = 1,
+    kSpinLockSleeper = 2,  // Held, and there may be threads sleeping on it.
+  };
+
+  void SlowLock();
+  void SlowUnlock();
+
+  int lockword_;
+
+  DISALLOW_COPY_AND_ASSIGN(SpinLock);
+};
+
+// Corresponding locker object that arranges to acquire a spinlock for the
+// duration of a C++ scope.
+class SpinLockHolder {
+ public:
+  explicit SpinLockHolder(SpinLock* lock) : lock_(lock) {
+    lock_->Lock();
+  }
+
+  ~SpinLockHolder() {
+    lock_->Unlock();
+  }
+
+ private:
+  SpinLock* lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(SpinLockHolder);
+};
+
+#endif  // BASE_SPINLOCK_H_
@@ -11,22 +11,30 @@
 #include <new>
 
 #include "base/hash.h"
+#include "checkpoint.h"
+#include "self_profile.h"
 
 namespace leak_detector {
 
-CallStackManager::CallStackManager() {}
+CallStackManager::CallStackManager()
+    : call_stacks_(CallStackPointerAllocator(CustomAllocator::kCallStackArena)) {
+}
 
 CallStackManager::~CallStackManager() {
   for (CallStack* call_stack : call_stacks_) {
     CustomAllocator::Free(call_stack->stack,
-                          call_stack->depth * sizeof(*call_stack->stack));
-    CustomAllocator::Free(call_stack, sizeof(CallStack));
+                          call_stack->depth * sizeof(*call_stack->stack),
+                          CustomAllocator::kCallStackArena);
+    CustomAllocator::Free(call_stack, sizeof(CallStack),
+                          CustomAllocator::kCallStackArena);
   }
   call_stacks_.clear();
 }
 
 const CallStack* CallStackManager::GetCallStack(
     int depth, const void* const stack[]) {
+  self_profile::ScopedTimer timer(self_profile::kGetCallStack);
+
   // Temporarily create a call stack object for lookup in |call_stacks_|.
   CallStack temp;
   temp.depth = depth;
@@ -43,19 +51,34 @@ const CallStack* CallStackManager::GetCallStack(
   // Since |call_stacks_| stores CallStack pointers rather than actual objects,
   // create new call objects manually here.
   CallStack* call_stack =
-      new(CustomAllocator::Allocate(sizeof(CallStack))) CallStack;
+      new(CustomAllocator::Allocate(sizeof(CallStack),
+                                    CustomAllocator::kCallStackArena))
+      CallStack;
   memset(call_stack, 0, sizeof(*call_stack));
   call_stack->depth = depth;
   call_stack->hash = temp.hash;  // Don't run the hash function again.
   call_stack->stack =
       reinterpret_cast<const void**>(
-          CustomAllocator::Allocate(sizeof(*stack) * depth));
+          CustomAllocator::Allocate(sizeof(*stack) * depth,
+                                    CustomAllocator::kCallStackArena));
   std::copy(stack, stack + depth, call_stack->stack);
 
   call_stacks_.insert(call_stack);
   return call_stack;
 }
 
+void CallStackManager::Save(CheckpointWriter* writer) const {
+  writer->WriteUint64(call_stacks_.size());
+  for (const CallStack* call_stack : call_stacks_)
+    writer->DefineCallStack(call_stack);
+}
+
+void CallStackManager::Load(CheckpointReader* reader) {
+  uint64_t num_call_stacks = reader->ReadUint64();
+  for (uint64_t i = 0; i < num_call_stacks && reader->ok(); ++i)
+    reader->ReadCallStackDefinition(this);
+}
+
 bool CallStackManager::CallStackPointerEqual::operator() (
     const CallStack* c1, const CallStack* c2) const {
   return c1->depth == c2->depth &&
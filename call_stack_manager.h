@@ -15,6 +15,9 @@
 
 namespace leak_detector {
 
+class CheckpointReader;
+class CheckpointWriter;
+
 // Struct to represent a call stack.
 struct CallStack {
   uint32_t depth;                        // Depth of current call stack.
@@ -42,6 +45,11 @@ class CallStackManager {
     return call_stacks_.size();
   }
 
+  // Save all call stacks to |writer|, or create those saved in |reader|. Other
+  // objects in the same checkpoint refer to the call stacks by id.
+  void Save(CheckpointWriter* writer) const;
+  void Load(CheckpointReader* reader);
+
  private:
   // Allocator class for unique call stacks.
   using CallStackPointerAllocator = STL_Allocator<CallStack*, CustomAllocator>;
@@ -4,8 +4,11 @@
 
 #include "components/metrics/leak_detector/call_stack_table.h"
 
+#include <algorithm>
 #include <utility>
+#include <vector>
 
+#include "checkpoint.h"
 #include "components/metrics/leak_detector/call_stack_manager.h"
 
 namespace leak_detector {
@@ -34,7 +37,10 @@ size_t CallStackTable::StoredHash::operator() (
 CallStackTable::CallStackTable(int call_stack_suspicion_threshold)
     : num_allocs_(0),
       num_frees_(0),
-      entry_map_(kInitialHashTableSize),
+      entry_map_(kInitialHashTableSize,
+                 StoredHash(),
+                 std::equal_to<const CallStack*>(),
+                 TableEntryAllocator(CustomAllocator::kAnalysisArena)),
       leak_analyzer_(kRankedListSize, call_stack_suspicion_threshold) {
 }
 
@@ -93,17 +99,74 @@ size_t CallStackTable::Dump(const size_t buffer_size, char* buffer) const {
 }
 
 void CallStackTable::TestForLeaks() {
-  // Add all entries to the ranked list.
+  // Add all entries to the ranked list. Entries with equal counts are ranked in
+  // the order they are added, so add them in order of their values rather than
+  // in the order of the hash table, which depends on its history.
+  std::vector<std::pair<ValueType, uint32_t>,
+              STL_Allocator<std::pair<ValueType, uint32_t>, CustomAllocator>>
+      entries(STL_Allocator<std::pair<ValueType, uint32_t>, CustomAllocator>(
+          CustomAllocator::kAnalysisArena));
+  entries.reserve(entry_map_.size());
+  for (const auto& entry_pair : entry_map_) {
+    const Entry& entry = entry_pair.second;
+    if (entry.net_num_allocs > 0)
+      entries.emplace_back(ValueType(entry_pair.first), entry.net_num_allocs);
+  }
+  std::sort(entries.begin(), entries.end());
+
   RankedList ranked_list(kRankedListSize);
+  for (const auto& entry : entries)
+    ranked_list.Add(entry.first, entry.second);
+  leak_analyzer_.AddSample(std::move(ranked_list));
+}
+
+void CallStackTable::ClearCounts() {
+  entry_map_.clear();
+  num_allocs_ = 0;
+  num_frees_ = 0;
+}
 
+void CallStackTable::AddCounts(const CallStackTable& other) {
+  for (const auto& entry_pair : other.entry_map_) {
+    entry_map_[entry_pair.first].net_num_allocs +=
+        entry_pair.second.net_num_allocs;
+  }
+  num_allocs_ += other.num_allocs_;
+  num_frees_ += other.num_frees_;
+}
+
+void CallStackTable::AddCount(const CallStack* call_stack, uint32_t count) {
+  if (!count)
+    return;
+  entry_map_[call_stack].net_num_allocs += count;
+  num_allocs_ += count;
+}
+
+void CallStackTable::Save(CheckpointWriter* writer) const {
+  writer->WriteUint32(num_allocs_);
+  writer->WriteUint32(num_frees_);
+  writer->WriteUint64(entry_map_.size());
   for (const auto& entry_pair : entry_map_) {
-    const Entry& entry = entry_pair.second;
-    if (entry.net_num_allocs > 0) {
-      LeakDetectorValueType call_stack_value(entry_pair.first);
-      ranked_list.Add(call_stack_value, entry.net_num_allocs);
+    writer->WriteCallStack(entry_pair.first);
+    writer->WriteUint32(entry_pair.second.net_num_allocs);
+  }
+  leak_analyzer_.Save(writer);
+}
+
+void CallStackTable::Load(CheckpointReader* reader) {
+  ClearCounts();
+  num_allocs_ = reader->ReadUint32();
+  num_frees_ = reader->ReadUint32();
+  uint64_t num_entries = reader->ReadUint64();
+  for (uint64_t i = 0; i < num_entries && reader->ok(); ++i) {
+    const CallStack* call_stack = reader->ReadCallStack();
+    if (!call_stack) {
+      reader->Fail();
+      break;
     }
+    entry_map_[call_stack].net_num_allocs = reader->ReadUint32();
   }
-  leak_analyzer_.AddSample(std::move(ranked_list));
+  leak_analyzer_.Load(reader);
 }
 
 }  // namespace leak_detector
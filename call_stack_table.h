@@ -18,6 +18,8 @@
 namespace leak_detector {
 
 struct CallStack;
+class CheckpointReader;
+class CheckpointWriter;
 
 // Contains a hash table where the key is the call stack and the value is the
 // number of allocations from that call stack.
@@ -45,6 +47,30 @@ class CallStackTable {
   // Check for leak patterns in the allocation data.
   void TestForLeaks();
 
+  // Reset all alloc and free counts to zero, keeping the leak analysis state.
+  void ClearCounts();
+
+  // Add the alloc and free counts of |other| to those of this table.
+  void AddCounts(const CallStackTable& other);
+
+  // Add |count| allocations of |call_stack| that have not been freed.
+  void AddCount(const CallStack* call_stack, uint32_t count);
+
+  // Call |callback(call_stack, net_num_allocs)| for each call stack with a
+  // nonzero net number of allocations, in no particular order.
+  template <typename Callback>
+  void ForEachCount(Callback callback) const {
+    for (const auto& entry_pair : entry_map_) {
+      if (entry_pair.second.net_num_allocs > 0)
+        callback(entry_pair.first, entry_pair.second.net_num_allocs);
+    }
+  }
+
+  // Save the counts and the leak analysis state to |writer|, or replace them
+  // with those saved in |reader|.
+  void Save(CheckpointWriter* writer) const;
+  void Load(CheckpointReader* reader);
+
   const LeakAnalyzer& leak_analyzer() const {
     return leak_analyzer_;
   }
@@ -0,0 +1,230 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "call_stack_manager.h"
+
+namespace leak_detector {
+
+namespace {
+
+// Deeper call stacks are taken as a sign of a corrupt checkpoint.
+const uint32_t kMaxCallStackDepth = 1024;
+
+}  // namespace
+
+CheckpointWriter::CheckpointWriter()
+    : fd_(-1),
+      failed_(false),
+      buffer_size_(0),
+      call_stack_ids_(16,
+                      std::hash<const CallStack*>(),
+                      std::equal_to<const CallStack*>(),
+                      decltype(call_stack_ids_)::allocator_type(
+                          CustomAllocator::kDefaultArena)) {
+}
+
+CheckpointWriter::~CheckpointWriter() {
+  Close();
+}
+
+bool CheckpointWriter::Open(const char* path) {
+  Close();
+  fd_ = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  failed_ = fd_ < 0;
+  buffer_size_ = 0;
+  call_stack_ids_.clear();
+  return !failed_;
+}
+
+bool CheckpointWriter::Close() {
+  if (fd_ < 0)
+    return !failed_;
+  Flush();
+  if (close(fd_) != 0)
+    failed_ = true;
+  fd_ = -1;
+  return !failed_;
+}
+
+void CheckpointWriter::WriteUint32(uint32_t value) {
+  WriteBytes(&value, sizeof(value));
+}
+
+void CheckpointWriter::WriteUint64(uint64_t value) {
+  WriteBytes(&value, sizeof(value));
+}
+
+void CheckpointWriter::WriteBytes(const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size) {
+    if (buffer_size_ == sizeof(buffer_))
+      Flush();
+    size_t chunk = std::min(size, sizeof(buffer_) - buffer_size_);
+    memcpy(buffer_ + buffer_size_, bytes, chunk);
+    buffer_size_ += chunk;
+    bytes += chunk;
+    size -= chunk;
+  }
+}
+
+void CheckpointWriter::DefineCallStack(const CallStack* call_stack) {
+  WriteUint32(call_stack->depth);
+  for (uint32_t i = 0; i < call_stack->depth; ++i)
+    WriteUint64(reinterpret_cast<uintptr_t>(call_stack->stack[i]));
+  uint32_t id = call_stack_ids_.size() + 1;
+  call_stack_ids_.insert(std::make_pair(call_stack, id));
+}
+
+void CheckpointWriter::WriteCallStack(const CallStack* call_stack) {
+  if (!call_stack) {
+    WriteUint32(0);
+    return;
+  }
+  auto iter = call_stack_ids_.find(call_stack);
+  if (iter == call_stack_ids_.end()) {
+    failed_ = true;
+    WriteUint32(0);
+    return;
+  }
+  WriteUint32(iter->second);
+}
+
+void CheckpointWriter::WriteValue(const LeakDetectorValueType& value) {
+  WriteUint32(value.type());
+  WriteUint32(value.size());
+  WriteCallStack(value.call_stack());
+}
+
+void CheckpointWriter::Flush() {
+  const char* data = buffer_;
+  while (buffer_size_ && !failed_) {
+    ssize_t written = write(fd_, data, buffer_size_);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      failed_ = true;
+      break;
+    }
+    data += written;
+    buffer_size_ -= written;
+  }
+  buffer_size_ = 0;
+}
+
+CheckpointReader::CheckpointReader()
+    : fd_(-1),
+      failed_(false),
+      buffer_offset_(0),
+      buffer_size_(0),
+      call_stacks_(decltype(call_stacks_)::allocator_type(
+          CustomAllocator::kDefaultArena)) {
+}
+
+CheckpointReader::~CheckpointReader() {
+  Close();
+}
+
+bool CheckpointReader::Open(const char* path) {
+  Close();
+  fd_ = open(path, O_RDONLY | O_CLOEXEC);
+  failed_ = fd_ < 0;
+  buffer_offset_ = 0;
+  buffer_size_ = 0;
+  call_stacks_.clear();
+  return !failed_;
+}
+
+void CheckpointReader::Close() {
+  if (fd_ >= 0)
+    close(fd_);
+  fd_ = -1;
+}
+
+uint32_t CheckpointReader::ReadUint32() {
+  uint32_t value;
+  ReadBytes(&value, sizeof(value));
+  return value;
+}
+
+uint64_t CheckpointReader::ReadUint64() {
+  uint64_t value;
+  ReadBytes(&value, sizeof(value));
+  return value;
+}
+
+void CheckpointReader::ReadBytes(void* data, size_t size) {
+  char* bytes = static_cast<char*>(data);
+  while (size && !failed_) {
+    if (buffer_offset_ == buffer_size_) {
+      ssize_t result = read(fd_, buffer_, sizeof(buffer_));
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result <= 0) {
+        failed_ = true;
+        break;
+      }
+      buffer_offset_ = 0;
+      buffer_size_ = result;
+    }
+    size_t chunk = std::min(size, buffer_size_ - buffer_offset_);
+    memcpy(bytes, buffer_ + buffer_offset_, chunk);
+    buffer_offset_ += chunk;
+    bytes += chunk;
+    size -= chunk;
+  }
+  if (size)
+    memset(bytes, 0, size);
+}
+
+const CallStack* CheckpointReader::ReadCallStackDefinition(
+    CallStackManager* manager) {
+  uint32_t depth = ReadUint32();
+  if (depth > kMaxCallStackDepth)
+    failed_ = true;
+  if (failed_)
+    return nullptr;
+
+  const void* stack[depth];
+  for (uint32_t i = 0; i < depth; ++i)
+    stack[i] = reinterpret_cast<const void*>(ReadUint64());
+  const CallStack* call_stack = manager->GetCallStack(depth, stack);
+  call_stacks_.push_back(call_stack);
+  return call_stack;
+}
+
+const CallStack* CheckpointReader::ReadCallStack() {
+  uint32_t id = ReadUint32();
+  if (!id)
+    return nullptr;
+  if (id > call_stacks_.size()) {
+    failed_ = true;
+    return nullptr;
+  }
+  return call_stacks_[id - 1];
+}
+
+LeakDetectorValueType CheckpointReader::ReadValue() {
+  uint32_t type = ReadUint32();
+  uint32_t size = ReadUint32();
+  const CallStack* call_stack = ReadCallStack();
+  switch (type) {
+    case LeakDetectorValueType::kNone:
+      return LeakDetectorValueType();
+    case LeakDetectorValueType::kSize:
+      return LeakDetectorValueType(size);
+    case LeakDetectorValueType::kCallStack:
+      if (call_stack)
+        return LeakDetectorValueType(call_stack);
+      break;
+  }
+  failed_ = true;
+  return LeakDetectorValueType();
+}
+
+}  // namespace leak_detector
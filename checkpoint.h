@@ -0,0 +1,125 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <gperftools/custom_allocator.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "base/macros.h"
+#include "leak_detector_value_type.h"
+#include "stl_allocator.h"
+
+namespace leak_detector {
+
+struct CallStack;
+class CallStackManager;
+
+// Checkpoints hold the complete state of a leak detector, so that a trace
+// replay can be resumed from the point where a checkpoint was saved. Each class
+// of the detector saves and loads its own state with the two classes below.
+//
+// Call stacks are written out in full once, by the CallStackManager that owns
+// them, and everything else refers to them by id.
+//
+// Both classes do file I/O with read() and write() on a fixed buffer, and
+// allocate only from CustomAllocator, so they can be used from within the
+// allocation hooks.
+
+class CheckpointWriter {
+ public:
+  CheckpointWriter();
+  ~CheckpointWriter();
+
+  // Create the checkpoint at |path|. Returns false on failure.
+  bool Open(const char* path);
+
+  // Write out any buffered data and close the file. Returns false if anything
+  // failed since Open().
+  bool Close();
+
+  void WriteUint32(uint32_t value);
+  void WriteUint64(uint64_t value);
+  void WriteBytes(const void* data, size_t size);
+
+  // Write |call_stack| in full, and assign it the next id.
+  void DefineCallStack(const CallStack* call_stack);
+
+  // Write the id of |call_stack|, which must have been defined, or null.
+  void WriteCallStack(const CallStack* call_stack);
+
+  void WriteValue(const LeakDetectorValueType& value);
+
+ private:
+  void Flush();
+
+  int fd_;
+  bool failed_;
+
+  char buffer_[0x4000];
+  size_t buffer_size_;
+
+  // Ids of the call stacks defined so far. Zero stands for null.
+  std::unordered_map<const CallStack*,
+                     uint32_t,
+                     std::hash<const CallStack*>,
+                     std::equal_to<const CallStack*>,
+                     STL_Allocator<std::pair<const CallStack* const, uint32_t>,
+                                   CustomAllocator>> call_stack_ids_;
+
+  DISALLOW_COPY_AND_ASSIGN(CheckpointWriter);
+};
+
+class CheckpointReader {
+ public:
+  CheckpointReader();
+  ~CheckpointReader();
+
+  // Open the checkpoint at |path|. Returns false on failure.
+  bool Open(const char* path);
+  void Close();
+
+  // Once a read fails, all further reads return zeros, and ok() is false.
+  uint32_t ReadUint32();
+  uint64_t ReadUint64();
+  void ReadBytes(void* data, size_t size);
+
+  // Read a call stack written by DefineCallStack(), get the matching call stack
+  // object from |manager|, and assign it the next id.
+  const CallStack* ReadCallStackDefinition(CallStackManager* manager);
+
+  // Read a call stack id, and return the call stack that it was assigned to.
+  const CallStack* ReadCallStack();
+
+  LeakDetectorValueType ReadValue();
+
+  // Mark the checkpoint as invalid.
+  void Fail() {
+    failed_ = true;
+  }
+
+  bool ok() const {
+    return !failed_;
+  }
+
+ private:
+  int fd_;
+  bool failed_;
+
+  char buffer_[0x4000];
+  size_t buffer_offset_;
+  size_t buffer_size_;
+
+  // Call stacks by id, minus one.
+  std::vector<const CallStack*, STL_Allocator<const CallStack*, CustomAllocator>>
+      call_stacks_;
+
+  DISALLOW_COPY_AND_ASSIGN(CheckpointReader);
+};
+
+}  // namespace leak_detector
+
+#endif  // CHECKPOINT_H_
@@ -0,0 +1,152 @@
+#include "checkpoint.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "call_stack_table.h"
+#include "gtest/gtest.h"
+#include "sharded_leak_detector.h"
+#include "test_workload.h"
+
+namespace leak_detector {
+
+namespace {
+
+const int kSizeSuspicionThreshold = 4;
+const int kCallStackSuspicionThreshold = 4;
+
+}  // namespace
+
+class CheckpointTest : public ::testing::Test {
+ public:
+  CheckpointTest() {}
+
+  void SetUp() override {
+    CustomAllocator::InitializeForUnitTest();
+    char path[] = "/tmp/checkpoint_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    path_ = path;
+  }
+
+  void TearDown() override {
+    unlink(path_.c_str());
+    CustomAllocator::Shutdown();
+  }
+
+ protected:
+  std::string path_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(CheckpointTest);
+};
+
+TEST_F(CheckpointTest, ResumeFromCheckpoint) {
+  for (int num_shards = 0; num_shards <= 2; ++num_shards) {
+    ShardedLeakDetector original(num_shards, kTestMappingAddr, kTestMappingSize,
+                                 kSizeSuspicionThreshold,
+                                 kCallStackSuspicionThreshold, false);
+    TestWorkload workload(num_shards);
+
+    // Save a checkpoint once a stack table has been created for the leaked
+    // size, but before any leaks are reported.
+    EXPECT_EQ(0U, workload.RunRounds(6, &original));
+
+    CheckpointWriter writer;
+    ASSERT_TRUE(writer.Open(path_.c_str()));
+    original.Save(&writer);
+    ASSERT_TRUE(writer.Close());
+
+    ShardedLeakDetector restored(num_shards, kTestMappingAddr, kTestMappingSize,
+                                 kSizeSuspicionThreshold,
+                                 kCallStackSuspicionThreshold, false);
+    CheckpointReader reader;
+    ASSERT_TRUE(reader.Open(path_.c_str()));
+    ASSERT_TRUE(restored.Load(&reader));
+
+    // The restored instance carries on exactly like the original one.
+    EXPECT_GT(workload.RunRounds(20, &original, &restored), 0U);
+  }
+}
+
+TEST_F(CheckpointTest, LoadOverStackTable) {
+  ShardedLeakDetector original(0, kTestMappingAddr, kTestMappingSize,
+                               kSizeSuspicionThreshold,
+                               kCallStackSuspicionThreshold, false);
+  TestWorkload workload(0);
+  workload.RunRounds(6, &original);
+
+  CheckpointWriter writer;
+  ASSERT_TRUE(writer.Open(path_.c_str()));
+  original.Save(&writer);
+  ASSERT_TRUE(writer.Close());
+
+  // The saved stack table of the leaked size replaces the existing one, rather
+  // than being left unread in the checkpoint.
+  ShardedLeakDetector restored(0, kTestMappingAddr, kTestMappingSize,
+                               kSizeSuspicionThreshold,
+                               kCallStackSuspicionThreshold, false);
+  restored.AddStackTables(InternalVector<uint32_t>(1, 48));
+  CheckpointReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  ASSERT_TRUE(restored.Load(&reader));
+
+  EXPECT_GT(workload.RunRounds(20, &original, &restored), 0U);
+}
+
+TEST_F(CheckpointTest, Invalid) {
+  ShardedLeakDetector original(1, kTestMappingAddr, kTestMappingSize,
+                               kSizeSuspicionThreshold,
+                               kCallStackSuspicionThreshold, false);
+  TestWorkload workload(0);
+  workload.Run(1, &original);
+  CheckpointWriter writer;
+  ASSERT_TRUE(writer.Open(path_.c_str()));
+  original.Save(&writer);
+  ASSERT_TRUE(writer.Close());
+
+  // A different number of shards.
+  {
+    ShardedLeakDetector restored(2, kTestMappingAddr, kTestMappingSize,
+                                 kSizeSuspicionThreshold,
+                                 kCallStackSuspicionThreshold, false);
+    CheckpointReader reader;
+    ASSERT_TRUE(reader.Open(path_.c_str()));
+    EXPECT_FALSE(restored.Load(&reader));
+  }
+
+  // A truncated checkpoint.
+  ASSERT_EQ(0, truncate(path_.c_str(), 64));
+  {
+    ShardedLeakDetector restored(1, kTestMappingAddr, kTestMappingSize,
+                                 kSizeSuspicionThreshold,
+                                 kCallStackSuspicionThreshold, false);
+    CheckpointReader reader;
+    ASSERT_TRUE(reader.Open(path_.c_str()));
+    EXPECT_FALSE(restored.Load(&reader));
+  }
+}
+
+TEST_F(CheckpointTest, NullStackInTable) {
+  // A stack table whose only entry refers to no call stack.
+  CheckpointWriter writer;
+  ASSERT_TRUE(writer.Open(path_.c_str()));
+  writer.WriteUint32(1);
+  writer.WriteUint32(0);
+  writer.WriteUint64(1);
+  writer.WriteUint32(0);
+  writer.WriteUint32(1);
+  ASSERT_TRUE(writer.Close());
+
+  CallStackTable table(kCallStackSuspicionThreshold);
+  CheckpointReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  table.Load(&reader);
+  EXPECT_FALSE(reader.ok());
+}
+
+}  // namespace leak_detector
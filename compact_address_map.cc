@@ -2,57 +2,170 @@
 
 #include <gperftools/custom_allocator.h>
 
-CompactAddressMap::CompactAddressMap()
-    : free_entries_(NULL),
-      allocated_objects_(NULL),
-      num_entries_(0) {
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+CompactAddressMap::CompactAddressMap(int flags)
+    : concurrent_(flags & kConcurrent),
+      exact_large_sizes_(flags & kExactLargeSizes),
+      sorted_regions_(NULL),
+      last_region_(NULL),
+      allocated_objects_(NULL) {
   stats_ = {0};
-  cluster_hash_table_ = New<Cluster*>(kClusterHashTableSize);
+  memset(region_hash_table_, 0, sizeof(region_hash_table_));
+  memset(free_blocks_, 0, sizeof(free_blocks_));
+  memset(large_sizes_, 0, sizeof(large_sizes_));
+  memset(num_entries_, 0, sizeof(num_entries_));
 }
 
 CompactAddressMap::~CompactAddressMap() {
   // De-allocate all of the objects we allocated.
   for (Object* object = allocated_objects_; object != NULL; /**/) {
     Object* next = object->next;
-    Free(object);
+    Free(object, object->size);
     object = next;
   }
 }
 
 // static
 void* CompactAddressMap::Alloc(size_t size) {
-  return CustomAllocator::Allocate(size);
+  return CustomAllocator::Allocate(size, CustomAllocator::kAddressMapArena);
 }
 
 // static
-void CompactAddressMap::Free(void* ptr) {
-  CustomAllocator::Free(ptr, 0);
+void CompactAddressMap::Free(void* ptr, size_t size) {
+  CustomAllocator::Free(ptr, size, CustomAllocator::kAddressMapArena);
 }
 
-CompactAddressMap::Cluster* CompactAddressMap::GetCluster(uintptr_t addr) {
-  uintptr_t id = addr / kClusterSize;
-  int index = id % kClusterHashTableSize;
-  for (Cluster* c = cluster_hash_table_[index]; c != NULL; c = c->next) {
-    if (c->id == id)
-      return c;
+// static
+uint16_t CompactAddressMap::SizeToCode(size_t size) {
+  if (size < kMaxExactSize)
+    return size;
+
+  // Keep the highest set bit and the kSizeClassBits bits below it.
+  const int kMinShift = kMaxExactSizeBits - kSizeClassBits;
+  const uint64_t value = size;
+  int shift = 63 - __builtin_clzll(value) - kSizeClassBits;
+  uint64_t size_class = value >> shift & ((1 << kSizeClassBits) - 1);
+  return kMaxExactSize + ((shift - kMinShift) << kSizeClassBits) + size_class;
+}
+
+// static
+size_t CompactAddressMap::CodeToSize(uint16_t code) {
+  if (code < kMaxExactSize)
+    return code;
+
+  const int kMinShift = kMaxExactSizeBits - kSizeClassBits;
+  code -= kMaxExactSize;
+  int shift = (code >> kSizeClassBits) + kMinShift;
+  uint64_t size_class = code & ((1 << kSizeClassBits) - 1);
+  return ((1ULL << kSizeClassBits) | size_class) << shift;
+}
+
+template <class T>
+T* CompactAddressMap::CreateNode(T** slot, size_t* stat) {
+  MaybeLock(&allocator_lock_);
+  T* node = New<T>(1);
+  MaybeUnlock(&allocator_lock_);
+
+  if (concurrent_) {
+    T* existing = NULL;
+    if (!__atomic_compare_exchange_n(slot, &existing, node, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      // Another thread published a node first.
+      SpinLockHolder lock(&allocator_lock_);
+      Delete(node);
+      return existing;
+    }
+  } else {
+    *slot = node;
+  }
+  UpdateStat(stat, 1);
+  return node;
+}
+
+CompactAddressMap::Region* CompactAddressMap::FindRegion(uint64_t id) {
+  Region* region = Load(&last_region_);
+  if (region && region->id == id)
+    return region;
+
+  for (region = Load(&region_hash_table_[id % kRegionHashTableSize]);
+       region != NULL;
+       region = region->next) {
+    if (region->id == id) {
+      Store(&last_region_, region);
+      return region;
+    }
+  }
+  return NULL;
+}
+
+CompactAddressMap::Region* CompactAddressMap::GetRegion(uintptr_t addr) {
+  uint64_t id = RegionId(addr);
+  Region* region = FindRegion(id);
+  if (region)
+    return region;
+
+  MaybeLock(&allocator_lock_);
+  region = New<Region>(1);
+  MaybeUnlock(&allocator_lock_);
+  region->id = id;
+
+  // Regions are pushed onto the front of their hash chain, and only removed by
+  // Compact(), which must not run concurrently with other users of the map. So
+  // the chain can be read without locking.
+  Region** chain = &region_hash_table_[id % kRegionHashTableSize];
+  Region* head = Load(chain);
+  for (;;) {
+    // Another thread may have added this region in the meantime.
+    for (Region* r = head; r != NULL; r = r->next) {
+      if (r->id == id) {
+        SpinLockHolder lock(&allocator_lock_);
+        Delete(region);
+        return r;
+      }
+    }
+    region->next = head;
+    if (!concurrent_) {
+      *chain = region;
+      break;
+    }
+    if (__atomic_compare_exchange_n(chain, &head, region, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      break;
+    }
   }
+  UpdateStat(&stats_.num_regions, 1);
+  Store(&last_region_, region);
 
-  Cluster* c = New<Cluster>(1);
-  c->id = id;
-  c->next = cluster_hash_table_[index];
-  cluster_hash_table_[index] = c;
-  ++stats_.num_clusters;
-  return c;
+  // Add the region to the sorted list used for iteration.
+  MaybeLock(&allocator_lock_);
+  Region** link = &sorted_regions_;
+  while (*link && (*link)->id < id)
+    link = &(*link)->next_sorted;
+  region->next_sorted = *link;
+  *link = region;
+  MaybeUnlock(&allocator_lock_);
+  return region;
+}
+
+CompactAddressMap::Cluster* CompactAddressMap::GetCluster(uintptr_t addr) {
+  Region* region = GetRegion(addr);
+  int index = ClusterIndex(addr);
+  Cluster* cluster = Load(&region->clusters[index]);
+  if (!cluster)
+    cluster = CreateNode(&region->clusters[index], &stats_.num_clusters);
+  return cluster;
 }
 
 CompactAddressMap::Subcluster* CompactAddressMap::GetSubcluster(
     Cluster* cluster, uintptr_t addr) {
-  int index = (addr % kClusterSize) / kSubclusterSize;
-  Subcluster* subcluster = cluster->subclusters[index];
+  int index = SubclusterIndex(addr);
+  Subcluster* subcluster = Load(&cluster->subclusters[index]);
   if (!subcluster) {
-    subcluster = New<Subcluster>(1);
-    cluster->subclusters[index] = subcluster;
-    ++stats_.num_subclusters;
+    subcluster = CreateNode(&cluster->subclusters[index],
+                            &stats_.num_subclusters);
   }
   return subcluster;
 }
@@ -60,81 +173,439 @@ CompactAddressMap::Subcluster* CompactAddressMap::GetSubcluster(
 CompactAddressMap::Page* CompactAddressMap::GetPage(uintptr_t addr) {
   Cluster* cluster = GetCluster(addr);
   Subcluster* subcluster = GetSubcluster(cluster, addr);
-  int index = (addr % kSubclusterSize) / kPageSize;
+  int index = PageIndex(addr);
 
-  Page *page = subcluster->pages[index];
-  if (!page) {
-    page = New<Page>(1);
-    subcluster->pages[index] = page;
-    ++stats_.num_pages;
-  }
+  Page *page = Load(&subcluster->pages[index]);
+  if (!page)
+    page = CreateNode(&subcluster->pages[index], &stats_.num_pages);
   return page;
 }
 
+CompactAddressMap::Page* CompactAddressMap::FindPage(uintptr_t addr) {
+  Region* region = FindRegion(RegionId(addr));
+  if (!region)
+    return NULL;
+
+  Cluster* cluster = Load(&region->clusters[ClusterIndex(addr)]);
+  if (!cluster)
+    return NULL;
+  Subcluster* subcluster = Load(&cluster->subclusters[SubclusterIndex(addr)]);
+  if (!subcluster)
+    return NULL;
+  return Load(&subcluster->pages[PageIndex(addr)]);
+}
+
+void CompactAddressMap::UpdateLiveNodes(uintptr_t addr, int delta) {
+  Region* region = FindRegion(RegionId(addr));
+  Cluster* cluster = Load(&region->clusters[ClusterIndex(addr)]);
+  Subcluster* subcluster = Load(&cluster->subclusters[SubclusterIndex(addr)]);
+
+  // A node becomes live when its count goes from 0 to 1, and empty when it
+  // goes back to 0. The counts are only changed here, under the allocator
+  // lock, so the transitions propagate up the tree in order.
+  const int transition = delta > 0 ? 1 : 0;
+  MaybeLock(&allocator_lock_);
+  UpdateStat(&stats_.num_live_pages, delta);
+  if ((subcluster->num_live_pages += delta) == transition) {
+    UpdateStat(&stats_.num_live_subclusters, delta);
+    if ((cluster->num_live_subclusters += delta) == transition) {
+      UpdateStat(&stats_.num_live_clusters, delta);
+      if ((region->num_live_clusters += delta) == transition)
+        UpdateStat(&stats_.num_live_regions, delta);
+    }
+  }
+  MaybeUnlock(&allocator_lock_);
+}
+
+CompactAddressMap::Block* CompactAddressMap::AllocBlock(int block_class) {
+  MaybeLock(&allocator_lock_);
+  if (free_blocks_[block_class] == NULL) {
+    // Allocate a new batch of blocks and add them to the free list.
+    const size_t block_bytes = BlockBytes(block_class);
+    size_t count = kBlockBulkAllocBytes / block_bytes;
+    if (count == 0)
+      count = 1;
+    char* array = New<char>(count * block_bytes);
+    for (size_t i = 0; i < count; ++i) {
+      Block* block = reinterpret_cast<Block*>(array + i * block_bytes);
+      block->capacity = kMinBlockCapacity << block_class;
+      memcpy(block->entries(), &free_blocks_[block_class], sizeof(Block*));
+      free_blocks_[block_class] = block;
+    }
+  }
+
+  Block* block = free_blocks_[block_class];
+  memcpy(&free_blocks_[block_class], block->entries(), sizeof(Block*));
+  MaybeUnlock(&allocator_lock_);
+
+  block->num_entries = 0;
+  memset(block->offsets(), 0xff, block->capacity * sizeof(uint16_t));
+  UpdateStat(&stats_.num_blocks, 1);
+  UpdateStat(&stats_.num_entries, block->capacity);
+  return block;
+}
+
+void CompactAddressMap::FreeBlock(Block* block) {
+  int block_class = BlockClass(block);
+  UpdateStat(&stats_.num_blocks, -1);
+  UpdateStat(&stats_.num_entries, -block->capacity);
+
+  MaybeLock(&allocator_lock_);
+  memcpy(block->entries(), &free_blocks_[block_class], sizeof(Block*));
+  free_blocks_[block_class] = block;
+  MaybeUnlock(&allocator_lock_);
+}
+
+CompactAddressMap::LargeSize** CompactAddressMap::FindLargeSize(
+    uintptr_t addr) {
+  for (LargeSize** link = &large_sizes_[LargeSizeBucket(addr)];
+       *link != NULL;
+       link = &(*link)->next) {
+    if ((*link)->address == addr)
+      return link;
+  }
+  return NULL;
+}
+
+void CompactAddressMap::RemoveLargeSize(uintptr_t addr) {
+  MaybeLock(&allocator_lock_);
+  LargeSize** link = FindLargeSize(addr);
+  if (link) {
+    LargeSize* large_size = *link;
+    *link = large_size->next;
+    Delete(large_size);
+    UpdateStat(&stats_.num_large_sizes, -1);
+  }
+  MaybeUnlock(&allocator_lock_);
+}
+
+void CompactAddressMap::StoreEntry(uintptr_t addr,
+                                   size_t size,
+                                   const uint32_t* hash,
+                                   bool replace,
+                                   StoredEntry* entry) {
+  if (replace && entry->size_code == kLargeSizeCode)
+    RemoveLargeSize(addr);
+
+  uint16_t code = SizeToCode(size);
+  if (exact_large_sizes_ && CodeToSize(code) != size) {
+    MaybeLock(&allocator_lock_);
+    LargeSize* large_size = New<LargeSize>(1);
+    large_size->address = addr;
+    large_size->size = size;
+    LargeSize** bucket = &large_sizes_[LargeSizeBucket(addr)];
+    large_size->next = *bucket;
+    *bucket = large_size;
+    UpdateStat(&stats_.num_large_sizes, 1);
+    MaybeUnlock(&allocator_lock_);
+    code = kLargeSizeCode;
+  }
+
+  entry->size_code = code;
+  entry->has_call_stack = hash != NULL;
+  entry->call_stack_hash = hash ? *hash : 0;
+}
+
+void CompactAddressMap::LoadEntry(uintptr_t addr,
+                                  const StoredEntry& entry,
+                                  Entry* result) const {
+  if (entry.size_code == kLargeSizeCode) {
+    MaybeLock(&allocator_lock_);
+    const LargeSize* large_size = large_sizes_[LargeSizeBucket(addr)];
+    while (large_size->address != addr)
+      large_size = large_size->next;
+    result->size = large_size->size;
+    MaybeUnlock(&allocator_lock_);
+  } else {
+    result->size = CodeToSize(entry.size_code);
+  }
+  result->has_call_stack = entry.has_call_stack;
+  result->call_stack_hash = entry.call_stack_hash;
+}
+
+int CompactAddressMap::FindOffset(Block* block, uint16_t offset) {
+  const uint16_t* offsets = block->offsets();
+  size_t num_steps = 0;
+  int result = -1;
+#if defined(__SSE2__)
+  const __m128i key = _mm_set1_epi16(offset);
+  for (int i = 0; i < block->num_entries; i += kOffsetsPerStep) {
+    ++num_steps;
+    __m128i values =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(offsets + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(values, key));
+    if (mask) {
+      result = i + __builtin_ctz(mask) / sizeof(uint16_t);
+      break;
+    }
+  }
+#else
+  for (int i = 0; i < block->num_entries; ++i) {
+    if (i % kOffsetsPerStep == 0)
+      ++num_steps;
+    if (offsets[i] == offset) {
+      result = i;
+      break;
+    }
+  }
+#endif
+  size_t max_num_steps = Load(&stats_.max_num_steps);
+  while (num_steps > max_num_steps) {
+    if (!concurrent_) {
+      stats_.max_num_steps = num_steps;
+      break;
+    }
+    if (__atomic_compare_exchange_n(&stats_.max_num_steps, &max_num_steps,
+                                    num_steps, true, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  return result;
+}
+
 void CompactAddressMap::Insert(const void* ptr,
-                               uint16_t size,
+                               size_t size,
                                const uint32_t* hash) {
   uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
   Page* page = GetPage(addr);
 
-  // Look in linked-list for this block.
-  const int block = (addr % kPageSize) / kBlockSize;
+  const int block_index = (addr % kPageSize) / kBlockSize;
   const uint16_t block_offset = addr % kBlockSize;
-  size_t num_steps = 0;
-  for (Entry* entry = page->blocks[block]; entry != NULL; entry = entry->next) {
-    ++num_steps;
-    if (entry->offset == block_offset) {
-      entry->Store(block_offset, size, hash);
-      if (num_steps > stats_.max_num_steps)
-        stats_.max_num_steps = num_steps;
-      ++num_entries_;
+  MaybeLock(&page->lock);
+  Block* block = page->blocks[block_index];
+  if (!block) {
+    block = AllocBlock(0);
+    page->blocks[block_index] = block;
+    if (page->num_blocks++ == 0)
+      UpdateLiveNodes(addr, 1);
+  }
 
-      return;
-    }
+  // Overwrite the existing entry if the address is already in the map.
+  int index = FindOffset(block, block_offset);
+  if (index >= 0) {
+    StoreEntry(addr, size, hash, true, &block->entries()[index]);
+    MaybeUnlock(&page->lock);
+    return;
   }
 
-  // Create entry.
-  if (free_entries_ == NULL) {
-    // Allocate a new batch of entries and add to free-list.
-    Entry* array = New<Entry>(kEntryBulkAllocCount);
-    stats_.num_entries += kEntryBulkAllocCount;
-    for (int i = 0; i < kEntryBulkAllocCount - 1; i++)
-      array[i].next = &array[i + 1];
-    array[kEntryBulkAllocCount - 1].next = free_entries_;
-    free_entries_ = &array[0];
+  if (block->num_entries == block->capacity) {
+    // Move the contents to a block of the next larger class.
+    Block* new_block = AllocBlock(BlockClass(block) + 1);
+    memcpy(new_block->offsets(), block->offsets(),
+           block->num_entries * sizeof(uint16_t));
+    memcpy(new_block->entries(), block->entries(),
+           block->num_entries * sizeof(StoredEntry));
+    new_block->num_entries = block->num_entries;
+    FreeBlock(block);
+    block = new_block;
+    page->blocks[block_index] = block;
   }
 
-  // Detach a free entry for the current operation.
-  Entry* entry = free_entries_;
-  free_entries_ = entry->next;
-  entry->Store(block_offset, size, hash);
-  entry->next = page->blocks[block];
-  page->blocks[block] = entry;
-  ++num_entries_;
+  index = block->num_entries++;
+  block->offsets()[index] = block_offset;
+  StoreEntry(addr, size, hash, false, &block->entries()[index]);
+  MaybeUnlock(&page->lock);
+
+  UpdateEntryCount(page, 1);
+}
+
+bool CompactAddressMap::Find(const void* ptr, Entry* result) {
+  uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+  Page* page = FindPage(addr);
+  if (!page)
+    return false;
 
-  if (num_steps > stats_.max_num_steps)
-    stats_.max_num_steps = num_steps;
+  const int block_index = (addr % kPageSize) / kBlockSize;
+  MaybeLock(&page->lock);
+  Block* block = page->blocks[block_index];
+  int index = block ? FindOffset(block, addr % kBlockSize) : -1;
+  if (index >= 0)
+    LoadEntry(addr, block->entries()[index], result);
+  MaybeUnlock(&page->lock);
+  return index >= 0;
 }
 
 bool CompactAddressMap::FindAndRemove(const void *ptr, Entry* result) {
   uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
-  Page* page = GetPage(addr);
+  Page* page = FindPage(addr);
+  if (!page)
+    return false;
 
-  // Look in linked-list for this block.
-  const int block = (addr % kPageSize) / kBlockSize;
+  const int block_index = (addr % kPageSize) / kBlockSize;
   const uint16_t block_offset = addr % kBlockSize;
-  for (Entry** p = &page->blocks[block]; *p; p = &((*p)->next)) {
-    Entry* entry = *p;
-    if (entry->offset == block_offset) {
-      *result = *entry;
-      *p = entry->next;
-      // Put the removed entry back into the free list.
-      entry->next = free_entries_;
-      free_entries_ = entry;
-      --num_entries_;
+  MaybeLock(&page->lock);
+  Block* block = page->blocks[block_index];
+  int index = block ? FindOffset(block, block_offset) : -1;
+  if (index < 0) {
+    MaybeUnlock(&page->lock);
+    return false;
+  }
+
+  LoadEntry(addr, block->entries()[index], result);
+  if (block->entries()[index].size_code == kLargeSizeCode)
+    RemoveLargeSize(addr);
+
+  // Keep the used slots contiguous by moving the last entry into the hole.
+  int last = --block->num_entries;
+  block->offsets()[index] = block->offsets()[last];
+  block->entries()[index] = block->entries()[last];
+  block->offsets()[last] = kNoOffset;
 
-      return true;
+  if (block->num_entries == 0) {
+    FreeBlock(block);
+    page->blocks[block_index] = NULL;
+    if (--page->num_blocks == 0)
+      UpdateLiveNodes(addr, -1);
+  }
+  MaybeUnlock(&page->lock);
+
+  UpdateEntryCount(page, -1);
+  return true;
+}
+
+void CompactAddressMap::Compact() {
+  // Children are freed before their parents, so that a node whose live count
+  // is zero has no children left by the time it is freed itself.
+  Region* next_region = NULL;
+  for (Region* region = sorted_regions_; region != NULL;
+       region = next_region) {
+    next_region = region->next_sorted;
+    for (int i = 0; i < kNumClustersPerRegion; ++i) {
+      Cluster* cluster = region->clusters[i];
+      if (!cluster)
+        continue;
+      for (int j = 0; j < kNumSubclustersPerCluster; ++j) {
+        Subcluster* subcluster = cluster->subclusters[j];
+        if (!subcluster)
+          continue;
+        for (int k = 0; k < kNumPagesPerSubcluster; ++k) {
+          Page* page = subcluster->pages[k];
+          if (page && page->num_blocks == 0) {
+            Delete(page);
+            subcluster->pages[k] = NULL;
+            --stats_.num_pages;
+          }
+        }
+        if (subcluster->num_live_pages == 0) {
+          Delete(subcluster);
+          cluster->subclusters[j] = NULL;
+          --stats_.num_subclusters;
+        }
+      }
+      if (cluster->num_live_subclusters == 0) {
+        Delete(cluster);
+        region->clusters[i] = NULL;
+        --stats_.num_clusters;
+      }
+    }
+    if (region->num_live_clusters == 0)
+      DeleteRegion(region);
+  }
+}
+
+void CompactAddressMap::DeleteRegion(Region* region) {
+  for (Region** link = &region_hash_table_[region->id % kRegionHashTableSize];
+       *link != NULL;
+       link = &(*link)->next) {
+    if (*link == region) {
+      *link = region->next;
+      break;
+    }
+  }
+  for (Region** link = &sorted_regions_; *link != NULL;
+       link = &(*link)->next_sorted) {
+    if (*link == region) {
+      *link = region->next_sorted;
+      break;
+    }
+  }
+  if (last_region_ == region)
+    last_region_ = NULL;
+
+  Delete(region);
+  --stats_.num_regions;
+}
+
+CompactAddressMap::const_iterator CompactAddressMap::begin() const {
+  return const_iterator(this, sorted_regions_);
+}
+
+CompactAddressMap::const_iterator CompactAddressMap::end() const {
+  return const_iterator(this, NULL);
+}
+
+CompactAddressMap::const_iterator::const_iterator(const CompactAddressMap* map,
+                                                  const Region* region)
+    : map_(map),
+      region_(region),
+      cluster_(0),
+      subcluster_(0),
+      page_(0),
+      block_(0),
+      offset_(-1),
+      page_ptr_(NULL) {
+  if (region_)
+    Advance();
+}
+
+bool CompactAddressMap::const_iterator::FindBlock() {
+  // Each loop resumes at the current index, and the inner indices are reset
+  // whenever an outer index moves on.
+  for (; region_ != NULL; region_ = region_->next_sorted, cluster_ = 0) {
+    for (; cluster_ < kNumClustersPerRegion; ++cluster_, subcluster_ = 0) {
+      const Cluster* cluster = region_->clusters[cluster_];
+      if (!cluster)
+        continue;
+      for (; subcluster_ < kNumSubclustersPerCluster;
+           ++subcluster_, page_ = 0) {
+        const Subcluster* subcluster = cluster->subclusters[subcluster_];
+        if (!subcluster)
+          continue;
+        for (; page_ < kNumPagesPerSubcluster; ++page_, block_ = 0) {
+          page_ptr_ = subcluster->pages[page_];
+          if (!page_ptr_)
+            continue;
+          for (; block_ < kNumBlocksPerPage; ++block_) {
+            if (page_ptr_->blocks[block_])
+              return true;
+          }
+        }
+      }
     }
   }
   return false;
 }
+
+void CompactAddressMap::const_iterator::Advance() {
+  while (FindBlock()) {
+    Block* block = page_ptr_->blocks[block_];
+    if (offset_ < 0) {
+      // Entering a new block. The entries in a block are not sorted, so
+      // index them by offset.
+      memset(index_of_offset_, 0xff, sizeof(index_of_offset_));
+      for (int i = 0; i < block->num_entries; ++i)
+        index_of_offset_[block->offsets()[i]] = i;
+    }
+    for (++offset_; offset_ < kBlockSize; ++offset_) {
+      uint16_t index = index_of_offset_[offset_];
+      if (index == kNoOffset)
+        continue;
+      current_.address = static_cast<uintptr_t>(
+          (region_->id << kRegionShift) +
+          static_cast<uint64_t>(cluster_) * kClusterSize +
+          subcluster_ * kSubclusterSize + page_ * kPageSize +
+          block_ * kBlockSize + offset_);
+      map_->LoadEntry(current_.address, block->entries()[index],
+                      &current_.entry);
+      return;
+    }
+    ++block_;
+    offset_ = -1;
+  }
+
+  // Reached the end. Match the position of end().
+  cluster_ = subcluster_ = page_ = block_ = 0;
+  offset_ = -1;
+  page_ptr_ = NULL;
+}
@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <sys/types.h>
+
+#include "base/spinlock.h"
 
 class CompactAddressMap {
  public:
@@ -11,73 +14,212 @@ class CompactAddressMap {
 
   struct Stats {
     size_t heap_size;
+    size_t num_regions;
     size_t num_clusters;
     size_t num_subclusters;
     size_t num_pages;
-    size_t num_entries;
-    size_t max_num_steps;
+    // The nodes above that hold at least one entry. The rest are empty, and
+    // are retained until Compact() is called.
+    size_t num_live_regions;
+    size_t num_live_clusters;
+    size_t num_live_subclusters;
+    size_t num_live_pages;
+    size_t num_blocks;
+    size_t num_entries;    // Number of entry slots in all blocks.
+    size_t max_num_steps;  // Max number of offset vectors compared in a block.
+    size_t num_large_sizes;  // Number of sizes in the large size table.
   };
 
   struct Entry {
-    Entry* next;
-    uint16_t size : 15;
-    uint8_t has_call_stack : 1;
-    uint16_t offset;
+    size_t size;
+    bool has_call_stack;
     uint32_t call_stack_hash;
+  };
 
-    void Store(uint16_t offset, uint8_t size, const uint32_t* hash) {
-      this->offset = offset;
-      this->size = size;
-      if (hash) {
-        has_call_stack = true;
-        call_stack_hash = *hash;
-      } else {
-        has_call_stack = false;
-      }
-    }
+  // An entry together with the address it was stored for.
+  struct LiveEntry {
+    uintptr_t address;
+    Entry entry;
+  };
+
+  // Iterates over all entries in increasing address order.
+  class const_iterator;
+
+  enum Flags {
+    // Allow Insert() and FindAndRemove() to be called from multiple threads
+    // at once. Tree nodes are published with compare-and-swap, and each page
+    // has its own lock, so threads working on different parts of the address
+    // space do not contend.
+    kConcurrent = 1 << 0,
+
+    // Sizes of kMaxExactSize bytes and up are normally rounded down to one of
+    // 256 classes per power of two. With this flag, sizes that do not fall
+    // exactly on a class are kept in a separate table instead.
+    kExactLargeSizes = 1 << 1,
   };
 
-  CompactAddressMap();
+  // Sizes below this are always stored exactly.
+  static const int kMaxExactSizeBits = 14;
+  static const size_t kMaxExactSize = 1 << kMaxExactSizeBits;
+
+  // Return the size that is stored for an entry of |size| bytes, unless the
+  // kExactLargeSizes flag is set.
+  static size_t RoundSize(size_t size) {
+    return CodeToSize(SizeToCode(size));
+  }
+
+  explicit CompactAddressMap(int flags = 0);
   ~CompactAddressMap();
 
+  // In concurrent mode, the stats are only approximate while other threads
+  // are modifying the map.
   const Stats& stats() const {
     return stats_;
   }
 
   const size_t size() const {
-    return num_entries_;
+    size_t result = 0;
+    for (const EntryCounter& counter : num_entries_)
+      result += __atomic_load_n(&counter.count, __ATOMIC_RELAXED);
+    return result;
   }
 
-  void Insert(const void* ptr, uint16_t size, const uint32_t* hash);
+  void Insert(const void* ptr, size_t size, const uint32_t* hash);
+  bool Find(const void* ptr, Entry* result);
   bool FindAndRemove(const void *ptr, Entry* result);
 
+  // Free the regions, clusters, subclusters and pages that no longer hold any
+  // entries. This walks the whole tree, so it is meant to be called
+  // periodically rather than after every removal. Must not be called while
+  // other threads are using the map, and invalidates all iterators.
+  void Compact();
+
+  const_iterator begin() const;
+  const_iterator end() const;
+
  private:
   static const int kBlockSize = 256;
 
+  // Sizes are stored as 15-bit codes. Codes below kMaxExactSize are sizes in
+  // bytes. They are followed by the size classes, each power of two from
+  // kMaxExactSize up being split into 2^kSizeClassBits classes. The last code
+  // means that the size is in the large size table.
+  static const int kSizeClassBits = 8;
+  static const uint16_t kLargeSizeCode = 0x7fff;
+
+  static uint16_t SizeToCode(size_t size);
+  static size_t CodeToSize(uint16_t code);
+
+  // The entry as it is stored in a block.
+  struct StoredEntry {
+    uint16_t size_code : 15;
+    uint16_t has_call_stack : 1;
+    uint32_t call_stack_hash;
+  };
+  static_assert(sizeof(StoredEntry) == 8, "StoredEntry should be 8 bytes.");
+
+  // The entries within one kBlockSize-byte block of address space. The offsets
+  // of the entries within the block are kept in a contiguous array, with the
+  // entries themselves in a parallel array, so a lookup scans one or two cache
+  // lines of offsets and then touches a single entry. The arrays follow the
+  // Block header in memory:
+  //   uint16_t offsets[capacity];
+  //   StoredEntry entries[capacity];
+  // Only the first |num_entries| slots are used. The remaining offsets are
+  // kNoOffset, so offsets can be compared kOffsetsPerStep at a time.
+  struct Block {
+    uint16_t num_entries;
+    uint16_t capacity;
+
+    uint16_t* offsets() {
+      return reinterpret_cast<uint16_t*>(this + 1);
+    }
+    StoredEntry* entries() {
+      return reinterpret_cast<StoredEntry*>(offsets() + capacity);
+    }
+  };
+
+  static const uint16_t kNoOffset = 0xffff;
+  static const int kOffsetsPerStep = 8;
+
+  // Blocks come in power-of-two capacities, from kMinBlockCapacity up to one
+  // slot for each possible offset. A block is replaced with one of the next
+  // capacity when it fills up.
+  static const int kMinBlockCapacity = kOffsetsPerStep;
+  static const int kNumBlockClasses = 6;
+  static_assert(kMinBlockCapacity << (kNumBlockClasses - 1) == kBlockSize,
+                "Largest block class must fit all offsets in a block.");
+
+  static int BlockClass(const Block* block) {
+    int block_class = 0;
+    while ((kMinBlockCapacity << block_class) < block->capacity)
+      ++block_class;
+    return block_class;
+  }
+
+  static size_t BlockBytes(int block_class) {
+    int capacity = kMinBlockCapacity << block_class;
+    return sizeof(Block) +
+           capacity * (sizeof(uint16_t) + sizeof(StoredEntry));
+  }
+
   static const int kNumBlocksPerPage = 16;
   static const int kPageSize = kNumBlocksPerPage * kBlockSize;
   struct Page {
-    Entry* blocks[kNumBlocksPerPage];
+    Block* blocks[kNumBlocksPerPage];
+    int num_blocks;  // Number of non-NULL |blocks|.
+    SpinLock lock;   // Guards |blocks| and |num_blocks| in concurrent mode.
   };
 
   static const int kNumPagesPerSubcluster = 16;
   static const int kSubclusterSize = kNumPagesPerSubcluster * kPageSize;
   struct Subcluster {
     Page* pages[kNumPagesPerSubcluster];
+    int num_live_pages;
   };
 
   static const int kNumSubclustersPerCluster = 16;
   static const int kClusterSize = kNumSubclustersPerCluster * kSubclusterSize;
   struct Cluster {
-    uint32_t id;
-    Cluster* next;
     Subcluster* subclusters[kNumSubclustersPerCluster];
+    int num_live_subclusters;
+  };
+
+  // The address space is divided into 4 GiB regions, each of which is a flat
+  // array of clusters. Regions are only created for the parts of the address
+  // space that are in use, and are looked up through a small hash table keyed
+  // by the upper address bits, so any pointer width is supported.
+  static const int kRegionShift = 32;
+  static const int kNumClustersPerRegion =
+      (1ULL << kRegionShift) / kClusterSize;
+  struct Region {
+    uint64_t id;
+    Region* next;         // Next region in the same hash chain.
+    Region* next_sorted;  // Next region in |sorted_regions_|.
+    Cluster* clusters[kNumClustersPerRegion];
+    int num_live_clusters;
   };
 
-  static const int kClusterHashTableSize = (1UL << 32) / kClusterSize;
+  static const int kRegionHashTableSize = 64;
 
-  // Allocate this many free Entries at a time.
-  static const int kEntryBulkAllocCount = 64;
+  // The exact sizes of entries with kLargeSizeCode, in a hash table keyed by
+  // address. Such sizes are at least kMaxExactSize, so there are few of them.
+  struct LargeSize {
+    uintptr_t address;
+    size_t size;
+    LargeSize* next;
+  };
+  static const int kLargeSizeHashTableSize = 256;
+
+  // Allocate free Blocks of each class this many bytes at a time.
+  static const int kBlockBulkAllocBytes = 4096;
+
+  // The entry count is split over several cache lines, so that concurrent
+  // updates from threads working on different pages do not contend.
+  static const int kNumEntryCounters = 16;
+  struct alignas(64) EntryCounter {
+    size_t count;
+  };
 
   //--------------------------------------------------------------
   // Memory management -- we keep all objects we allocate linked
@@ -88,23 +230,24 @@ class CompactAddressMap {
   struct Object {
     Object* next;
     Object* prev;
-    int count;
+    size_t size;
     // The real data starts here
   };
 
   static void* Alloc(size_t size);
-  static void Free(void* ptr);
+  static void Free(void* ptr, size_t size);
 
-  // Custom object allocator.
+  // Custom object allocator. Must be called with |allocator_lock_| held in
+  // concurrent mode.
   template <class T>
   T* New(int count) {
     size_t size = sizeof(Object) + count * sizeof(T);
     void* ptr = Alloc(size);
     memset(ptr, 0, size);
-    stats_.heap_size += size;
+    UpdateStat(&stats_.heap_size, size);
 
     Object* object = reinterpret_cast<Object*>(ptr);
-    object->count = count;
+    object->size = size;
     object->next = allocated_objects_;
     object->prev = NULL;
     if (allocated_objects_)
@@ -113,11 +256,12 @@ class CompactAddressMap {
     return reinterpret_cast<T*>(reinterpret_cast<Object*>(ptr) + 1);
   }
 
-  // Custom object deallocator
+  // Custom object deallocator. Must be called with |allocator_lock_| held in
+  // concurrent mode.
   template <class T>
-  T* Delete(T* ptr) {
+  void Delete(T* ptr) {
     Object* object = reinterpret_cast<Object*>(ptr) - 1;
-    stats_.heap_size -= sizeof(Object) + sizeof(T) * object->count;
+    UpdateStat(&stats_.heap_size, -static_cast<ssize_t>(object->size));
 
     if (object->prev)
       object->prev->next = object->next;
@@ -127,20 +271,210 @@ class CompactAddressMap {
     if (object->next)
       object->next->prev = object->prev;
 
-    Free(object);
+    Free(object, object->size);
+  }
+
+  // Lock and unlock |lock|, if this is a concurrent map.
+  void MaybeLock(SpinLock* lock) const {
+    if (concurrent_)
+      lock->Lock();
+  }
+  void MaybeUnlock(SpinLock* lock) const {
+    if (concurrent_)
+      lock->Unlock();
+  }
+
+  // Read a tree node pointer or stat that may be written concurrently.
+  template <class T>
+  T Load(const T* slot) const {
+    return concurrent_ ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : *slot;
+  }
+
+  // Write a pointer that may be read concurrently with Load().
+  template <class T>
+  void Store(T* slot, T value) {
+    if (concurrent_)
+      __atomic_store_n(slot, value, __ATOMIC_RELEASE);
+    else
+      *slot = value;
+  }
+
+  // Allocate a tree node of type T and store it into the empty |*slot|. If
+  // another thread stored a node there first, use that one instead.
+  template <class T>
+  T* CreateNode(T** slot, size_t* stat);
+
+  // Add |delta| to a stat counter.
+  void UpdateStat(size_t* stat, ssize_t delta) {
+    if (concurrent_)
+      __atomic_fetch_add(stat, delta, __ATOMIC_RELAXED);
+    else
+      *stat += delta;
+  }
+
+  // Add |delta| to the entry count for |page|.
+  void UpdateEntryCount(const Page* page, int delta) {
+    size_t* count = &num_entries_[
+        (reinterpret_cast<uintptr_t>(page) / sizeof(Page)) %
+        kNumEntryCounters].count;
+    UpdateStat(count, delta);
+  }
+
+  static uint64_t RegionId(uintptr_t addr) {
+    return static_cast<uint64_t>(addr) >> kRegionShift;
+  }
+  static int ClusterIndex(uintptr_t addr) {
+    return (static_cast<uint64_t>(addr) % (1ULL << kRegionShift)) /
+           kClusterSize;
+  }
+  static int SubclusterIndex(uintptr_t addr) {
+    return (addr % kClusterSize) / kSubclusterSize;
+  }
+  static int PageIndex(uintptr_t addr) {
+    return (addr % kSubclusterSize) / kPageSize;
   }
 
+  // Return the region with the given id, or NULL if there is none.
+  Region* FindRegion(uint64_t id);
+
+  // Return the region, cluster, subcluster and page containing |addr|,
+  // creating them if they do not exist yet.
+  Region* GetRegion(uintptr_t addr);
   Cluster* GetCluster(uintptr_t addr);
   Subcluster* GetSubcluster(Cluster* cluster, uintptr_t addr);
   Page* GetPage(uintptr_t addr);
 
-  Cluster** cluster_hash_table_;
-  Entry* free_entries_;
+  // Return the page containing |addr|, or NULL if there is none.
+  Page* FindPage(uintptr_t addr);
+
+  // Called when the page containing |addr| gets its first block (|delta| is
+  // 1) or loses its last block (|delta| is -1). Updates the live node counts
+  // of the page and of its ancestors. Must be called with the page locked in
+  // concurrent mode.
+  void UpdateLiveNodes(uintptr_t addr, int delta);
+
+  // Remove |region| from |region_hash_table_| and free it.
+  void DeleteRegion(Region* region);
+
+  // Store |size| and |hash| into |entry|, the entry for |addr|. If |entry|
+  // is already in use, |replace| should be set.
+  void StoreEntry(uintptr_t addr, size_t size, const uint32_t* hash,
+                  bool replace, StoredEntry* entry);
+
+  // Decode |entry|, the entry for |addr|, into |result|.
+  void LoadEntry(uintptr_t addr, const StoredEntry& entry,
+                 Entry* result) const;
+
+  static int LargeSizeBucket(uintptr_t addr) {
+    // Large allocations are usually page aligned, so mix in the upper bits.
+    return (static_cast<uint64_t>(addr) * 0x9e3779b97f4a7c15ULL) >>
+           (64 - 8);
+  }
+  static_assert(kLargeSizeHashTableSize == 1 << 8,
+                "LargeSizeBucket() must cover the large size table.");
+
+  // Return the link to the large size table entry for |addr|. The link is
+  // NULL if there is none.
+  LargeSize** FindLargeSize(uintptr_t addr);
+
+  // Remove the large size table entry for |addr|, if there is one.
+  void RemoveLargeSize(uintptr_t addr);
+
+  // Get an empty block of the given class from |free_blocks_|, and return a
+  // block to it.
+  Block* AllocBlock(int block_class);
+  void FreeBlock(Block* block);
+
+  // Return the index of |offset| in |block|, or -1 if it is not there.
+  int FindOffset(Block* block, uint16_t offset);
+
+  // Set if the kConcurrent flag was passed in.
+  const bool concurrent_;
+
+  // Set if the kExactLargeSizes flag was passed in.
+  const bool exact_large_sizes_;
+
+  Region* region_hash_table_[kRegionHashTableSize];
+
+  // All regions, sorted by id. Guarded by |allocator_lock_| in concurrent
+  // mode.
+  Region* sorted_regions_;
+
+  // The most recently accessed region. Allocations tend to be concentrated in
+  // a small part of the address space, so this avoids most hash lookups.
+  Region* last_region_;
+
+  // Lists of empty blocks of each class, linked through their first entry.
+  Block* free_blocks_[kNumBlockClasses];
+
+  // Guarded by |allocator_lock_| in concurrent mode.
+  LargeSize* large_sizes_[kLargeSizeHashTableSize];
+
+  // In concurrent mode, guards New(), Delete(), |free_blocks_|,
+  // |large_sizes_| and |allocated_objects_|.
+  mutable SpinLock allocator_lock_;
+
   Object* allocated_objects_;
 
   Stats stats_;
 
-  size_t num_entries_;
+  EntryCounter num_entries_[kNumEntryCounters];
+};
+
+// The map must not be modified while an iterator is in use, e.g. the allocation
+// hooks that feed it must be paused, or the iteration must be done on a copy.
+class CompactAddressMap::const_iterator {
+ public:
+  const LiveEntry& operator* () const {
+    return current_;
+  }
+  const LiveEntry* operator-> () const {
+    return &current_;
+  }
+  const_iterator& operator++ () {
+    Advance();
+    return *this;
+  }
+  bool operator== (const const_iterator& other) const {
+    return region_ == other.region_ && cluster_ == other.cluster_ &&
+           subcluster_ == other.subcluster_ && page_ == other.page_ &&
+           block_ == other.block_ && offset_ == other.offset_;
+  }
+  bool operator!= (const const_iterator& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  friend class CompactAddressMap;
+
+  // Creates an iterator pointing to the first entry of |map| at or after the
+  // start of |region|, or the end iterator if |region| is NULL.
+  const_iterator(const CompactAddressMap* map, const Region* region);
+
+  // Move to the next position that has a block, starting at the current
+  // position. Returns false if there are no more blocks.
+  bool FindBlock();
+
+  // Move to the entry with the next higher address.
+  void Advance();
+
+  const CompactAddressMap* map_;
+
+  // The current position in the tree. The region is NULL at the end.
+  const Region* region_;
+  int cluster_;
+  int subcluster_;
+  int page_;
+  int block_;
+  int offset_;
+
+  // The page at the current position, set by FindBlock().
+  const Page* page_ptr_;
+
+  // The index of each offset in the current block, or kNoOffset.
+  uint16_t index_of_offset_[kBlockSize];
+
+  LiveEntry current_;
 };
 
 #endif  // COMPACT_ADDRESS_MAP_H_
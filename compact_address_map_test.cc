@@ -3,6 +3,8 @@
 #include <gperftools/custom_allocator.h>
 
 #include <map>
+#include <thread>
+#include <vector>
 
 #include "base/macros.h"
 #include "gtest/gtest.h"
@@ -56,3 +58,270 @@ TEST_F(CompactAddressMapTest, Test) {
     delete [] ptr;
   }
 }
+
+TEST_F(CompactAddressMapTest, HighAddresses) {
+  // These addresses are never dereferenced. They differ only in the bits above
+  // 32, and in bits that span multiple clusters within a region.
+  const uintptr_t kAddrs[] = {
+    0x0000000010000010ULL,
+    0x0000000110000010ULL,
+    0x0000100010000010ULL,
+    0x00007fff10000010ULL,
+    0x00007fff10100020ULL,
+    0x00ffffff10000010ULL,
+  };
+  const size_t kNumAddrs = sizeof(kAddrs) / sizeof(kAddrs[0]);
+
+  CompactAddressMap cam;
+  for (size_t i = 0; i < kNumAddrs; ++i) {
+    uint32_t hash = i;
+    cam.Insert(reinterpret_cast<void*>(kAddrs[i]), i + 1, &hash);
+  }
+  EXPECT_EQ(kNumAddrs, cam.size());
+  EXPECT_EQ(5U, cam.stats().num_regions);
+
+  CompactAddressMap::Entry entry = {};
+  EXPECT_FALSE(cam.FindAndRemove(reinterpret_cast<void*>(0x200000010ULL),
+                                 &entry));
+
+  for (size_t i = 0; i < kNumAddrs; ++i) {
+    EXPECT_TRUE(cam.Find(reinterpret_cast<void*>(kAddrs[i]), &entry));
+    EXPECT_EQ(i + 1, entry.size);
+    EXPECT_TRUE(cam.FindAndRemove(reinterpret_cast<void*>(kAddrs[i]), &entry));
+    EXPECT_EQ(i + 1, entry.size);
+    EXPECT_EQ(i, entry.call_stack_hash);
+  }
+  EXPECT_EQ(0U, cam.size());
+}
+
+TEST_F(CompactAddressMapTest, DenseBlock) {
+  // Fill every byte offset of a single block, so that the block is grown
+  // through every capacity.
+  const uintptr_t kBase = 0x12345600;
+  CompactAddressMap cam;
+  for (uint32_t offset = 0; offset < 256; ++offset) {
+    uint32_t hash = offset * 7;
+    cam.Insert(reinterpret_cast<void*>(kBase + offset), offset & 0x7f, &hash);
+  }
+  EXPECT_EQ(256U, cam.size());
+  EXPECT_EQ(1U, cam.stats().num_blocks);
+
+  // Re-inserting an existing address replaces its entry.
+  cam.Insert(reinterpret_cast<void*>(kBase + 3), 100, nullptr);
+  EXPECT_EQ(256U, cam.size());
+
+  // Remove in an order that moves entries around within the block.
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t offset = (i * 97) % 256;
+    CompactAddressMap::Entry entry = {};
+    ASSERT_TRUE(cam.FindAndRemove(reinterpret_cast<void*>(kBase + offset),
+                                  &entry));
+    if (offset == 3) {
+      EXPECT_EQ(100U, entry.size);
+      EXPECT_FALSE(entry.has_call_stack);
+    } else {
+      EXPECT_EQ(offset & 0x7f, entry.size);
+      EXPECT_TRUE(entry.has_call_stack);
+      EXPECT_EQ(offset * 7, entry.call_stack_hash);
+    }
+    EXPECT_FALSE(cam.FindAndRemove(reinterpret_cast<void*>(kBase + offset),
+                                   &entry));
+  }
+  EXPECT_EQ(0U, cam.size());
+  EXPECT_EQ(0U, cam.stats().num_blocks);
+}
+
+TEST_F(CompactAddressMapTest, Concurrent) {
+  const int kNumThreads = 4;
+  const uintptr_t kNumAddrsPerThread = 20000;
+  // Threads share pages and blocks, and some of them create new regions.
+  const uintptr_t kBases[] = { 0x10000000ULL, 0x3f00000000ULL };
+
+  CompactAddressMap cam(CompactAddressMap::kConcurrent);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&cam, &kBases, t] {
+      for (uintptr_t i = 0; i < kNumAddrsPerThread; ++i) {
+        uintptr_t addr = kBases[i % 2] + (i * kNumThreads + t) * 16;
+        uint32_t hash = addr;
+        cam.Insert(reinterpret_cast<void*>(addr), t, &hash);
+      }
+      // Remove every other address inserted by this thread.
+      for (uintptr_t i = 0; i < kNumAddrsPerThread; i += 2) {
+        uintptr_t addr = kBases[i % 2] + (i * kNumThreads + t) * 16;
+        CompactAddressMap::Entry entry = {};
+        EXPECT_TRUE(cam.FindAndRemove(reinterpret_cast<void*>(addr), &entry));
+        EXPECT_EQ(static_cast<uint32_t>(t), entry.size);
+        EXPECT_EQ(static_cast<uint32_t>(addr), entry.call_stack_hash);
+      }
+    });
+  }
+  for (std::thread& thread : threads)
+    thread.join();
+
+  EXPECT_EQ(kNumThreads * kNumAddrsPerThread / 2, cam.size());
+  EXPECT_EQ(2U, cam.stats().num_regions);
+  for (int t = 0; t < kNumThreads; ++t) {
+    for (uintptr_t i = 1; i < kNumAddrsPerThread; i += 2) {
+      uintptr_t addr = kBases[i % 2] + (i * kNumThreads + t) * 16;
+      CompactAddressMap::Entry entry = {};
+      EXPECT_TRUE(cam.FindAndRemove(reinterpret_cast<void*>(addr), &entry));
+      EXPECT_EQ(static_cast<uint32_t>(t), entry.size);
+    }
+  }
+  EXPECT_EQ(0U, cam.size());
+  EXPECT_EQ(0U, cam.stats().num_live_pages);
+  EXPECT_EQ(0U, cam.stats().num_live_regions);
+}
+
+TEST_F(CompactAddressMapTest, Iterate) {
+  CompactAddressMap cam;
+  EXPECT_TRUE(cam.begin() == cam.end());
+
+  // Insert addresses out of order, over several regions and within a block.
+  std::map<uintptr_t, AllocInfo> expected;
+  uint64_t value = 12345;
+  for (int i = 0; i < 5000; ++i) {
+    value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+    uintptr_t addr = (value >> 16) & 0x3ffffffffffULL;
+    if (i % 4 == 0)
+      addr = 0x7f0000001000ULL + (value >> 56);  // Dense block.
+    AllocInfo info = { static_cast<uint16_t>(i % 100),
+                       static_cast<uint32_t>(value) };
+    cam.Insert(reinterpret_cast<void*>(addr), info.size, &info.hash);
+    expected[addr] = info;
+  }
+  // Remove some of them, so the iteration sees holes left by removals.
+  for (auto it = expected.begin(); it != expected.end(); ) {
+    CompactAddressMap::Entry entry = {};
+    if (it->first % 3 == 0) {
+      EXPECT_TRUE(cam.FindAndRemove(reinterpret_cast<void*>(it->first),
+                                    &entry));
+      it = expected.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  ASSERT_EQ(expected.size(), cam.size());
+
+  auto expected_it = expected.begin();
+  for (const CompactAddressMap::LiveEntry& live : cam) {
+    ASSERT_TRUE(expected_it != expected.end());
+    EXPECT_EQ(expected_it->first, live.address);
+    EXPECT_EQ(expected_it->second.size, live.entry.size);
+    EXPECT_EQ(expected_it->second.hash, live.entry.call_stack_hash);
+    ++expected_it;
+  }
+  EXPECT_TRUE(expected_it == expected.end());
+}
+
+TEST_F(CompactAddressMapTest, Compact) {
+  // One address in each of several pages, subclusters, clusters and regions.
+  const uintptr_t kAddrs[] = {
+    0x10000000ULL,
+    0x10001000ULL,
+    0x10010000ULL,
+    0x11000000ULL,
+    0x3f10000000ULL,
+  };
+  const size_t kNumAddrs = sizeof(kAddrs) / sizeof(kAddrs[0]);
+
+  CompactAddressMap cam;
+  for (size_t i = 0; i < kNumAddrs; ++i)
+    cam.Insert(reinterpret_cast<void*>(kAddrs[i]), i, nullptr);
+  EXPECT_EQ(2U, cam.stats().num_regions);
+  EXPECT_EQ(3U, cam.stats().num_clusters);
+  EXPECT_EQ(4U, cam.stats().num_subclusters);
+  EXPECT_EQ(5U, cam.stats().num_pages);
+  EXPECT_EQ(2U, cam.stats().num_live_regions);
+  EXPECT_EQ(5U, cam.stats().num_live_pages);
+
+  // Empty the second page and the second region. The nodes are retained until
+  // the map is compacted.
+  CompactAddressMap::Entry entry = {};
+  EXPECT_TRUE(cam.FindAndRemove(reinterpret_cast<void*>(kAddrs[1]), &entry));
+  EXPECT_TRUE(cam.FindAndRemove(reinterpret_cast<void*>(kAddrs[4]), &entry));
+  EXPECT_EQ(5U, cam.stats().num_pages);
+  EXPECT_EQ(3U, cam.stats().num_live_pages);
+  EXPECT_EQ(3U, cam.stats().num_live_subclusters);
+  EXPECT_EQ(2U, cam.stats().num_live_clusters);
+  EXPECT_EQ(1U, cam.stats().num_live_regions);
+
+  cam.Compact();
+  EXPECT_EQ(1U, cam.stats().num_regions);
+  EXPECT_EQ(2U, cam.stats().num_clusters);
+  EXPECT_EQ(3U, cam.stats().num_subclusters);
+  EXPECT_EQ(3U, cam.stats().num_pages);
+  EXPECT_EQ(3U, cam.size());
+
+  // The remaining entries are still there, and removed nodes can be created
+  // again.
+  cam.Insert(reinterpret_cast<void*>(kAddrs[4]), 4, nullptr);
+  size_t num_entries = 0;
+  for (const CompactAddressMap::LiveEntry& live : cam) {
+    EXPECT_NE(kAddrs[1], live.address);
+    ++num_entries;
+  }
+  EXPECT_EQ(4U, num_entries);
+
+  for (size_t i = 0; i < kNumAddrs; ++i)
+    cam.FindAndRemove(reinterpret_cast<void*>(kAddrs[i]), &entry);
+  const size_t heap_size = cam.stats().heap_size;
+  cam.Compact();
+  EXPECT_EQ(0U, cam.stats().num_regions);
+  EXPECT_EQ(0U, cam.stats().num_pages);
+  EXPECT_LT(cam.stats().heap_size, heap_size);
+  EXPECT_TRUE(cam.begin() == cam.end());
+}
+
+TEST_F(CompactAddressMapTest, SizeEncoding) {
+  // Small sizes are exact, and large ones are rounded down to within 1/256.
+  for (size_t size = 0; size < CompactAddressMap::kMaxExactSize; ++size)
+    EXPECT_EQ(size, CompactAddressMap::RoundSize(size));
+  for (size_t size = CompactAddressMap::kMaxExactSize; size != 0;
+       size = size * 3 + 1) {
+    size_t rounded = CompactAddressMap::RoundSize(size);
+    EXPECT_LE(rounded, size);
+    EXPECT_LT(size - rounded, size / 256 + 1);
+    EXPECT_EQ(rounded, CompactAddressMap::RoundSize(rounded));
+    if (size > SIZE_MAX / 3)
+      break;
+  }
+
+  const size_t kSizes[] = { 0, 255, 256, 40000, 1 << 20, (1 << 20) + 1,
+                            123456789 };
+  const size_t kNumSizes = sizeof(kSizes) / sizeof(kSizes[0]);
+  const uintptr_t kBase = 0x7f0000000000ULL;
+
+  CompactAddressMap rounded_cam;
+  CompactAddressMap exact_cam(CompactAddressMap::kExactLargeSizes);
+  for (size_t i = 0; i < kNumSizes; ++i) {
+    void* ptr = reinterpret_cast<void*>(kBase + i * 4096);
+    rounded_cam.Insert(ptr, kSizes[i], nullptr);
+    exact_cam.Insert(ptr, kSizes[i], nullptr);
+  }
+  // Only the sizes that are not stored exactly go to the large size table.
+  EXPECT_EQ(0U, rounded_cam.stats().num_large_sizes);
+  EXPECT_EQ(3U, exact_cam.stats().num_large_sizes);
+
+  // Replacing an entry replaces its large size.
+  exact_cam.Insert(reinterpret_cast<void*>(kBase + 3 * 4096), 10, nullptr);
+  EXPECT_EQ(2U, exact_cam.stats().num_large_sizes);
+  exact_cam.Insert(reinterpret_cast<void*>(kBase + 3 * 4096), 40000, nullptr);
+  EXPECT_EQ(3U, exact_cam.stats().num_large_sizes);
+
+  size_t i = 0;
+  for (const CompactAddressMap::LiveEntry& live : exact_cam)
+    EXPECT_EQ(kSizes[i++], live.entry.size);
+  EXPECT_EQ(kNumSizes, i);
+
+  for (i = 0; i < kNumSizes; ++i) {
+    void* ptr = reinterpret_cast<void*>(kBase + i * 4096);
+    CompactAddressMap::Entry entry = {};
+    EXPECT_TRUE(rounded_cam.FindAndRemove(ptr, &entry));
+    EXPECT_EQ(CompactAddressMap::RoundSize(kSizes[i]), entry.size);
+    EXPECT_TRUE(exact_cam.FindAndRemove(ptr, &entry));
+    EXPECT_EQ(kSizes[i], entry.size);
+  }
+  EXPECT_EQ(0U, exact_cam.stats().num_large_sizes);
+}
@@ -4,11 +4,31 @@
 
 #include <gperftools/custom_allocator.h>
 
+#include <string.h>
+
+#include <atomic>
+
 #include "base/low_level_alloc.h"
 
 namespace {
 
-LowLevelAlloc::Arena* g_arena = nullptr;
+LowLevelAlloc::Arena* g_arenas[CustomAllocator::kNumArenas] = { nullptr };
+
+// Allocation stats for each arena. These are updated outside of the arena
+// locks, so they are atomic.
+struct AtomicStats {
+  std::atomic<size_t> num_allocs;
+  std::atomic<size_t> num_frees;
+  std::atomic<size_t> bytes_in_use;
+  std::atomic<size_t> peak_bytes_in_use;
+
+  void Reset() {
+    num_allocs = 0;
+    num_frees = 0;
+    bytes_in_use = 0;
+    peak_bytes_in_use = 0;
+  }
+} g_stats[CustomAllocator::kNumArenas];
 
 bool g_is_initalized_for_unit_test = false;
 
@@ -16,42 +36,116 @@ bool g_is_initalized_for_unit_test = false;
 
 // static
 void CustomAllocator::Initialize() {
-  g_arena = LowLevelAlloc::NewArena(0, LowLevelAlloc::DefaultArena());
+  for (AtomicStats& stats : g_stats)
+    stats.Reset();
+  for (int i = 0; i < kNumArenas; ++i)
+    g_arenas[i] = LowLevelAlloc::NewArena(0, LowLevelAlloc::DefaultArena());
 }
 
 // static
 bool CustomAllocator::Shutdown() {
-  if (!g_is_initalized_for_unit_test)
-    return LowLevelAlloc::DeleteArena(g_arena);
+  if (!g_is_initalized_for_unit_test) {
+    bool all_empty = true;
+    for (int i = 0; i < kNumArenas; ++i) {
+      if (!LowLevelAlloc::DeleteArena(g_arenas[i]))
+        all_empty = false;
+    }
+    return all_empty;
+  }
   g_is_initalized_for_unit_test = false;
   return true;
 }
 
 // static
 bool CustomAllocator::IsInitialized() {
-  return g_arena || g_is_initalized_for_unit_test;
+  return g_arenas[kDefaultArena] || g_is_initalized_for_unit_test;
 }
 
 // static
 void CustomAllocator::InitializeForUnitTest() {
+  for (AtomicStats& stats : g_stats)
+    stats.Reset();
   g_is_initalized_for_unit_test = true;
 }
 
 // static
 void* CustomAllocator::Allocate(size_t size) {
-  if (g_is_initalized_for_unit_test)
-    return new char[size];
+  return Allocate(size, kDefaultArena);
+}
 
-  if (!g_arena)
-    return nullptr;
+// static
+void CustomAllocator::Free(void* ptr, size_t size) {
+  Free(ptr, size, kDefaultArena);
+}
+
+// static
+void* CustomAllocator::Allocate(size_t size, ArenaId arena) {
+  void* ptr = nullptr;
+  if (g_is_initalized_for_unit_test)
+    ptr = new char[size];
+  else if (g_arenas[arena])
+    ptr = LowLevelAlloc::AllocWithArena(size, g_arenas[arena]);
 
-  return LowLevelAlloc::AllocWithArena(size, g_arena);
+  if (ptr) {
+    AtomicStats* stats = &g_stats[arena];
+    stats->num_allocs.fetch_add(1, std::memory_order_relaxed);
+    size_t bytes_in_use =
+        stats->bytes_in_use.fetch_add(size, std::memory_order_relaxed) + size;
+    size_t peak = stats->peak_bytes_in_use.load(std::memory_order_relaxed);
+    while (bytes_in_use > peak &&
+           !stats->peak_bytes_in_use.compare_exchange_weak(
+               peak, bytes_in_use, std::memory_order_relaxed)) {
+    }
+  }
+  return ptr;
 }
 
 // static
-void CustomAllocator::Free(void* ptr, size_t /* size */) {
+void CustomAllocator::Free(void* ptr, size_t size, ArenaId arena) {
+  if (!ptr)
+    return;
+
+  AtomicStats* stats = &g_stats[arena];
+  stats->num_frees.fetch_add(1, std::memory_order_relaxed);
+  stats->bytes_in_use.fetch_sub(size, std::memory_order_relaxed);
+
   if (g_is_initalized_for_unit_test)
     delete [] reinterpret_cast<char*>(ptr);
   else
     LowLevelAlloc::Free(ptr);
 }
+
+// static
+void CustomAllocator::GetStats(ArenaId arena, Stats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->num_allocs = g_stats[arena].num_allocs;
+  stats->num_frees = g_stats[arena].num_frees;
+  stats->bytes_in_use = g_stats[arena].bytes_in_use;
+  stats->peak_bytes_in_use = g_stats[arena].peak_bytes_in_use;
+
+  if (g_is_initalized_for_unit_test || !g_arenas[arena])
+    return;
+  LowLevelAlloc::LockStats lock_stats;
+  LowLevelAlloc::GetLockStats(g_arenas[arena], &lock_stats);
+  stats->num_lock_acquisitions = lock_stats.num_acquisitions;
+  stats->num_contended_lock_acquisitions =
+      lock_stats.num_contended_acquisitions;
+  stats->lock_cycles_held = lock_stats.cycles_held;
+  stats->lock_cycles_waited = lock_stats.cycles_waited;
+}
+
+// static
+const char* CustomAllocator::GetArenaName(ArenaId arena) {
+  switch (arena) {
+  case kDefaultArena:
+    return "default";
+  case kAddressMapArena:
+    return "address map";
+  case kCallStackArena:
+    return "call stack";
+  case kAnalysisArena:
+    return "analysis";
+  default:
+    return "(none)";
+  }
+}
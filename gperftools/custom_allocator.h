@@ -6,13 +6,42 @@
 #define CUSTOM_ALLOCATOR_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 // PERFTOOLS_DLL_DECL is unnecessary, as it is Windows specific.
 
 // A container class for using LowLevelAlloc with STL_Allocator. The functions
 // Allocate() and Free() must match the specificiations in STL_Allocator.
+// Allocate() and Free() are thread-safe.
 class CustomAllocator {
  public:
+  // Allocations are segregated into separate arenas by the subsystem that owns
+  // them, so that data with different lifetimes and access patterns does not
+  // get interleaved in memory, and so that memory usage can be accounted for
+  // per subsystem.
+  enum ArenaId {
+    kDefaultArena,     // Everything not listed below.
+    kAddressMapArena,  // Tracking of individual allocated addresses.
+    kCallStackArena,   // Unique call stacks.
+    kAnalysisArena,    // Size and call stack tables, leak analysis.
+    kNumArenas,
+  };
+
+  // Allocation stats for a single arena.
+  struct Stats {
+    size_t num_allocs;
+    size_t num_frees;
+    size_t bytes_in_use;
+    size_t peak_bytes_in_use;
+
+    // Stats for the lock that guards the arena, in CycleClock ticks. These are
+    // zero when initialized for unit tests.
+    int64_t num_lock_acquisitions;
+    int64_t num_contended_lock_acquisitions;
+    int64_t lock_cycles_held;
+    int64_t lock_cycles_waited;
+  };
+
   // This is a stateless class, but there is static data within the module that
   // needs to be created and deleted.
   static void Initialize();
@@ -22,8 +51,17 @@ class CustomAllocator {
   // Special initialization for unit testing. Uses new/delete for allocations.
   static void InitializeForUnitTest();
 
+  // Allocate from and free to the default arena.
   static void* Allocate(size_t size);
   static void Free(void* ptr, size_t size);
+
+  // Allocate from and free to the given arena. |ptr| must be freed to the same
+  // arena that it was allocated from.
+  static void* Allocate(size_t size, ArenaId arena);
+  static void Free(void* ptr, size_t size, ArenaId arena);
+
+  static void GetStats(ArenaId arena, Stats* stats);
+  static const char* GetArenaName(ArenaId arena);
 };
 
 #endif  // CUSTOM_ALLOCATOR_H_
@@ -0,0 +1,421 @@
+// Benchmark for the cost of the leak detector's allocation hooks.
+//
+// Drives MallocHook::InvokeNewHook() and InvokeDeleteHook() from several
+// threads, with the default leak detector instance set up by
+// leak_detector::Initialize(), so that the hooks run exactly as they do in a
+// process. Each operation is timed on its own, and the latencies are reported
+// in nanoseconds for each path through the hooks:
+//
+//   alloc_unsampled  Allocations whose address is not sampled.
+//   alloc_sampled    Sampled allocations of sizes without a stack table.
+//   alloc_stack      Sampled allocations that take and record a call stack.
+//   free_unsampled   Frees whose address is not sampled.
+//   free_sampled     Frees whose address is sampled.
+//   leak_check       Allocations that ran a stats dump and leak check.
+//   timer            An empty operation, which is the cost of timing one.
+//
+// Usage: hook_benchmark [--OPTION=VALUE ...]
+//
+// Options:
+//   --threads=N           Run with 1, 2, 4, ... threads, up to N. Defaults
+//                         to 4.
+//   --ops=N               Allocations per thread. Defaults to 2000000.
+//   --sampling-factor=N   As LEAK_DETECTOR_SAMPLING_FACTOR. Defaults to 1.
+//   --stack-depth=N       As LEAK_DETECTOR_STACK_DEPTH. Defaults to 4.
+//   --dump-interval-kb=N  As LEAK_DETECTOR_DUMP_INTERVAL_KB. Defaults to
+//                         32768.
+//   --shards=N            As LEAK_DETECTOR_NUM_SHARDS. Defaults to 0.
+//   --addresses=D         "sequential" for objects packed back to back, or
+//                         "random" for random addresses. Defaults to running
+//                         both.
+//   --live=N              Live allocations per thread. Each allocation beyond
+//                         that is followed by the free of a random live one.
+//                         Defaults to 10000.
+//   --leak-rate=R         Fraction of allocations that leak, all from one call
+//                         stack and of one size, so that the detector creates a
+//                         stack table for that size. Defaults to 0.01.
+//   --verbose             Show the output of the leak detector, which is
+//                         discarded otherwise.
+//
+// The defaults are those of the leak detector. Each configuration runs in a
+// child process, since the default instance can only be set up once per
+// process.
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/cycleclock.h"
+#include "hooks.h"
+#include "latency_histogram.h"
+#include "leak_detector.h"
+#include "tool_options.h"
+
+namespace {
+
+using leak_detector::LeakDetector;
+
+struct Options {
+  Options()
+      : max_threads(4),
+        num_ops(2000000),
+        sampling_factor(1),
+        stack_depth(4),
+        dump_interval_kb(32768),
+        num_shards(0),
+        addresses(NULL),
+        num_live(10000),
+        leak_rate(0.01),
+        verbose(false) {}
+
+  int max_threads;
+  uint64_t num_ops;
+  int sampling_factor;
+  int stack_depth;
+  int dump_interval_kb;
+  int num_shards;
+  const char* addresses;
+  size_t num_live;
+  double leak_rate;
+  bool verbose;
+};
+
+enum Path {
+  kAllocUnsampled,
+  kAllocSampled,
+  kAllocStack,
+  kFreeUnsampled,
+  kFreeSampled,
+  kLeakCheck,
+  kTimer,
+  kNumPaths,
+};
+
+const char* const kPathNames[kNumPaths] = {
+  "alloc_unsampled", "alloc_sampled", "alloc_stack", "free_unsampled",
+  "free_sampled", "leak_check", "timer",
+};
+
+// Size of the leaked allocations.
+const uint32_t kLeakSize = 200;
+
+// Number of distinct call stacks that the other allocations come from.
+const int kNumStacks = 64;
+
+// Each thread allocates from its own address range of this size.
+const uintptr_t kThreadRangeSize = 1ULL << 40;
+
+// Set by the leak check callback, which runs on the thread whose allocation
+// triggered the check.
+__thread bool t_leak_checked = false;
+
+void OnLeakCheck(
+    const leak_detector::InternalVector<leak_detector::InternalLeakReport>&,
+    void* /* context */) {
+  t_leak_checked = true;
+}
+
+void PrintUsage(const char* program) {
+  printf("Usage: %s [--OPTION=VALUE ...]\n"
+         "See hook_benchmark.cc for the options.\n", program);
+}
+
+bool ParseOptions(int argc, char* argv[], Options* options) {
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value;
+    if (strcmp(arg, "--verbose") == 0) {
+      options->verbose = true;
+    } else if (MatchOption(arg, "threads", &value)) {
+      options->max_threads = atoi(value);
+    } else if (MatchOption(arg, "ops", &value)) {
+      options->num_ops = strtoull(value, NULL, 10);
+    } else if (MatchOption(arg, "sampling-factor", &value)) {
+      options->sampling_factor = atoi(value);
+    } else if (MatchOption(arg, "stack-depth", &value)) {
+      options->stack_depth = atoi(value);
+    } else if (MatchOption(arg, "dump-interval-kb", &value)) {
+      options->dump_interval_kb = atoi(value);
+    } else if (MatchOption(arg, "shards", &value)) {
+      options->num_shards = atoi(value);
+    } else if (MatchOption(arg, "addresses", &value)) {
+      if (strcmp(value, "sequential") != 0 && strcmp(value, "random") != 0) {
+        printf("Unknown address distribution: %s\n", value);
+        return false;
+      }
+      options->addresses = value;
+    } else if (MatchOption(arg, "live", &value)) {
+      options->num_live = strtoull(value, NULL, 10);
+    } else if (MatchOption(arg, "leak-rate", &value)) {
+      options->leak_rate = atof(value);
+    } else {
+      printf("Unexpected argument: %s\n", arg);
+      return false;
+    }
+  }
+
+  if (options->max_threads < 1 || options->num_ops < 1 ||
+      options->sampling_factor < 1 || options->sampling_factor > 256 ||
+      options->stack_depth < 1 || options->dump_interval_kb < 1 ||
+      options->num_shards < 0 || options->leak_rate < 0 ||
+      options->leak_rate >= 1) {
+    printf("Invalid options\n");
+    return false;
+  }
+  return true;
+}
+
+// An allocation to be made by a benchmark thread.
+struct Allocation {
+  uintptr_t address;
+  uint32_t size;
+  int stack;  // -1 if the allocation leaks.
+};
+
+// Generate the allocations of thread |thread|, from its own address range.
+std::vector<Allocation> GenerateAllocations(const Options& options,
+                                            const char* addresses,
+                                            int thread) {
+  std::mt19937_64 rng(thread + 1);
+  std::uniform_int_distribution<uint32_t> size_dist(1, 64);
+  std::uniform_int_distribution<uintptr_t> address_dist(
+      0, kThreadRangeSize / 16 - 1);
+  std::uniform_int_distribution<int> stack_dist(0, kNumStacks - 1);
+  std::bernoulli_distribution leak_dist(options.leak_rate);
+
+  const bool sequential = strcmp(addresses, "sequential") == 0;
+  uintptr_t cursor = (thread + 1) * kThreadRangeSize;
+  std::vector<Allocation> allocations;
+  allocations.reserve(options.num_ops);
+  for (uint64_t i = 0; i < options.num_ops; ++i) {
+    Allocation allocation;
+    const bool leak = leak_dist(rng);
+    allocation.size = leak ? kLeakSize : size_dist(rng) * 16;
+    allocation.stack = leak ? -1 : stack_dist(rng);
+    if (sequential) {
+      allocation.address = cursor;
+      cursor += allocation.size;
+    } else {
+      allocation.address =
+          (thread + 1) * kThreadRangeSize + address_dist(rng) * 16;
+    }
+    allocations.push_back(allocation);
+  }
+  return allocations;
+}
+
+// Make the allocations in |allocations|, and record the latency of each hook
+// invocation by its path in |histograms|.
+void RunThread(const Options& options,
+               const std::vector<Allocation>& allocations,
+               int thread,
+               LatencyHistogram histograms[kNumPaths]) {
+  const LeakDetector* detector = leak_detector::GetDefaultInstance();
+  std::mt19937_64 rng(1000 + thread);
+
+  // Fake call stacks, which only need to be distinct.
+  std::vector<std::vector<void*>> stacks(kNumStacks + 1);
+  for (size_t i = 0; i < stacks.size(); ++i) {
+    for (int j = 0; j < options.stack_depth; ++j) {
+      stacks[i].push_back(
+          reinterpret_cast<void*>(0x400000 + i * 0x1000 + j * 0x10));
+    }
+  }
+
+  std::vector<uintptr_t> live;
+  live.reserve(options.num_live + 1);
+  for (const Allocation& allocation : allocations) {
+    const void* ptr = reinterpret_cast<const void*>(allocation.address);
+    const std::vector<void*>& stack =
+        stacks[allocation.stack < 0 ? kNumStacks : allocation.stack];
+    MallocHook::SetCallerStackTrace(stack.size(), stack.data());
+
+    Path path = kAllocUnsampled;
+    if (detector->ShouldGetStackTrace(ptr, allocation.size))
+      path = kAllocStack;
+    else if (detector->ShouldSample(ptr))
+      path = kAllocSampled;
+    t_leak_checked = false;
+    int64_t start = CycleClock::Now();
+    MallocHook::InvokeNewHook(ptr, allocation.size);
+    int64_t ticks = CycleClock::Now() - start;
+    histograms[t_leak_checked ? kLeakCheck : path].Add(ticks);
+
+    start = CycleClock::Now();
+    histograms[kTimer].Add(CycleClock::Now() - start);
+
+    if (allocation.stack >= 0)
+      live.push_back(allocation.address);
+    if (live.size() <= options.num_live)
+      continue;
+
+    size_t index = rng() % live.size();
+    const void* freed = reinterpret_cast<const void*>(live[index]);
+    live[index] = live.back();
+    live.pop_back();
+    path = detector->ShouldSample(freed) ? kFreeSampled : kFreeUnsampled;
+    start = CycleClock::Now();
+    MallocHook::InvokeDeleteHook(freed);
+    histograms[path].Add(CycleClock::Now() - start);
+  }
+
+  // Free the rest, so that the next configuration starts out the same.
+  for (uintptr_t address : live)
+    MallocHook::InvokeDeleteHook(reinterpret_cast<const void*>(address));
+}
+
+double NowNanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void SetEnv(const char* name, int value) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%d", value);
+  setenv(name, buffer, 1);
+}
+
+// Run one configuration in the calling process, and write a result row per
+// path to |out|.
+void RunConfiguration(const Options& options,
+                      const char* addresses,
+                      int num_threads,
+                      FILE* out) {
+  SetEnv("LEAK_DETECTOR_SAMPLING_FACTOR", options.sampling_factor);
+  SetEnv("LEAK_DETECTOR_STACK_DEPTH", options.stack_depth);
+  SetEnv("LEAK_DETECTOR_DUMP_INTERVAL_KB", options.dump_interval_kb);
+  SetEnv("LEAK_DETECTOR_NUM_SHARDS", options.num_shards);
+  leak_detector::Initialize();
+  leak_detector::SetLeakCheckCallback(&OnLeakCheck);
+
+  std::vector<std::vector<Allocation>> allocations;
+  for (int i = 0; i < num_threads; ++i)
+    allocations.push_back(GenerateAllocations(options, addresses, i));
+  std::vector<std::vector<LatencyHistogram>> histograms(
+      num_threads, std::vector<LatencyHistogram>(kNumPaths));
+
+  // CycleClock ticks are converted to nanoseconds by their rate over the
+  // whole run.
+  const double start_ns = NowNanoseconds();
+  const int64_t start_ticks = CycleClock::Now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.push_back(std::thread(&RunThread, std::cref(options),
+                                  std::cref(allocations[i]), i,
+                                  histograms[i].data()));
+  }
+  for (std::thread& thread : threads)
+    thread.join();
+  const double ns_per_tick =
+      (NowNanoseconds() - start_ns) / (CycleClock::Now() - start_ticks);
+
+  leak_detector::Shutdown();
+
+  for (int path = 0; path < kNumPaths; ++path) {
+    LatencyHistogram total;
+    for (int i = 0; i < num_threads; ++i)
+      total.Merge(histograms[i][path]);
+    fprintf(out,
+            "%7d %-10s %-15s %10" PRIu64 " %8.0f %8.0f %8.0f %8.0f %9.1f\n",
+            num_threads, addresses, kPathNames[path], total.count(),
+            total.Quantile(0.5) * ns_per_tick,
+            total.Quantile(0.9) * ns_per_tick,
+            total.Quantile(0.99) * ns_per_tick,
+            total.Quantile(0.999) * ns_per_tick, total.Mean() * ns_per_tick);
+  }
+}
+
+// Run one configuration in a child process, and append its result rows to
+// |results|. Returns false if it failed.
+bool RunChild(const Options& options,
+              const char* addresses,
+              int num_threads,
+              std::string* results) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    return false;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return false;
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+    FILE* out = fdopen(fds[1], "w");
+    if (!options.verbose && !freopen("/dev/null", "w", stdout))
+      _exit(1);
+    RunConfiguration(options, addresses, num_threads, out);
+    fclose(out);
+    fflush(stdout);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  char buffer[4096];
+  ssize_t length;
+  while ((length = read(fds[0], buffer, sizeof(buffer))) > 0)
+    results->append(buffer, length);
+  close(fds[0]);
+
+  int status;
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Configuration with %d threads and %s addresses failed\n",
+            num_threads, addresses);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  std::vector<const char*> distributions;
+  if (options.addresses) {
+    distributions.push_back(options.addresses);
+  } else {
+    distributions.push_back("sequential");
+    distributions.push_back("random");
+  }
+  std::vector<int> thread_counts;
+  for (int threads = 1; threads < options.max_threads; threads *= 2)
+    thread_counts.push_back(threads);
+  thread_counts.push_back(options.max_threads);
+
+  // The leak detector's output comes first, if shown, and the results after.
+  std::string results;
+  for (const char* addresses : distributions) {
+    for (int threads : thread_counts) {
+      if (!RunChild(options, addresses, threads, &results))
+        return 1;
+    }
+  }
+
+  printf("%7s %-10s %-15s %10s %8s %8s %8s %8s %9s\n",
+         "threads", "addresses", "path", "ops", "p50_ns", "p90_ns", "p99_ns",
+         "p99.9_ns", "mean_ns");
+  fputs(results.c_str(), stdout);
+  return 0;
+}
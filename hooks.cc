@@ -3,42 +3,44 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
 
 namespace MallocHook {
 
 namespace {
 
-NewHookType new_hook_ = NULL;
-DeleteHookType delete_hook_ = NULL;
-void* stack_trace_[32];
-int depth_;
+// Atomic, since the hooks may be set while other threads invoke them.
+std::atomic<NewHookType> new_hook_(NULL);
+std::atomic<DeleteHookType> delete_hook_(NULL);
+
+// Per thread, so that several threads can invoke the hooks at once.
+__thread void* const* stack_trace_ = NULL;
+__thread int depth_;
 
 }  // namespace
 
 NewHookType SetNewHook(NewHookType hook) {
-  NewHookType old_hook = new_hook_;
-  new_hook_ = hook;
-  return old_hook;
+  return new_hook_.exchange(hook);
 }
 
 DeleteHookType SetDeleteHook(DeleteHookType hook) {
-  DeleteHookType old_hook = delete_hook_;
-  delete_hook_ = hook;
-  return old_hook;
+  return delete_hook_.exchange(hook);
 }
 
 void InvokeNewHook(const void* ptr, size_t size) {
-  if (new_hook_)
-    new_hook_(ptr, size);
+  NewHookType hook = new_hook_;
+  if (hook)
+    hook(ptr, size);
 }
 
 void InvokeDeleteHook(const void* ptr) {
-  if (delete_hook_)
-    delete_hook_(ptr);
+  DeleteHookType hook = delete_hook_;
+  if (hook)
+    hook(ptr);
 }
 
 void SetCallerStackTrace(int depth, void* const stack[]) {
-  memcpy(stack_trace_, stack, sizeof(*stack) * depth);
+  stack_trace_ = stack;
   depth_ = depth;
 }
 
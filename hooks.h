@@ -14,6 +14,8 @@ DeleteHookType SetDeleteHook(DeleteHookType);
 void InvokeNewHook(const void* ptr, size_t size);
 void InvokeDeleteHook(const void* ptr);
 
+// |stack| is not copied, and must remain valid until the hooks that use it have
+// been invoked. Each thread has its own caller stack trace.
 void SetCallerStackTrace(int depth, void* const stack[]);
 int GetCallerStackTrace(void* stack[], int depth, int skip);
 
@@ -0,0 +1,80 @@
+#ifndef LATENCY_HISTOGRAM_H_
+#define LATENCY_HISTOGRAM_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+// Histogram of operation latencies, for the benchmarks. Values below
+// kNumExactBuckets have a bucket each. Above that, each power of two is split
+// into kSubBuckets buckets.
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : buckets_(kNumBuckets), count_(0), sum_(0) {}
+
+  void Add(int64_t value) {
+    if (value < 0)
+      value = 0;
+    ++buckets_[BucketIndex(value)];
+    ++count_;
+    sum_ += value;
+  }
+
+  // Add all values of |other|, e.g. to combine the histograms of several
+  // threads.
+  void Merge(const LatencyHistogram& other) {
+    for (int i = 0; i < kNumBuckets; ++i)
+      buckets_[i] += other.buckets_[i];
+    count_ += other.count_;
+    sum_ += other.sum_;
+  }
+
+  uint64_t count() const {
+    return count_;
+  }
+
+  double Mean() const {
+    return count_ ? static_cast<double>(sum_) / count_ : 0;
+  }
+
+  // Return the lower bound of the bucket containing the |fraction| quantile.
+  uint64_t Quantile(double fraction) const {
+    uint64_t target = static_cast<uint64_t>(fraction * count_);
+    uint64_t total = 0;
+    for (int i = 0; i < kNumBuckets; ++i) {
+      total += buckets_[i];
+      if (total > target)
+        return BucketValue(i);
+    }
+    return BucketValue(kNumBuckets - 1);
+  }
+
+ private:
+  static const int kSubBucketBits = 4;
+  static const int kSubBuckets = 1 << kSubBucketBits;
+  static const int kNumExactBuckets = 2 * kSubBuckets;
+  static const int kNumBuckets =
+      kNumExactBuckets + (64 - kSubBucketBits - 1) * kSubBuckets;
+
+  static int BucketIndex(uint64_t value) {
+    if (value < kNumExactBuckets)
+      return value;
+    int shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+    int sub_bucket = (value >> shift) & (kSubBuckets - 1);
+    return kNumExactBuckets + (shift - 1) * kSubBuckets + sub_bucket;
+  }
+
+  static uint64_t BucketValue(int index) {
+    if (index < kNumExactBuckets)
+      return index;
+    index -= kNumExactBuckets;
+    int shift = index / kSubBuckets + 1;
+    return static_cast<uint64_t>(kSubBuckets + index % kSubBuckets) << shift;
+  }
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_;
+  uint64_t sum_;
+};
+
+#endif  // LATENCY_HISTOGRAM_H_
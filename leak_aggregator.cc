@@ -0,0 +1,295 @@
+// Looks for leaks in the pooled allocation counts of many processes that run
+// the same binary. Each process only samples a small part of its allocations,
+// but the leak analysis runs on the sum of the samples of all of them, so the
+// processes can use a much lower sampling factor for the same detection power.
+//
+// Usage: leak_aggregator [--OPTION=VALUE ...] SOCKET
+//
+// Options:
+//   --interval-ms=N     Analyze the latest summaries of all processes every N
+//                       milliseconds. Defaults to 10000.
+//   --size-suspicion-threshold=N
+//   --call-stack-suspicion-threshold=N
+//                       As the LEAK_DETECTOR_* environment variables of the
+//                       same names. Default to 4.
+//   --verbose           Dump all leak analysis data.
+//
+// The processes connect to the Unix socket SOCKET when their
+// LEAK_DETECTOR_AGGREGATOR environment variable is set to it, and send it a
+// summary of their counts at each of their own leak checks. See
+// leak_summary.h. The summaries must have been taken over similar periods,
+// e.g. with the same dump interval, for their counts to be comparable.
+//
+// The analysis runs on the latest summary of each connected process, if any
+// arrived since the last analysis. It replies to all processes with the sizes
+// that it suspects, so that they record the call stacks of those sizes and
+// include them in later summaries. Suspected leaks are printed as:
+//
+//   report analysis=N processes=P size=SIZE stack=OFFSET,...
+//
+// with the same offsets as in the leak reports of the processes.
+
+#include <gperftools/custom_allocator.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "leak_detector_impl.h"
+#include "leak_summary.h"
+#include "tool_options.h"
+
+namespace {
+
+using leak_detector::InternalLeakReport;
+using leak_detector::InternalVector;
+using leak_detector::LeakDetectorImpl;
+
+struct Options {
+  Options()
+      : socket_path(NULL),
+        interval_ms(10000),
+        size_suspicion_threshold(4),
+        call_stack_suspicion_threshold(4),
+        verbose(false) {}
+
+  const char* socket_path;
+  int interval_ms;
+  int size_suspicion_threshold;
+  int call_stack_suspicion_threshold;
+  bool verbose;
+};
+
+// A connected process, and its latest summary.
+struct Client {
+  int fd;
+  std::vector<uint8_t> summary;
+};
+
+// Set by the handler of SIGINT and SIGTERM.
+volatile sig_atomic_t g_stop = 0;
+
+void Stop(int /* signum */) {
+  g_stop = 1;
+}
+
+void PrintUsage(const char* program) {
+  printf("Usage: %s [--OPTION=VALUE ...] SOCKET\n"
+         "See leak_aggregator.cc for the options.\n", program);
+}
+
+bool ParseOptions(int argc, char* argv[], Options* options) {
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value;
+    if (strcmp(arg, "--verbose") == 0) {
+      options->verbose = true;
+    } else if (MatchOption(arg, "interval-ms", &value)) {
+      options->interval_ms = atoi(value);
+    } else if (MatchOption(arg, "size-suspicion-threshold", &value)) {
+      options->size_suspicion_threshold = atoi(value);
+    } else if (MatchOption(arg, "call-stack-suspicion-threshold", &value)) {
+      options->call_stack_suspicion_threshold = atoi(value);
+    } else if (arg[0] == '-' || options->socket_path) {
+      printf("Unexpected argument: %s\n", arg);
+      return false;
+    } else {
+      options->socket_path = arg;
+    }
+  }
+
+  if (!options->socket_path)
+    return false;
+  if (options->interval_ms < 1 || options->size_suspicion_threshold < 1 ||
+      options->call_stack_suspicion_threshold < 1) {
+    printf("Invalid options\n");
+    return false;
+  }
+  return true;
+}
+
+// Create the socket that the processes connect to. Returns -1 on failure.
+int Listen(const char* path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printf("Socket path is too long: %s\n", path);
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0 ||
+      bind(fd, reinterpret_cast<struct sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    printf("Could not listen on %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+uint64_t NowMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+// Receive a message from |client|. Returns false if it disconnected or sent an
+// invalid summary.
+bool Receive(Client* client, std::vector<uint8_t>* buffer) {
+  ssize_t length =
+      recv(client->fd, buffer->data(), buffer->size(), MSG_TRUNC);
+  if (length < 0 && errno == EINTR)
+    return true;
+  if (length <= 0)
+    return false;
+  if (static_cast<size_t>(length) > buffer->size()) {
+    printf("Summary of %zd bytes is too large\n", length);
+    return false;
+  }
+
+  auto ignore_size = [](uint32_t, uint32_t) {};
+  auto ignore_stack = [](uint32_t, uint32_t, int, const void* const*) {};
+  if (!leak_detector::leak_summary::ParseSummary(
+          buffer->data(), length, ignore_size, ignore_stack)) {
+    printf("Invalid summary\n");
+    return false;
+  }
+  client->summary.assign(buffer->begin(), buffer->begin() + length);
+  return true;
+}
+
+// Run the leak analysis on the latest summaries of |clients|, print the
+// suspected leaks, and tell the clients which sizes to record call stacks for.
+void Analyze(const Options& options,
+             uint64_t analysis,
+             const std::vector<Client>& clients,
+             LeakDetectorImpl* detector) {
+  detector->ClearCounts();
+  int num_processes = 0;
+  for (const Client& client : clients) {
+    if (client.summary.empty())
+      continue;
+    detector->AddSummary(client.summary.data(), client.summary.size());
+    ++num_processes;
+  }
+
+  InternalVector<InternalLeakReport> reports;
+  detector->TestForLeaks(options.verbose, &reports);
+  for (const InternalLeakReport& report : reports) {
+    printf("report analysis=%" PRIu64 " processes=%d size=%zu stack=",
+           analysis, num_processes, report.alloc_size_bytes);
+    for (size_t i = 0; i < report.call_stack.size(); ++i)
+      printf("%s%" PRIxPTR, i ? "," : "", report.call_stack[i]);
+    printf("\n");
+  }
+  fflush(stdout);
+
+  InternalVector<uint32_t> sizes;
+  InternalVector<uint8_t> reply;
+  detector->GetStackTableSizes(&sizes);
+  leak_detector::leak_summary::WriteReply(sizes, &reply);
+  for (const Client& client : clients) {
+    // A client that is not reading gets the sizes with the next reply.
+    send(client.fd, reply.data(), reply.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  int listen_fd = Listen(options.socket_path);
+  if (listen_fd < 0)
+    return 1;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &Stop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  CustomAllocator::Initialize();
+  {
+    // Without a mapping, the offsets in the summaries are kept as they are.
+    LeakDetectorImpl detector(0, 0, options.size_suspicion_threshold,
+                              options.call_stack_suspicion_threshold,
+                              options.verbose);
+    std::vector<Client> clients;
+    std::vector<uint8_t> buffer(leak_detector::leak_summary::kMaxMessageSize);
+    std::vector<struct pollfd> fds;
+    uint64_t num_analyses = 0;
+    uint64_t next_analysis_ms = NowMs() + options.interval_ms;
+    bool have_new_summaries = false;
+
+    while (!g_stop) {
+      fds.clear();
+      fds.push_back({ listen_fd, POLLIN, 0 });
+      for (const Client& client : clients)
+        fds.push_back({ client.fd, POLLIN, 0 });
+
+      uint64_t now_ms = NowMs();
+      int timeout_ms =
+          next_analysis_ms > now_ms ? next_analysis_ms - now_ms : 0;
+      if (poll(fds.data(), fds.size(), timeout_ms) < 0 && errno != EINTR) {
+        printf("poll: %s\n", strerror(errno));
+        break;
+      }
+
+      // Clients are only added and removed after handling all of |fds|, whose
+      // order matches |clients|.
+      size_t num_clients = clients.size();
+      for (size_t i = num_clients; i-- > 0;) {
+        if (!fds[i + 1].revents)
+          continue;
+        if (Receive(&clients[i], &buffer)) {
+          have_new_summaries = true;
+          continue;
+        }
+        close(clients[i].fd);
+        clients.erase(clients.begin() + i);
+      }
+      if (fds[0].revents & POLLIN) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd >= 0)
+          clients.push_back({ fd, std::vector<uint8_t>() });
+      }
+
+      if (NowMs() < next_analysis_ms)
+        continue;
+      next_analysis_ms += options.interval_ms;
+      if (!have_new_summaries)
+        continue;
+      have_new_summaries = false;
+      Analyze(options, ++num_analyses, clients, &detector);
+    }
+
+    for (const Client& client : clients)
+      close(client.fd);
+  }
+  CustomAllocator::Shutdown();
+
+  close(listen_fd);
+  unlink(options.socket_path);
+  return 0;
+}
@@ -7,6 +7,8 @@
 #include <set>
 #include <utility>
 
+#include "checkpoint.h"
+
 namespace leak_detector {
 
 namespace {
@@ -121,6 +123,40 @@ size_t LeakAnalyzer::Dump(const size_t buffer_size, char* buffer) const {
   return buffer_size - size_remaining;
 }
 
+void LeakAnalyzer::Save(CheckpointWriter* writer) const {
+  ranked_entries_.Save(writer);
+  prev_ranked_entries_.Save(writer);
+
+  writer->WriteUint64(suspected_histogram_.size());
+  for (const auto& entry : suspected_histogram_) {
+    writer->WriteValue(entry.first);
+    writer->WriteUint32(entry.second);
+  }
+
+  writer->WriteUint64(suspected_leaks_.size());
+  for (const ValueType& value : suspected_leaks_)
+    writer->WriteValue(value);
+}
+
+void LeakAnalyzer::Load(CheckpointReader* reader) {
+  ranked_entries_.Load(reader);
+  prev_ranked_entries_.Load(reader);
+
+  suspected_histogram_.clear();
+  uint64_t num_suspects = reader->ReadUint64();
+  for (uint64_t i = 0; i < num_suspects && reader->ok(); ++i) {
+    ValueType value = reader->ReadValue();
+    suspected_histogram_[value] = reader->ReadUint32();
+  }
+
+  suspected_leaks_.clear();
+  uint64_t num_leaks = reader->ReadUint64();
+  if (num_leaks > suspected_histogram_.size())
+    reader->Fail();
+  for (uint64_t i = 0; i < num_leaks && reader->ok(); ++i)
+    suspected_leaks_.push_back(reader->ReadValue());
+}
+
 void LeakAnalyzer::AnalyzeDeltas(const RankedList& ranked_deltas) {
   bool found_drop = false;
   RankedList::const_iterator drop_position = ranked_deltas.end();
@@ -152,7 +188,9 @@ void LeakAnalyzer::AnalyzeDeltas(const RankedList& ranked_deltas) {
   // All leak values before the drop are suspected during this analysis.
   std::set<ValueType,
            std::less<ValueType>,
-           Allocator<ValueType>> current_suspects;
+           Allocator<ValueType>> current_suspects(
+      std::less<ValueType>(),
+      Allocator<ValueType>(CustomAllocator::kAnalysisArena));
   if (found_drop) {
     for (RankedList::const_iterator ranked_list_iter = ranked_deltas.begin();
          ranked_list_iter != drop_position;
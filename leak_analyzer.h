@@ -18,6 +18,9 @@
 
 namespace leak_detector {
 
+class CheckpointReader;
+class CheckpointWriter;
+
 class LeakAnalyzer {
  public:
   using ValueType = LeakDetectorValueType;
@@ -28,6 +31,11 @@ class LeakAnalyzer {
   LeakAnalyzer(uint32_t ranking_size, uint32_t num_suspicions_threshold)
       : ranking_size_(ranking_size),
         score_threshold_(num_suspicions_threshold),
+        suspected_histogram_(
+            std::less<ValueType>(),
+            Allocator<std::pair<ValueType, uint32_t>>(
+                CustomAllocator::kAnalysisArena)),
+        suspected_leaks_(Allocator<ValueType>(CustomAllocator::kAnalysisArena)),
         ranked_entries_(ranking_size),
         prev_ranked_entries_(ranking_size) {
     suspected_leaks_.reserve(ranking_size);
@@ -51,6 +59,11 @@ class LeakAnalyzer {
   // 1, unless |size| == 0.
   size_t Dump(const size_t buffer_size, char* buffer) const;
 
+  // Save the analysis state to |writer|, or replace it with that saved in
+  // |reader|.
+  void Save(CheckpointWriter* writer) const;
+  void Load(CheckpointReader* reader);
+
  private:
   // Analyze a list of allocation count deltas from the previous iteration. If
   // anything looks like a possible leak, update the suspicion scores.
@@ -8,15 +8,29 @@
 #include <gperftools/malloc_extension.h>
 #include <gperftools/malloc_hook.h>
 #include <gperftools/spin_lock_wrapper.h>
+#include <errno.h>
 #include <link.h>
+#include <signal.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <new>
+#include <utility>
 
 #include "base/logging.h"
+#include "checkpoint.h"
 #include "components/metrics/leak_detector/leak_detector_impl.h"
 #include "hooks.h"
+#include "leak_summary.h"
+#include "reader_epoch.h"
+#include "self_profile.h"
+#include "sharded_leak_detector.h"
 
 namespace leak_detector {
 
@@ -37,7 +51,8 @@ static const int kStripFrames = 3;
 struct MappingInfo {
   uintptr_t addr;
   size_t size;
-} chrome_mapping;
+  bool verbose;  // Whether to log the loaded objects.
+};
 
 // TODO(sque): This is a temporary solution for leak detector params. Eventually
 // params should be passed in from elsewhere in Chromium, and this file should
@@ -55,60 +70,29 @@ int EnvToInt(const char* envname, const int default_value) {
       : strtol(getenv(envname), nullptr, 10);
 }
 
-// Used for sampling allocs and frees. Randomly samples |g_sampling_factor|/256
-// of the pointers being allocated and freed.
-int g_sampling_factor = EnvToInt("LEAK_DETECTOR_SAMPLING_FACTOR", 1);
+// If nonzero, the number of a signal (e.g. SIGUSR1) that requests an immediate
+// stats dump and leak check of the default instance, rather than waiting for
+// its dump interval. Set by Initialize() from LEAK_DETECTOR_DUMP_SIGNAL.
+int g_dump_signal = 0;
 
-// The number of call stack levels to unwind when profiling allocations by call
-// stack.
-int g_stack_depth = EnvToInt("LEAK_DETECTOR_STACK_DEPTH", 4);
+// The disposition of |g_dump_signal| before Initialize(), restored by
+// Shutdown().
+struct sigaction g_old_dump_signal_action;
 
-// Dump allocation stats and check for memory leaks after this many bytes have
-// been allocated since the last dump/check. Does not get affected by sampling.
-uint64_t g_dump_interval_bytes =
-    EnvToInt("LEAK_DETECTOR_DUMP_INTERVAL_KB", 32768) * 1024;
+// Identifies checkpoint files, and their layout version.
+const char kCheckpointMagic[8] = { 'L', 'D', 'C', 'K', 'P', 'T', '0', '1' };
 
-// Enable verbose logging. Dump all leak analysis data, not just analysis
-// summaries and suspected leak reports.
-bool g_dump_leak_analysis = EnvToBool("LEAK_DETECTOR_VERBOSE", false);
+// Points to the default instance of the leak detector, which is fed by the
+// hooks below.
+std::atomic<LeakDetector*> g_leak_detector(nullptr);
 
-// The number of times an allocation size must be suspected as a leak before it
-// gets reported.
-int g_size_suspicion_threshold =
-    EnvToInt("LEAK_DETECTOR_SIZE_SUSPICION_THRESHOLD", 4);
+// The hooks and the dump signal handler only use the default instance within
+// a reader of this, so that Shutdown() can wait for them before destroying it.
+ReaderEpoch g_hook_readers;
 
-// The number of times a call stack for a particular allocation size must be
-// suspected as a leak before it gets reported.
-int g_call_stack_suspicion_threshold =
-    EnvToInt("LEAK_DETECTOR_CALL_STACK_SUSPICION_THRESHOLD", 4);
-
-// Use a simple spinlock for locking. Don't use a mutex, which can call malloc
-// and cause infinite recursion.
-SpinLockWrapper* g_heap_lock = nullptr;
-
-// Points to the active instance of the leak detector.
-// Modify this only when locked.
-LeakDetectorImpl* g_leak_detector = nullptr;
-
-// Keep track of the total number of bytes allocated.
-// Modify this only when locked.
-uint64_t g_total_alloc_size = 0;
-
-// Keep track of the total alloc size when the last dump occurred.
-// Modify this only when locked.
-uint64_t g_last_alloc_dump_size = 0;
-
-// Dump allocation stats and check for leaks after |g_dump_interval_bytes| bytes
-// have been allocated since the last time that was done. Should be called with
-// a lock since it modifies the global variable |g_last_alloc_dump_size|.
-inline void MaybeDumpStatsAndCheckForLeaks() {
-  if (g_total_alloc_size > g_last_alloc_dump_size + g_dump_interval_bytes) {
-    g_last_alloc_dump_size = g_total_alloc_size;
-
-    InternalVector<InternalLeakReport> reports;
-    g_leak_detector->TestForLeaks(true /* do_logging */, &reports);
-  }
-}
+// The sampling factor of the default instance, so that the free hook can skip
+// unsampled pointers without becoming a reader of |g_hook_readers|.
+uint64_t g_sampling_factor = 0;
 
 // Convert a pointer to a hash value. Returns only the upper eight bits.
 inline uint64_t PointerToHash(const void* ptr) {
@@ -121,49 +105,50 @@ inline uint64_t PointerToHash(const void* ptr) {
   return value >> 56;
 }
 
-// Uses PointerToHash() to pseudorandomly sample |ptr|.
-inline bool ShouldSample(const void* ptr) {
-  return PointerToHash(ptr) < static_cast<uint64_t>(g_sampling_factor);
-}
-
 // Allocation/deallocation hooks for MallocHook.
 void NewHook(const void* ptr, size_t size) {
-  {
-    ScopedSpinLockHolder lock(g_heap_lock);
-    g_total_alloc_size += size;
-  }
-
-  if (!ShouldSample(ptr) || !ptr || !g_leak_detector)
+  ReaderEpoch::ScopedReader reader(&g_hook_readers);
+  LeakDetector* detector = g_leak_detector;
+  if (!detector)
     return;
+  self_profile::ScopedTimer timer(self_profile::kNewHook);
 
   // Take the stack trace outside the critical section.
-  // |g_leak_detector->ShouldGetStackTraceForSize()| is const; there is no need
-  // for a lock.
-  void* stack[g_stack_depth];
+  void* stack[detector->params().stack_depth];
   int depth = 0;
-  if (g_leak_detector->ShouldGetStackTraceForSize(size)) {
+  if (detector->ShouldGetStackTrace(ptr, size)) {
+    self_profile::ScopedTimer unwind_timer(self_profile::kStackUnwind);
     depth = MallocHook::GetCallerStackTrace(
-        stack, g_stack_depth, kStripFrames + 1);
+        stack, detector->params().stack_depth, kStripFrames + 1);
   }
-
-  ScopedSpinLockHolder lock(g_heap_lock);
-  g_leak_detector->RecordAlloc(ptr, size, depth, stack);
-  MaybeDumpStatsAndCheckForLeaks();
+  detector->RecordAlloc(ptr, size, depth, stack);
 }
 
 void DeleteHook(const void* ptr) {
-  if (!ShouldSample(ptr) || !ptr || !g_leak_detector)
+  self_profile::ScopedTimer timer(self_profile::kDeleteHook);
+  // Same as LeakDetector::ShouldSample().
+  if (!ptr || PointerToHash(ptr) >= g_sampling_factor)
     return;
+  ReaderEpoch::ScopedReader reader(&g_hook_readers);
+  LeakDetector* detector = g_leak_detector;
+  if (detector)
+    detector->RecordFree(ptr);
+}
 
-  ScopedSpinLockHolder lock(g_heap_lock);
-  g_leak_detector->RecordFree(ptr);
+// Handler for |g_dump_signal|. Must be async-signal-safe, so it only asks the
+// detector to dump at the next allocation.
+void DumpSignalHandler(int /* signum */) {
+  ReaderEpoch::ScopedReader reader(&g_hook_readers);
+  LeakDetector* detector = g_leak_detector;
+  if (detector)
+    detector->RequestDump();
 }
 
 // Callback for dl_iterate_phdr() to find the Chrome binary mapping.
 int IterateLoadedObjects(struct dl_phdr_info *shared_object,
                          size_t /* size */,
                          void *data) {
-    if (g_dump_leak_analysis) {
+    if (static_cast<MappingInfo*>(data)->verbose) {
       LOG(ERROR) << "name=" << shared_object->dlpi_name << ", "
                  << "addr=" << std::hex << shared_object->dlpi_phnum;
     }
@@ -186,7 +171,7 @@ int IterateLoadedObjects(struct dl_phdr_info *shared_object,
 
         mapping->addr = shared_object->dlpi_addr + segment_header.p_offset;
         mapping->size = segment_header.p_memsz;
-        if (g_dump_leak_analysis) {
+        if (mapping->verbose) {
           LOG(ERROR) << "Chrome mapped from " << std::hex
                      << mapping->addr << " to "
                      << mapping->addr + mapping->size;
@@ -199,11 +184,320 @@ int IterateLoadedObjects(struct dl_phdr_info *shared_object,
 
 }  // namespace
 
+LeakDetector::Params::Params()
+    : sampling_factor(1),
+      stack_depth(4),
+      dump_interval_bytes(32768 * 1024),
+      size_suspicion_threshold(4),
+      call_stack_suspicion_threshold(4),
+      num_shards(0),
+      dump_leak_analysis(false),
+      aggregator_path(nullptr) {}
+
+// static
+LeakDetector::Params LeakDetector::Params::FromEnvironment() {
+  Params params;
+  params.sampling_factor =
+      EnvToInt("LEAK_DETECTOR_SAMPLING_FACTOR", params.sampling_factor);
+  params.stack_depth =
+      EnvToInt("LEAK_DETECTOR_STACK_DEPTH", params.stack_depth);
+  params.dump_interval_bytes =
+      EnvToInt("LEAK_DETECTOR_DUMP_INTERVAL_KB",
+               params.dump_interval_bytes / 1024) * 1024ULL;
+  params.size_suspicion_threshold =
+      EnvToInt("LEAK_DETECTOR_SIZE_SUSPICION_THRESHOLD",
+               params.size_suspicion_threshold);
+  params.call_stack_suspicion_threshold =
+      EnvToInt("LEAK_DETECTOR_CALL_STACK_SUSPICION_THRESHOLD",
+               params.call_stack_suspicion_threshold);
+  params.num_shards = EnvToInt("LEAK_DETECTOR_NUM_SHARDS", params.num_shards);
+  params.dump_leak_analysis =
+      EnvToBool("LEAK_DETECTOR_VERBOSE", params.dump_leak_analysis);
+  params.aggregator_path = getenv("LEAK_DETECTOR_AGGREGATOR");
+  return params;
+}
+
+LeakDetector::LeakDetector(const Params& params,
+                           uintptr_t mapping_addr,
+                           size_t mapping_size)
+    : params_(params),
+      mapping_addr_(mapping_addr),
+      mapping_size_(mapping_size),
+      impl_(nullptr),
+      total_alloc_size_(0),
+      last_alloc_dump_size_(0),
+      leak_check_callback_(nullptr),
+      leak_check_context_(nullptr),
+      aggregator_fd_(-1),
+      dump_requested_(0) {
+  impl_ = NewImpl();
+  if (params_.aggregator_path)
+    ConnectToAggregator();
+}
+
+LeakDetector::~LeakDetector() {
+  if (aggregator_fd_ >= 0)
+    close(aggregator_fd_);
+  DeleteImpl(impl_);
+}
+
+bool LeakDetector::ShouldGetStackTrace(const void* ptr, size_t size) const {
+  if (!ptr || !ShouldSample(ptr))
+    return false;
+  // |impl_->ShouldGetStackTraceForSize()| is const; there is no need for a
+  // lock, only for keeping |impl_| alive.
+  ReaderEpoch::ScopedReader reader(&impl_readers_);
+  return impl_.load()->ShouldGetStackTraceForSize(size);
+}
+
+void LeakDetector::RecordAlloc(const void* ptr,
+                               size_t size,
+                               int stack_depth,
+                               const void* const call_stack[]) {
+  ScopedSpinLockHolder lock(&lock_);
+  total_alloc_size_ += size;
+  if (!ptr || !ShouldSample(ptr))
+    return;
+  if (!impl_.load()->ShouldGetStackTraceForSize(size))
+    stack_depth = 0;
+  stack_depth = std::min(stack_depth, params_.stack_depth);
+  {
+    self_profile::ScopedTimer timer(self_profile::kRecordAlloc);
+    impl_.load()->RecordAlloc(ptr, size, stack_depth, call_stack);
+  }
+  MaybeDumpStatsAndCheckForLeaks();
+}
+
+void LeakDetector::RecordFree(const void* ptr) {
+  if (!ptr || !ShouldSample(ptr))
+    return;
+  ScopedSpinLockHolder lock(&lock_);
+  self_profile::ScopedTimer timer(self_profile::kRecordFree);
+  impl_.load()->RecordFree(ptr);
+}
+
+void LeakDetector::SetLeakCheckCallback(LeakCheckCallback callback,
+                                        void* context) {
+  ScopedSpinLockHolder lock(&lock_);
+  leak_check_callback_ = callback;
+  leak_check_context_ = context;
+}
+
+bool LeakDetector::SaveCheckpoint(const char* path, uint64_t position) {
+  CheckpointWriter writer;
+  if (!writer.Open(path)) {
+    LOG(ERROR) << "Unable to create checkpoint " << path;
+    return false;
+  }
+
+  ScopedSpinLockHolder lock(&lock_);
+  SaveParameters(&writer);
+  writer.WriteUint64(position);
+  writer.WriteUint64(total_alloc_size_);
+  writer.WriteUint64(last_alloc_dump_size_);
+  impl_.load()->Save(&writer);
+  if (!writer.Close()) {
+    LOG(ERROR) << "Unable to write checkpoint " << path;
+    return false;
+  }
+  return true;
+}
+
+bool LeakDetector::LoadCheckpoint(const char* path, uint64_t* position) {
+  CheckpointReader reader;
+  if (!reader.Open(path)) {
+    LOG(ERROR) << "Unable to open checkpoint " << path;
+    return false;
+  }
+  if (!CheckParameters(&reader))
+    return false;
+  uint64_t saved_position = reader.ReadUint64();
+  uint64_t total_alloc_size = reader.ReadUint64();
+  uint64_t last_alloc_dump_size = reader.ReadUint64();
+
+  // The new instance is created and filled in without holding |lock_|, since
+  // creating the shards' threads allocates memory.
+  ShardedLeakDetector* impl = NewImpl();
+  if (impl->Load(&reader)) {
+    ScopedSpinLockHolder lock(&lock_);
+    impl = impl_.exchange(impl);
+    total_alloc_size_ = total_alloc_size;
+    last_alloc_dump_size_ = last_alloc_dump_size;
+    *position = saved_position;
+    // Hooks may still be checking sizes against the old instance. Waiting with
+    // |lock_| held serializes the waits of concurrent loads, and only holds up
+    // the hooks for as long as those checks take.
+    impl_readers_.WaitForReaders();
+  } else {
+    LOG(ERROR) << "Invalid checkpoint " << path;
+    reader.Fail();
+  }
+
+  DeleteImpl(impl);
+  return reader.ok();
+}
+
+// Uses PointerToHash() to pseudorandomly sample |ptr|.
+bool LeakDetector::ShouldSample(const void* ptr) const {
+  return PointerToHash(ptr) < static_cast<uint64_t>(params_.sampling_factor);
+}
+
+// Dump allocation stats and check for leaks after |dump_interval_bytes| bytes
+// have been allocated since the last time that was done, or if a dump was
+// requested by RequestDump().
+void LeakDetector::MaybeDumpStatsAndCheckForLeaks() {
+  if (total_alloc_size_ >
+          last_alloc_dump_size_ + params_.dump_interval_bytes ||
+      dump_requested_) {
+    dump_requested_ = 0;
+    last_alloc_dump_size_ = total_alloc_size_;
+
+    InternalVector<InternalLeakReport> reports;
+    {
+      self_profile::ScopedTimer timer(self_profile::kLeakCheck);
+      impl_.load()->TestForLeaks(true /* do_logging */, &reports);
+    }
+    report_publisher_.Publish(total_alloc_size_, reports);
+    if (leak_check_callback_)
+      leak_check_callback_(reports, leak_check_context_);
+    if (aggregator_fd_ >= 0)
+      ExchangeSummary();
+  }
+}
+
+void LeakDetector::ConnectToAggregator() {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(params_.aggregator_path) >= sizeof(address.sun_path)) {
+    LOG(ERROR) << "Aggregator socket path is too long: "
+               << params_.aggregator_path;
+    return;
+  }
+  strcpy(address.sun_path, params_.aggregator_path);
+
+  // Sequenced packets keep each summary and reply in one piece.
+  aggregator_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (aggregator_fd_ < 0 ||
+      connect(aggregator_fd_, reinterpret_cast<struct sockaddr*>(&address),
+              sizeof(address)) != 0) {
+    LOG(ERROR) << "Unable to connect to aggregator at "
+               << params_.aggregator_path << ": " << strerror(errno);
+    if (aggregator_fd_ >= 0)
+      close(aggregator_fd_);
+    aggregator_fd_ = -1;
+    return;
+  }
+
+  // Summaries are sent without waiting, so make room for a whole one.
+  int buffer_size = leak_summary::kMaxMessageSize;
+  setsockopt(aggregator_fd_, SOL_SOCKET, SO_SNDBUF, &buffer_size,
+             sizeof(buffer_size));
+}
+
+// Runs within the allocation hooks, so it never blocks, and only allocates
+// from CustomAllocator.
+void LeakDetector::ExchangeSummary() {
+  // Only the latest reply matters, since the aggregator's stack tables are
+  // never removed.
+  InternalVector<uint32_t> sizes;
+  InternalVector<uint32_t> reply_sizes;
+  bool have_reply = false;
+  uint8_t reply[leak_summary::kMaxReplySize];
+  ssize_t length;
+  while ((length = recv(aggregator_fd_, reply, sizeof(reply),
+                        MSG_DONTWAIT)) > 0) {
+    if (leak_summary::ReadReply(reply, length, &reply_sizes)) {
+      sizes.swap(reply_sizes);
+      have_reply = true;
+    }
+  }
+  if (length == 0) {
+    DisconnectFromAggregator("connection closed");
+    return;
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    DisconnectFromAggregator(strerror(errno));
+    return;
+  }
+  if (have_reply)
+    impl_.load()->AddStackTables(sizes);
+
+  // The summary is dropped if the aggregator is behind; the next one
+  // supersedes it anyway.
+  InternalVector<uint8_t> summary;
+  impl_.load()->WriteSummary(&summary);
+  if (send(aggregator_fd_, summary.data(), summary.size(),
+           MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+      errno != EAGAIN && errno != EWOULDBLOCK) {
+    DisconnectFromAggregator(strerror(errno));
+  }
+}
+
+void LeakDetector::DisconnectFromAggregator(const char* error) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "Disconnecting from aggregator: %s\n", error);
+  RAW_LOG(ERROR, buf);
+  close(aggregator_fd_);
+  aggregator_fd_ = -1;
+}
+
+ShardedLeakDetector* LeakDetector::NewImpl() const {
+  return new(CustomAllocator::Allocate(sizeof(ShardedLeakDetector)))
+      ShardedLeakDetector(params_.num_shards,
+                          mapping_addr_,
+                          mapping_size_,
+                          params_.size_suspicion_threshold,
+                          params_.call_stack_suspicion_threshold,
+                          params_.dump_leak_analysis);
+}
+
+// static
+void LeakDetector::DeleteImpl(ShardedLeakDetector* impl) {
+  impl->~ShardedLeakDetector();
+  CustomAllocator::Free(impl, sizeof(ShardedLeakDetector));
+}
+
+void LeakDetector::SaveParameters(CheckpointWriter* writer) const {
+  writer->WriteBytes(kCheckpointMagic, sizeof(kCheckpointMagic));
+  writer->WriteUint64(mapping_addr_);
+  writer->WriteUint64(mapping_size_);
+  writer->WriteUint32(params_.sampling_factor);
+  writer->WriteUint32(params_.stack_depth);
+  writer->WriteUint64(params_.dump_interval_bytes);
+  writer->WriteUint32(params_.size_suspicion_threshold);
+  writer->WriteUint32(params_.call_stack_suspicion_threshold);
+}
+
+bool LeakDetector::CheckParameters(CheckpointReader* reader) const {
+  char magic[sizeof(kCheckpointMagic)];
+  reader->ReadBytes(magic, sizeof(magic));
+  if (memcmp(magic, kCheckpointMagic, sizeof(magic)) != 0) {
+    LOG(ERROR) << "Not a leak detector checkpoint";
+    return false;
+  }
+  if (reader->ReadUint64() != mapping_addr_ ||
+      reader->ReadUint64() != mapping_size_ ||
+      reader->ReadUint32() != static_cast<uint32_t>(params_.sampling_factor) ||
+      reader->ReadUint32() != static_cast<uint32_t>(params_.stack_depth) ||
+      reader->ReadUint64() != params_.dump_interval_bytes ||
+      reader->ReadUint32() !=
+          static_cast<uint32_t>(params_.size_suspicion_threshold) ||
+      reader->ReadUint32() !=
+          static_cast<uint32_t>(params_.call_stack_suspicion_threshold)) {
+    LOG(ERROR) << "Checkpoint was saved with different parameters";
+    return false;
+  }
+  return reader->ok();
+}
+
 void Initialize() {
+  LeakDetector::Params params = LeakDetector::Params::FromEnvironment();
+
   // If the sampling factor is too low, don't bother enabling the leak detector.
-  if (g_sampling_factor < 1) {
-    LOG(ERROR) << "Not enabling leak detector because g_sampling_factor="
-               << g_sampling_factor;
+  if (params.sampling_factor < 1) {
+    LOG(ERROR) << "Not enabling leak detector because sampling_factor="
+               << params.sampling_factor;
     return;
   }
 
@@ -211,6 +505,7 @@ void Initialize() {
     return;
 
   // Locate the Chrome binary mapping before doing anything else.
+  MappingInfo chrome_mapping = { 0, 0, params.dump_leak_analysis };
   dl_iterate_phdr(IterateLoadedObjects, &chrome_mapping);
 
   if (default_chrome_addr && default_chrome_size) {
@@ -231,48 +526,54 @@ void Initialize() {
     return;
   }
   CustomAllocator::Initialize();
-
-  g_heap_lock = new(CustomAllocator::Allocate(sizeof(SpinLockWrapper)))
-      SpinLockWrapper;
-
-  ScopedSpinLockHolder lock(g_heap_lock);
-  if (g_leak_detector)
-    return;
+  self_profile::Reset();
 
   LOG(ERROR) << "Starting leak detector. Sampling factor: "
-             << g_sampling_factor;
+             << params.sampling_factor;
+  if (params.num_shards > 0)
+    LOG(ERROR) << "Recording allocations in " << params.num_shards
+               << " shards";
 
-  g_leak_detector = new(CustomAllocator::Allocate(sizeof(LeakDetectorImpl)))
-      LeakDetectorImpl(chrome_mapping.addr,
-                       chrome_mapping.size,
-                       g_size_suspicion_threshold,
-                       g_call_stack_suspicion_threshold,
-                       g_dump_leak_analysis);
+  g_sampling_factor = params.sampling_factor;
+  g_leak_detector = new(CustomAllocator::Allocate(sizeof(LeakDetector)))
+      LeakDetector(params, chrome_mapping.addr, chrome_mapping.size);
 
   // Now set the hooks that capture new/delete and malloc/free. Make sure
   // nothing is already set.
   CHECK(MallocHook::SetNewHook(&NewHook) == nullptr);
   CHECK(MallocHook::SetDeleteHook(&DeleteHook) == nullptr);
+
+  g_dump_signal = EnvToInt("LEAK_DETECTOR_DUMP_SIGNAL", 0);
+  if (g_dump_signal > 0) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &DumpSignalHandler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(g_dump_signal, &action, &g_old_dump_signal_action) != 0) {
+      LOG(ERROR) << "Unable to install handler for signal " << g_dump_signal;
+      g_dump_signal = 0;
+    }
+  }
 }
 
 void Shutdown() {
   if (!IsInitialized())
     return;
 
-  {
-    ScopedSpinLockHolder lock(g_heap_lock);
-
-    // Unset our new/delete hooks, checking they were previously set.
-    CHECK_EQ(MallocHook::SetNewHook(nullptr), &NewHook);
-    CHECK_EQ(MallocHook::SetDeleteHook(nullptr), &DeleteHook);
+  if (g_dump_signal > 0)
+    sigaction(g_dump_signal, &g_old_dump_signal_action, nullptr);
 
-    g_leak_detector->~LeakDetectorImpl();
-    CustomAllocator::Free(g_leak_detector, sizeof(LeakDetectorImpl));
-    g_leak_detector = nullptr;
-  }
+  // Unset our new/delete hooks, checking they were previously set.
+  CHECK_EQ(MallocHook::SetNewHook(nullptr), &NewHook);
+  CHECK_EQ(MallocHook::SetDeleteHook(nullptr), &DeleteHook);
 
-  g_heap_lock->~SpinLockWrapper();
-  CustomAllocator::Free(g_heap_lock, sizeof(*g_heap_lock));
+  // Hooks that were already running may still be using the instance, e.g.
+  // waiting for its lock.
+  LeakDetector* detector = g_leak_detector.exchange(nullptr);
+  g_hook_readers.WaitForReaders();
+  detector->~LeakDetector();
+  CustomAllocator::Free(detector, sizeof(LeakDetector));
 
   if (!CustomAllocator::Shutdown())
     LOG(ERROR) <<  "Memory leak in LeakDetector, allocated objects remain.";
@@ -284,4 +585,23 @@ bool IsInitialized() {
   return g_leak_detector;
 }
 
+LeakDetector* GetDefaultInstance() {
+  return g_leak_detector;
+}
+
+void SetLeakCheckCallback(LeakCheckCallback callback, void* context) {
+  if (LeakDetector* detector = g_leak_detector)
+    detector->SetLeakCheckCallback(callback, context);
+}
+
+bool SaveCheckpoint(const char* path, uint64_t position) {
+  LeakDetector* detector = g_leak_detector;
+  return detector && detector->SaveCheckpoint(path, position);
+}
+
+bool LoadCheckpoint(const char* path, uint64_t* position) {
+  LeakDetector* detector = g_leak_detector;
+  return detector && detector->LoadCheckpoint(path, position);
+}
+
 }  // namespace leak_detector
@@ -5,17 +5,220 @@
 #ifndef COMPONENTS_METRICS_LEAK_DETECTOR_LEAK_DETECTOR_H_
 #define COMPONENTS_METRICS_LEAK_DETECTOR_LEAK_DETECTOR_H_
 
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include <gperftools/spin_lock_wrapper.h>
+
+#include "base/macros.h"
+#include "components/metrics/leak_detector/leak_detector_impl.h"
+#include "leak_report_publisher.h"
+#include "reader_epoch.h"
+
 namespace leak_detector {
 
-// The top level leak detector is a singleton instance. Implement it as a
-// namespace with init/shutdown functions rather than as a class with static
-// member functions.
+class CheckpointReader;
+class CheckpointWriter;
+class ShardedLeakDetector;
+
+// Receives the suspected leaks found by each leak check, which may be none,
+// along with the context that it was registered with. It is called from the
+// allocation that triggered the check, with the leak detector locked, so it
+// must not allocate memory through the hooked allocator.
+using LeakCheckCallback =
+    void (*)(const InternalVector<InternalLeakReport>& reports, void* context);
+
+// A leak detector with its own state, lock and parameters. Any number of them
+// can be fed allocations in one process, e.g. to analyze the traces of several
+// processes at once, or to compare parameters on the same allocations.
+//
+// Instances allocate their state with CustomAllocator, which must remain
+// initialized while any instance exists. All methods are thread-safe, but an
+// instance must not be destroyed while another thread may still call it.
+class LeakDetector {
+ public:
+  struct Params {
+    // Use the defaults.
+    Params();
+
+    // Use the defaults, overridden by the LEAK_DETECTOR_* environment
+    // variables.
+    static Params FromEnvironment();
+
+    // Randomly samples |sampling_factor|/256 of the pointers being allocated
+    // and freed.
+    int sampling_factor;
+
+    // The number of call stack levels to unwind when profiling allocations by
+    // call stack.
+    int stack_depth;
+
+    // Dump allocation stats and check for memory leaks after this many bytes
+    // have been allocated since the last dump/check. Does not get affected by
+    // sampling.
+    uint64_t dump_interval_bytes;
+
+    // The number of times an allocation size must be suspected as a leak
+    // before it gets reported.
+    int size_suspicion_threshold;
+
+    // The number of times a call stack for a particular allocation size must
+    // be suspected as a leak before it gets reported.
+    int call_stack_suspicion_threshold;
+
+    // If nonzero, allocations are recorded on this many worker threads, each
+    // of which handles a subset of the addresses. See ShardedLeakDetector.
+    int num_shards;
+
+    // Dump all leak analysis data, not just analysis summaries and suspected
+    // leak reports.
+    bool dump_leak_analysis;
+
+    // If not null, the path of the Unix socket of a leak_aggregator, which
+    // analyzes the counts of all processes that run the same binary together.
+    // Each leak check sends it a summary of the counts. See leak_summary.h.
+    const char* aggregator_path;
+  };
+
+  // Look for leaks from the binary mapped at |mapping_addr|.
+  LeakDetector(const Params& params,
+               uintptr_t mapping_addr,
+               size_t mapping_size);
+  ~LeakDetector();
+
+  const Params& params() const {
+    return params_;
+  }
+
+  // Whether RecordAlloc() needs the call stack of an allocation of |size|
+  // bytes at |ptr|, so that callers can skip unwinding it otherwise.
+  bool ShouldGetStackTrace(const void* ptr, size_t size) const;
+
+  // Whether allocations and frees at |ptr| are sampled, and thus analyzed.
+  bool ShouldSample(const void* ptr) const;
+
+  // Record an allocation or a free. All allocations count towards the dump
+  // interval, but only sampled ones are analyzed. |call_stack| is only used
+  // if ShouldGetStackTrace() is true for the allocation.
+  void RecordAlloc(const void* ptr,
+                   size_t size,
+                   int stack_depth,
+                   const void* const call_stack[]);
+  void RecordFree(const void* ptr);
+
+  // Dump stats and check for leaks at the next sampled call to RecordAlloc(),
+  // rather than waiting for the dump interval. Nothing happens until then, so
+  // a detector that is not fed allocations never services the request.
+  // Async-signal-safe.
+  void RequestDump() {
+    dump_requested_ = 1;
+  }
+
+  void SetLeakCheckCallback(LeakCheckCallback callback, void* context);
+
+  // The reports of the latest leak check, which any thread can read with a
+  // LeakReportPublisher::Reader without waiting for the detector or stalling
+  // it.
+  const LeakReportPublisher& report_publisher() const {
+    return report_publisher_;
+  }
+
+  // See the functions of the same names below.
+  bool SaveCheckpoint(const char* path, uint64_t position);
+  bool LoadCheckpoint(const char* path, uint64_t* position);
+
+ private:
+  // Dump allocation stats and check for leaks if it is time to. Must be
+  // called with |lock_| held.
+  void MaybeDumpStatsAndCheckForLeaks();
+
+  // Connect to the aggregator at |params_.aggregator_path|, or send it a
+  // summary of the counts and apply its latest reply, which must be done with
+  // |lock_| held after a leak check. Any error disconnects from it.
+  void ConnectToAggregator();
+  void ExchangeSummary();
+  void DisconnectFromAggregator(const char* error);
+
+  // Create and destroy the instance that does the analysis.
+  ShardedLeakDetector* NewImpl() const;
+  static void DeleteImpl(ShardedLeakDetector* impl);
+
+  // Write or check the parameters that a checkpoint depends on.
+  void SaveParameters(CheckpointWriter* writer) const;
+  bool CheckParameters(CheckpointReader* reader) const;
+
+  const Params params_;
+  const uintptr_t mapping_addr_;
+  const size_t mapping_size_;
+
+  // A spinlock rather than a mutex, which can call malloc and cause infinite
+  // recursion when the detector is called from allocation hooks.
+  SpinLockWrapper lock_;
+
+  // The members below are only modified when |lock_| is held.
+
+  // Also read by ShouldGetStackTrace() without |lock_|, within
+  // |impl_readers_|, so that LoadCheckpoint() can wait for those reads before
+  // freeing an instance that it replaced.
+  std::atomic<ShardedLeakDetector*> impl_;
+  mutable ReaderEpoch impl_readers_;
+
+  // Total number of bytes allocated, and its value when the last dump
+  // occurred.
+  uint64_t total_alloc_size_;
+  uint64_t last_alloc_dump_size_;
+
+  LeakCheckCallback leak_check_callback_;
+  void* leak_check_context_;
+
+  LeakReportPublisher report_publisher_;
+
+  // Socket connected to the aggregator, or -1.
+  int aggregator_fd_;
+
+  // Set by RequestDump(), which may interrupt a call that holds |lock_|.
+  volatile sig_atomic_t dump_requested_;
+
+  DISALLOW_COPY_AND_ASSIGN(LeakDetector);
+};
+
+// The functions below operate on a default instance that is fed by the malloc
+// hooks of this process, and whose parameters are taken from the environment.
+// Implement it as a namespace with init/shutdown functions rather than as a
+// class with static member functions.
+//
+// If LEAK_DETECTOR_DUMP_SIGNAL is set to a signal number, Initialize() installs
+// a handler for that signal that calls RequestDump() on the default instance.
+// The dump only runs at the next sampled allocation that goes through the
+// hooks, so an idle process never services it.
 
 void Initialize();
+
+// Unhooks and destroys the default instance, after waiting for the hooks that
+// are already running on other threads. Must not run concurrently with the
+// other functions below.
 void Shutdown();
 
 bool IsInitialized();
 
+// The default instance, or null if it is not initialized.
+LeakDetector* GetDefaultInstance();
+
+void SetLeakCheckCallback(LeakCheckCallback callback, void* context = nullptr);
+
+// Save the state of the leak detector to a checkpoint file at |path|, along
+// with |position|, which is where the caller is in the allocation trace.
+// Returns false on failure.
+bool SaveCheckpoint(const char* path, uint64_t position);
+
+// Replace the state of the leak detector with that saved at |path|, and return
+// the saved position in |*position|. The checkpoint must have been saved with
+// the same parameters. Returns false, and keeps the current state, on failure.
+bool LoadCheckpoint(const char* path, uint64_t* position);
+
 }  // namespace leak_detector
 
 #endif  // COMPONENTS_METRICS_LEAK_DETECTOR_LEAK_DETECTOR_H_
@@ -13,8 +13,11 @@
 #include <utility>
 
 #include "base/hash.h"
+#include "checkpoint.h"
 #include "components/metrics/leak_detector/call_stack_table.h"
 #include "components/metrics/leak_detector/ranked_list.h"
+#include "leak_summary.h"
+#include "self_profile.h"
 
 namespace leak_detector {
 
@@ -32,6 +35,11 @@ const int kAddressMapNumBuckets = 100003;
 // are rare if not nonexistent.
 const int kNumSizeEntries = 2048;
 
+// Number of call stacks per size in the summaries written by WriteSummary().
+// The analysis only looks at the top |kRankedListSize| call stacks of the
+// combined counts, which are almost always among the top few of each process.
+const size_t kMaxSummaryStacks = 4 * kRankedListSize;
+
 using ValueType = LeakDetectorValueType;
 
 // Print the contents of |str| prefixed with the current pid.
@@ -96,12 +104,24 @@ LeakDetectorImpl::LeakDetectorImpl(uintptr_t mapping_addr,
                                    int size_suspicion_threshold,
                                    int call_stack_suspicion_threshold,
                                    bool verbose)
-    : num_stack_tables_(0),
-      address_map_(kAddressMapNumBuckets),
+    : num_allocs_(0),
+      num_frees_(0),
+      alloc_size_(0),
+      free_size_(0),
+      num_allocs_with_call_stack_(0),
+      num_stack_tables_(0),
+      address_map_(kAddressMapNumBuckets,
+                   AddressHash(),
+                   std::equal_to<uintptr_t>(),
+                   AllocationEntryAllocator(CustomAllocator::kAddressMapArena)),
       size_leak_analyzer_(kRankedListSize, size_suspicion_threshold),
-      size_entries_(kNumSizeEntries, {0}),
+      size_entries_(kNumSizeEntries,
+                    {0},
+                    InternalVector<AllocSizeEntry>::allocator_type(
+                        CustomAllocator::kAnalysisArena)),
       mapping_addr_(mapping_addr),
       mapping_size_(mapping_size),
+      size_suspicion_threshold_(size_suspicion_threshold),
       call_stack_suspicion_threshold_(call_stack_suspicion_threshold),
       verbose_(verbose) {
 }
@@ -113,7 +133,8 @@ LeakDetectorImpl::~LeakDetectorImpl() {
     if (!table)
       continue;
     table->~CallStackTable();
-    CustomAllocator::Free(table, sizeof(CallStackTable));
+    CustomAllocator::Free(table, sizeof(CallStackTable),
+                          CustomAllocator::kAnalysisArena);
   }
   size_entries_.clear();
 }
@@ -125,6 +146,15 @@ bool LeakDetectorImpl::ShouldGetStackTraceForSize(size_t size) const {
 void LeakDetectorImpl::RecordAlloc(
     const void* ptr, size_t size,
     int stack_depth, const void* const stack[]) {
+  const CallStack* call_stack = nullptr;
+  if (stack_depth > 0 && ShouldGetStackTraceForSize(size))
+    call_stack = call_stack_manager_.GetCallStack(stack_depth, stack);
+  RecordAllocWithCallStack(ptr, size, call_stack);
+}
+
+void LeakDetectorImpl::RecordAllocWithCallStack(const void* ptr,
+                                                size_t size,
+                                                const CallStack* call_stack) {
   AllocInfo alloc_info;
   alloc_info.size = size;
 
@@ -134,9 +164,8 @@ void LeakDetectorImpl::RecordAlloc(
   AllocSizeEntry* entry = &size_entries_[SizeToIndex(size)];
   ++entry->num_allocs;
 
-  if (entry->stack_table && stack_depth > 0) {
-    alloc_info.call_stack =
-        call_stack_manager_.GetCallStack(stack_depth, stack);
+  if (entry->stack_table && call_stack) {
+    alloc_info.call_stack = call_stack;
     entry->stack_table->Add(alloc_info.call_stack);
 
     ++num_allocs_with_call_stack_;
@@ -172,38 +201,46 @@ void LeakDetectorImpl::RecordFree(const void* ptr) {
 void LeakDetectorImpl::TestForLeaks(
     bool do_logging,
     InternalVector<InternalLeakReport>* reports) {
-  if (do_logging)
+  if (do_logging) {
+    self_profile::ScopedTimer timer(self_profile::kDumpStats);
     DumpStats();
-
-  // Add net alloc counts for each size to a ranked list.
-  RankedList size_ranked_list(kRankedListSize);
-  for (size_t i = 0; i < size_entries_.size(); ++i) {
-    const AllocSizeEntry& entry = size_entries_[i];
-    ValueType size_value(IndexToSize(i));
-    size_ranked_list.Add(size_value, entry.num_allocs - entry.num_frees);
   }
-  size_leak_analyzer_.AddSample(std::move(size_ranked_list));
 
-  // Dump out the top entries.
   char buf[0x4000];
-  if (do_logging && verbose_) {
-    if (size_leak_analyzer_.Dump(sizeof(buf), buf) < sizeof(buf))
-      PrintWithPidOnEachLine(buf);
-  }
+  {
+    self_profile::ScopedTimer timer(self_profile::kSizeAnalysis);
+
+    // Add net alloc counts for each size to a ranked list.
+    RankedList size_ranked_list(kRankedListSize);
+    for (size_t i = 0; i < size_entries_.size(); ++i) {
+      const AllocSizeEntry& entry = size_entries_[i];
+      ValueType size_value(IndexToSize(i));
+      size_ranked_list.Add(size_value, entry.num_allocs - entry.num_frees);
+    }
+    size_leak_analyzer_.AddSample(std::move(size_ranked_list));
 
-  // Get suspected leaks by size.
-  for (const ValueType& size_value : size_leak_analyzer_.suspected_leaks()) {
-    uint32_t size = size_value.size();
-    AllocSizeEntry* entry = &size_entries_[SizeToIndex(size)];
-    if (entry->stack_table)
-      continue;
-    if (do_logging) {
-      snprintf(buf, sizeof(buf), "Adding stack table for size %u\n", size);
-      PrintWithPidOnEachLine(buf);
+    // Dump out the top entries.
+    if (do_logging && verbose_) {
+      if (size_leak_analyzer_.Dump(sizeof(buf), buf) < sizeof(buf))
+        PrintWithPidOnEachLine(buf);
+    }
+
+    // Get suspected leaks by size.
+    for (const ValueType& size_value : size_leak_analyzer_.suspected_leaks()) {
+      uint32_t size = size_value.size();
+      AllocSizeEntry* entry = &size_entries_[SizeToIndex(size)];
+      if (entry->stack_table)
+        continue;
+      if (do_logging) {
+        snprintf(buf, sizeof(buf), "Adding stack table for size %u\n", size);
+        PrintWithPidOnEachLine(buf);
+      }
+      entry->stack_table =
+          new(CustomAllocator::Allocate(sizeof(CallStackTable),
+                                        CustomAllocator::kAnalysisArena))
+          CallStackTable(call_stack_suspicion_threshold_);
+      ++num_stack_tables_;
     }
-    entry->stack_table = new(CustomAllocator::Allocate(sizeof(CallStackTable)))
-        CallStackTable(call_stack_suspicion_threshold_);
-    ++num_stack_tables_;
   }
 
   // Check for leaks in each CallStackTable. It makes sense to this before
@@ -211,6 +248,7 @@ void LeakDetectorImpl::TestForLeaks(
   // CallStackTable. However, the overhead to check a new CallStackTable is
   // small since this function is run very rarely. So handle the leak checks of
   // Tier 2 here.
+  self_profile::ScopedTimer timer(self_profile::kCallStackAnalysis);
   reports->clear();
   for (size_t i = 0; i < size_entries_.size(); ++i) {
     const AllocSizeEntry& entry = size_entries_[i];
@@ -258,6 +296,239 @@ void LeakDetectorImpl::TestForLeaks(
   }
 }
 
+const CallStack* LeakDetectorImpl::GetCallStack(
+    int stack_depth, const void* const call_stack[]) {
+  return call_stack_manager_.GetCallStack(stack_depth, call_stack);
+}
+
+void LeakDetectorImpl::MergeCounts(const LeakDetectorImpl* const shards[],
+                                   int num_shards) {
+  ClearCounts();
+  for (int i = 0; i < num_shards; ++i) {
+    const LeakDetectorImpl& shard = *shards[i];
+    num_allocs_ += shard.num_allocs_;
+    num_frees_ += shard.num_frees_;
+    alloc_size_ += shard.alloc_size_;
+    free_size_ += shard.free_size_;
+    num_allocs_with_call_stack_ += shard.num_allocs_with_call_stack_;
+
+    for (size_t j = 0; j < size_entries_.size(); ++j) {
+      AllocSizeEntry* entry = &size_entries_[j];
+      const AllocSizeEntry& shard_entry = shard.size_entries_[j];
+      entry->num_allocs += shard_entry.num_allocs;
+      entry->num_frees += shard_entry.num_frees;
+      if (entry->stack_table && shard_entry.stack_table)
+        entry->stack_table->AddCounts(*shard_entry.stack_table);
+    }
+  }
+}
+
+void LeakDetectorImpl::AddStackTables(const LeakDetectorImpl& front) {
+  for (size_t i = 0; i < size_entries_.size(); ++i) {
+    AllocSizeEntry* entry = &size_entries_[i];
+    if (entry->stack_table || !front.size_entries_[i].stack_table)
+      continue;
+    entry->stack_table =
+        new(CustomAllocator::Allocate(sizeof(CallStackTable),
+                                      CustomAllocator::kAnalysisArena))
+        CallStackTable(call_stack_suspicion_threshold_);
+    ++num_stack_tables_;
+  }
+}
+
+void LeakDetectorImpl::WriteSummary(InternalVector<uint8_t>* summary) const {
+  using StackCount = std::pair<uint32_t, const CallStack*>;
+  InternalVector<StackCount> stack_counts(
+      InternalVector<StackCount>::allocator_type(
+          CustomAllocator::kAnalysisArena));
+
+  size_t num_sizes = 0;
+  for (const AllocSizeEntry& entry : size_entries_) {
+    if (entry.num_allocs != entry.num_frees)
+      ++num_sizes;
+  }
+
+  summary->clear();
+  leak_summary::AppendVarint(summary, leak_summary::kSummaryVersion);
+  leak_summary::AppendVarint(summary, num_sizes);
+  for (size_t i = 0; i < size_entries_.size(); ++i) {
+    const AllocSizeEntry& entry = size_entries_[i];
+    if (entry.num_allocs == entry.num_frees)
+      continue;
+
+    // Take the call stacks with the most allocations, and break ties by their
+    // frames so that the summary does not depend on the hash table's history.
+    stack_counts.clear();
+    if (entry.stack_table) {
+      entry.stack_table->ForEachCount(
+          [&stack_counts](const CallStack* call_stack, uint32_t count) {
+            stack_counts.push_back(StackCount(count, call_stack));
+          });
+    }
+    size_t num_stacks = std::min(stack_counts.size(), kMaxSummaryStacks);
+    std::partial_sort(
+        stack_counts.begin(), stack_counts.begin() + num_stacks,
+        stack_counts.end(),
+        [](const StackCount& a, const StackCount& b) {
+          if (a.first != b.first)
+            return a.first > b.first;
+          return std::lexicographical_compare(
+              a.second->stack, a.second->stack + a.second->depth,
+              b.second->stack, b.second->stack + b.second->depth);
+        });
+
+    leak_summary::AppendVarint(summary, IndexToSize(i));
+    leak_summary::AppendVarint(summary, entry.num_allocs - entry.num_frees);
+    leak_summary::AppendVarint(summary, num_stacks);
+    for (size_t j = 0; j < num_stacks; ++j) {
+      const CallStack* call_stack = stack_counts[j].second;
+      leak_summary::AppendVarint(summary, stack_counts[j].first);
+      leak_summary::AppendVarint(summary, call_stack->depth);
+      for (size_t k = 0; k < call_stack->depth; ++k)
+        leak_summary::AppendVarint(summary, GetOffset(call_stack->stack[k]));
+    }
+  }
+}
+
+bool LeakDetectorImpl::AddSummary(const uint8_t* summary, size_t size) {
+  // Check the whole summary before adding any of it.
+  auto ignore_size = [](uint32_t, uint32_t) {};
+  auto ignore_stack = [](uint32_t, uint32_t, int, const void* const*) {};
+  if (!leak_summary::ParseSummary(summary, size, ignore_size, ignore_stack))
+    return false;
+
+  leak_summary::ParseSummary(
+      summary, size,
+      [this](uint32_t alloc_size, uint32_t count) {
+        if (alloc_size >= IndexToSize(kNumSizeEntries))
+          return;
+        size_entries_[SizeToIndex(alloc_size)].num_allocs += count;
+        num_allocs_ += count;
+        alloc_size_ += static_cast<uint64_t>(alloc_size) * count;
+      },
+      [this](uint32_t alloc_size, uint32_t count, int depth,
+             const void* const frames[]) {
+        if (alloc_size >= IndexToSize(kNumSizeEntries))
+          return;
+        CallStackTable* stack_table =
+            size_entries_[SizeToIndex(alloc_size)].stack_table;
+        if (!stack_table)
+          return;
+        stack_table->AddCount(call_stack_manager_.GetCallStack(depth, frames),
+                              count);
+        num_allocs_with_call_stack_ += count;
+      });
+  return true;
+}
+
+void LeakDetectorImpl::ClearCounts() {
+  num_allocs_ = 0;
+  num_frees_ = 0;
+  alloc_size_ = 0;
+  free_size_ = 0;
+  num_allocs_with_call_stack_ = 0;
+  for (AllocSizeEntry& entry : size_entries_) {
+    entry.num_allocs = 0;
+    entry.num_frees = 0;
+    if (entry.stack_table)
+      entry.stack_table->ClearCounts();
+  }
+}
+
+void LeakDetectorImpl::GetStackTableSizes(
+    InternalVector<uint32_t>* sizes) const {
+  sizes->clear();
+  for (size_t i = 0; i < size_entries_.size(); ++i) {
+    if (size_entries_[i].stack_table)
+      sizes->push_back(IndexToSize(i));
+  }
+}
+
+void LeakDetectorImpl::AddStackTables(const InternalVector<uint32_t>& sizes) {
+  for (uint32_t size : sizes) {
+    if (size >= IndexToSize(kNumSizeEntries))
+      continue;
+    AllocSizeEntry* entry = &size_entries_[SizeToIndex(size)];
+    if (entry->stack_table)
+      continue;
+    entry->stack_table =
+        new(CustomAllocator::Allocate(sizeof(CallStackTable),
+                                      CustomAllocator::kAnalysisArena))
+        CallStackTable(call_stack_suspicion_threshold_);
+    ++num_stack_tables_;
+  }
+}
+
+void LeakDetectorImpl::Save(CheckpointWriter* writer) const {
+  call_stack_manager_.Save(writer);
+
+  writer->WriteUint64(num_allocs_);
+  writer->WriteUint64(num_frees_);
+  writer->WriteUint64(alloc_size_);
+  writer->WriteUint64(free_size_);
+  writer->WriteUint32(num_allocs_with_call_stack_);
+
+  size_leak_analyzer_.Save(writer);
+
+  writer->WriteUint64(size_entries_.size());
+  for (const AllocSizeEntry& entry : size_entries_) {
+    writer->WriteUint32(entry.num_allocs);
+    writer->WriteUint32(entry.num_frees);
+    writer->WriteUint32(entry.stack_table != nullptr);
+    if (entry.stack_table)
+      entry.stack_table->Save(writer);
+  }
+
+  writer->WriteUint64(address_map_.size());
+  for (const auto& pair : address_map_) {
+    writer->WriteUint64(pair.first);
+    writer->WriteUint64(pair.second.size);
+    writer->WriteCallStack(pair.second.call_stack);
+  }
+}
+
+bool LeakDetectorImpl::Load(CheckpointReader* reader) {
+  call_stack_manager_.Load(reader);
+
+  num_allocs_ = reader->ReadUint64();
+  num_frees_ = reader->ReadUint64();
+  alloc_size_ = reader->ReadUint64();
+  free_size_ = reader->ReadUint64();
+  num_allocs_with_call_stack_ = reader->ReadUint32();
+
+  size_leak_analyzer_.Load(reader);
+
+  if (reader->ReadUint64() != size_entries_.size())
+    reader->Fail();
+  for (size_t i = 0; i < size_entries_.size() && reader->ok(); ++i) {
+    AllocSizeEntry* entry = &size_entries_[i];
+    entry->num_allocs = reader->ReadUint32();
+    entry->num_frees = reader->ReadUint32();
+    if (!reader->ReadUint32())
+      continue;
+    // The saved table always has to be read, to get to what follows it.
+    if (!entry->stack_table) {
+      entry->stack_table =
+          new(CustomAllocator::Allocate(sizeof(CallStackTable),
+                                        CustomAllocator::kAnalysisArena))
+          CallStackTable(call_stack_suspicion_threshold_);
+      ++num_stack_tables_;
+    }
+    entry->stack_table->Load(reader);
+  }
+
+  uint64_t num_addresses = reader->ReadUint64();
+  for (uint64_t i = 0; i < num_addresses && reader->ok(); ++i) {
+    uintptr_t addr = reader->ReadUint64();
+    AllocInfo alloc_info;
+    alloc_info.size = reader->ReadUint64();
+    alloc_info.call_stack = reader->ReadCallStack();
+    address_map_.insert(std::pair<uintptr_t, AllocInfo>(addr, alloc_info));
+  }
+
+  return reader->ok();
+}
+
 size_t LeakDetectorImpl::AddressHash::operator() (uintptr_t addr) const {
   return base::Hash(reinterpret_cast<const char*>(&addr), sizeof(addr));
 }
@@ -282,6 +553,38 @@ void LeakDetectorImpl::DumpStats() const {
            num_allocs_ ? 100.0f * num_allocs_with_call_stack_ / num_allocs_ : 0,
            call_stack_manager_.size());
   PrintWithPidOnEachLine(buf);
+
+  for (int i = 0; i < CustomAllocator::kNumArenas; ++i) {
+    CustomAllocator::ArenaId arena = static_cast<CustomAllocator::ArenaId>(i);
+    CustomAllocator::Stats stats;
+    CustomAllocator::GetStats(arena, &stats);
+    snprintf(buf, sizeof(buf),
+             "Arena %s: %zu bytes in use, %zu peak, %zu allocs, %zu frees, "
+             "%" PRId64 "/%" PRId64 " contended locks, "
+             "%" PRId64 " cycles held, %" PRId64 " cycles waited\n",
+             CustomAllocator::GetArenaName(arena), stats.bytes_in_use,
+             stats.peak_bytes_in_use, stats.num_allocs, stats.num_frees,
+             stats.num_contended_lock_acquisitions,
+             stats.num_lock_acquisitions, stats.lock_cycles_held,
+             stats.lock_cycles_waited);
+    PrintWithPidOnEachLine(buf);
+  }
+
+  for (int i = 0; i < self_profile::kNumTimers; ++i) {
+    self_profile::Timer timer = static_cast<self_profile::Timer>(i);
+    self_profile::Histogram histogram;
+    self_profile::GetHistogram(timer, &histogram);
+    if (!histogram.count)
+      continue;
+    snprintf(buf, sizeof(buf),
+             "Timer %s: %" PRIu64 " timed, mean %" PRIu64 ", p50 %" PRIu64
+             ", p99 %" PRIu64 ", p99.9 %" PRIu64 " cycles\n",
+             self_profile::GetTimerName(timer), histogram.count,
+             histogram.total_ticks / histogram.count,
+             histogram.Quantile(0.5), histogram.Quantile(0.99),
+             histogram.Quantile(0.999));
+    PrintWithPidOnEachLine(buf);
+  }
 }
 
 }  // namespace leak_detector
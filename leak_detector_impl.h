@@ -23,6 +23,8 @@ template <typename T>
 using InternalVector = std::vector<T, STL_Allocator<T, CustomAllocator>>;
 
 struct CallStackTable;
+class CheckpointReader;
+class CheckpointWriter;
 
 struct InternalLeakReport {
   size_t alloc_size_bytes;
@@ -61,6 +63,59 @@ class LeakDetectorImpl {
   void TestForLeaks(bool do_logging,
                     InternalVector<InternalLeakReport>* reports);
 
+  // The functions below allow the allocations to be split by address across
+  // several shard instances, as done by ShardedLeakDetector. A single front
+  // instance creates the call stacks that the shards record, and runs the leak
+  // analysis on the combined counts of the shards.
+
+  // Returns the unique call stack object for |call_stack|.
+  const CallStack* GetCallStack(int stack_depth,
+                                const void* const call_stack[]);
+
+  // Same as RecordAlloc(), with a call stack that was returned by
+  // GetCallStack() of the front instance, or null.
+  void RecordAllocWithCallStack(const void* ptr,
+                                size_t size,
+                                const CallStack* call_stack);
+
+  // Replace the allocation stats and counts of this instance with the sums of
+  // those of |shards|.
+  void MergeCounts(const LeakDetectorImpl* const shards[], int num_shards);
+
+  // Create stack tables for all sizes that |front| has stack tables for.
+  void AddStackTables(const LeakDetectorImpl& front);
+
+  // The functions below let the processes that run the same binary pool their
+  // counts in a single instance, as done by leak_aggregator. Call stacks are
+  // exchanged as offsets within the binary. See leak_summary.h.
+
+  // Write the net allocation counts by size, and by call stack for the sizes
+  // that have stack tables, to |summary|. Only the call stacks with the most
+  // allocations are written for each size.
+  void WriteSummary(InternalVector<uint8_t>* summary) const;
+
+  // Add the counts in |summary| to those of this instance, which should have
+  // no mapping, so that the offsets in call stacks are kept as they are. Call
+  // stack counts are only added for the sizes that have stack tables. Returns
+  // false if the summary is invalid, in which case none of it is added.
+  bool AddSummary(const uint8_t* summary, size_t size);
+
+  // Reset all alloc and free counts to zero, keeping the leak analysis state.
+  void ClearCounts();
+
+  // Get the sizes that have stack tables, or create stack tables for |sizes|.
+  void GetStackTableSizes(InternalVector<uint32_t>* sizes) const;
+  void AddStackTables(const InternalVector<uint32_t>& sizes);
+
+  // Save the complete state to |writer|, including the call stacks, which must
+  // come before anything that refers to them.
+  void Save(CheckpointWriter* writer) const;
+
+  // Restore the state saved in |reader|. Must be called on a newly created
+  // instance with the same parameters as the saved one. Returns false if the
+  // checkpoint is invalid.
+  bool Load(CheckpointReader* reader);
+
  private:
   // A record of allocations for a particular size.
   struct AllocSizeEntry {
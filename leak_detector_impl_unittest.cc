@@ -458,4 +458,86 @@ TEST_F(LeakDetectorImplTest, JuliaSetWithLeak) {
   }
 }
 
+TEST_F(LeakDetectorImplTest, PooledSummaries) {
+  // Processes that run the same binary at different addresses, and an
+  // aggregator without a mapping that analyzes their pooled counts.
+  const int kNumProcesses = 3;
+  const uintptr_t kProcessMappingDistance = 0x10000000;
+  const uintptr_t kLeakOffsets[] = { 0x100, 0x2340, 0x5678 };
+  const uintptr_t kOtherOffsets[] = { 0x200, 0x2340, 0x5678 };
+  const size_t kLeakSize = 48;
+
+  scoped_ptr<LeakDetectorImpl> processes[kNumProcesses];
+  for (int i = 0; i < kNumProcesses; ++i) {
+    processes[i].reset(new LeakDetectorImpl(
+        kMappingAddr + i * kProcessMappingDistance, kMappingSize, 4, 4,
+        false /* verbose */));
+  }
+  LeakDetectorImpl aggregator(0, 0, 4, 4, false /* verbose */);
+
+  uintptr_t next_ptr = 0x10000;
+  std::vector<const void*> live(kNumProcesses, nullptr);
+  InternalVector<InternalLeakReport> reports;
+  std::set<InternalLeakReport> pooled_reports;
+  for (int round = 0; round < 20; ++round) {
+    aggregator.ClearCounts();
+    for (int i = 0; i < kNumProcesses; ++i) {
+      LeakDetectorImpl* process = processes[i].get();
+      const uintptr_t mapping = kMappingAddr + i * kProcessMappingDistance;
+      const void* leak_stack[arraysize(kLeakOffsets)];
+      const void* other_stack[arraysize(kOtherOffsets)];
+      for (size_t j = 0; j < arraysize(kLeakOffsets); ++j) {
+        leak_stack[j] =
+            reinterpret_cast<const void*>(mapping + kLeakOffsets[j]);
+        other_stack[j] =
+            reinterpret_cast<const void*>(mapping + kOtherOffsets[j]);
+      }
+
+      // Two allocations leak in each round, while those of the other call
+      // stack and size are freed.
+      for (int j = 0; j < 2; ++j) {
+        process->RecordAlloc(reinterpret_cast<const void*>(next_ptr += 0x100),
+                             kLeakSize, arraysize(leak_stack), leak_stack);
+      }
+      if (live[i])
+        process->RecordFree(live[i]);
+      live[i] = reinterpret_cast<const void*>(next_ptr += 0x100);
+      process->RecordAlloc(live[i], kLeakSize, arraysize(other_stack),
+                           other_stack);
+      const void* freed = reinterpret_cast<const void*>(next_ptr += 0x100);
+      process->RecordAlloc(freed, 64, arraysize(other_stack), other_stack);
+      process->RecordFree(freed);
+
+      InternalVector<uint8_t> summary;
+      process->WriteSummary(&summary);
+      ASSERT_TRUE(aggregator.AddSummary(summary.data(), summary.size()));
+    }
+
+    aggregator.TestForLeaks(false /* do_logging */, &reports);
+    for (const InternalLeakReport& report : reports)
+      pooled_reports.insert(report);
+
+    // The processes record call stacks for the sizes that the aggregator
+    // suspects.
+    InternalVector<uint32_t> sizes;
+    aggregator.GetStackTableSizes(&sizes);
+    for (auto& process : processes)
+      process->AddStackTables(sizes);
+  }
+
+  ASSERT_EQ(1U, pooled_reports.size());
+  const InternalLeakReport& report = *pooled_reports.begin();
+  EXPECT_EQ(kLeakSize, report.alloc_size_bytes);
+  ASSERT_EQ(arraysize(kLeakOffsets), report.call_stack.size());
+  for (size_t i = 0; i < arraysize(kLeakOffsets); ++i)
+    EXPECT_EQ(kLeakOffsets[i], report.call_stack[i]);
+
+  // Invalid summaries are rejected as a whole.
+  InternalVector<uint8_t> summary;
+  processes[0]->WriteSummary(&summary);
+  EXPECT_FALSE(aggregator.AddSummary(summary.data(), summary.size() - 1));
+  summary.push_back(0);
+  EXPECT_FALSE(aggregator.AddSummary(summary.data(), summary.size()));
+}
+
 }  // namespace leak_detector
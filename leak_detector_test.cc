@@ -0,0 +1,203 @@
+#include "components/metrics/leak_detector/leak_detector.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "hooks.h"
+#include "test_workload.h"
+
+namespace leak_detector {
+
+namespace {
+
+// Counts the reports of the detector that it is registered for.
+void CountReports(const InternalVector<InternalLeakReport>& reports,
+                  void* context) {
+  *static_cast<size_t*>(context) += reports.size();
+}
+
+}  // namespace
+
+class LeakDetectorTest : public ::testing::Test {
+ public:
+  LeakDetectorTest() {}
+
+  void SetUp() override {
+    CustomAllocator::InitializeForUnitTest();
+  }
+
+  void TearDown() override {
+    CustomAllocator::Shutdown();
+  }
+
+ protected:
+  // Parameters that record every allocation and check for leaks often.
+  static LeakDetector::Params TestParams() {
+    LeakDetector::Params params;
+    params.sampling_factor = 256;
+    params.stack_depth = TestWorkload::kStackDepth;
+    params.dump_interval_bytes = 64 * 1024;
+    return params;
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(LeakDetectorTest);
+};
+
+TEST_F(LeakDetectorTest, IndependentInstances) {
+  LeakDetector::Params strict_params = TestParams();
+  strict_params.call_stack_suspicion_threshold = 1000000;
+  LeakDetector detector(TestParams(), kTestMappingAddr, kTestMappingSize);
+  LeakDetector strict_detector(strict_params, kTestMappingAddr,
+                               kTestMappingSize);
+  size_t num_reports = 0;
+  size_t num_strict_reports = 0;
+  detector.SetLeakCheckCallback(&CountReports, &num_reports);
+  strict_detector.SetLeakCheckCallback(&CountReports, &num_strict_reports);
+
+  TestWorkload workload(1);
+  workload.Run(80000, &detector, &strict_detector);
+  EXPECT_GT(num_reports, 0U);
+  EXPECT_EQ(0U, num_strict_reports);
+}
+
+TEST_F(LeakDetectorTest, RequestDump) {
+  LeakDetector::Params params = TestParams();
+  params.dump_interval_bytes = 1ULL << 40;
+  LeakDetector detector(params, kTestMappingAddr, kTestMappingSize);
+  size_t num_checks = 0;
+  detector.SetLeakCheckCallback(
+      [](const InternalVector<InternalLeakReport>&, void* context) {
+        ++*static_cast<size_t*>(context);
+      },
+      &num_checks);
+
+  TestWorkload workload(0);
+  detector.RecordAlloc(reinterpret_cast<void*>(0x1000), 16,
+                       TestWorkload::kStackDepth, workload.stack(0));
+  EXPECT_EQ(0U, num_checks);
+  detector.RequestDump();
+  detector.RecordAlloc(reinterpret_cast<void*>(0x2000), 16,
+                       TestWorkload::kStackDepth, workload.stack(0));
+  EXPECT_EQ(1U, num_checks);
+
+  LeakReportPublisher::Reader reader(&detector.report_publisher());
+  ASSERT_NE(nullptr, reader.snapshot());
+  EXPECT_EQ(1U, reader.snapshot()->leak_check);
+  EXPECT_EQ(32U, reader.snapshot()->total_alloc_size);
+}
+
+TEST_F(LeakDetectorTest, Checkpoint) {
+  char path[] = "/tmp/leak_detector_test.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+
+  LeakDetector detector(TestParams(), kTestMappingAddr, kTestMappingSize);
+  TestWorkload workload(1);
+  workload.Run(80000, &detector);
+  ASSERT_TRUE(detector.SaveCheckpoint(path, 1234));
+
+  uint64_t position = 0;
+  LeakDetector restored(TestParams(), kTestMappingAddr, kTestMappingSize);
+  EXPECT_TRUE(restored.LoadCheckpoint(path, &position));
+  EXPECT_EQ(1234U, position);
+
+  // Checkpoints only apply to detectors with the same parameters.
+  LeakDetector::Params other_params = TestParams();
+  other_params.size_suspicion_threshold++;
+  LeakDetector other(other_params, kTestMappingAddr, kTestMappingSize);
+  EXPECT_FALSE(other.LoadCheckpoint(path, &position));
+
+  unlink(path);
+}
+
+TEST_F(LeakDetectorTest, LoadCheckpointWhileRecording) {
+  char path[] = "/tmp/leak_detector_test.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  close(fd);
+
+  LeakDetector detector(TestParams(), kTestMappingAddr, kTestMappingSize);
+  TestWorkload workload(1);
+  workload.Run(80000, &detector);
+  ASSERT_TRUE(detector.SaveCheckpoint(path, 0));
+
+  // Record allocations like the hooks do, including the unlocked check of
+  // whether to unwind the stack, while the state is replaced.
+  std::atomic<bool> done(false);
+  std::thread recorder([&]() {
+    uintptr_t next_ptr = 0x40000000;
+    while (!done) {
+      const void* ptr = reinterpret_cast<const void*>(next_ptr);
+      next_ptr += 48;
+      int depth =
+          detector.ShouldGetStackTrace(ptr, 48) ? TestWorkload::kStackDepth : 0;
+      detector.RecordAlloc(ptr, 48, depth, workload.stack(0));
+      detector.RecordFree(ptr);
+    }
+  });
+  uint64_t position;
+  for (int i = 0; i < 20; ++i)
+    EXPECT_TRUE(detector.LoadCheckpoint(path, &position));
+  done = true;
+  recorder.join();
+
+  unlink(path);
+}
+
+// Uses the default instance, which can only be initialized once per process,
+// since CustomAllocator cannot be initialized again after it is shut down.
+TEST(LeakDetectorDefaultInstanceTest, DumpSignalAndShutdown) {
+  setenv("LEAK_DETECTOR_SAMPLING_FACTOR", "256", 1);
+  setenv("LEAK_DETECTOR_DUMP_SIGNAL", std::to_string(SIGUSR2).c_str(), 1);
+  Initialize();
+  ASSERT_TRUE(IsInitialized());
+  size_t num_checks = 0;
+  SetLeakCheckCallback(
+      [](const InternalVector<InternalLeakReport>&, void* context) {
+        ++*static_cast<size_t*>(context);
+      },
+      &num_checks);
+
+  MallocHook::InvokeNewHook(reinterpret_cast<void*>(0x1000), 16);
+  EXPECT_EQ(0U, num_checks);
+  ASSERT_EQ(0, raise(SIGUSR2));
+  EXPECT_EQ(0U, num_checks);
+  MallocHook::InvokeNewHook(reinterpret_cast<void*>(0x2000), 16);
+  EXPECT_EQ(1U, num_checks);
+
+  MallocHook::InvokeDeleteHook(reinterpret_cast<void*>(0x1000));
+  MallocHook::InvokeDeleteHook(reinterpret_cast<void*>(0x2000));
+
+  // Shut down while another thread keeps invoking the hooks.
+  std::atomic<bool> done(false);
+  std::atomic<bool> hooked(false);
+  std::thread allocator([&]() {
+    uintptr_t next_ptr = 0x40000000;
+    while (!done) {
+      const void* ptr = reinterpret_cast<const void*>(next_ptr);
+      next_ptr += 16;
+      MallocHook::InvokeNewHook(ptr, 16);
+      MallocHook::InvokeDeleteHook(ptr);
+      hooked = true;
+    }
+  });
+  while (!hooked) {
+  }
+  Shutdown();
+  EXPECT_FALSE(IsInitialized());
+  done = true;
+  allocator.join();
+  unsetenv("LEAK_DETECTOR_DUMP_SIGNAL");
+  unsetenv("LEAK_DETECTOR_SAMPLING_FACTOR");
+}
+
+}  // namespace leak_detector
@@ -6,8 +6,31 @@
 
 #include <stdio.h>
 
+#include <algorithm>
+#include <functional>
+
+#include "components/metrics/leak_detector/call_stack_manager.h"
+
 namespace leak_detector {
 
+namespace {
+
+// Orders call stacks by their contents rather than by their addresses, so that
+// the leak analysis does not depend on where the call stacks were allocated.
+bool CallStackLess(const CallStack* a, const CallStack* b) {
+  if (a == b)
+    return false;
+  if (a->hash != b->hash)
+    return a->hash < b->hash;
+  if (a->depth != b->depth)
+    return a->depth < b->depth;
+  return std::lexicographical_compare(a->stack, a->stack + a->depth,
+                                      b->stack, b->stack + b->depth,
+                                      std::less<const void*>());
+}
+
+}  // namespace
+
 const char* LeakDetectorValueType::GetTypeName() const {
   switch (type_) {
   case kSize:
@@ -60,7 +83,7 @@ bool LeakDetectorValueType::operator< (
   case kSize:
     return size_ < other.size_;
   case kCallStack:
-    return call_stack_ < other.call_stack_;
+    return CallStackLess(call_stack_, other.call_stack_);
   default:
     return false;
   }
@@ -0,0 +1,455 @@
+// Measures how well and how cheaply the leak detector finds the leaks that
+// trace_generator injected into traces, across a grid of detector parameters.
+// Each trace is replayed with each combination of parameters, in parallel
+// processes.
+//
+// Usage: leak_eval [--jobs=N] [--leak=PATH] [--param=NAME=V1,V2,...] ...
+//                  TRACE...
+//
+// Options:
+//   --jobs=N              Number of replays to run at once. Defaults to the
+//                         number of CPUs.
+//   --leak=PATH           The replay tool. Defaults to ./leak.
+//   --param=NAME=V1,...   Environment variable of the replay tool, usually one
+//                         of the LEAK_DETECTOR_* parameters, and the values to
+//                         try. May be repeated, and all combinations of values
+//                         are tried. Defaults to a grid of sampling factors and
+//                         suspicion thresholds.
+//
+// Each TRACE needs a ground truth file TRACE.truth. For each combination, the
+// results over all traces are:
+//   found      Injected leaks that were reported, out of all injected leaks.
+//   events     Mean number of events from the start of a leak to its first
+//              report.
+//   ms         Mean trace time from the first leaked allocation to the first
+//              report, as precise as the block times of the trace.
+//   false      Number of distinct reported call stacks that were not injected.
+//   cpu        Detector CPU time per million events, in ms. That is the CPU
+//              time of the replay minus that of a replay with the detector
+//              disabled.
+//   memory     Largest peak memory usage of the detector, in KB.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "tool_options.h"
+
+namespace {
+
+// A leak injected by trace_generator.
+struct InjectedLeak {
+  uint64_t size;
+  uint64_t start;
+  uint64_t time;
+  std::vector<uint64_t> stack;
+};
+
+struct Trace {
+  std::string path;
+  uint64_t num_events;
+  std::vector<InjectedLeak> leaks;
+  double baseline_cpu;  // Seconds, with the detector disabled.
+};
+
+// One combination of parameter values.
+struct Config {
+  std::vector<std::pair<std::string, std::string>> env;
+  std::string label;
+};
+
+struct Report {
+  uint64_t event;
+  uint64_t time;
+  uint64_t size;
+  std::vector<uint64_t> stack;
+};
+
+// The outcome of replaying one trace with one config.
+struct Result {
+  std::vector<Report> reports;
+  double cpu;
+  uint64_t peak_memory;
+  bool ok;
+};
+
+// A replay, of |trace| with |config|, or with the detector disabled if
+// |config| is -1.
+struct Run {
+  int trace;
+  int config;
+  std::string output;
+  Result result;
+};
+
+const char kDefaultLeakPath[] = "./leak";
+const char kParamPrefix[] = "LEAK_DETECTOR_";
+
+// Split |str| at each |separator|.
+std::vector<std::string> Split(const std::string& str, char separator) {
+  std::vector<std::string> parts;
+  size_t start = 0;
+  for (;;) {
+    size_t end = str.find(separator, start);
+    parts.push_back(str.substr(start, end - start));
+    if (end == std::string::npos)
+      return parts;
+    start = end + 1;
+  }
+}
+
+std::vector<uint64_t> ParseStack(const std::string& str) {
+  std::vector<uint64_t> stack;
+  for (const std::string& frame : Split(str, ','))
+    stack.push_back(strtoull(frame.c_str(), NULL, 16));
+  return stack;
+}
+
+// Parse a line of "key=value" fields after a keyword into |*fields|.
+void ParseFields(const char* line, std::map<std::string, std::string>* fields) {
+  std::vector<std::string> words = Split(line, ' ');
+  for (size_t i = 1; i < words.size(); ++i) {
+    size_t equals = words[i].find('=');
+    if (equals != std::string::npos)
+      (*fields)[words[i].substr(0, equals)] = words[i].substr(equals + 1);
+  }
+}
+
+// Call |callback| with each line of |path|, without the newline. Returns false
+// if the file cannot be read.
+template <typename Callback>
+bool ForEachLine(const std::string& path, Callback callback) {
+  FILE* fp = fopen(path.c_str(), "r");
+  if (!fp)
+    return false;
+  char* line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+  while ((length = getline(&line, &capacity, fp)) >= 0) {
+    if (length && line[length - 1] == '\n')
+      line[length - 1] = '\0';
+    callback(line);
+  }
+  free(line);
+  fclose(fp);
+  return true;
+}
+
+bool ReadTruth(Trace* trace) {
+  std::string path = trace->path + ".truth";
+  trace->num_events = 0;
+  bool ok = ForEachLine(path, [trace](const char* line) {
+    if (strncmp(line, "events ", 7) == 0) {
+      trace->num_events = strtoull(line + 7, NULL, 10);
+    } else if (strncmp(line, "leak ", 5) == 0) {
+      std::map<std::string, std::string> fields;
+      ParseFields(line, &fields);
+      InjectedLeak leak;
+      leak.size = strtoull(fields["size"].c_str(), NULL, 10);
+      leak.start = strtoull(fields["start"].c_str(), NULL, 10);
+      leak.time = strtoull(fields["time"].c_str(), NULL, 10);
+      leak.stack = ParseStack(fields["stack"]);
+      trace->leaks.push_back(leak);
+    }
+  });
+  if (!ok || !trace->num_events) {
+    printf("Could not read %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ReadResult(const std::string& path, Result* result) {
+  result->peak_memory = 0;
+  result->ok = ForEachLine(path, [result](const char* line) {
+    const char kPeakMemory[] = "Peak leak detector memory: ";
+    if (strncmp(line, "report ", 7) == 0) {
+      std::map<std::string, std::string> fields;
+      ParseFields(line, &fields);
+      Report report;
+      report.event = strtoull(fields["event"].c_str(), NULL, 10);
+      report.time = strtoull(fields["time"].c_str(), NULL, 10);
+      report.size = strtoull(fields["size"].c_str(), NULL, 10);
+      report.stack = ParseStack(fields["stack"]);
+      result->reports.push_back(report);
+    } else if (strncmp(line, kPeakMemory, strlen(kPeakMemory)) == 0) {
+      result->peak_memory = strtoull(line + strlen(kPeakMemory), NULL, 10);
+    }
+  });
+  return result->ok;
+}
+
+// Whether |report| is of |leak|. The detector counts sizes in units of four
+// bytes, and reports as many frames as its stack depth.
+bool Matches(const Report& report, const InjectedLeak& leak) {
+  return report.size == leak.size / 4 * 4 && !report.stack.empty() &&
+         report.stack.size() <= leak.stack.size() &&
+         std::equal(report.stack.begin(), report.stack.end(),
+                    leak.stack.begin());
+}
+
+// Build all combinations of the values in |params|.
+std::vector<Config> MakeConfigs(
+    const std::vector<std::pair<std::string, std::vector<std::string>>>&
+        params) {
+  std::vector<Config> configs(1);
+  for (const auto& param : params) {
+    std::vector<Config> expanded;
+    for (const Config& config : configs) {
+      for (const std::string& value : param.second) {
+        Config next = config;
+        next.env.push_back(std::make_pair(param.first, value));
+        std::string name = param.first;
+        if (name.compare(0, strlen(kParamPrefix), kParamPrefix) == 0)
+          name = name.substr(strlen(kParamPrefix));
+        if (!next.label.empty())
+          next.label += " ";
+        next.label += name + "=" + value;
+        expanded.push_back(next);
+      }
+    }
+    configs.swap(expanded);
+  }
+  return configs;
+}
+
+// Start replaying |trace| with |config|, or with the detector disabled if it
+// is null, writing the output to |output|. Returns the pid, or -1.
+pid_t StartRun(const char* leak_path, const Trace& trace, const Config* config,
+               const std::string& output) {
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+
+  int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    _exit(127);
+  dup2(fd, STDOUT_FILENO);
+  dup2(fd, STDERR_FILENO);
+  close(fd);
+
+  // Decompress on the replay thread, so that the CPU time does not include
+  // the overhead of handing blocks between threads.
+  setenv("TRACE_DECOMPRESSION_THREADS", "0", 1);
+  if (config) {
+    setenv("TRACE_PRINT_REPORTS", "1", 1);
+    for (const auto& var : config->env)
+      setenv(var.first.c_str(), var.second.c_str(), 1);
+  } else {
+    setenv("LEAK_DETECTOR_SAMPLING_FACTOR", "0", 1);
+  }
+  execl(leak_path, leak_path, trace.path.c_str(), static_cast<char*>(NULL));
+  _exit(127);
+}
+
+// Run all of |runs|, at most |num_jobs| at a time.
+bool RunAll(const char* leak_path, const std::vector<Trace>& traces,
+            const std::vector<Config>& configs, int num_jobs,
+            std::vector<Run>* runs) {
+  std::map<pid_t, Run*> running;
+  size_t next = 0;
+  bool ok = true;
+  while (next < runs->size() || !running.empty()) {
+    while (next < runs->size() && static_cast<int>(running.size()) < num_jobs) {
+      Run* run = &(*runs)[next++];
+      const Config* config =
+          run->config >= 0 ? &configs[run->config] : nullptr;
+      pid_t pid = StartRun(leak_path, traces[run->trace], config, run->output);
+      if (pid < 0) {
+        perror("fork");
+        return false;
+      }
+      running[pid] = run;
+    }
+
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, 0, &usage);
+    if (pid < 0) {
+      perror("wait4");
+      return false;
+    }
+    auto iter = running.find(pid);
+    if (iter == running.end())
+      continue;
+    Run* run = iter->second;
+    running.erase(iter);
+
+    run->result.cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                      (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+        !ReadResult(run->output, &run->result)) {
+      printf("Replay of %s failed, see %s\n",
+             traces[run->trace].path.c_str(), run->output.c_str());
+      ok = false;
+      continue;
+    }
+    unlink(run->output.c_str());
+  }
+  return ok;
+}
+
+void PrintUsage(const char* program) {
+  printf("Usage: %s [--jobs=N] [--leak=PATH] [--param=NAME=V1,V2,...] ... "
+         "TRACE...\n"
+         "See leak_eval.cc for details.\n", program);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int num_jobs = std::max(1u, std::thread::hardware_concurrency());
+  const char* leak_path = kDefaultLeakPath;
+  std::vector<std::pair<std::string, std::vector<std::string>>> params;
+  std::vector<Trace> traces;
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value;
+    if (MatchOption(arg, "jobs", &value)) {
+      num_jobs = std::max(1, atoi(value));
+    } else if (MatchOption(arg, "leak", &value)) {
+      leak_path = value;
+    } else if (MatchOption(arg, "param", &value)) {
+      std::string param = value;
+      size_t equals = param.find('=');
+      if (equals == std::string::npos || equals == 0) {
+        PrintUsage(argv[0]);
+        return 1;
+      }
+      params.push_back(std::make_pair(param.substr(0, equals),
+                                      Split(param.substr(equals + 1), ',')));
+    } else if (arg[0] == '-') {
+      PrintUsage(argv[0]);
+      return 1;
+    } else {
+      Trace trace;
+      trace.path = arg;
+      if (!ReadTruth(&trace))
+        return 1;
+      traces.push_back(trace);
+    }
+  }
+  if (traces.empty()) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  if (params.empty()) {
+    params.push_back(std::make_pair(
+        "LEAK_DETECTOR_SAMPLING_FACTOR",
+        std::vector<std::string>{ "4", "16", "64", "256" }));
+    params.push_back(std::make_pair(
+        "LEAK_DETECTOR_SIZE_SUSPICION_THRESHOLD",
+        std::vector<std::string>{ "2", "4" }));
+    params.push_back(std::make_pair(
+        "LEAK_DETECTOR_CALL_STACK_SUSPICION_THRESHOLD",
+        std::vector<std::string>{ "2", "4" }));
+  }
+  std::vector<Config> configs = MakeConfigs(params);
+
+  // One run per trace with the detector disabled, and one per trace and
+  // config.
+  std::vector<Run> runs;
+  for (size_t i = 0; i < traces.size(); ++i) {
+    for (int j = -1; j < static_cast<int>(configs.size()); ++j) {
+      char output[64];
+      snprintf(output, sizeof(output), "leak_eval.%d.%zu.%d.out", getpid(), i,
+               j + 1);
+      Run run;
+      run.trace = i;
+      run.config = j;
+      run.output = output;
+      runs.push_back(run);
+    }
+  }
+  printf("Replaying %zu traces with %zu configurations, %d at a time\n",
+         traces.size(), configs.size(), num_jobs);
+  fflush(stdout);
+  if (!RunAll(leak_path, traces, configs, num_jobs, &runs))
+    return 1;
+  for (const Run& run : runs) {
+    if (run.config < 0)
+      traces[run.trace].baseline_cpu = run.result.cpu;
+  }
+
+  printf("%-7s %10s %10s %6s %10s %10s  %s\n", "found", "events", "ms",
+         "false", "cpu", "memory", "configuration");
+  int best_config = -1;
+  double best_cpu = 0;
+  for (size_t i = 0; i < configs.size(); ++i) {
+    size_t num_leaks = 0;
+    size_t num_found = 0;
+    double total_events = 0;
+    double total_ms = 0;
+    size_t num_false = 0;
+    double total_cpu = 0;
+    uint64_t peak_memory = 0;
+    for (const Run& run : runs) {
+      if (run.config != static_cast<int>(i))
+        continue;
+      const Trace& trace = traces[run.trace];
+      const Result& result = run.result;
+
+      for (const InjectedLeak& leak : trace.leaks) {
+        ++num_leaks;
+        for (const Report& report : result.reports) {
+          if (!Matches(report, leak))
+            continue;
+          ++num_found;
+          total_events += report.event - std::min(report.event, leak.start);
+          total_ms += (report.time - std::min(report.time, leak.time)) * 1e-6;
+          break;
+        }
+      }
+
+      std::set<std::pair<uint64_t, std::vector<uint64_t>>> false_reports;
+      for (const Report& report : result.reports) {
+        bool injected = false;
+        for (const InjectedLeak& leak : trace.leaks)
+          injected = injected || Matches(report, leak);
+        if (!injected)
+          false_reports.insert(std::make_pair(report.size, report.stack));
+      }
+      num_false += false_reports.size();
+
+      total_cpu += std::max(0.0, result.cpu - trace.baseline_cpu) * 1e9 /
+                   trace.num_events;
+      peak_memory = std::max(peak_memory, result.peak_memory);
+    }
+
+    double cpu = total_cpu / traces.size();
+    char found[32];
+    snprintf(found, sizeof(found), "%zu/%zu", num_found, num_leaks);
+    printf("%-7s %10.0f %10.1f %6zu %10.1f %10" PRIu64 "  %s\n", found,
+           num_found ? total_events / num_found : 0,
+           num_found ? total_ms / num_found : 0, num_false, cpu,
+           peak_memory / 1024, configs[i].label.c_str());
+
+    if (num_found == num_leaks && !num_false &&
+        (best_config < 0 || cpu < best_cpu)) {
+      best_config = i;
+      best_cpu = cpu;
+    }
+  }
+
+  if (best_config >= 0) {
+    printf("Cheapest configuration that found all leaks without false "
+           "positives: %s\n", configs[best_config].label.c_str());
+  } else {
+    printf("No configuration found all leaks without false positives\n");
+  }
+  return 0;
+}
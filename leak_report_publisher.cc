@@ -0,0 +1,57 @@
+#include "leak_report_publisher.h"
+
+namespace leak_detector {
+
+// Readers and the publisher check each other with sequentially consistent
+// operations: a reader increments the count of a snapshot and then checks that
+// it is still published, while the publisher switches the published snapshot,
+// and later checks the count of the spare before overwriting it. So either the
+// publisher sees the reader's count and leaves the snapshot alone, or the
+// reader sees that it is no longer published and lets go of it.
+LeakReportPublisher::Reader::Reader(const LeakReportPublisher* publisher)
+    : publisher_(publisher), index_(-1), snapshot_(nullptr) {
+  for (;;) {
+    int index = publisher_->published_.load();
+    if (index < 0)
+      return;
+    publisher_->num_readers_[index].fetch_add(1);
+    if (publisher_->published_.load() == index) {
+      index_ = index;
+      snapshot_ = &publisher_->snapshots_[index];
+      return;
+    }
+    publisher_->num_readers_[index].fetch_sub(1);
+  }
+}
+
+LeakReportPublisher::Reader::~Reader() {
+  if (index_ >= 0)
+    publisher_->num_readers_[index_].fetch_sub(1, std::memory_order_release);
+}
+
+LeakReportPublisher::LeakReportPublisher()
+    : published_(-1), num_leak_checks_(0), num_dropped_(0) {
+  for (std::atomic<uint32_t>& num_readers : num_readers_)
+    num_readers = 0;
+}
+
+bool LeakReportPublisher::Publish(
+    uint64_t total_alloc_size,
+    const InternalVector<InternalLeakReport>& reports) {
+  ++num_leak_checks_;
+  int spare = published_.load(std::memory_order_relaxed) == 0 ? 1 : 0;
+  if (num_readers_[spare].load()) {
+    ++num_dropped_;
+    return false;
+  }
+
+  // Assignment reuses the memory of the previous reports in the spare.
+  LeakReportSnapshot* snapshot = &snapshots_[spare];
+  snapshot->leak_check = num_leak_checks_;
+  snapshot->total_alloc_size = total_alloc_size;
+  snapshot->reports = reports;
+  published_.store(spare);
+  return true;
+}
+
+}  // namespace leak_detector
@@ -0,0 +1,93 @@
+#ifndef LEAK_REPORT_PUBLISHER_H_
+#define LEAK_REPORT_PUBLISHER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "base/macros.h"
+#include "leak_detector_impl.h"
+
+namespace leak_detector {
+
+// The reports of one leak check. Never modified while a reader holds it.
+struct LeakReportSnapshot {
+  // The number of the leak check that found the reports, counting from 1.
+  uint64_t leak_check;
+
+  // Total number of bytes allocated when the check ran.
+  uint64_t total_alloc_size;
+
+  InternalVector<InternalLeakReport> reports;
+};
+
+// Makes the reports of the latest leak check available to any thread, e.g. a
+// metrics exporter, without taking the leak detector's lock.
+//
+// There are two snapshots: the published one, and a spare that the next
+// Publish() fills in before publishing it with an atomic index. Each snapshot
+// has a count of the readers holding it, so the publisher knows when the spare
+// is no longer read. The publisher never waits for readers: if the spare is
+// still held, the new reports are dropped, and the next leak check, which
+// recomputes all reports, publishes them instead. Readers never wait either,
+// and only retry if a publication happens while they pick a snapshot.
+class LeakReportPublisher {
+ public:
+  // Holds the latest published snapshot for as long as it exists, which
+  // should be briefly, since it keeps the reports of the next leak check from
+  // being published. Must not outlive the publisher.
+  class Reader {
+   public:
+    explicit Reader(const LeakReportPublisher* publisher);
+    ~Reader();
+
+    // Null if no reports have been published yet.
+    const LeakReportSnapshot* snapshot() const {
+      return snapshot_;
+    }
+
+   private:
+    const LeakReportPublisher* const publisher_;
+    int index_;
+    const LeakReportSnapshot* snapshot_;
+
+    DISALLOW_COPY_AND_ASSIGN(Reader);
+  };
+
+  LeakReportPublisher();
+
+  // Publish the |reports| of a leak check that ran after |total_alloc_size|
+  // bytes were allocated. Returns false if they were dropped because a reader
+  // still holds the spare snapshot. Only allocates from CustomAllocator.
+  // Calls must be serialized, but may run concurrently with readers.
+  bool Publish(uint64_t total_alloc_size,
+               const InternalVector<InternalLeakReport>& reports);
+
+  // The number of calls to Publish(), and of those that dropped their reports.
+  // Only for the caller of Publish().
+  uint64_t num_leak_checks() const {
+    return num_leak_checks_;
+  }
+  uint64_t num_dropped() const {
+    return num_dropped_;
+  }
+
+ private:
+  LeakReportSnapshot snapshots_[2];
+
+  // The number of readers holding each snapshot, including those that are
+  // about to find that it is no longer published.
+  mutable std::atomic<uint32_t> num_readers_[2];
+
+  // Index of the published snapshot, or -1 before the first publication.
+  std::atomic<int> published_;
+
+  uint64_t num_leak_checks_;
+  uint64_t num_dropped_;
+
+  DISALLOW_COPY_AND_ASSIGN(LeakReportPublisher);
+};
+
+}  // namespace leak_detector
+
+#endif  // LEAK_REPORT_PUBLISHER_H_
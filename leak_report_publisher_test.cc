@@ -0,0 +1,120 @@
+#include "leak_report_publisher.h"
+
+#include <gperftools/custom_allocator.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace leak_detector {
+
+namespace {
+
+// Reports whose contents are all derived from |num_reports|, which the tests
+// also publish as the total allocation size, so that readers can check that a
+// snapshot is consistent.
+InternalVector<InternalLeakReport> MakeReports(size_t num_reports) {
+  InternalVector<InternalLeakReport> reports(num_reports);
+  for (size_t i = 0; i < num_reports; ++i) {
+    reports[i].alloc_size_bytes = num_reports;
+    reports[i].call_stack.assign(num_reports % 5, num_reports);
+  }
+  return reports;
+}
+
+bool IsConsistent(const LeakReportSnapshot& snapshot) {
+  const size_t num_reports = snapshot.total_alloc_size;
+  if (snapshot.reports.size() != num_reports)
+    return false;
+  for (const InternalLeakReport& report : snapshot.reports) {
+    if (report.alloc_size_bytes != num_reports ||
+        report.call_stack.size() != num_reports % 5)
+      return false;
+    for (uintptr_t offset : report.call_stack) {
+      if (offset != num_reports)
+        return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+class LeakReportPublisherTest : public ::testing::Test {
+ public:
+  LeakReportPublisherTest() {}
+
+  void SetUp() override {
+    CustomAllocator::InitializeForUnitTest();
+  }
+
+  void TearDown() override {
+    CustomAllocator::Shutdown();
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(LeakReportPublisherTest);
+};
+
+TEST_F(LeakReportPublisherTest, HeldSnapshots) {
+  LeakReportPublisher publisher;
+  {
+    LeakReportPublisher::Reader reader(&publisher);
+    EXPECT_EQ(nullptr, reader.snapshot());
+  }
+
+  EXPECT_TRUE(publisher.Publish(1, MakeReports(1)));
+  LeakReportPublisher::Reader first(&publisher);
+  ASSERT_NE(nullptr, first.snapshot());
+  EXPECT_EQ(1U, first.snapshot()->leak_check);
+  EXPECT_TRUE(IsConsistent(*first.snapshot()));
+
+  // The spare is free, but the one after it is held by |first|.
+  EXPECT_TRUE(publisher.Publish(2, MakeReports(2)));
+  EXPECT_FALSE(publisher.Publish(3, MakeReports(3)));
+  EXPECT_EQ(1U, publisher.num_dropped());
+  EXPECT_EQ(1U, first.snapshot()->leak_check);
+  EXPECT_TRUE(IsConsistent(*first.snapshot()));
+  {
+    LeakReportPublisher::Reader second(&publisher);
+    ASSERT_NE(nullptr, second.snapshot());
+    EXPECT_EQ(2U, second.snapshot()->leak_check);
+    EXPECT_TRUE(IsConsistent(*second.snapshot()));
+  }
+}
+
+TEST_F(LeakReportPublisherTest, ConcurrentReaders) {
+  LeakReportPublisher publisher;
+  std::atomic<bool> done(false);
+  std::atomic<int> num_inconsistent(0);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&]() {
+      uint64_t last_leak_check = 0;
+      while (!done) {
+        LeakReportPublisher::Reader reader(&publisher);
+        const LeakReportSnapshot* snapshot = reader.snapshot();
+        if (!snapshot)
+          continue;
+        if (!IsConsistent(*snapshot) || snapshot->leak_check < last_leak_check)
+          ++num_inconsistent;
+        last_leak_check = snapshot->leak_check;
+      }
+    });
+  }
+
+  for (size_t i = 1; i <= 20000; ++i)
+    publisher.Publish(i % 64, MakeReports(i % 64));
+  done = true;
+  for (std::thread& reader : readers)
+    reader.join();
+
+  EXPECT_EQ(0, num_inconsistent);
+  EXPECT_EQ(20000U, publisher.num_leak_checks());
+  EXPECT_LT(publisher.num_dropped(), publisher.num_leak_checks());
+}
+
+}  // namespace leak_detector
@@ -0,0 +1,151 @@
+#ifndef LEAK_SUMMARY_H_
+#define LEAK_SUMMARY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "leak_detector_impl.h"
+#include "trace_format.h"
+
+namespace leak_detector {
+
+// Summaries of the net allocation counts of a leak detector, which processes
+// that run the same binary send to leak_aggregator, so that the leak analysis
+// runs on the counts of all of them together. See leak_aggregator.cc.
+//
+// Summaries and replies are single messages on a SOCK_SEQPACKET Unix socket,
+// so they need no framing. All integers in them are varints.
+//
+// A summary is written by LeakDetectorImpl::WriteSummary():
+//
+//   kSummaryVersion num_sizes
+//   num_sizes times:
+//     size net_num_allocs num_stacks
+//     num_stacks times:
+//       net_num_allocs depth
+//       depth times:
+//         frame
+//
+// Frames are offsets within the binary, as in leak reports, so that the call
+// stacks of different processes match. Only the sizes that the process has
+// stack tables for have call stacks.
+//
+// The aggregator replies to each summary with the sizes that it has stack
+// tables for, so that the processes start recording their call stacks:
+//
+//   kReplyVersion num_sizes
+//   num_sizes times:
+//     size
+namespace leak_summary {
+
+const uint64_t kSummaryVersion = 1;
+const uint64_t kReplyVersion = 1;
+
+// Messages are rejected if they are larger than this.
+const size_t kMaxMessageSize = 1 << 20;
+
+// Replies list at most all sizes that a detector can have stack tables for,
+// which takes far less than this.
+const size_t kMaxReplySize = 16 << 10;
+
+// Call stacks deeper than this are rejected.
+const uint64_t kMaxStackDepth = 1024;
+
+inline void AppendVarint(InternalVector<uint8_t>* out, uint64_t value) {
+  uint8_t buffer[10];
+  out->insert(out->end(), buffer, trace_format::PutVarint(buffer, value));
+}
+
+// Check that the summary in |data| is complete, and call
+// |size_callback(size, net_num_allocs)| for each of its sizes, followed by
+// |stack_callback(size, net_num_allocs, depth, frames)| for each of the call
+// stacks of that size. Returns false if the summary is invalid, possibly after
+// calling the callbacks for part of it.
+template <typename SizeCallback, typename StackCallback>
+bool ParseSummary(const uint8_t* data,
+                  size_t size,
+                  SizeCallback size_callback,
+                  StackCallback stack_callback) {
+  const uint8_t* end = data + size;
+  uint64_t version;
+  uint64_t num_sizes;
+  if (!trace_format::GetVarint(&data, end, &version) ||
+      version != kSummaryVersion ||
+      !trace_format::GetVarint(&data, end, &num_sizes)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < num_sizes; ++i) {
+    uint64_t alloc_size;
+    uint64_t net_num_allocs;
+    uint64_t num_stacks;
+    if (!trace_format::GetVarint(&data, end, &alloc_size) ||
+        !trace_format::GetVarint(&data, end, &net_num_allocs) ||
+        !trace_format::GetVarint(&data, end, &num_stacks) ||
+        alloc_size > UINT32_MAX || net_num_allocs > UINT32_MAX) {
+      return false;
+    }
+    size_callback(static_cast<uint32_t>(alloc_size),
+                  static_cast<uint32_t>(net_num_allocs));
+
+    for (uint64_t j = 0; j < num_stacks; ++j) {
+      uint64_t stack_num_allocs;
+      uint64_t depth;
+      if (!trace_format::GetVarint(&data, end, &stack_num_allocs) ||
+          !trace_format::GetVarint(&data, end, &depth) ||
+          stack_num_allocs > UINT32_MAX || depth > kMaxStackDepth) {
+        return false;
+      }
+      const void* frames[depth];
+      for (uint64_t k = 0; k < depth; ++k) {
+        uint64_t frame;
+        if (!trace_format::GetVarint(&data, end, &frame))
+          return false;
+        frames[k] = reinterpret_cast<const void*>(frame);
+      }
+      stack_callback(static_cast<uint32_t>(alloc_size),
+                     static_cast<uint32_t>(stack_num_allocs),
+                     static_cast<int>(depth), frames);
+    }
+  }
+  return data == end;
+}
+
+inline void WriteReply(const InternalVector<uint32_t>& sizes,
+                       InternalVector<uint8_t>* out) {
+  out->clear();
+  AppendVarint(out, kReplyVersion);
+  AppendVarint(out, sizes.size());
+  for (uint32_t size : sizes)
+    AppendVarint(out, size);
+}
+
+// Returns false if the reply in |data| is invalid.
+inline bool ReadReply(const uint8_t* data,
+                      size_t size,
+                      InternalVector<uint32_t>* sizes) {
+  const uint8_t* end = data + size;
+  uint64_t version;
+  uint64_t num_sizes;
+  if (!trace_format::GetVarint(&data, end, &version) ||
+      version != kReplyVersion ||
+      !trace_format::GetVarint(&data, end, &num_sizes) ||
+      num_sizes > size) {
+    return false;
+  }
+  sizes->clear();
+  for (uint64_t i = 0; i < num_sizes; ++i) {
+    uint64_t alloc_size;
+    if (!trace_format::GetVarint(&data, end, &alloc_size) ||
+        alloc_size > UINT32_MAX) {
+      return false;
+    }
+    sizes->push_back(static_cast<uint32_t>(alloc_size));
+  }
+  return data == end;
+}
+
+}  // namespace leak_summary
+
+}  // namespace leak_detector
+
+#endif  // LEAK_SUMMARY_H_
@@ -0,0 +1,187 @@
+#include "lz4_block.h"
+
+#include <string.h>
+
+#include <vector>
+
+namespace lz4 {
+
+namespace {
+
+const size_t kMinMatch = 4;
+
+// The format requires the last match to start at least this many bytes before
+// the end of the input, and the last this many bytes to be literals.
+const size_t kMatchStartLimit = 12;
+const size_t kLastLiterals = 5;
+
+const size_t kMaxOffset = 0xffff;
+
+const int kHashBits = 12;
+
+inline uint32_t Load32(const uint8_t* ptr) {
+  uint32_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+inline uint32_t Hash(uint32_t sequence) {
+  return (sequence * 2654435761U) >> (32 - kHashBits);
+}
+
+// Write a length that did not fit in a token nibble. Returns NULL if there is
+// not enough room.
+uint8_t* PutLength(uint8_t* out, uint8_t* end, size_t length) {
+  while (length >= 255) {
+    if (out == end)
+      return NULL;
+    *out++ = 255;
+    length -= 255;
+  }
+  if (out == end)
+    return NULL;
+  *out++ = length;
+  return out;
+}
+
+// Write a sequence of |num_literals| literals followed by a match of
+// |match_length| bytes at |offset| back. A match length of 0 means there is no
+// match, as in the last sequence of a block. Returns NULL if there is not
+// enough room.
+uint8_t* PutSequence(uint8_t* out, uint8_t* end, const uint8_t* literals,
+                     size_t num_literals, size_t offset, size_t match_length) {
+  if (out == end)
+    return NULL;
+  uint8_t* token = out++;
+  *token = (num_literals < 15 ? num_literals : 15) << 4;
+  if (num_literals >= 15 && !(out = PutLength(out, end, num_literals - 15)))
+    return NULL;
+  if (static_cast<size_t>(end - out) < num_literals)
+    return NULL;
+  memcpy(out, literals, num_literals);
+  out += num_literals;
+
+  if (match_length == 0)
+    return out;
+  if (end - out < 2)
+    return NULL;
+  *out++ = offset & 0xff;
+  *out++ = offset >> 8;
+  size_t length_code = match_length - kMinMatch;
+  *token |= length_code < 15 ? length_code : 15;
+  if (length_code >= 15 && !(out = PutLength(out, end, length_code - 15)))
+    return NULL;
+  return out;
+}
+
+// Read a length continued after a token nibble into |*length|. Returns false
+// if the input ends first.
+bool GetLength(const uint8_t** in, const uint8_t* end, size_t* length) {
+  uint8_t byte;
+  do {
+    if (*in == end)
+      return false;
+    byte = *(*in)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+}  // namespace
+
+size_t Compress(const uint8_t* src, size_t src_size,
+                uint8_t* dst, size_t dst_capacity) {
+  uint8_t* out = dst;
+  uint8_t* const out_end = dst + dst_capacity;
+  size_t anchor = 0;
+
+  if (src_size > kMatchStartLimit) {
+    // Positions of recent 4-byte sequences, plus one so that 0 means empty.
+    std::vector<uint32_t> table(1 << kHashBits);
+    const size_t match_start_limit = src_size - kMatchStartLimit;
+    const size_t match_end_limit = src_size - kLastLiterals;
+
+    size_t pos = 0;
+    while (pos < match_start_limit) {
+      uint32_t sequence = Load32(src + pos);
+      uint32_t* entry = &table[Hash(sequence)];
+      size_t candidate = *entry;
+      *entry = pos + 1;
+      if (candidate == 0 || pos - (candidate - 1) > kMaxOffset ||
+          Load32(src + candidate - 1) != sequence) {
+        ++pos;
+        continue;
+      }
+      --candidate;
+
+      size_t match_end = pos + kMinMatch;
+      while (match_end < match_end_limit &&
+             src[match_end] == src[candidate + match_end - pos]) {
+        ++match_end;
+      }
+      out = PutSequence(out, out_end, src + anchor, pos - anchor,
+                        pos - candidate, match_end - pos);
+      if (!out)
+        return 0;
+      pos = anchor = match_end;
+    }
+  }
+
+  out = PutSequence(out, out_end, src + anchor, src_size - anchor, 0, 0);
+  return out ? out - dst : 0;
+}
+
+bool Decompress(const uint8_t* src, size_t src_size,
+                uint8_t* dst, size_t dst_size) {
+  const uint8_t* in = src;
+  const uint8_t* const in_end = src + src_size;
+  uint8_t* out = dst;
+  uint8_t* const out_end = dst + dst_size;
+
+  for (;;) {
+    if (in == in_end)
+      return false;
+    const uint8_t token = *in++;
+
+    size_t num_literals = token >> 4;
+    if (num_literals == 15 && !GetLength(&in, in_end, &num_literals))
+      return false;
+    if (static_cast<size_t>(in_end - in) < num_literals ||
+        static_cast<size_t>(out_end - out) < num_literals) {
+      return false;
+    }
+    memcpy(out, in, num_literals);
+    in += num_literals;
+    out += num_literals;
+
+    // The last sequence has no match.
+    if (in == in_end)
+      return out == out_end;
+
+    if (in_end - in < 2)
+      return false;
+    size_t offset = in[0] | (in[1] << 8);
+    in += 2;
+    if (offset == 0 || offset > static_cast<size_t>(out - dst))
+      return false;
+
+    size_t match_length = token & 15;
+    if (match_length == 15 && !GetLength(&in, in_end, &match_length))
+      return false;
+    match_length += kMinMatch;
+    if (static_cast<size_t>(out_end - out) < match_length)
+      return false;
+
+    const uint8_t* match = out - offset;
+    if (offset >= match_length) {
+      memcpy(out, match, match_length);
+      out += match_length;
+    } else {
+      // The match overlaps the output, repeating the last |offset| bytes.
+      for (size_t i = 0; i < match_length; ++i)
+        *out++ = match[i];
+    }
+  }
+}
+
+}  // namespace lz4
@@ -0,0 +1,31 @@
+#ifndef LZ4_BLOCK_H_
+#define LZ4_BLOCK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A small implementation of the LZ4 block format, for compressing trace
+// blocks. The compressor is a simple greedy matcher, so it is fast but does not
+// compress as well as the reference implementation. Its output can be read by
+// any LZ4 block decoder, and Decompress() accepts any valid LZ4 block.
+namespace lz4 {
+
+// Largest possible compressed size of |size| bytes of input.
+inline size_t CompressBound(size_t size) {
+  return size + size / 255 + 16;
+}
+
+// Compress |src| into |dst|. Returns the compressed size, or 0 if it does not
+// fit in |dst_capacity| bytes.
+size_t Compress(const uint8_t* src, size_t src_size,
+                uint8_t* dst, size_t dst_capacity);
+
+// Decompress |src| into |dst|, which must be exactly |dst_size| bytes once
+// decompressed. Returns false if |src| is malformed or does not decompress to
+// exactly |dst_size| bytes. Never reads or writes out of bounds.
+bool Decompress(const uint8_t* src, size_t src_size,
+                uint8_t* dst, size_t dst_size);
+
+}  // namespace lz4
+
+#endif  // LZ4_BLOCK_H_
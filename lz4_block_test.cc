@@ -0,0 +1,93 @@
+#include "lz4_block.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+void ExpectRoundTrip(const std::vector<uint8_t>& input) {
+  std::vector<uint8_t> compressed(lz4::CompressBound(input.size()));
+  size_t compressed_size = lz4::Compress(input.data(), input.size(),
+                                         compressed.data(), compressed.size());
+  ASSERT_GT(compressed_size, 0U);
+
+  std::vector<uint8_t> output(input.size());
+  ASSERT_TRUE(lz4::Decompress(compressed.data(), compressed_size,
+                              output.data(), output.size()));
+  EXPECT_TRUE(input == output);
+}
+
+}  // namespace
+
+TEST(LZ4BlockTest, RoundTrip) {
+  ExpectRoundTrip(std::vector<uint8_t>());
+  ExpectRoundTrip(std::vector<uint8_t>(1, 'x'));
+  ExpectRoundTrip(std::vector<uint8_t>(13, 'x'));
+  ExpectRoundTrip(std::vector<uint8_t>(100000, 'x'));
+
+  // Random data does not compress, and has literal runs longer than 255.
+  std::mt19937 rng(1);
+  std::vector<uint8_t> random(70000);
+  for (uint8_t& byte : random)
+    byte = rng();
+  ExpectRoundTrip(random);
+
+  // Repeated phrases with varying gaps, including offsets shorter than the
+  // match length.
+  std::vector<uint8_t> text;
+  const char kPhrases[][8] = { "abc", "leak", "detect", "ab" };
+  for (int i = 0; i < 20000; ++i) {
+    const char* phrase = kPhrases[rng() % 4];
+    text.insert(text.end(), phrase, phrase + strlen(phrase));
+    if (rng() % 8 == 0)
+      text.push_back(rng());
+  }
+  ExpectRoundTrip(text);
+}
+
+TEST(LZ4BlockTest, Compresses) {
+  std::vector<uint8_t> input;
+  for (int i = 0; i < 10000; ++i)
+    input.push_back(i % 7);
+  std::vector<uint8_t> compressed(lz4::CompressBound(input.size()));
+  size_t compressed_size = lz4::Compress(input.data(), input.size(),
+                                         compressed.data(), compressed.size());
+  EXPECT_GT(compressed_size, 0U);
+  EXPECT_LT(compressed_size, input.size() / 50);
+
+  // Not enough room.
+  EXPECT_EQ(0U, lz4::Compress(input.data(), input.size(),
+                              compressed.data(), compressed_size - 1));
+}
+
+TEST(LZ4BlockTest, RejectsMalformedInput) {
+  std::vector<uint8_t> input(1000);
+  for (size_t i = 0; i < input.size(); ++i)
+    input[i] = i % 13;
+  std::vector<uint8_t> compressed(lz4::CompressBound(input.size()));
+  size_t compressed_size = lz4::Compress(input.data(), input.size(),
+                                         compressed.data(), compressed.size());
+  compressed.resize(compressed_size);
+
+  std::vector<uint8_t> output(input.size());
+  // Wrong output size.
+  EXPECT_FALSE(lz4::Decompress(compressed.data(), compressed.size(),
+                               output.data(), output.size() - 1));
+  // Every truncation fails cleanly.
+  for (size_t size = 0; size < compressed.size(); ++size) {
+    EXPECT_FALSE(lz4::Decompress(compressed.data(), size,
+                                 output.data(), output.size()));
+  }
+  // Corrupting any byte never makes the decoder go out of bounds.
+  for (size_t i = 0; i < compressed.size(); ++i) {
+    std::vector<uint8_t> corrupt(compressed);
+    corrupt[i] ^= 0xff;
+    lz4::Decompress(corrupt.data(), corrupt.size(), output.data(),
+                    output.size());
+  }
+}
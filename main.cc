@@ -1,28 +1,21 @@
+#include <gperftools/custom_allocator.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <memory>
+#include <algorithm>
+#include <string>
+#include <thread>
 
-#include "base/logging.h"
 #include "hooks.h"
 #include "leak_detector.h"
-
-const uint32_t kAllocCode = 0xdeadbeef;
-const uint32_t kFreeCode = 0xcafebabe;
-
-struct AllocEntry {
-  uint32_t code;
-  const void* ptr;
-  uint32_t size;
-  uint32_t depth;
-  const void* const* stack;
-};
-
-struct FreeEntry {
-  uint32_t code;
-  const void* ptr;
-};
+#include "trace_reader.h"
 
 static bool DEBUG = getenv("DEBUG");
 
@@ -36,57 +29,203 @@ extern uint64_t default_chrome_size;
 using leak_detector::default_chrome_addr;
 using leak_detector::default_chrome_size;
 
+// Compressed traces are decompressed on worker threads, leaving one core for
+// replaying the events. TRACE_DECOMPRESSION_THREADS overrides the number of
+// workers, and 0 decompresses on the replay thread.
+static int NumDecompressionThreads() {
+  const char* value = getenv("TRACE_DECOMPRESSION_THREADS");
+  if (value)
+    return atoi(value);
+  int num_cpus = std::thread::hardware_concurrency();
+  return std::max(0, std::min(4, num_cpus - 1));
+}
+
+// Legacy traces do not say how the recorded process laid them out.
+// TRACE_LEGACY_POINTER_SIZE sets the size of their pointers, 4 or 8, and
+// TRACE_LEGACY_BIG_ENDIAN marks them as big-endian. Both default to the layout
+// of this process.
+static void SetLegacyFormat(TraceReader* reader) {
+  const char* pointer_size = getenv("TRACE_LEGACY_POINTER_SIZE");
+  reader->set_legacy_format(
+      pointer_size ? atoi(pointer_size) : sizeof(void*),
+      getenv("TRACE_LEGACY_BIG_ENDIAN") ? trace_format::kBigEndian
+                                        : trace_format::kHostByteOrder);
+}
+
+// Listen on the Unix domain socket at |path|, and return the first connection
+// to it, or -1 on failure.
+static int AcceptConnection(const char* path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("Socket path %s is too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      listen(listen_fd, 1) != 0) {
+    perror(path);
+    close(listen_fd);
+    return -1;
+  }
+  printf("Waiting for a trace on %s\n", path);
+  fflush(stdout);
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0)
+    perror("accept");
+  close(listen_fd);
+  unlink(path);
+  return fd;
+}
+
+// Open the trace given on the command line: "-" streams it from stdin, and
+// "unix:PATH" from the first process that connects to a socket at PATH, such
+// as trace_recorder. Anything else is a file.
+static bool OpenTrace(const char* name, TraceReader* reader) {
+  static const char kSocketPrefix[] = "unix:";
+  if (strcmp(name, "-") == 0)
+    return reader->OpenStream(STDIN_FILENO);
+  if (strncmp(name, kSocketPrefix, sizeof(kSocketPrefix) - 1) == 0) {
+    int fd = AcceptConnection(name + sizeof(kSocketPrefix) - 1);
+    return fd >= 0 && reader->OpenStream(fd);
+  }
+  return reader->Open(name, NumDecompressionThreads());
+}
+
+// If TRACE_PRINT_REPORTS is set, the suspected leaks of each leak check are
+// printed in a form that is easy to parse, one per line, with the position in
+// the trace where the check was done:
+//
+//   report event=EVENT time=NS size=SIZE stack=OFFSET,...
+//
+// |context| is the TraceReader.
+static void PrintReports(
+    const leak_detector::InternalVector<leak_detector::InternalLeakReport>&
+        reports,
+    void* context) {
+  const TraceReader* reader = static_cast<const TraceReader*>(context);
+  for (const auto& report : reports) {
+    printf("report event=%" PRIu64 " time=%" PRIu64 " size=%zu stack=",
+           reader->event_index(), reader->time(), report.alloc_size_bytes);
+    for (size_t i = 0; i < report.call_stack.size(); ++i)
+      printf("%s%" PRIxPTR, i ? "," : "", report.call_stack[i]);
+    printf("\n");
+  }
+}
+
+// Returns the sum of the peak memory usage of all leak detector arenas.
+static size_t PeakDetectorMemory() {
+  size_t peak = 0;
+  for (int i = 0; i < CustomAllocator::kNumArenas; ++i) {
+    CustomAllocator::Stats stats;
+    CustomAllocator::GetStats(static_cast<CustomAllocator::ArenaId>(i), &stats);
+    peak += stats.peak_bytes_in_use;
+  }
+  return peak;
+}
+
+// If TRACE_CHECKPOINT_INTERVAL is set, the leak detector state is saved every
+// that many events, to TRACE_CHECKPOINT_PREFIX.<event>.ckpt. The prefix
+// defaults to the trace file name. The replay can be resumed from any of those
+// checkpoints.
+static uint64_t CheckpointInterval() {
+  const char* value = getenv("TRACE_CHECKPOINT_INTERVAL");
+  return value ? strtoull(value, NULL, 10) : 0;
+}
+
+static std::string CheckpointPath(const char* trace_path, uint64_t position) {
+  const char* prefix = getenv("TRACE_CHECKPOINT_PREFIX");
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%" PRIu64 ".ckpt", position);
+  return std::string(prefix ? prefix : trace_path) + suffix;
+}
+
 int main(int argc, char* argv[]) {
   if (argc < 2) {
-    printf("Need to provide an input file:\n");
-    printf("  %s [FILE].\n", argv[0]);
+    printf("Need to provide an input file, \"-\" for stdin or unix:PATH for a "
+           "socket, and optionally a checkpoint to resume from:\n");
+    printf("  %s [FILE] [CHECKPOINT].\n", argv[0]);
     return 0;
   }
 
-  FILE* fp = fopen(argv[1], "rb");
-  CHECK(fp);
-  CHECK(!feof(fp));
-  CHECK_EQ(1, fread(&default_chrome_addr, sizeof(default_chrome_addr), 1, fp));
-  CHECK_EQ(1, fread(&default_chrome_size, sizeof(default_chrome_size), 1, fp));
+  TraceReader reader;
+  SetLegacyFormat(&reader);
+  if (!OpenTrace(argv[1], &reader)) {
+    printf("Could not read %s: %s\n", argv[1],
+           reader.error() ? reader.error() : "No connection");
+    return 1;
+  }
+  default_chrome_addr = reader.mapping_addr();
+  default_chrome_size = reader.mapping_size();
 
   leak_detector::Initialize();
 
-  while (!feof(fp)) {
-    union {
-      uint32_t code;
-      AllocEntry alloc;
-      FreeEntry free;
-    };
-    int entry_offset = ftell(fp);
-    fread(&code, sizeof(code), 1, fp);
-    if (code == kAllocCode) {
-      fread(&code + 1, sizeof(alloc) - sizeof(code) - sizeof(alloc.stack), 1, fp);
+  if (argc > 2) {
+    uint64_t position;
+    if (!leak_detector::LoadCheckpoint(argv[2], &position)) {
+      printf("Could not load checkpoint %s\n", argv[2]);
+      return 1;
+    }
+    if (!reader.SeekToEvent(position)) {
+      printf("Could not resume at event %" PRIu64 ": %s\n", position,
+             reader.error());
+      return 1;
+    }
+    printf("Resuming at event %" PRIu64 "\n", position);
+  }
+  const uint64_t checkpoint_interval = CheckpointInterval();
+  if (getenv("TRACE_PRINT_REPORTS"))
+    leak_detector::SetLeakCheckCallback(&PrintReports, &reader);
+
+  struct timespec start_time;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  uint64_t num_events = 0;
+  TraceReader::Event event;
+  while (reader.Next(&event)) {
+    ++num_events;
+    if (event.type == TraceReader::Event::kAlloc) {
       if (DEBUG) {
-        printf("%x: ALLOC %p\t%u\t%u\n", entry_offset, alloc.ptr, alloc.size,
-               alloc.depth);
+        printf("%zx: ALLOC %p\t%" PRIu64 "\t%u\n", event.offset, event.ptr,
+               event.size, event.depth);
       }
-      std::unique_ptr<void*[]> stack;
-      if (alloc.depth > 0) {
-        stack.reset(new void*[alloc.depth]);
-        fread(stack.get(), sizeof(void*), alloc.depth, fp);
-      }
-      MallocHook::SetCallerStackTrace(alloc.depth, stack.get());
-      if (alloc.ptr && alloc.size)
-        MallocHook::InvokeNewHook(alloc.ptr, alloc.size);
-    } else if (code == kFreeCode) {
-      if (DEBUG)
-        printf("%x: FREE %p\n", entry_offset, free.ptr);
-      fread(&code + 1, sizeof(free) - sizeof(code), 1, fp);
-      MallocHook::InvokeDeleteHook(free.ptr);
+      // The stack stays valid until the next call to Next(), so until the hook
+      // has been invoked.
+      MallocHook::SetCallerStackTrace(event.depth, event.stack);
+      if (event.ptr && event.size)
+        MallocHook::InvokeNewHook(event.ptr, event.size);
     } else {
-      printf("Unknown code at offset %lx, quitting: %x\n",
-             ftell(fp) - sizeof(code), code);
-      break;
+      if (DEBUG)
+        printf("%zx: FREE %p\n", event.offset, event.ptr);
+      MallocHook::InvokeDeleteHook(event.ptr);
     }
-  }
 
-  printf("Finished with %lu bytes read\n", ftell(fp));
-  fclose(fp);
+    if (checkpoint_interval &&
+        reader.event_index() % checkpoint_interval == 0) {
+      std::string path = CheckpointPath(argv[1], reader.event_index());
+      if (!leak_detector::SaveCheckpoint(path.c_str(), reader.event_index()))
+        printf("Could not save checkpoint %s\n", path.c_str());
+    }
+  }
+  if (reader.error())
+    printf("%s at offset %zx, quitting\n", reader.error(), reader.offset());
+
+  struct timespec end_time;
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  double seconds = (end_time.tv_sec - start_time.tv_sec) +
+                   (end_time.tv_nsec - start_time.tv_nsec) * 1e-9;
+  printf("Finished with %" PRIu64 " events (%zu bytes) in %.3f s, "
+         "%.0f events/s\n",
+         num_events, reader.offset(), seconds,
+         seconds > 0 ? num_events / seconds : 0);
+  if (leak_detector::IsInitialized())
+    printf("Peak leak detector memory: %zu bytes\n", PeakDetectorMemory());
 
   leak_detector::Shutdown();
 
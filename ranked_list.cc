@@ -7,6 +7,8 @@
 #include <algorithm>
 #include <utility>
 
+#include "checkpoint.h"
+
 namespace leak_detector {
 
 RankedList& RankedList::operator= (RankedList&& other) {
@@ -33,4 +35,26 @@ void RankedList::Add(const ValueType& value, int count) {
     entries_.resize(max_size_);
 }
 
+void RankedList::Save(CheckpointWriter* writer) const {
+  writer->WriteUint64(entries_.size());
+  for (const Entry& entry : entries_) {
+    writer->WriteValue(entry.value);
+    writer->WriteUint32(entry.count);
+  }
+}
+
+void RankedList::Load(CheckpointReader* reader) {
+  entries_.clear();
+  uint64_t num_entries = reader->ReadUint64();
+  if (num_entries > max_size_)
+    reader->Fail();
+  // Entries with equal counts are kept in the order they were added, so this
+  // restores the saved order.
+  for (uint64_t i = 0; i < num_entries && reader->ok(); ++i) {
+    ValueType value = reader->ReadValue();
+    int count = reader->ReadUint32();
+    Add(value, count);
+  }
+}
+
 }  // namespace leak_detector
@@ -20,6 +20,9 @@
 
 namespace leak_detector {
 
+class CheckpointReader;
+class CheckpointWriter;
+
 class RankedList {
  public:
   using ValueType = LeakDetectorValueType;
@@ -39,7 +42,9 @@ class RankedList {
   using EntryList = std::list<Entry, STL_Allocator<Entry, CustomAllocator>>;
   using const_iterator = EntryList::const_iterator;
 
-  explicit RankedList(size_t max_size) : max_size_(max_size) {}
+  explicit RankedList(size_t max_size)
+      : max_size_(max_size),
+        entries_(EntryList::allocator_type(CustomAllocator::kAnalysisArena)) {}
   RankedList& operator= (RankedList&& other);  // Support std::move().
   ~RankedList() {}
 
@@ -62,6 +67,11 @@ class RankedList {
   // with the same value.
   void Add(const ValueType& value, int count);
 
+  // Save the entries to |writer|, or replace them with those saved in
+  // |reader|.
+  void Save(CheckpointWriter* writer) const;
+  void Load(CheckpointReader* reader);
+
  private:
   // Max and min counts. Returns 0 if the list is empty.
   const int max_count() const {
@@ -75,7 +85,7 @@ class RankedList {
   size_t max_size_;
 
   // Points to the array of entries.
-  std::list<Entry, STL_Allocator<Entry, CustomAllocator>> entries_;
+  EntryList entries_;
 
   DISALLOW_COPY_AND_ASSIGN(RankedList);
 };
@@ -0,0 +1,71 @@
+#ifndef READER_EPOCH_H_
+#define READER_EPOCH_H_
+
+#include <sched.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "base/macros.h"
+
+namespace leak_detector {
+
+// Lets a writer that has replaced a shared pointer wait until no reader can
+// still be using the old object, so that it can be freed. Readers never wait,
+// so this can guard pointers that the allocation hooks read without a lock.
+//
+// Each reader counts itself in one of two counters, picked by the parity of
+// the current epoch. WaitForReaders() moves to the next epoch, so that new
+// readers use the other counter, and waits for the counter of the previous
+// epoch to drain. Readers that started before the pointer was replaced are
+// all in that counter, and those that start later see the new pointer.
+class ReaderEpoch {
+ public:
+  // Counts the current thread as a reader until destroyed.
+  class ScopedReader {
+   public:
+    explicit ScopedReader(ReaderEpoch* epoch) : epoch_(epoch) {
+      // Only retries if a writer moves to the next epoch meanwhile.
+      for (;;) {
+        uint64_t current = epoch_->epoch_.load();
+        index_ = current & 1;
+        epoch_->num_readers_[index_].fetch_add(1);
+        if (epoch_->epoch_.load() == current)
+          return;
+        epoch_->num_readers_[index_].fetch_sub(1);
+      }
+    }
+    ~ScopedReader() {
+      epoch_->num_readers_[index_].fetch_sub(1, std::memory_order_release);
+    }
+
+   private:
+    ReaderEpoch* const epoch_;
+    int index_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedReader);
+  };
+
+  ReaderEpoch() : epoch_(0) {
+    num_readers_[0] = 0;
+    num_readers_[1] = 0;
+  }
+
+  // Wait for all readers that may have read a pointer before it was replaced,
+  // which must be done before this call. Calls must be serialized.
+  void WaitForReaders() {
+    uint64_t previous = epoch_.fetch_add(1);
+    while (num_readers_[previous & 1].load())
+      sched_yield();
+  }
+
+ private:
+  std::atomic<uint64_t> epoch_;
+  std::atomic<uint32_t> num_readers_[2];
+
+  DISALLOW_COPY_AND_ASSIGN(ReaderEpoch);
+};
+
+}  // namespace leak_detector
+
+#endif  // READER_EPOCH_H_
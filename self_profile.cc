@@ -0,0 +1,98 @@
+#include "self_profile.h"
+
+#include <atomic>
+
+namespace leak_detector {
+
+namespace self_profile {
+
+__thread uint32_t t_countdown[kNumTimers];
+
+namespace {
+
+// Updated with relaxed atomics, since they are only read for reporting.
+struct AtomicHistogram {
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> total_ticks;
+  std::atomic<uint64_t> buckets[kNumBuckets];
+} g_histograms[kNumTimers];
+
+int BucketIndex(uint64_t ticks) {
+  if (!ticks)
+    return 0;
+  int index = 64 - __builtin_clzll(ticks);
+  return index < kNumBuckets ? index : kNumBuckets - 1;
+}
+
+}  // namespace
+
+uint64_t Histogram::Quantile(double fraction) const {
+  uint64_t target = static_cast<uint64_t>(fraction * count);
+  uint64_t total = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    total += buckets[i];
+    if (total > target)
+      return i ? (1ULL << i) - 1 : 0;
+  }
+  return 0;
+}
+
+void GetHistogram(Timer timer, Histogram* histogram) {
+  const AtomicHistogram& source = g_histograms[timer];
+  histogram->count = source.count.load(std::memory_order_relaxed);
+  histogram->total_ticks = source.total_ticks.load(std::memory_order_relaxed);
+  for (int i = 0; i < kNumBuckets; ++i)
+    histogram->buckets[i] = source.buckets[i].load(std::memory_order_relaxed);
+}
+
+const char* GetTimerName(Timer timer) {
+  switch (timer) {
+  case kNewHook:
+    return "new hook";
+  case kDeleteHook:
+    return "delete hook";
+  case kStackUnwind:
+    return "stack unwind";
+  case kRecordAlloc:
+    return "record alloc";
+  case kRecordFree:
+    return "record free";
+  case kGetCallStack:
+    return "get call stack";
+  case kLeakCheck:
+    return "leak check";
+  case kMergeShards:
+    return "merge shards";
+  case kDumpStats:
+    return "dump stats";
+  case kSizeAnalysis:
+    return "size analysis";
+  case kCallStackAnalysis:
+    return "call stack analysis";
+  default:
+    return "(none)";
+  }
+}
+
+void Reset() {
+  for (AtomicHistogram& histogram : g_histograms) {
+    histogram.count = 0;
+    histogram.total_ticks = 0;
+    for (std::atomic<uint64_t>& bucket : histogram.buckets)
+      bucket = 0;
+  }
+}
+
+void Record(Timer timer, int64_t ticks) {
+  if (ticks < 0)
+    ticks = 0;
+  AtomicHistogram* histogram = &g_histograms[timer];
+  histogram->count.fetch_add(1, std::memory_order_relaxed);
+  histogram->total_ticks.fetch_add(ticks, std::memory_order_relaxed);
+  histogram->buckets[BucketIndex(ticks)].fetch_add(1,
+                                                   std::memory_order_relaxed);
+}
+
+}  // namespace self_profile
+
+}  // namespace leak_detector
@@ -0,0 +1,105 @@
+#ifndef SELF_PROFILE_H_
+#define SELF_PROFILE_H_
+
+#include <stdint.h>
+
+#include "base/cycleclock.h"
+
+namespace leak_detector {
+
+// Timers by which the leak detector measures its own cost, in CycleClock
+// ticks. Each timer keeps a histogram with a bucket per power of two, shared by
+// all threads and all detector instances in the process.
+//
+// Timers on the allocation path only time one in every kSamplingInterval calls
+// on each thread, which keeps their overhead to a thread-local countdown on the
+// other calls. Their counts are thus a fraction of the number of calls. Timers
+// of the leak analysis time every call.
+namespace self_profile {
+
+// The timers before kLeakCheck are on the allocation path, and are sampled.
+enum Timer {
+  kNewHook,            // The whole allocation hook.
+  kDeleteHook,         // The whole free hook.
+  kStackUnwind,        // Getting the call stack of an allocation.
+  kRecordAlloc,        // Recording a sampled allocation.
+  kRecordFree,         // Recording a sampled free.
+  kGetCallStack,       // Interning a call stack.
+  kLeakCheck,          // A whole stats dump and leak check.
+  kMergeShards,        // Combining the counts of the shards.
+  kDumpStats,          // Logging the stats.
+  kSizeAnalysis,       // Analyzing the counts by size.
+  kCallStackAnalysis,  // Analyzing the counts by call stack.
+  kNumTimers,
+};
+
+const uint32_t kSamplingInterval = 64;
+
+// Bucket 0 counts the measurements of 0 ticks, and bucket i > 0 those from
+// 2^(i-1) up to 2^i - 1 ticks. The last bucket also counts anything longer.
+const int kNumBuckets = 48;
+
+struct Histogram {
+  uint64_t count;
+  uint64_t total_ticks;
+  uint64_t buckets[kNumBuckets];
+
+  // Return the upper bound of the bucket containing the |fraction| quantile,
+  // or 0 if there are no measurements.
+  uint64_t Quantile(double fraction) const;
+};
+
+// Get the current histogram of |timer|.
+void GetHistogram(Timer timer, Histogram* histogram);
+
+const char* GetTimerName(Timer timer);
+
+// Clear all histograms.
+void Reset();
+
+// Add a measurement of |ticks| to the histogram of |timer|.
+void Record(Timer timer, int64_t ticks);
+
+// The countdown of each timer on the current thread until its next timed
+// call. Only used by ScopedTimer.
+extern __thread uint32_t t_countdown[kNumTimers];
+
+// Whether the next call of |timer| on the current thread should be timed.
+inline bool ShouldTime(Timer timer) {
+  if (timer >= kLeakCheck)
+    return true;
+  if (t_countdown[timer]) {
+    --t_countdown[timer];
+    return false;
+  }
+  t_countdown[timer] = kSamplingInterval - 1;
+  return true;
+}
+
+// Records the time between its construction and destruction to a timer, for
+// the calls that the timer samples.
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(Timer timer)
+      : timer_(timer),
+        timed_(ShouldTime(timer)),
+        start_(timed_ ? CycleClock::Now() : 0) {}
+  ~ScopedTimer() {
+    if (timed_)
+      Record(timer_, CycleClock::Now() - start_);
+  }
+
+ private:
+  const Timer timer_;
+  const bool timed_;
+  const int64_t start_;
+
+  ScopedTimer(const ScopedTimer&) = delete;
+  void operator=(const ScopedTimer&) = delete;
+};
+
+}  // namespace self_profile
+
+}  // namespace leak_detector
+
+#endif  // SELF_PROFILE_H_
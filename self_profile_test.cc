@@ -0,0 +1,56 @@
+#include "self_profile.h"
+
+#include <stdint.h>
+
+#include "gtest/gtest.h"
+
+namespace leak_detector {
+
+namespace self_profile {
+
+TEST(SelfProfileTest, SampledTimers) {
+  Reset();
+  const uint32_t kNumCalls = 10 * kSamplingInterval;
+  for (uint32_t i = 0; i < kNumCalls; ++i) {
+    ScopedTimer timer(kRecordAlloc);
+  }
+  for (uint32_t i = 0; i < 10; ++i) {
+    ScopedTimer timer(kSizeAnalysis);
+  }
+
+  Histogram histogram;
+  GetHistogram(kRecordAlloc, &histogram);
+  EXPECT_EQ(kNumCalls / kSamplingInterval, histogram.count);
+  GetHistogram(kSizeAnalysis, &histogram);
+  EXPECT_EQ(10U, histogram.count);
+  GetHistogram(kRecordFree, &histogram);
+  EXPECT_EQ(0U, histogram.count);
+}
+
+TEST(SelfProfileTest, Histogram) {
+  Reset();
+  for (int i = 0; i < 98; ++i)
+    Record(kLeakCheck, 100);
+  Record(kLeakCheck, 0);
+  Record(kLeakCheck, 1 << 20);
+
+  Histogram histogram;
+  GetHistogram(kLeakCheck, &histogram);
+  EXPECT_EQ(100U, histogram.count);
+  EXPECT_EQ(98U * 100 + (1 << 20), histogram.total_ticks);
+  EXPECT_EQ(1U, histogram.buckets[0]);
+  EXPECT_EQ(98U, histogram.buckets[7]);
+  EXPECT_EQ(1U, histogram.buckets[21]);
+  EXPECT_EQ(0U, histogram.Quantile(0));
+  EXPECT_EQ(127U, histogram.Quantile(0.5));
+  EXPECT_EQ((1U << 21) - 1, histogram.Quantile(0.995));
+
+  Reset();
+  GetHistogram(kLeakCheck, &histogram);
+  EXPECT_EQ(0U, histogram.count);
+  EXPECT_EQ(0U, histogram.Quantile(0.5));
+}
+
+}  // namespace self_profile
+
+}  // namespace leak_detector
@@ -0,0 +1,264 @@
+#include "sharded_leak_detector.h"
+
+#include <gperftools/custom_allocator.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#include "checkpoint.h"
+#include "self_profile.h"
+
+namespace leak_detector {
+
+namespace {
+
+// Number of events that are handed to a shard's worker at a time.
+const size_t kBatchSize = 1024;
+
+// Number of batches per shard. Once they are all waiting to be recorded, the
+// caller waits for the shard's worker.
+const uint64_t kNumBatches = 8;
+
+struct Event {
+  const void* ptr;
+  size_t size;
+  const CallStack* call_stack;
+  bool is_alloc;
+};
+
+struct Batch {
+  Event events[kBatchSize];
+  size_t size;
+};
+
+}  // namespace
+
+class ShardedLeakDetector::Shard {
+ public:
+  Shard(uintptr_t mapping_addr,
+        size_t mapping_size,
+        int size_suspicion_threshold,
+        int call_stack_suspicion_threshold,
+        bool verbose)
+      : detector_(mapping_addr,
+                  mapping_size,
+                  size_suspicion_threshold,
+                  call_stack_suspicion_threshold,
+                  verbose),
+        num_submitted_(0),
+        num_recorded_(0),
+        stopping_(false) {
+    batch_ = &batches_[0];
+    batch_->size = 0;
+    thread_ = std::thread(&Shard::WorkerLoop, this);
+  }
+
+  ~Shard() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  LeakDetectorImpl* detector() {
+    return &detector_;
+  }
+
+  void Add(const Event& event) {
+    batch_->events[batch_->size++] = event;
+    if (batch_->size == kBatchSize)
+      Submit();
+  }
+
+  // Wait until all events added so far have been recorded. The worker does not
+  // touch |detector_| until more events are added.
+  void Wait() {
+    if (batch_->size)
+      Submit();
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return num_recorded_ == num_submitted_; });
+  }
+
+ private:
+  // Hand the current batch to the worker, and start the next one.
+  void Submit() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++num_submitted_;
+    cv_.notify_all();
+    cv_.wait(lock,
+             [this] { return num_submitted_ - num_recorded_ < kNumBatches; });
+    batch_ = &batches_[num_submitted_ % kNumBatches];
+    batch_->size = 0;
+  }
+
+  void WorkerLoop() {
+    for (;;) {
+      Batch* batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] {
+          return stopping_ || num_recorded_ < num_submitted_;
+        });
+        if (stopping_)
+          return;
+        batch = &batches_[num_recorded_ % kNumBatches];
+      }
+
+      for (size_t i = 0; i < batch->size; ++i) {
+        const Event& event = batch->events[i];
+        if (event.is_alloc) {
+          detector_.RecordAllocWithCallStack(event.ptr, event.size,
+                                             event.call_stack);
+        } else {
+          detector_.RecordFree(event.ptr);
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++num_recorded_;
+      }
+      cv_.notify_all();
+    }
+  }
+
+  LeakDetectorImpl detector_;
+
+  Batch batches_[kNumBatches];
+  Batch* batch_;  // The batch being filled.
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  uint64_t num_submitted_;
+  uint64_t num_recorded_;
+  bool stopping_;
+
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(Shard);
+};
+
+ShardedLeakDetector::ShardedLeakDetector(int num_shards,
+                                         uintptr_t mapping_addr,
+                                         size_t mapping_size,
+                                         int size_suspicion_threshold,
+                                         int call_stack_suspicion_threshold,
+                                         bool verbose)
+    : front_(mapping_addr,
+             mapping_size,
+             size_suspicion_threshold,
+             call_stack_suspicion_threshold,
+             verbose),
+      shards_(nullptr),
+      num_shards_(num_shards > 0 ? num_shards : 0) {
+  if (!num_shards_)
+    return;
+  shards_ = static_cast<Shard**>(
+      CustomAllocator::Allocate(sizeof(*shards_) * num_shards_));
+  for (int i = 0; i < num_shards_; ++i) {
+    shards_[i] = new(CustomAllocator::Allocate(sizeof(Shard))) Shard(
+        mapping_addr, mapping_size, size_suspicion_threshold,
+        call_stack_suspicion_threshold, verbose);
+  }
+}
+
+ShardedLeakDetector::~ShardedLeakDetector() {
+  for (int i = 0; i < num_shards_; ++i) {
+    shards_[i]->~Shard();
+    CustomAllocator::Free(shards_[i], sizeof(Shard));
+  }
+  if (shards_)
+    CustomAllocator::Free(shards_, sizeof(*shards_) * num_shards_);
+}
+
+void ShardedLeakDetector::RecordAlloc(const void* ptr,
+                                      size_t size,
+                                      int stack_depth,
+                                      const void* const call_stack[]) {
+  if (!num_shards_) {
+    front_.RecordAlloc(ptr, size, stack_depth, call_stack);
+    return;
+  }
+
+  // The call stacks are created here rather than by the shards, so that there
+  // is a single CallStack object for each call stack.
+  Event event = { ptr, size, nullptr, true };
+  if (stack_depth > 0 && front_.ShouldGetStackTraceForSize(size))
+    event.call_stack = front_.GetCallStack(stack_depth, call_stack);
+  GetShard(ptr)->Add(event);
+}
+
+void ShardedLeakDetector::RecordFree(const void* ptr) {
+  if (!num_shards_) {
+    front_.RecordFree(ptr);
+    return;
+  }
+  Event event = { ptr, 0, nullptr, false };
+  GetShard(ptr)->Add(event);
+}
+
+void ShardedLeakDetector::TestForLeaks(
+    bool do_logging,
+    InternalVector<InternalLeakReport>* reports) {
+  if (num_shards_) {
+    self_profile::ScopedTimer timer(self_profile::kMergeShards);
+    LeakDetectorImpl* detectors[num_shards_];
+    for (int i = 0; i < num_shards_; ++i) {
+      shards_[i]->Wait();
+      detectors[i] = shards_[i]->detector();
+    }
+    front_.MergeCounts(detectors, num_shards_);
+  }
+
+  front_.TestForLeaks(do_logging, reports);
+
+  // Sizes that became suspects are recorded with call stacks from now on.
+  for (int i = 0; i < num_shards_; ++i)
+    shards_[i]->detector()->AddStackTables(front_);
+}
+
+void ShardedLeakDetector::AddStackTables(
+    const InternalVector<uint32_t>& sizes) {
+  front_.AddStackTables(sizes);
+  for (int i = 0; i < num_shards_; ++i) {
+    shards_[i]->Wait();
+    shards_[i]->detector()->AddStackTables(front_);
+  }
+}
+
+void ShardedLeakDetector::Save(CheckpointWriter* writer) {
+  writer->WriteUint32(num_shards_);
+  // The front instance owns the call stacks, so it goes first.
+  front_.Save(writer);
+  for (int i = 0; i < num_shards_; ++i) {
+    shards_[i]->Wait();
+    shards_[i]->detector()->Save(writer);
+  }
+}
+
+bool ShardedLeakDetector::Load(CheckpointReader* reader) {
+  if (reader->ReadUint32() != static_cast<uint32_t>(num_shards_))
+    return false;
+  if (!front_.Load(reader))
+    return false;
+  for (int i = 0; i < num_shards_; ++i) {
+    if (!shards_[i]->detector()->Load(reader))
+      return false;
+  }
+  return true;
+}
+
+ShardedLeakDetector::Shard* ShardedLeakDetector::GetShard(
+    const void* ptr) const {
+  // Allocations are aligned, so the low bits carry no information. The
+  // multiplier is the golden ratio, as in Fibonacci hashing.
+  const uint64_t kMultiplier = 0x9e3779b97f4a7c15ULL;
+  uint64_t hash = (reinterpret_cast<uint64_t>(ptr) >> 4) * kMultiplier;
+  return shards_[(hash >> 32) % num_shards_];
+}
+
+}  // namespace leak_detector
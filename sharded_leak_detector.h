@@ -0,0 +1,82 @@
+#ifndef SHARDED_LEAK_DETECTOR_H_
+#define SHARDED_LEAK_DETECTOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base/macros.h"
+#include "leak_detector_impl.h"
+
+namespace leak_detector {
+
+// Has the same interface as LeakDetectorImpl, but splits the allocations by
+// address across several LeakDetectorImpl shards. Each shard records the allocs
+// and frees of its addresses on its own worker thread, so that the caller only
+// has to sample them and look up call stacks. The frees of an address always go
+// to the shard that recorded its alloc.
+//
+// TestForLeaks() waits for the shards to catch up, and analyzes their combined
+// counts, so the results are the same as those of a single LeakDetectorImpl
+// that recorded all the allocations.
+//
+// With zero shards, all calls go directly to a single LeakDetectorImpl.
+//
+// Like LeakDetectorImpl, this class is not thread-safe, so calls to it must be
+// serialized.
+class ShardedLeakDetector {
+ public:
+  ShardedLeakDetector(int num_shards,
+                      uintptr_t mapping_addr,
+                      size_t mapping_size,
+                      int size_suspicion_threshold,
+                      int call_stack_suspicion_threshold,
+                      bool verbose);
+  ~ShardedLeakDetector();
+
+  bool ShouldGetStackTraceForSize(size_t size) const {
+    return front_.ShouldGetStackTraceForSize(size);
+  }
+
+  void RecordAlloc(const void* ptr,
+                   size_t size,
+                   int stack_depth,
+                   const void* const call_stack[]);
+  void RecordFree(const void* ptr);
+
+  void TestForLeaks(bool do_logging,
+                    InternalVector<InternalLeakReport>* reports);
+
+  // Write a summary of the counts as of the last TestForLeaks(), or create
+  // stack tables for |sizes| in all instances. See LeakDetectorImpl.
+  void WriteSummary(InternalVector<uint8_t>* summary) const {
+    front_.WriteSummary(summary);
+  }
+  void AddStackTables(const InternalVector<uint32_t>& sizes);
+
+  // Save the state of the front instance and of all shards to |writer|, or
+  // restore it from |reader|, which must hold a checkpoint of an instance with
+  // the same number of shards. See LeakDetectorImpl::Load().
+  void Save(CheckpointWriter* writer);
+  bool Load(CheckpointReader* reader);
+
+  int num_shards() const {
+    return num_shards_;
+  }
+
+ private:
+  class Shard;
+
+  Shard* GetShard(const void* ptr) const;
+
+  // Runs the leak analysis, and creates the call stacks that the shards record.
+  LeakDetectorImpl front_;
+
+  Shard** shards_;
+  int num_shards_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShardedLeakDetector);
+};
+
+}  // namespace leak_detector
+
+#endif  // SHARDED_LEAK_DETECTOR_H_
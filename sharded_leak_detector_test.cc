@@ -0,0 +1,46 @@
+#include "sharded_leak_detector.h"
+
+#include "gtest/gtest.h"
+#include "test_workload.h"
+
+namespace leak_detector {
+
+namespace {
+
+const int kSizeSuspicionThreshold = 4;
+const int kCallStackSuspicionThreshold = 4;
+
+}  // namespace
+
+class ShardedLeakDetectorTest : public ::testing::Test {
+ public:
+  ShardedLeakDetectorTest() {}
+
+  void SetUp() override {
+    CustomAllocator::InitializeForUnitTest();
+  }
+
+  void TearDown() override {
+    CustomAllocator::Shutdown();
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ShardedLeakDetectorTest);
+};
+
+TEST_F(ShardedLeakDetectorTest, SameReportsAsSingleDetector) {
+  for (int num_shards = 0; num_shards <= 3; ++num_shards) {
+    LeakDetectorImpl reference(kTestMappingAddr, kTestMappingSize,
+                               kSizeSuspicionThreshold,
+                               kCallStackSuspicionThreshold, false);
+    ShardedLeakDetector sharded(num_shards, kTestMappingAddr, kTestMappingSize,
+                                kSizeSuspicionThreshold,
+                                kCallStackSuspicionThreshold, false);
+    EXPECT_EQ(num_shards, sharded.num_shards());
+
+    TestWorkload workload(num_shards);
+    EXPECT_GT(workload.RunRounds(40, &reference, &sharded), 0U);
+  }
+}
+
+}  // namespace leak_detector
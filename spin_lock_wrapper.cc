@@ -4,14 +4,25 @@
 
 #include <gperftools/spin_lock_wrapper.h>
 
-SpinLockWrapper::SpinLockWrapper() {
+#include <gperftools/custom_allocator.h>
+
+#include <new>
+
+#include "base/spinlock.h"
+
+SpinLockWrapper::SpinLockWrapper()
+    : lock_(new(CustomAllocator::Allocate(sizeof(SpinLock))) SpinLock) {
 }
 
 SpinLockWrapper::~SpinLockWrapper() {
+  lock_->~SpinLock();
+  CustomAllocator::Free(lock_, sizeof(SpinLock));
 }
 
 void SpinLockWrapper::Lock() {
+  lock_->Lock();
 }
 
 void SpinLockWrapper::Unlock() {
+  lock_->Unlock();
 }
@@ -9,52 +9,85 @@
 
 #include <limits>
 #include <memory>
+#include <type_traits>
 
 #include "base/logging.h"
 
 // Generic allocator class for STL objects.
 // deallocate() to use the template class Alloc's allocation.
 // that uses a given type-less allocator Alloc, which must provide:
-//   static void* Alloc::Allocate(size_t size);
-//   static void Alloc::Free(void* ptr, size_t size);
+//   enum Alloc::ArenaId, including Alloc::kDefaultArena;
+//   static void* Alloc::Allocate(size_t size, Alloc::ArenaId arena);
+//   static void Alloc::Free(void* ptr, size_t size, Alloc::ArenaId arena);
 //
 // Inherits from the default allocator, std::allocator. Overrides allocate() and
 //
 // STL_Allocator<T, MyAlloc> provides the same thread-safety
 // guarantees as MyAlloc.
 //
+// Each STL_Allocator instance is bound to an arena, which is passed along to
+// Alloc. Allocators bound to different arenas compare unequal, and containers
+// carry their allocator (and thus their arena) along when they are assigned,
+// moved or swapped.
+//
 // Usage example:
 //   set<T, less<T>, STL_Allocator<T, MyAlloc> > my_set;
+//   set<T, less<T>, STL_Allocator<T, MyAlloc> > my_arena_set(
+//       less<T>(), STL_Allocator<T, MyAlloc>(MyAlloc::kMyArena));
 
 template <typename T, class Alloc>
 class STL_Allocator : public std::allocator<T> {
  public:
   typedef size_t     size_type;
   typedef T*         pointer;
+  typedef typename Alloc::ArenaId ArenaId;
+
+  typedef std::true_type  propagate_on_container_copy_assignment;
+  typedef std::true_type  propagate_on_container_move_assignment;
+  typedef std::true_type  propagate_on_container_swap;
+  typedef std::false_type is_always_equal;
 
   template <class T1> struct rebind {
     typedef STL_Allocator<T1, Alloc> other;
   };
 
-  STL_Allocator() {}
-  explicit STL_Allocator(const STL_Allocator&) {}
-  template <class T1> STL_Allocator(const STL_Allocator<T1, Alloc>&) {}
+  STL_Allocator() : arena_(Alloc::kDefaultArena) {}
+  explicit STL_Allocator(ArenaId arena) : arena_(arena) {}
+  STL_Allocator(const STL_Allocator& other) : arena_(other.arena_) {}
+  template <class T1> STL_Allocator(const STL_Allocator<T1, Alloc>& other)
+      : arena_(other.arena()) {}
   ~STL_Allocator() {}
 
   pointer allocate(size_type n, const void* = 0) {
     // Make sure the computation of the total allocation size does not cause an
     // integer overflow.
     RAW_CHECK(n < max_size());
-    return static_cast<T*>(Alloc::Allocate(n * sizeof(T)));
+    return static_cast<T*>(Alloc::Allocate(n * sizeof(T), arena_));
   }
 
   void deallocate(pointer p, size_type n) {
-    Alloc::Free(p, n * sizeof(T));
+    Alloc::Free(p, n * sizeof(T), arena_);
   }
 
   size_type max_size() const {
     return std::numeric_limits<size_t>::max() / sizeof(T);
   }
+
+  ArenaId arena() const {
+    return arena_;
+  }
+
+  template <class T1>
+  bool operator== (const STL_Allocator<T1, Alloc>& other) const {
+    return arena_ == other.arena();
+  }
+  template <class T1>
+  bool operator!= (const STL_Allocator<T1, Alloc>& other) const {
+    return arena_ != other.arena();
+  }
+
+ private:
+  ArenaId arena_;
 };
 
 #endif  // COMPONENTS_METRICS_LEAK_DETECTOR_STL_ALLOCATOR_H_
@@ -0,0 +1,129 @@
+#ifndef TEST_WORKLOAD_H_
+#define TEST_WORKLOAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <random>
+#include <vector>
+
+#include "base/macros.h"
+#include "gtest/gtest.h"
+#include "leak_detector_impl.h"
+
+// Allocations shared by the tests of the detector classes, which all have the
+// same RecordAlloc(), RecordFree() and TestForLeaks() methods.
+
+namespace leak_detector {
+
+// The mapping that contains the call stacks of TestWorkload.
+const uintptr_t kTestMappingAddr = 0x800000;
+const size_t kTestMappingSize = 0x200000;
+
+// Allocations of several sizes from several call stacks, most of which are
+// freed again. Those of one size from two of the call stacks are leaked.
+// Consecutive calls carry on with the same allocations, so that detectors can
+// be added along the way.
+class TestWorkload {
+ public:
+  static const int kNumStacks = 8;
+  static const int kStackDepth = 4;
+  static const int kAllocsPerRound = 2000;
+
+  explicit TestWorkload(uint32_t seed) : rng_(seed), next_ptr_(0x10000000) {
+    for (int i = 0; i < kNumStacks; ++i) {
+      for (int j = 0; j < kStackDepth; ++j)
+        stacks_[i][j] = reinterpret_cast<const void*>(
+            kTestMappingAddr + i * 0x1000 + j * 0x10);
+    }
+  }
+
+  const void* const* stack(int index) const { return stacks_[index]; }
+
+  // Feed the next |num_allocs| allocations to all of |detectors|.
+  template <typename... Detectors>
+  void Run(int num_allocs, Detectors*... detectors) {
+    for (int i = 0; i < num_allocs; ++i) {
+      const size_t size = 16 * (1 + rng_() % 8);
+      const int stack = rng_() % kNumStacks;
+      const void* ptr = reinterpret_cast<const void*>(next_ptr_);
+      next_ptr_ += size;
+      RecordAlloc(ptr, size, stacks_[stack], detectors...);
+      if (size == 48 && stack < 2)
+        continue;
+      live_.push_back(reinterpret_cast<uintptr_t>(ptr));
+      if (live_.size() > 100) {
+        size_t index = rng_() % live_.size();
+        RecordFree(reinterpret_cast<const void*>(live_[index]), detectors...);
+        live_[index] = live_.back();
+        live_.pop_back();
+      }
+    }
+  }
+
+  // Run |num_rounds| rounds of allocations and check that all of |detectors|
+  // report the same leaks after each of them. Returns the number of reports.
+  template <typename... Detectors>
+  size_t RunRounds(int num_rounds, Detectors*... detectors) {
+    size_t num_reports = 0;
+    for (int round = 0; round < num_rounds; ++round) {
+      Run(kAllocsPerRound, detectors...);
+      num_reports += ExpectSameReports(detectors...);
+    }
+    return num_reports;
+  }
+
+  // Check that all of |others| report the same leaks as |reference|. Returns
+  // the number of reports of |reference|.
+  template <typename Reference, typename... Detectors>
+  static size_t ExpectSameReports(Reference* reference, Detectors*... others) {
+    InternalVector<InternalLeakReport> reports;
+    reference->TestForLeaks(false, &reports);
+    ExpectReports(reports, others...);
+    return reports.size();
+  }
+
+ private:
+  template <typename Detector, typename... Detectors>
+  void RecordAlloc(const void* ptr, size_t size, const void* const* stack,
+                   Detector* detector, Detectors*... detectors) {
+    detector->RecordAlloc(ptr, size, kStackDepth, stack);
+    RecordAlloc(ptr, size, stack, detectors...);
+  }
+  void RecordAlloc(const void* /* ptr */, size_t /* size */,
+                   const void* const* /* stack */) {}
+
+  template <typename Detector, typename... Detectors>
+  void RecordFree(const void* ptr, Detector* detector,
+                  Detectors*... detectors) {
+    detector->RecordFree(ptr);
+    RecordFree(ptr, detectors...);
+  }
+  void RecordFree(const void* /* ptr */) {}
+
+  template <typename Detector, typename... Detectors>
+  static void ExpectReports(const InternalVector<InternalLeakReport>& expected,
+                            Detector* detector, Detectors*... detectors) {
+    InternalVector<InternalLeakReport> reports;
+    detector->TestForLeaks(false, &reports);
+    EXPECT_EQ(expected.size(), reports.size());
+    for (size_t i = 0; i < expected.size() && i < reports.size(); ++i) {
+      EXPECT_EQ(expected[i].alloc_size_bytes, reports[i].alloc_size_bytes);
+      EXPECT_TRUE(expected[i].call_stack == reports[i].call_stack);
+    }
+    ExpectReports(expected, detectors...);
+  }
+  static void ExpectReports(
+      const InternalVector<InternalLeakReport>& /* expected */) {}
+
+  std::mt19937 rng_;
+  uintptr_t next_ptr_;
+  std::vector<uintptr_t> live_;
+  const void* stacks_[kNumStacks][kStackDepth];
+
+  DISALLOW_COPY_AND_ASSIGN(TestWorkload);
+};
+
+}  // namespace leak_detector
+
+#endif  // TEST_WORKLOAD_H_
@@ -0,0 +1,20 @@
+#ifndef TOOL_OPTIONS_H_
+#define TOOL_OPTIONS_H_
+
+#include <string.h>
+
+// Command line parsing shared by the tools, whose options all have the form
+// "--name=value".
+
+// Parse "--name=value" into |*value| if |arg| is that option.
+inline bool MatchOption(const char* arg, const char* name, const char** value) {
+  size_t length = strlen(name);
+  if (strncmp(arg, "--", 2) != 0 || strncmp(arg + 2, name, length) != 0 ||
+      arg[2 + length] != '=') {
+    return false;
+  }
+  *value = arg + 3 + length;
+  return true;
+}
+
+#endif  // TOOL_OPTIONS_H_
@@ -0,0 +1,88 @@
+// Converts an allocation trace in any format that TraceReader supports to the
+// compact version 3 format described in trace_format.h.
+//
+// Usage: trace_convert [--no-compression] [--legacy-pointer-size=N]
+//                      [--legacy-big-endian] INPUT OUTPUT
+//
+// Legacy traces do not say how they were laid out by the recorded process, so
+// that is given by --legacy-pointer-size, 4 or 8, and --legacy-big-endian. They
+// default to the layout of this process. The pointer size, clock and modules of
+// other traces are carried over to the output.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace_reader.h"
+#include "trace_writer.h"
+
+int main(int argc, char* argv[]) {
+  const char* program = argv[0];
+  bool compression = true;
+  int legacy_pointer_size = sizeof(void*);
+  trace_format::ByteOrder legacy_byte_order = trace_format::kHostByteOrder;
+  const char kPointerSizeFlag[] = "--legacy-pointer-size=";
+  const size_t kPointerSizeFlagLength = sizeof(kPointerSizeFlag) - 1;
+  for (; argc > 1 && strncmp(argv[1], "--", 2) == 0; --argc, ++argv) {
+    if (strcmp(argv[1], "--no-compression") == 0) {
+      compression = false;
+    } else if (strncmp(argv[1], kPointerSizeFlag, kPointerSizeFlagLength) == 0) {
+      legacy_pointer_size = atoi(argv[1] + kPointerSizeFlagLength);
+    } else if (strcmp(argv[1], "--legacy-big-endian") == 0) {
+      legacy_byte_order = trace_format::kBigEndian;
+    } else {
+      break;
+    }
+  }
+  if (argc < 3) {
+    printf("Usage: %s [--no-compression] [--legacy-pointer-size=N] "
+           "[--legacy-big-endian] INPUT OUTPUT\n",
+           program);
+    return 1;
+  }
+
+  TraceReader reader;
+  reader.set_legacy_format(legacy_pointer_size, legacy_byte_order);
+  if (!reader.Open(argv[1])) {
+    printf("Could not read %s: %s\n", argv[1], reader.error());
+    return 1;
+  }
+  TraceWriter writer;
+  writer.set_pointer_size(reader.pointer_size());
+  writer.set_clock(reader.clock());
+  for (const TraceReader::Module& module : reader.modules())
+    writer.AddModule(module.addr, module.size, module.name);
+  if (!writer.Open(argv[2], reader.mapping_addr(), reader.mapping_size())) {
+    printf("Could not create %s\n", argv[2]);
+    return 1;
+  }
+  writer.set_compression(compression);
+
+  TraceReader::Event event;
+  while (reader.Next(&event)) {
+    writer.set_time(reader.time());
+    if (event.type == TraceReader::Event::kAlloc)
+      writer.WriteAlloc(event.ptr, event.size, event.depth, event.stack);
+    else
+      writer.WriteFree(event.ptr);
+  }
+  if (reader.error()) {
+    printf("%s at offset %zx in %s\n", reader.error(), reader.offset(),
+           argv[1]);
+    return 1;
+  }
+  if (!writer.Close()) {
+    printf("Could not write %s\n", argv[2]);
+    return 1;
+  }
+
+  FILE* fp = fopen(argv[2], "rb");
+  fseek(fp, 0, SEEK_END);
+  long output_size = ftell(fp);
+  fclose(fp);
+  printf("Converted %" PRIu64 " events with %" PRIu64 " unique call stacks: "
+         "%zu -> %ld bytes\n",
+         writer.num_events(), writer.num_stacks(), reader.size(), output_size);
+  return 0;
+}
@@ -0,0 +1,187 @@
+#ifndef TRACE_FORMAT_H_
+#define TRACE_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Layout of version 2 and 3 allocation traces, shared by TraceReader and
+// TraceWriter.
+//
+// The file starts with a FileHeader, followed by a table of the modules that
+// were loaded in the recorded process, followed by blocks. Each block is a
+// BlockHeader followed by |payload_size| bytes of records. Blocks can be
+// decoded independently of each other: pointer deltas start over at the
+// beginning of each block, and every call stack that is used in a block is
+// defined in that block before it is used.
+//
+// A block's payload may be compressed as a whole, as given by its header.
+//
+// The last block of a complete trace is an index of the blocks before it, by
+// which readers can seek to an event by its index or time. It has no events,
+// so it is skipped by readers that go through the blocks in order. Its payload
+// is an array of IndexEntry, one per block, followed by an IndexTrailer, which
+// ends the file. A trace without an index, e.g. because
+// the writer did not finish, can still be read block by block.
+//
+// Records start with a one-byte tag:
+//   kStackRecord: varint id, varint depth, then |depth| frames. Each frame is
+//                 the zigzag varint delta from the previous frame, the first
+//                 from zero. The id is unique within the trace.
+//   kAllocRecord: zigzag varint delta of the pointer from the previous
+//                 pointer in the block, varint size, varint stack id.
+//   kFreeRecord:  zigzag varint delta of the pointer.
+//
+// The structs below are written in the byte order of the writer, which readers
+// detect from FileHeader::version. Records are made of bytes and varints, so
+// they are the same in either byte order. Pointers and frames have the width
+// of the recorded process, and deltas between them wrap around at that width.
+//
+// Version 2 traces are little-endian, come from 64-bit processes, and have no
+// module table.
+namespace trace_format {
+
+const char kMagic[8] = { 'L', 'D', 'T', 'R', 'A', 'C', 'E', '\0' };
+const uint32_t kVersion = 3;
+const uint32_t kMinVersion = 2;
+
+enum ByteOrder {
+  kLittleEndian = 1,
+  kBigEndian = 2,
+};
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+const ByteOrder kHostByteOrder = kBigEndian;
+#else
+const ByteOrder kHostByteOrder = kLittleEndian;
+#endif
+
+// What the event times are measured with.
+enum ClockSource {
+  kUnknownClock = 0,
+  kRealtimeClock = 1,   // CLOCK_REALTIME, in nanoseconds since the epoch.
+  kMonotonicClock = 2,  // CLOCK_MONOTONIC, in nanoseconds.
+  kSyntheticClock = 3,  // Made up, e.g. by trace_generator.
+};
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;  // Offset of the first block.
+  // The module that leaks are reported in.
+  uint64_t mapping_addr;
+  uint64_t mapping_size;
+
+  // Version 3 and later.
+  uint8_t byte_order;    // ByteOrder of the writer.
+  uint8_t pointer_size;  // Size of pointers in the recorded process, 4 or 8.
+  uint16_t clock;        // ClockSource of the event times.
+  uint32_t num_modules;  // Number of ModuleEntry structs after the header.
+};
+
+// Size of a version 2 FileHeader.
+const size_t kVersion2HeaderSize = 32;
+
+// A module loaded in the recorded process. Followed by the |name_size| bytes
+// of its name, e.g. the path of a shared library, padded with zeros to a
+// multiple of 8 bytes.
+struct ModuleEntry {
+  uint64_t addr;
+  uint64_t size;
+  uint32_t name_size;
+  uint32_t reserved;
+};
+
+enum Compression {
+  kNoCompression = 0,
+  kLZ4Compression = 1,  // LZ4 block format, see lz4_block.h.
+};
+
+struct BlockHeader {
+  uint32_t payload_size;  // Size of the payload as stored.
+  uint32_t raw_size;      // Size of the payload once uncompressed.
+  uint32_t compression;
+  uint32_t num_events;
+  uint64_t first_event_index;
+  // Time of the first event in nanoseconds, as set by the writer, or 0 if
+  // unknown.
+  uint64_t first_event_time;
+};
+
+const char kIndexMagic[8] = { 'L', 'D', 'I', 'N', 'D', 'E', 'X', '\0' };
+
+struct IndexEntry {
+  uint64_t offset;  // Offset of the block header in the file.
+  uint64_t first_event_index;
+  uint64_t first_event_time;
+};
+
+struct IndexTrailer {
+  uint64_t index_offset;  // Offset of the index block's header.
+  char magic[8];
+};
+
+enum RecordTag {
+  kStackRecord = 1,
+  kAllocRecord = 2,
+  kFreeRecord = 3,
+};
+
+// Blocks are closed once their payload reaches this size.
+const size_t kTargetBlockSize = 64 << 10;
+
+// Readers reject blocks that are larger than this once uncompressed.
+const size_t kMaxBlockSize = 64 << 20;
+
+// Call stack ids must be below this.
+const uint32_t kMaxStackId = 1 << 24;
+
+inline uint16_t ByteSwap(uint16_t value) {
+  return __builtin_bswap16(value);
+}
+inline uint32_t ByteSwap(uint32_t value) {
+  return __builtin_bswap32(value);
+}
+inline uint64_t ByteSwap(uint64_t value) {
+  return __builtin_bswap64(value);
+}
+
+inline uint64_t ZigZagEncode(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ (value >> 63);
+}
+
+inline int64_t ZigZagDecode(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Append |value| to |out| as a varint. Returns the new end of |out|, which
+// must have room for 10 bytes.
+inline uint8_t* PutVarint(uint8_t* out, uint64_t value) {
+  while (value >= 0x80) {
+    *out++ = static_cast<uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+  *out++ = static_cast<uint8_t>(value);
+  return out;
+}
+
+// Read a varint from |*pos| into |*value|, without going past |end|. Returns
+// false if the varint is truncated or too long.
+inline bool GetVarint(const uint8_t** pos, const uint8_t* end,
+                      uint64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*pos == end)
+      return false;
+    uint8_t byte = *(*pos)++;
+    result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace trace_format
+
+#endif  // TRACE_FORMAT_H_
@@ -0,0 +1,404 @@
+// Generates synthetic allocation traces with known leaks, for benchmarking the
+// leak detector and measuring how well it finds them.
+//
+// Usage: trace_generator [--OPTION=VALUE ...] OUTPUT
+//
+// Options:
+//   --events=N          Number of events to write. Defaults to 1000000.
+//   --seed=N            Random seed. The same options and seed always produce
+//                       the same trace. Defaults to 1.
+//   --threads=N         Number of simulated threads. Each one allocates from
+//                       its own address range, and their events are
+//                       interleaved at random. Defaults to 4.
+//   --stacks=N          Number of distinct call stacks that allocate memory.
+//                       Defaults to 1000.
+//   --stack-depth=N     Frames per call stack. Defaults to 16.
+//   --stack-skew=S      Exponent of the Zipf distribution that call stacks are
+//                       picked from. 0 picks them uniformly. Defaults to 1.
+//   --size-dist=D       Distribution of the allocation size of each call stack,
+//                       "uniform" or "loguniform". Defaults to "loguniform".
+//   --min-size=N        Smallest allocation size. Defaults to 8.
+//   --max-size=N        Largest allocation size. Defaults to 4096.
+//   --lifetime=N        Mean lifetime of allocations, in number of subsequent
+//                       allocations. Lifetimes are exponentially distributed.
+//                       Defaults to 10000.
+//   --leak=SIZE:RATE[:START]
+//                       Inject a leak: from event START on, a fraction RATE of
+//                       all allocations come from a call stack of its own,
+//                       have size SIZE, and are never freed. May be repeated,
+//                       with rates that add up to less than 1.
+//   --events-per-second=N
+//                       Rate at which event times advance. Defaults to
+//                       1000000.
+//   --truth=PATH        Where to write the ground truth. Defaults to
+//                       OUTPUT.truth.
+//   --no-compression    Do not compress the trace.
+//
+// The ground truth is a text file with one line per injected leak:
+//
+//   leak size=SIZE rate=RATE start=EVENT time=NS allocs=N stack=OFFSET,...
+//
+// where time is that of the first leaked allocation, the stack frames are
+// offsets within the mapping, as the leak detector reports them, and allocs is
+// the number of leaked allocations.
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "tool_options.h"
+#include "trace_writer.h"
+
+namespace {
+
+const uint64_t kMappingAddr = 0x400000;
+const uint64_t kMappingSize = 0x4000000;
+
+// Threads allocate from ranges this far apart.
+const uint64_t kThreadArenaBase = 0x100000000000ULL;
+const uint64_t kThreadArenaSize = 0x1000000000ULL;
+
+// Allocations are aligned to this many bytes, as by malloc().
+const uint64_t kAlignment = 16;
+
+struct Leak {
+  uint64_t size;
+  double rate;
+  uint64_t start;
+
+  // Filled in while generating.
+  std::vector<void*> stack;
+  uint64_t start_time;
+  uint64_t num_allocs;
+};
+
+struct Options {
+  Options()
+      : num_events(1000000),
+        seed(1),
+        num_threads(4),
+        num_stacks(1000),
+        stack_depth(16),
+        stack_skew(1.0),
+        log_uniform_sizes(true),
+        min_size(8),
+        max_size(4096),
+        lifetime(10000),
+        events_per_second(1000000),
+        compression(true),
+        output(NULL) {}
+
+  uint64_t num_events;
+  uint64_t seed;
+  int num_threads;
+  int num_stacks;
+  int stack_depth;
+  double stack_skew;
+  bool log_uniform_sizes;
+  uint64_t min_size;
+  uint64_t max_size;
+  double lifetime;
+  double events_per_second;
+  bool compression;
+  std::vector<Leak> leaks;
+  std::string truth;
+  const char* output;
+};
+
+// An allocation that will be freed once |death| allocations have been made.
+struct LiveAlloc {
+  uint64_t death;
+  uintptr_t ptr;
+  uint64_t size;
+  int thread;
+
+  bool operator> (const LiveAlloc& other) const {
+    return death > other.death;
+  }
+};
+
+// Hands out addresses like a simple segregated-fit allocator, so that freed
+// addresses get reused by later allocations of the same size.
+class ThreadArena {
+ public:
+  explicit ThreadArena(int thread)
+      : next_(kThreadArenaBase + thread * kThreadArenaSize) {}
+
+  uintptr_t Allocate(uint64_t size) {
+    std::vector<uintptr_t>& free_list = free_lists_[size];
+    if (!free_list.empty()) {
+      uintptr_t ptr = free_list.back();
+      free_list.pop_back();
+      return ptr;
+    }
+    uintptr_t ptr = next_;
+    next_ += (size + kAlignment - 1) / kAlignment * kAlignment;
+    return ptr;
+  }
+
+  void Free(uintptr_t ptr, uint64_t size) {
+    free_lists_[size].push_back(ptr);
+  }
+
+ private:
+  uintptr_t next_;
+  std::unordered_map<uint64_t, std::vector<uintptr_t>> free_lists_;
+};
+
+void PrintUsage(const char* program) {
+  printf("Usage: %s [--OPTION=VALUE ...] OUTPUT\n"
+         "See trace_generator.cc for the options.\n", program);
+}
+
+bool ParseLeak(const char* value, Leak* leak) {
+  char* end;
+  leak->size = strtoull(value, &end, 10);
+  if (*end != ':' || !leak->size)
+    return false;
+  leak->rate = strtod(end + 1, &end);
+  if (leak->rate <= 0 || leak->rate >= 1)
+    return false;
+  leak->start = 0;
+  if (*end == ':')
+    leak->start = strtoull(end + 1, &end, 10);
+  leak->start_time = 0;
+  leak->num_allocs = 0;
+  return *end == '\0';
+}
+
+bool ParseOptions(int argc, char* argv[], Options* options) {
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value;
+    if (strcmp(arg, "--no-compression") == 0) {
+      options->compression = false;
+    } else if (MatchOption(arg, "events", &value)) {
+      options->num_events = strtoull(value, NULL, 10);
+    } else if (MatchOption(arg, "seed", &value)) {
+      options->seed = strtoull(value, NULL, 10);
+    } else if (MatchOption(arg, "threads", &value)) {
+      options->num_threads = atoi(value);
+    } else if (MatchOption(arg, "stacks", &value)) {
+      options->num_stacks = atoi(value);
+    } else if (MatchOption(arg, "stack-depth", &value)) {
+      options->stack_depth = atoi(value);
+    } else if (MatchOption(arg, "stack-skew", &value)) {
+      options->stack_skew = atof(value);
+    } else if (MatchOption(arg, "size-dist", &value)) {
+      if (strcmp(value, "uniform") == 0) {
+        options->log_uniform_sizes = false;
+      } else if (strcmp(value, "loguniform") == 0) {
+        options->log_uniform_sizes = true;
+      } else {
+        printf("Unknown size distribution: %s\n", value);
+        return false;
+      }
+    } else if (MatchOption(arg, "min-size", &value)) {
+      options->min_size = strtoull(value, NULL, 10);
+    } else if (MatchOption(arg, "max-size", &value)) {
+      options->max_size = strtoull(value, NULL, 10);
+    } else if (MatchOption(arg, "lifetime", &value)) {
+      options->lifetime = atof(value);
+    } else if (MatchOption(arg, "leak", &value)) {
+      Leak leak;
+      if (!ParseLeak(value, &leak)) {
+        printf("Invalid leak: %s\n", value);
+        return false;
+      }
+      options->leaks.push_back(leak);
+    } else if (MatchOption(arg, "events-per-second", &value)) {
+      options->events_per_second = atof(value);
+    } else if (MatchOption(arg, "truth", &value)) {
+      options->truth = value;
+    } else if (arg[0] == '-' || options->output) {
+      printf("Unexpected argument: %s\n", arg);
+      return false;
+    } else {
+      options->output = arg;
+    }
+  }
+
+  if (!options->output)
+    return false;
+  if (options->num_threads < 1 || options->num_stacks < 1 ||
+      options->stack_depth < 1 || options->min_size < 1 ||
+      options->min_size > options->max_size || options->lifetime <= 0 ||
+      options->events_per_second <= 0) {
+    printf("Invalid options\n");
+    return false;
+  }
+  double total_leak_rate = 0;
+  for (const Leak& leak : options->leaks)
+    total_leak_rate += leak.rate;
+  if (total_leak_rate >= 1) {
+    printf("The rates of the leaks must add up to less than 1\n");
+    return false;
+  }
+  if (options->truth.empty())
+    options->truth = std::string(options->output) + ".truth";
+  return true;
+}
+
+// Create a call stack of |depth| distinct frames within the mapping.
+std::vector<void*> RandomStack(int depth, std::mt19937_64* rng) {
+  std::uniform_int_distribution<uint64_t> offset(0, kMappingSize / 4 - 1);
+  std::vector<void*> stack(depth);
+  for (void*& frame : stack)
+    frame = reinterpret_cast<void*>(kMappingAddr + offset(*rng) * 4);
+  return stack;
+}
+
+bool WriteTruth(const Options& options, uint64_t num_events) {
+  FILE* fp = fopen(options.truth.c_str(), "w");
+  if (!fp)
+    return false;
+  fprintf(fp, "# Ground truth of %s\n", options.output);
+  fprintf(fp, "events %" PRIu64 "\n", num_events);
+  for (const Leak& leak : options.leaks) {
+    fprintf(fp, "leak size=%" PRIu64 " rate=%g start=%" PRIu64
+            " time=%" PRIu64 " allocs=%" PRIu64 " stack=",
+            leak.size, leak.rate, leak.start, leak.start_time,
+            leak.num_allocs);
+    for (size_t i = 0; i < leak.stack.size(); ++i) {
+      fprintf(fp, "%s%" PRIxPTR, i ? "," : "",
+              reinterpret_cast<uintptr_t>(leak.stack[i]) - kMappingAddr);
+    }
+    fprintf(fp, "\n");
+  }
+  return fclose(fp) == 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  std::mt19937_64 rng(options.seed);
+
+  // Each call stack allocates a single size. Stacks are picked with a Zipf
+  // distribution over their index.
+  std::vector<std::vector<void*>> stacks;
+  std::vector<uint64_t> stack_sizes;
+  std::vector<double> stack_weights;
+  std::uniform_real_distribution<double> unit(0, 1);
+  for (int i = 0; i < options.num_stacks; ++i) {
+    stacks.push_back(RandomStack(options.stack_depth, &rng));
+    double size;
+    if (options.log_uniform_sizes) {
+      size = exp(log(options.min_size) +
+                 unit(rng) * (log(options.max_size + 1) -
+                              log(options.min_size)));
+    } else {
+      size = options.min_size +
+             unit(rng) * (options.max_size + 1 - options.min_size);
+    }
+    stack_sizes.push_back(std::min<uint64_t>(size, options.max_size));
+    stack_weights.push_back(pow(i + 1, -options.stack_skew));
+  }
+  std::discrete_distribution<int> pick_stack(stack_weights.begin(),
+                                             stack_weights.end());
+  for (Leak& leak : options.leaks)
+    leak.stack = RandomStack(options.stack_depth, &rng);
+
+  std::uniform_int_distribution<int> pick_thread(0, options.num_threads - 1);
+  std::exponential_distribution<double> lifetime(1 / options.lifetime);
+  std::vector<ThreadArena> arenas;
+  for (int i = 0; i < options.num_threads; ++i)
+    arenas.push_back(ThreadArena(i));
+
+  TraceWriter writer;
+  writer.set_clock(trace_format::kSyntheticClock);
+  if (!writer.Open(options.output, kMappingAddr, kMappingSize)) {
+    printf("Could not create %s\n", options.output);
+    return 1;
+  }
+  writer.set_compression(options.compression);
+
+  // Allocations that will be freed, soonest first.
+  std::priority_queue<LiveAlloc, std::vector<LiveAlloc>,
+                      std::greater<LiveAlloc>> live;
+  uint64_t num_allocs = 0;
+  uint64_t num_events = 0;
+  auto event_time = [&options](uint64_t event) {
+    return static_cast<uint64_t>(event * 1e9 / options.events_per_second);
+  };
+  while (num_events < options.num_events) {
+    writer.set_time(event_time(num_events));
+    if (!live.empty() && live.top().death <= num_allocs) {
+      const LiveAlloc& alloc = live.top();
+      writer.WriteFree(reinterpret_cast<void*>(alloc.ptr));
+      arenas[alloc.thread].Free(alloc.ptr, alloc.size);
+      live.pop();
+      ++num_events;
+      continue;
+    }
+
+    int thread = pick_thread(rng);
+    // One draw against the cumulative rates of the started leaks, so that each
+    // gets exactly its own rate.
+    Leak* leak = NULL;
+    double draw = unit(rng);
+    double cumulative_rate = 0;
+    for (Leak& candidate : options.leaks) {
+      if (num_events < candidate.start)
+        continue;
+      cumulative_rate += candidate.rate;
+      if (draw < cumulative_rate) {
+        leak = &candidate;
+        break;
+      }
+    }
+
+    if (leak) {
+      uintptr_t ptr = arenas[thread].Allocate(leak->size);
+      writer.WriteAlloc(reinterpret_cast<void*>(ptr), leak->size,
+                        leak->stack.size(), leak->stack.data());
+      if (!leak->num_allocs++)
+        leak->start_time = event_time(num_events);
+    } else {
+      int stack = pick_stack(rng);
+      uint64_t size = stack_sizes[stack];
+      uintptr_t ptr = arenas[thread].Allocate(size);
+      writer.WriteAlloc(reinterpret_cast<void*>(ptr), size,
+                        stacks[stack].size(), stacks[stack].data());
+      LiveAlloc alloc = {
+          num_allocs + 1 + static_cast<uint64_t>(lifetime(rng)), ptr, size,
+          thread };
+      live.push(alloc);
+    }
+    ++num_allocs;
+    ++num_events;
+  }
+
+  if (!writer.Close()) {
+    printf("Could not write %s\n", options.output);
+    return 1;
+  }
+  if (!WriteTruth(options, num_events)) {
+    printf("Could not write %s\n", options.truth.c_str());
+    return 1;
+  }
+
+  uint64_t num_leaked = 0;
+  for (const Leak& leak : options.leaks)
+    num_leaked += leak.num_allocs;
+  printf("Generated %" PRIu64 " events with %" PRIu64 " unique call stacks, "
+         "%" PRIu64 " of them leaked allocations\n",
+         writer.num_events(), writer.num_stacks(), num_leaked);
+  return 0;
+}
@@ -0,0 +1,1078 @@
+#include "trace_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "lz4_block.h"
+
+using trace_format::BlockHeader;
+using trace_format::FileHeader;
+using trace_format::GetVarint;
+using trace_format::IndexEntry;
+using trace_format::IndexTrailer;
+using trace_format::ModuleEntry;
+using trace_format::ZigZagDecode;
+
+namespace {
+
+size_t RoundUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// Module names are padded to a multiple of this.
+const size_t kModuleNameAlignment = 8;
+
+// The other byte order than |byte_order|.
+trace_format::ByteOrder Swapped(trace_format::ByteOrder byte_order) {
+  return byte_order == trace_format::kLittleEndian ? trace_format::kBigEndian
+                                                   : trace_format::kLittleEndian;
+}
+
+// Read |size| bytes from |fd| into |out|, unless the end of the stream comes
+// first or |wake_fd|, if it is not -1, becomes readable. Returns the number of
+// bytes read, or -1 on error or wakeup.
+ssize_t ReadFully(int fd, int wake_fd, void* out, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    pollfd fds[] = { { fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 } };
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (fds[1].revents)
+      return -1;
+    ssize_t result = read(fd, static_cast<char*>(out) + done, size - done);
+    if (result < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    if (result == 0)
+      break;
+    done += result;
+  }
+  return done;
+}
+
+}  // namespace
+
+// Decompresses the blocks of a trace on worker threads, in order from
+// |first_block|, keeping up to kNumSlotsPerThread blocks per thread ahead of the
+// reader. Uncompressed blocks go through the same slots without being copied.
+class TraceReader::Prefetcher {
+ public:
+  Prefetcher(const TraceReader* reader, int num_threads, size_t first_block)
+      : reader_(reader), next_block_(first_block), stopping_(false) {
+    for (int i = 0; i < kNumSlotsPerThread * num_threads; ++i)
+      slots_.push_back(Slot());
+    for (int i = 0; i < num_threads; ++i)
+      threads_.push_back(std::thread(&Prefetcher::WorkerLoop, this));
+  }
+
+  ~Prefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread& thread : threads_)
+      thread.join();
+  }
+
+  // Wait for block |index| to be decompressed, and return its payload, or NULL
+  // if it is corrupt. Blocks must be requested in order. The payload remains
+  // valid until Release() is called for the block.
+  const uint8_t* Get(size_t index) {
+    Slot* slot = &slots_[index % slots_.size()];
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [slot, index] {
+      return slot->state == Slot::kReady && slot->block == index;
+    });
+    return slot->payload;
+  }
+
+  void Release(size_t index) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      slots_[index % slots_.size()].state = Slot::kEmpty;
+    }
+    cv_.notify_all();
+  }
+
+ private:
+  static const int kNumSlotsPerThread = 2;
+
+  struct Slot {
+    enum State {
+      kEmpty,
+      kBusy,
+      kReady,
+    };
+    State state = kEmpty;
+    size_t block = 0;
+    const uint8_t* payload = NULL;  // NULL if the block is corrupt.
+    std::vector<uint8_t> data;
+  };
+
+  void WorkerLoop() {
+    for (;;) {
+      Slot* slot;
+      size_t index;
+      {
+        // Claim the next block once its slot has been released by the reader.
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] {
+          return stopping_ || (next_block_ < reader_->blocks_.size() &&
+                               slots_[next_block_ % slots_.size()].state ==
+                                   Slot::kEmpty);
+        });
+        if (stopping_)
+          return;
+        index = next_block_++;
+        slot = &slots_[index % slots_.size()];
+        slot->state = Slot::kBusy;
+      }
+
+      const Block& block = reader_->blocks_[index];
+      const uint8_t* payload;
+      if (block.header.compression == trace_format::kNoCompression) {
+        payload = reader_->Payload(block);
+      } else {
+        slot->data.resize(block.header.raw_size);
+        payload = reader_->Decompress(block, slot->data.data())
+                      ? slot->data.data()
+                      : NULL;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        slot->block = index;
+        slot->payload = payload;
+        slot->state = Slot::kReady;
+      }
+      cv_.notify_all();
+    }
+  }
+
+  const TraceReader* const reader_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Slot> slots_;
+  size_t next_block_;  // The next block for a worker to claim.
+  bool stopping_;
+
+  std::vector<std::thread> threads_;
+};
+
+// Reads the blocks of a stream on a thread, and decompresses them, into
+// kNumSlots slots. Once all slots are waiting to be decoded, it stops reading
+// until the reader releases one, which holds back the writer of the stream.
+class TraceReader::Streamer {
+ public:
+  Streamer(const TraceReader* reader, int fd, size_t offset)
+      : reader_(reader),
+        fd_(fd),
+        offset_(offset),
+        end_block_(kNoBlock),
+        error_(NULL),
+        stopping_(false) {
+    wake_fds_[0] = wake_fds_[1] = -1;
+    if (pipe2(wake_fds_, O_CLOEXEC) != 0) {
+      end_block_ = 0;
+      error_ = "Could not create a pipe";
+      return;
+    }
+    thread_ = std::thread(&Streamer::ReadLoop, this);
+  }
+
+  ~Streamer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    // Wake up the thread if it is waiting for the stream.
+    if (wake_fds_[1] >= 0) {
+      char byte = 0;
+      ssize_t result = write(wake_fds_[1], &byte, 1);
+      (void)result;
+    }
+    if (thread_.joinable())
+      thread_.join();
+    for (int fd : wake_fds_) {
+      if (fd >= 0)
+        close(fd);
+    }
+  }
+
+  // Wait for block |index| and get its raw payload. Returns false once the
+  // stream has ended before it, in which case |*error| says why, or is NULL if
+  // the stream ended cleanly. Blocks must be requested in order. The payload
+  // remains valid until Release() is called for the block.
+  bool Get(size_t index, Block* block, const uint8_t** payload,
+           const char** error) {
+    Slot* slot = &slots_[index % kNumSlots];
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this, slot, index] {
+      return (slot->state == Slot::kReady && slot->index == index) ||
+             index >= end_block_;
+    });
+    if (index >= end_block_) {
+      *error = error_;
+      return false;
+    }
+    *block = slot->block;
+    *payload = slot->data.data();
+    return true;
+  }
+
+  void Release(size_t index) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      slots_[index % kNumSlots].state = Slot::kEmpty;
+    }
+    cv_.notify_all();
+  }
+
+ private:
+  // One block is decoded while the next one is read.
+  static const int kNumSlots = 2;
+
+  struct Slot {
+    enum State {
+      kEmpty,
+      kReady,
+    };
+    State state = kEmpty;
+    size_t index = 0;
+    Block block;
+    std::vector<uint8_t> data;
+  };
+
+  void ReadLoop() {
+    for (size_t index = 0;; ++index) {
+      Slot* slot = &slots_[index % kNumSlots];
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this, slot] {
+          return stopping_ || slot->state == Slot::kEmpty;
+        });
+        if (stopping_)
+          return;
+      }
+
+      bool end = false;
+      const char* error = ReadBlock(slot, &end);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error || end) {
+          end_block_ = index;
+          error_ = error;
+        } else {
+          slot->index = index;
+          slot->state = Slot::kReady;
+        }
+      }
+      cv_.notify_all();
+      if (error || end)
+        return;
+    }
+  }
+
+  // Read the next block into |slot|. Sets |*end| if the stream ended cleanly
+  // before it.
+  const char* ReadBlock(Slot* slot, bool* end) {
+    Block* block = &slot->block;
+    block->offset = offset_;
+    ssize_t result =
+        ReadFully(fd_, wake_fds_[0], &block->header, sizeof(block->header));
+    if (result == 0) {
+      *end = true;
+      return NULL;
+    }
+    if (result != sizeof(block->header))
+      return "Truncated block header";
+    if (reader_->swap_)
+      reader_->Normalize(&block->header);
+    const char* error = reader_->CheckBlockHeader(block->header);
+    if (error)
+      return error;
+
+    const trace_format::BlockHeader& header = block->header;
+    const bool compressed = header.compression != trace_format::kNoCompression;
+    std::vector<uint8_t>* payload = compressed ? &compressed_ : &slot->data;
+    payload->resize(header.payload_size);
+    if (ReadFully(fd_, wake_fds_[0], payload->data(), payload->size()) !=
+        static_cast<ssize_t>(payload->size())) {
+      return "Truncated block";
+    }
+    offset_ += sizeof(header) + header.payload_size;
+    if (compressed) {
+      slot->data.resize(header.raw_size);
+      if (!lz4::Decompress(compressed_.data(), compressed_.size(),
+                           slot->data.data(), slot->data.size())) {
+        return "Corrupt compressed block";
+      }
+    }
+    return NULL;
+  }
+
+  const TraceReader* const reader_;
+  const int fd_;
+  int wake_fds_[2];  // Written to when |stopping_| is set.
+  size_t offset_;    // Stream offset of the next block.
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  Slot slots_[kNumSlots];
+  size_t end_block_;    // Index of the block where the stream ended.
+  const char* error_;   // Why it ended, or NULL if it ended cleanly.
+  bool stopping_;
+
+  // Holds compressed payloads while they are decompressed.
+  std::vector<uint8_t> compressed_;
+
+  std::thread thread_;
+};
+
+TraceReader::TraceReader()
+    : data_(NULL),
+      size_(0),
+      offset_(0),
+      stream_fd_(-1),
+      version_(0),
+      mapping_addr_(0),
+      mapping_size_(0),
+      byte_order_(trace_format::kHostByteOrder),
+      swap_(false),
+      pointer_size_(sizeof(void*)),
+      pointer_mask_(~static_cast<uintptr_t>(0)),
+      clock_(trace_format::kUnknownClock),
+      legacy_pointer_size_(sizeof(void*)),
+      legacy_byte_order_(trace_format::kHostByteOrder),
+      legacy_ptr_offset_(0),
+      legacy_alloc_size_(0),
+      legacy_free_size_(0),
+      legacy_in_place_(false),
+      next_event_index_(0),
+      has_index_(false),
+      blocks_error_(NULL),
+      num_threads_(0),
+      next_block_(0),
+      held_block_(kNoBlock),
+      block_offset_(0),
+      block_pos_(NULL),
+      block_end_(NULL),
+      block_num_events_(0),
+      block_events_left_(0),
+      block_time_(0),
+      prev_ptr_(0),
+      error_(NULL) {}
+
+TraceReader::~TraceReader() {
+  Close();
+}
+
+bool TraceReader::Open(const char* path, int num_threads) {
+  Close();
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    error_ = "Could not open file";
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    error_ = "Could not get file size";
+    return false;
+  }
+  if (static_cast<size_t>(st.st_size) < kHeaderSize) {
+    close(fd);
+    error_ = "File is too small for the trace header";
+    return false;
+  }
+
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    error_ = "Could not map file";
+    return false;
+  }
+  // The trace is mostly read front to back.
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  data_ = static_cast<const char*>(data);
+  size_ = st.st_size;
+  if (size_ >= sizeof(trace_format::kMagic) &&
+      memcmp(data_, trace_format::kMagic, sizeof(trace_format::kMagic)) == 0) {
+    return OpenVersion2(num_threads);
+  }
+
+  version_ = 1;
+  byte_order_ = legacy_byte_order_;
+  swap_ = byte_order_ != trace_format::kHostByteOrder;
+  if (!SetPointerSize(legacy_pointer_size_))
+    return false;
+  mapping_addr_ = Read64(0);
+  mapping_size_ = Read64(sizeof(mapping_addr_));
+
+  // The code is followed by the pointer, at its natural alignment. Records are
+  // padded to the alignment of the pointers in their call stack.
+  legacy_ptr_offset_ = std::max<size_t>(sizeof(uint32_t), pointer_size_);
+  legacy_alloc_size_ = RoundUp(
+      legacy_ptr_offset_ + pointer_size_ + 2 * sizeof(uint32_t), pointer_size_);
+  legacy_free_size_ = RoundUp(legacy_ptr_offset_ + pointer_size_, pointer_size_);
+  legacy_in_place_ = !swap_ && pointer_size_ == sizeof(void*);
+  offset_ = kHeaderSize;
+  return true;
+}
+
+bool TraceReader::OpenStream(int fd) {
+  Close();
+  stream_fd_ = fd;
+
+  // Read the header up front, so that it can be parsed like that of a mapped
+  // trace.
+  stream_header_.resize(trace_format::kVersion2HeaderSize);
+  if (ReadFully(fd, -1, stream_header_.data(), stream_header_.size()) !=
+      static_cast<ssize_t>(stream_header_.size())) {
+    error_ = "Stream is too short for the trace header";
+    return false;
+  }
+  if (memcmp(stream_header_.data(), trace_format::kMagic,
+             sizeof(trace_format::kMagic)) != 0) {
+    error_ = "Only version 2 and later traces can be streamed";
+    return false;
+  }
+  uint32_t version;
+  uint32_t header_size;
+  memcpy(&version, &stream_header_[offsetof(FileHeader, version)],
+         sizeof(version));
+  memcpy(&header_size, &stream_header_[offsetof(FileHeader, header_size)],
+         sizeof(header_size));
+  // Versions are small, so a large one was written in the other byte order.
+  if (version > trace_format::kVersion)
+    header_size = trace_format::ByteSwap(header_size);
+  if (header_size < stream_header_.size() ||
+      header_size > trace_format::kMaxBlockSize) {
+    error_ = "Invalid trace header size";
+    return false;
+  }
+  size_t read_size = stream_header_.size();
+  stream_header_.resize(header_size);
+  if (ReadFully(fd, -1, &stream_header_[read_size], header_size - read_size) !=
+      static_cast<ssize_t>(header_size - read_size)) {
+    error_ = "Stream is too short for the trace header";
+    return false;
+  }
+
+  // The header is all there is to parse for now, so no blocks are found.
+  data_ = stream_header_.data();
+  size_ = stream_header_.size();
+  if (!OpenVersion2(0))
+    return false;
+  streamer_.reset(new Streamer(this, fd, size_));
+  return true;
+}
+
+void TraceReader::Close() {
+  // Stop the workers before unmapping the trace.
+  prefetcher_.reset();
+  streamer_.reset();
+  if (stream_fd_ >= 0)
+    close(stream_fd_);
+  else if (data_)
+    munmap(const_cast<char*>(data_), size_);
+  stream_fd_ = -1;
+  stream_header_.clear();
+  data_ = NULL;
+  size_ = 0;
+  offset_ = 0;
+  version_ = 0;
+  mapping_addr_ = 0;
+  mapping_size_ = 0;
+  byte_order_ = trace_format::kHostByteOrder;
+  swap_ = false;
+  pointer_size_ = sizeof(void*);
+  pointer_mask_ = ~static_cast<uintptr_t>(0);
+  clock_ = trace_format::kUnknownClock;
+  modules_.clear();
+  next_event_index_ = 0;
+  blocks_.clear();
+  has_index_ = false;
+  blocks_error_ = NULL;
+  num_threads_ = 0;
+  next_block_ = 0;
+  held_block_ = kNoBlock;
+  block_time_ = 0;
+  block_pos_ = block_end_ = NULL;
+  block_num_events_ = 0;
+  block_events_left_ = 0;
+  stacks_.clear();
+  frames_.clear();
+  error_ = NULL;
+}
+
+bool TraceReader::OpenVersion2(int num_threads) {
+  if (size_ < trace_format::kVersion2HeaderSize) {
+    error_ = "File is too small for the trace header";
+    return false;
+  }
+
+  // The version is small, so it can only be read one way round.
+  const size_t version_offset = offsetof(FileHeader, version);
+  swap_ = false;
+  uint32_t version = Read32(version_offset);
+  if (version < trace_format::kMinVersion || version > trace_format::kVersion) {
+    swap_ = true;
+    version = Read32(version_offset);
+    if (version < trace_format::kMinVersion ||
+        version > trace_format::kVersion) {
+      error_ = "Unsupported trace version";
+      return false;
+    }
+  }
+  byte_order_ = swap_ ? Swapped(trace_format::kHostByteOrder)
+                      : trace_format::kHostByteOrder;
+
+  // Version 2 headers end before the fields that describe the recorded
+  // process.
+  const size_t min_header_size =
+      version == 2 ? trace_format::kVersion2HeaderSize : sizeof(FileHeader);
+  const uint32_t header_size = Read32(offsetof(FileHeader, header_size));
+  if (header_size < min_header_size || header_size > size_) {
+    error_ = "Invalid trace header size";
+    return false;
+  }
+  FileHeader header = {};
+  Read(0, &header, min_header_size);
+  version_ = version;
+  mapping_addr_ = Read64(offsetof(FileHeader, mapping_addr));
+  mapping_size_ = Read64(offsetof(FileHeader, mapping_size));
+  offset_ = header_size;
+
+  if (version == 2) {
+    if (byte_order_ != trace_format::kLittleEndian) {
+      error_ = "Version 2 trace is not little-endian";
+      return false;
+    }
+    if (!SetPointerSize(8))
+      return false;
+  } else {
+    if (header.byte_order != byte_order_) {
+      error_ = "Trace byte order does not match its header";
+      return false;
+    }
+    if (!SetPointerSize(header.pointer_size))
+      return false;
+    clock_ = static_cast<trace_format::ClockSource>(
+        swap_ ? trace_format::ByteSwap(header.clock) : header.clock);
+    uint32_t num_modules = swap_ ? trace_format::ByteSwap(header.num_modules)
+                                 : header.num_modules;
+    if (!ReadModules(sizeof(FileHeader), num_modules))
+      return false;
+  }
+
+  has_index_ = ReadIndex();
+  if (!has_index_)
+    ScanBlocks();
+
+  // Worker threads are only worth it if there is something to decompress.
+  for (const Block& block : blocks_) {
+    if (block.header.compression != trace_format::kNoCompression) {
+      num_threads_ = num_threads;
+      break;
+    }
+  }
+  if (num_threads_ > 0)
+    prefetcher_.reset(new Prefetcher(this, num_threads_, 0));
+  return true;
+}
+
+bool TraceReader::SetPointerSize(int pointer_size) {
+  if (pointer_size != 4 && pointer_size != 8) {
+    error_ = "Unsupported pointer size";
+    return false;
+  }
+  if (static_cast<size_t>(pointer_size) > sizeof(void*)) {
+    error_ = "Pointers are too wide for this host";
+    return false;
+  }
+  pointer_size_ = pointer_size;
+  pointer_mask_ = pointer_size == sizeof(void*)
+                      ? ~static_cast<uintptr_t>(0)
+                      : (static_cast<uintptr_t>(1) << (8 * pointer_size)) - 1;
+  return true;
+}
+
+bool TraceReader::ReadModules(size_t offset, uint32_t num_modules) {
+  for (uint32_t i = 0; i < num_modules; ++i) {
+    if (offset_ - offset < sizeof(ModuleEntry)) {
+      error_ = "Truncated module table";
+      return false;
+    }
+    Module module;
+    module.addr = Read64(offset + offsetof(ModuleEntry, addr));
+    module.size = Read64(offset + offsetof(ModuleEntry, size));
+    uint32_t name_size = Read32(offset + offsetof(ModuleEntry, name_size));
+    offset += sizeof(ModuleEntry);
+    if (name_size > offset_ - offset) {
+      error_ = "Truncated module table";
+      return false;
+    }
+    module.name.assign(data_ + offset, name_size);
+    offset += std::min(RoundUp(name_size, kModuleNameAlignment),
+                       offset_ - offset);
+    modules_.push_back(module);
+  }
+  return true;
+}
+
+const char* TraceReader::ReadBlock(size_t offset, Block* block) const {
+  if (size_ - offset < sizeof(block->header))
+    return "Truncated block header";
+  block->offset = offset;
+  Read(offset, &block->header, sizeof(block->header));
+  if (swap_)
+    Normalize(&block->header);
+
+  const BlockHeader& header = block->header;
+  if (header.payload_size > size_ - offset - sizeof(header))
+    return "Truncated block";
+  return CheckBlockHeader(header);
+}
+
+const char* TraceReader::CheckBlockHeader(const BlockHeader& header) const {
+  if (header.raw_size > trace_format::kMaxBlockSize)
+    return "Block is too large";
+  switch (header.compression) {
+    case trace_format::kNoCompression:
+      if (header.raw_size != header.payload_size)
+        return "Invalid block size";
+      break;
+    case trace_format::kLZ4Compression:
+      break;
+    default:
+      return "Unsupported block compression";
+  }
+  return NULL;
+}
+
+bool TraceReader::ReadIndex() {
+  IndexTrailer trailer;
+  if (size_ - offset_ < sizeof(trailer))
+    return false;
+  Read(size_ - sizeof(trailer), &trailer, sizeof(trailer));
+  trailer.index_offset = Read64(size_ - sizeof(trailer) +
+                                offsetof(IndexTrailer, index_offset));
+  if (memcmp(trailer.magic, trace_format::kIndexMagic,
+             sizeof(trailer.magic)) != 0 ||
+      trailer.index_offset < offset_ ||
+      trailer.index_offset > size_ - sizeof(trailer)) {
+    return false;
+  }
+
+  Block index_block;
+  if (ReadBlock(trailer.index_offset, &index_block) ||
+      index_block.header.compression != trace_format::kNoCompression ||
+      trailer.index_offset + sizeof(BlockHeader) +
+          index_block.header.payload_size != size_ ||
+      index_block.header.payload_size < sizeof(trailer) ||
+      (index_block.header.payload_size - sizeof(trailer)) %
+          sizeof(IndexEntry) != 0) {
+    return false;
+  }
+
+  size_t num_blocks = (index_block.header.payload_size - sizeof(trailer)) /
+                      sizeof(IndexEntry);
+  size_t entry_offset = trailer.index_offset + sizeof(BlockHeader);
+  size_t end_of_previous_block = offset_;
+  for (size_t i = 0; i < num_blocks; ++i) {
+    IndexEntry entry;
+    size_t offset = entry_offset + i * sizeof(entry);
+    entry.offset = Read64(offset + offsetof(IndexEntry, offset));
+    entry.first_event_index =
+        Read64(offset + offsetof(IndexEntry, first_event_index));
+    entry.first_event_time =
+        Read64(offset + offsetof(IndexEntry, first_event_time));
+    Block block;
+    if (entry.offset != end_of_previous_block ||
+        ReadBlock(entry.offset, &block) ||
+        block.header.first_event_index != entry.first_event_index ||
+        block.header.first_event_time != entry.first_event_time) {
+      blocks_.clear();
+      return false;
+    }
+    blocks_.push_back(block);
+    end_of_previous_block =
+        entry.offset + sizeof(BlockHeader) + block.header.payload_size;
+  }
+  if (end_of_previous_block != trailer.index_offset) {
+    blocks_.clear();
+    return false;
+  }
+  return true;
+}
+
+void TraceReader::ScanBlocks() {
+  for (size_t offset = offset_; offset < size_; ) {
+    Block block;
+    blocks_error_ = ReadBlock(offset, &block);
+    if (blocks_error_)
+      return;
+    blocks_.push_back(block);
+    offset += sizeof(BlockHeader) + block.header.payload_size;
+  }
+}
+
+const uint8_t* TraceReader::Payload(const Block& block) const {
+  return reinterpret_cast<const uint8_t*>(data_) + block.offset +
+         sizeof(BlockHeader);
+}
+
+bool TraceReader::Decompress(const Block& block, uint8_t* out) const {
+  return lz4::Decompress(Payload(block), block.header.payload_size, out,
+                         block.header.raw_size);
+}
+
+void TraceReader::Read(size_t offset, void* value, size_t size) const {
+  memcpy(value, data_ + offset, size);
+}
+
+uint32_t TraceReader::Read32(size_t offset) const {
+  uint32_t value;
+  Read(offset, &value, sizeof(value));
+  return swap_ ? trace_format::ByteSwap(value) : value;
+}
+
+uint64_t TraceReader::Read64(size_t offset) const {
+  uint64_t value;
+  Read(offset, &value, sizeof(value));
+  return swap_ ? trace_format::ByteSwap(value) : value;
+}
+
+uintptr_t TraceReader::ReadPointer(size_t offset) const {
+  return pointer_size_ == 4 ? Read32(offset) : Read64(offset);
+}
+
+void TraceReader::Normalize(BlockHeader* header) const {
+  header->payload_size = trace_format::ByteSwap(header->payload_size);
+  header->raw_size = trace_format::ByteSwap(header->raw_size);
+  header->compression = trace_format::ByteSwap(header->compression);
+  header->num_events = trace_format::ByteSwap(header->num_events);
+  header->first_event_index = trace_format::ByteSwap(header->first_event_index);
+  header->first_event_time = trace_format::ByteSwap(header->first_event_time);
+}
+
+bool TraceReader::Next(Event* event) {
+  if (!data_ || error_)
+    return false;
+  bool ok = version_ == 1 ? NextLegacy(event) : NextVersion2(event);
+  if (ok)
+    ++next_event_index_;
+  return ok;
+}
+
+bool TraceReader::SeekToEvent(uint64_t index) {
+  if (!data_)
+    return false;
+  if (streamer_) {
+    error_ = "Streams cannot seek";
+    return false;
+  }
+  error_ = NULL;
+  Event event;
+
+  if (version_ == 1) {
+    // Legacy traces can only be read from the start.
+    offset_ = kHeaderSize;
+    next_event_index_ = 0;
+  } else {
+    // Find the last block that starts at or before |index|.
+    size_t block = std::upper_bound(blocks_.begin(), blocks_.end(), index,
+                                    [](uint64_t index, const Block& block) {
+                                      return index <
+                                             block.header.first_event_index;
+                                    }) -
+                   blocks_.begin();
+    if (block > 0)
+      --block;
+
+    // Blocks can be decoded on their own, so decoding starts over at the
+    // beginning of that block.
+    prefetcher_.reset();
+    held_block_ = kNoBlock;
+    if (num_threads_ > 0)
+      prefetcher_.reset(new Prefetcher(this, num_threads_, block));
+    next_block_ = block;
+    block_pos_ = block_end_ = NULL;
+    block_events_left_ = 0;
+    next_event_index_ =
+        block < blocks_.size() ? blocks_[block].header.first_event_index : 0;
+  }
+
+  while (next_event_index_ < index) {
+    if (!Next(&event)) {
+      if (!error_)
+        error_ = "Event index is past the end of the trace";
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TraceReader::SeekToTime(uint64_t time) {
+  if (version_ == 1) {
+    error_ = "Legacy traces have no times";
+    return false;
+  }
+  if (streamer_) {
+    error_ = "Streams cannot seek";
+    return false;
+  }
+  // Start at the last block whose first event is no later than |time|, so that
+  // no event at or after |time| is skipped.
+  uint64_t index = 0;
+  for (const Block& block : blocks_) {
+    if (block.header.num_events == 0)
+      continue;
+    if (block.header.first_event_time > time)
+      break;
+    index = block.header.first_event_index;
+  }
+  return SeekToEvent(index);
+}
+
+bool TraceReader::NextLegacy(Event* event) {
+  if (offset_ == size_)
+    return false;
+
+  if (size_ - offset_ < sizeof(uint32_t)) {
+    error_ = "Truncated record";
+    return false;
+  }
+  uint32_t code = Read32(offset_);
+
+  event->offset = offset_;
+  if (code == kAllocCode) {
+    if (size_ - offset_ < legacy_alloc_size_) {
+      error_ = "Truncated record";
+      return false;
+    }
+    event->type = Event::kAlloc;
+    size_t field_offset = offset_ + legacy_ptr_offset_;
+    event->ptr = reinterpret_cast<const void*>(ReadPointer(field_offset));
+    field_offset += pointer_size_;
+    event->size = Read32(field_offset);
+    event->depth = Read32(field_offset + sizeof(uint32_t));
+
+    size_t stack_offset = offset_ + legacy_alloc_size_;
+    if (event->depth > (size_ - stack_offset) / pointer_size_) {
+      error_ = "Truncated call stack";
+      return false;
+    }
+    if (legacy_in_place_) {
+      event->stack = reinterpret_cast<void* const*>(data_ + stack_offset);
+      if (reinterpret_cast<uintptr_t>(event->stack) % alignof(void*) != 0) {
+        error_ = "Misaligned call stack";
+        return false;
+      }
+    } else {
+      legacy_stack_.resize(event->depth);
+      for (uint32_t i = 0; i < event->depth; ++i) {
+        legacy_stack_[i] = reinterpret_cast<void*>(
+            ReadPointer(stack_offset + i * pointer_size_));
+      }
+      event->stack = legacy_stack_.data();
+    }
+    offset_ = stack_offset + event->depth * pointer_size_;
+  } else if (code == kFreeCode) {
+    if (size_ - offset_ < legacy_free_size_) {
+      error_ = "Truncated record";
+      return false;
+    }
+    event->type = Event::kFree;
+    event->ptr =
+        reinterpret_cast<const void*>(ReadPointer(offset_ + legacy_ptr_offset_));
+    event->size = 0;
+    event->depth = 0;
+    event->stack = NULL;
+    offset_ += legacy_free_size_;
+  } else {
+    error_ = "Unknown record code";
+    return false;
+  }
+  return true;
+}
+
+bool TraceReader::StartBlock(size_t index) {
+  const Block& block = blocks_[index];
+  const uint8_t* payload;
+  if (prefetcher_) {
+    payload = prefetcher_->Get(index);
+    held_block_ = index;
+  } else if (block.header.compression == trace_format::kNoCompression) {
+    payload = Payload(block);
+  } else {
+    block_buffer_.resize(block.header.raw_size);
+    payload = Decompress(block, block_buffer_.data()) ? block_buffer_.data()
+                                                      : NULL;
+  }
+  if (!payload) {
+    error_ = "Corrupt compressed block";
+    return false;
+  }
+  SetBlock(block, payload);
+  return true;
+}
+
+bool TraceReader::StartStreamBlock() {
+  Block block;
+  const uint8_t* payload;
+  if (!streamer_->Get(next_block_, &block, &payload, &error_))
+    return false;
+  held_block_ = next_block_++;
+  SetBlock(block, payload);
+  return true;
+}
+
+void TraceReader::SetBlock(const Block& block, const uint8_t* payload) {
+  block_offset_ = block.offset;
+  block_pos_ = payload;
+  block_end_ = payload + block.header.raw_size;
+  block_num_events_ = block.header.num_events;
+  block_events_left_ = block.header.num_events;
+  block_time_ = block.header.first_event_time;
+  prev_ptr_ = 0;
+  offset_ = block.offset + sizeof(BlockHeader) + block.header.payload_size;
+}
+
+bool TraceReader::ReadStack() {
+  uint64_t id;
+  uint64_t depth;
+  if (!GetVarint(&block_pos_, block_end_, &id) ||
+      !GetVarint(&block_pos_, block_end_, &depth)) {
+    error_ = "Truncated stack record";
+    return false;
+  }
+  // Each frame takes at least a byte.
+  if (id >= trace_format::kMaxStackId ||
+      depth > static_cast<size_t>(block_end_ - block_pos_)) {
+    error_ = "Invalid stack record";
+    return false;
+  }
+  if (id >= stacks_.size())
+    stacks_.resize(id + 1, Stack{0, kUndefinedStack});
+
+  // Stacks are defined again in each block that uses them. Only decode them
+  // the first time.
+  Stack* stack = &stacks_[id];
+  bool defined = stack->depth != kUndefinedStack;
+  if (!defined) {
+    stack->begin = frames_.size();
+    stack->depth = depth;
+  }
+  uintptr_t frame = 0;
+  for (uint64_t i = 0; i < depth; ++i) {
+    uint64_t delta;
+    if (!GetVarint(&block_pos_, block_end_, &delta)) {
+      error_ = "Truncated stack record";
+      return false;
+    }
+    frame = (frame + ZigZagDecode(delta)) & pointer_mask_;
+    if (!defined)
+      frames_.push_back(reinterpret_cast<void*>(frame));
+  }
+  return true;
+}
+
+bool TraceReader::NextVersion2(Event* event) {
+  while (block_events_left_ == 0) {
+    // Blocks without events, such as the index, are skipped as a whole.
+    if (block_pos_ != block_end_ && block_num_events_ > 0) {
+      error_ = "Unexpected data at the end of the block";
+      return false;
+    }
+    if (held_block_ != kNoBlock) {
+      if (streamer_)
+        streamer_->Release(held_block_);
+      else
+        prefetcher_->Release(held_block_);
+      held_block_ = kNoBlock;
+    }
+    if (streamer_) {
+      if (!StartStreamBlock())
+        return false;
+      continue;
+    }
+    if (next_block_ == blocks_.size()) {
+      error_ = blocks_error_;
+      return false;
+    }
+    if (!StartBlock(next_block_++))
+      return false;
+  }
+
+  for (;;) {
+    if (block_pos_ == block_end_) {
+      error_ = "Truncated block";
+      return false;
+    }
+    uint8_t tag = *block_pos_++;
+    if (tag != trace_format::kStackRecord)
+      break;
+    if (!ReadStack())
+      return false;
+  }
+
+  const uint8_t tag = block_pos_[-1];
+  uint64_t delta;
+  if (!GetVarint(&block_pos_, block_end_, &delta)) {
+    error_ = "Truncated record";
+    return false;
+  }
+  prev_ptr_ = (prev_ptr_ + ZigZagDecode(delta)) & pointer_mask_;
+  event->ptr = reinterpret_cast<const void*>(prev_ptr_);
+  event->offset = block_offset_;
+
+  if (tag == trace_format::kAllocRecord) {
+    uint64_t stack_id;
+    if (!GetVarint(&block_pos_, block_end_, &event->size) ||
+        !GetVarint(&block_pos_, block_end_, &stack_id)) {
+      error_ = "Truncated record";
+      return false;
+    }
+    if (stack_id >= stacks_.size() ||
+        stacks_[stack_id].depth == kUndefinedStack) {
+      error_ = "Undefined stack id";
+      return false;
+    }
+    const Stack& stack = stacks_[stack_id];
+    event->type = Event::kAlloc;
+    event->depth = stack.depth;
+    event->stack = frames_.data() + stack.begin;
+  } else if (tag == trace_format::kFreeRecord) {
+    event->type = Event::kFree;
+    event->size = 0;
+    event->depth = 0;
+    event->stack = NULL;
+  } else {
+    error_ = "Unknown record tag";
+    return false;
+  }
+  --block_events_left_;
+  return true;
+}
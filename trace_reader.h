@@ -0,0 +1,338 @@
+#ifndef TRACE_READER_H_
+#define TRACE_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "trace_format.h"
+
+// Reads an allocation trace recorded from a running process. The whole file is
+// mapped into memory and events are decoded in place.
+//
+// Both the compact version 2 and 3 formats described in trace_format.h and the
+// legacy format are supported. A legacy trace starts with the address and size
+// of the binary's mapping, as two uint64_t values, followed by a sequence of
+// records laid out like these structs in the recorded process:
+//   struct Alloc { uint32_t code; const void* ptr; uint32_t size;
+//                  uint32_t depth; }   // Followed by void* stack[depth].
+//   struct Free { uint32_t code; const void* ptr; };
+// Legacy traces have no header that says how wide the pointers are or in which
+// byte order they were written, so that has to be set with set_legacy_format()
+// unless it is the same as in this process. Call stacks of legacy traces in
+// the layout of this process are returned as pointers into the mapping.
+//
+// Traces from processes with other pointer widths or byte orders are read as
+// if they had been recorded in this one. Version 2 and 3 call stacks are
+// decoded into a dictionary, once per stack.
+//
+// Compressed version 2 blocks can be decompressed ahead of time on worker
+// threads, so that the thread calling Next() only has to decode records.
+// Version 2 traces can also be read from any event on, through their index.
+//
+// Version 2 and 3 traces can also be read from a pipe or socket while they are
+// being written, see OpenStream().
+class TraceReader {
+ public:
+  struct Event {
+    enum Type {
+      kAlloc,
+      kFree,
+    };
+    Type type;
+    const void* ptr;
+
+    // Only set for kAlloc. |stack| remains valid until the next call to
+    // Next().
+    uint64_t size;
+    uint32_t depth;
+    void* const* stack;
+
+    // Offset of the record within the file, or for version 2 traces, of the
+    // block that contains it.
+    size_t offset;
+  };
+
+  // A module loaded in the recorded process.
+  struct Module {
+    uint64_t addr;
+    uint64_t size;
+    std::string name;
+  };
+
+  TraceReader();
+  ~TraceReader();
+
+  // Map the trace at |path| and read its header. Returns false on failure, in
+  // which case error() describes what went wrong. If |num_threads| is not zero,
+  // compressed blocks are decompressed on that many worker threads.
+  bool Open(const char* path, int num_threads = 0);
+
+  // Read a version 2 or 3 trace from |fd|, which may be a pipe or a socket,
+  // and read its header. Blocks are read and decompressed on a thread while
+  // the previous one is decoded. That thread stops reading from |fd| while the
+  // caller is behind, so that a writer on the other end is held back rather
+  // than the trace being buffered without bound. Streams cannot seek. Takes
+  // ownership of |fd|, even on failure.
+  bool OpenStream(int fd);
+
+  void Close();
+
+  // The layout of legacy traces that are opened from now on: the size of their
+  // pointers, 4 or 8, and their byte order. Defaults to that of this process.
+  void set_legacy_format(int pointer_size, trace_format::ByteOrder byte_order) {
+    legacy_pointer_size_ = pointer_size;
+    legacy_byte_order_ = byte_order;
+  }
+
+  // Read the next event into |event|. Returns false at the end of the trace or
+  // if the next record is invalid. In the latter case error() is set.
+  bool Next(Event* event);
+
+  // Position the reader so that the next call to Next() returns event |index|,
+  // counting from 0. Version 2 traces start decoding at the block that contains
+  // the event, which is found through the block index. Legacy traces are read
+  // from the start. Returns false if |index| is past the end of the trace or
+  // the trace is invalid before it.
+  bool SeekToEvent(uint64_t index);
+
+  // Position the reader at the start of the last block whose first event is no
+  // later than |time|, as set by TraceWriter::set_time(). Not supported for
+  // legacy traces.
+  bool SeekToTime(uint64_t time);
+
+  // Index of the event that the next call to Next() returns.
+  uint64_t event_index() const {
+    return next_event_index_;
+  }
+
+  // Time of the first event of the current block, or 0 if unknown.
+  uint64_t time() const {
+    return block_time_;
+  }
+
+  // Returns NULL if there was no error.
+  const char* error() const {
+    return error_;
+  }
+
+  uint64_t mapping_addr() const {
+    return mapping_addr_;
+  }
+  uint64_t mapping_size() const {
+    return mapping_size_;
+  }
+
+  // Trace format version. Legacy traces are version 1.
+  uint32_t version() const {
+    return version_;
+  }
+
+  // The byte order in which the trace was written, and the size of pointers in
+  // the recorded process.
+  trace_format::ByteOrder byte_order() const {
+    return byte_order_;
+  }
+  int pointer_size() const {
+    return pointer_size_;
+  }
+
+  // What time() is measured with.
+  trace_format::ClockSource clock() const {
+    return clock_;
+  }
+
+  // Modules loaded in the recorded process, if the trace lists them.
+  const std::vector<Module>& modules() const {
+    return modules_;
+  }
+
+  // Whether the trace is being read with OpenStream().
+  bool is_stream() const {
+    return stream_fd_ >= 0;
+  }
+
+  // Number of version 2 blocks, and whether they were found through the index
+  // at the end of the trace rather than by scanning the file. Blocks of streams
+  // are not counted.
+  size_t num_blocks() const {
+    return blocks_.size();
+  }
+  bool has_index() const {
+    return has_index_;
+  }
+
+  // Current read offset and total size of the trace, in bytes. The size of a
+  // stream is that of its header.
+  size_t offset() const {
+    return offset_;
+  }
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  static const uint32_t kAllocCode = 0xdeadbeef;
+  static const uint32_t kFreeCode = 0xcafebabe;
+
+  static const size_t kHeaderSize = 2 * sizeof(uint64_t);
+
+  // Copy |size| bytes at |offset| into |value|.
+  void Read(size_t offset, void* value, size_t size) const;
+
+  // Read an integer at |offset|, in the byte order of the trace.
+  uint32_t Read32(size_t offset) const;
+  uint64_t Read64(size_t offset) const;
+
+  // Read a pointer of the recorded process at |offset|.
+  uintptr_t ReadPointer(size_t offset) const;
+
+  // Convert a struct from trace_format.h to the byte order of this process.
+  void Normalize(trace_format::BlockHeader* header) const;
+
+  // A version 2 block.
+  struct Block {
+    size_t offset;  // Offset of the block header.
+    trace_format::BlockHeader header;
+  };
+
+  class Prefetcher;
+  class Streamer;
+
+  // Read the header of a version 2 or 3 trace, and find its blocks.
+  bool OpenVersion2(int num_threads);
+
+  // Set |pointer_size_| and |pointer_mask_|. Returns false if pointers of
+  // |pointer_size| are not supported.
+  bool SetPointerSize(int pointer_size);
+
+  // Read the module table at |offset|, which ends at |offset_|.
+  bool ReadModules(size_t offset, uint32_t num_modules);
+
+  // Fill |blocks_| from the index at the end of the trace. Returns false if
+  // there is no valid index.
+  bool ReadIndex();
+
+  // Fill |blocks_| by going through the block headers in order.
+  void ScanBlocks();
+
+  // Read and check the header of the block at |offset|. Returns an error
+  // message, or NULL if the block is valid.
+  const char* ReadBlock(size_t offset, Block* block) const;
+
+  // Check the fields of |header| that do not depend on the size of the trace.
+  const char* CheckBlockHeader(const trace_format::BlockHeader& header) const;
+
+  // The payload of |block| as stored in the trace.
+  const uint8_t* Payload(const Block& block) const;
+
+  // Decompress the payload of |block| into |out|, which must have room for
+  // its raw size. Returns false if the payload is corrupt.
+  bool Decompress(const Block& block, uint8_t* out) const;
+
+  bool NextLegacy(Event* event);
+  bool NextVersion2(Event* event);
+
+  // Start decoding block |index| of |blocks_|.
+  bool StartBlock(size_t index);
+
+  // Start decoding the next block from |streamer_|.
+  bool StartStreamBlock();
+
+  // Start decoding |block|, whose raw payload is at |payload|.
+  void SetBlock(const Block& block, const uint8_t* payload);
+
+  // Decode a stack record from the current block into |stacks_|.
+  bool ReadStack();
+
+  // A call stack in |frames_|.
+  struct Stack {
+    uint32_t begin;
+    uint32_t depth;
+  };
+  static const uint32_t kUndefinedStack = 0xffffffff;
+
+  const char* data_;
+  size_t size_;
+  size_t offset_;
+
+  // The file descriptor of a stream, or -1. The header of a stream is copied
+  // into |stream_header_|, which |data_| then points to.
+  int stream_fd_;
+  std::vector<char> stream_header_;
+
+  uint32_t version_;
+  uint64_t mapping_addr_;
+  uint64_t mapping_size_;
+
+  trace_format::ByteOrder byte_order_;
+  bool swap_;  // Whether |byte_order_| differs from that of this process.
+  int pointer_size_;
+  uintptr_t pointer_mask_;  // Truncates decoded pointers to |pointer_size_|.
+  trace_format::ClockSource clock_;
+  std::vector<Module> modules_;
+
+  int legacy_pointer_size_;
+  trace_format::ByteOrder legacy_byte_order_;
+
+  // Layout of legacy records, given their pointer size. Records in the layout
+  // of this process are decoded in place.
+  size_t legacy_ptr_offset_;
+  size_t legacy_alloc_size_;
+  size_t legacy_free_size_;
+  bool legacy_in_place_;
+
+  // Holds the call stack of the last legacy record if it was not decoded in
+  // place.
+  std::vector<void*> legacy_stack_;
+
+  uint64_t next_event_index_;
+
+  // The blocks of a version 2 trace, in order. If the blocks were scanned and
+  // an invalid one was found, it and all blocks after it are left out, and
+  // |blocks_error_| says what was wrong.
+  std::vector<Block> blocks_;
+  bool has_index_;
+  const char* blocks_error_;
+
+  // Number of decompression threads, or 0 if blocks are decompressed on the
+  // calling thread.
+  int num_threads_;
+
+  // Index of the next block to decode.
+  size_t next_block_;
+
+  // Decompresses blocks ahead of time, if there are worker threads.
+  std::unique_ptr<Prefetcher> prefetcher_;
+
+  // Reads the blocks of a stream.
+  std::unique_ptr<Streamer> streamer_;
+
+  // The block currently taken from |prefetcher_| or |streamer_|, if any.
+  static const size_t kNoBlock = static_cast<size_t>(-1);
+  size_t held_block_;
+
+  // Holds the current block if it was decompressed on this thread.
+  std::vector<uint8_t> block_buffer_;
+
+  // Decoding state of the current version 2 block.
+  size_t block_offset_;
+  const uint8_t* block_pos_;
+  const uint8_t* block_end_;
+  uint32_t block_num_events_;
+  uint32_t block_events_left_;
+  uint64_t block_time_;
+  uintptr_t prev_ptr_;
+
+  // Version 2 call stacks, indexed by id. Undefined stacks have a depth of
+  // kUndefinedStack.
+  std::vector<Stack> stacks_;
+  std::vector<void*> frames_;
+
+  const char* error_;
+};
+
+#endif  // TRACE_READER_H_
@@ -0,0 +1,608 @@
+#include "trace_reader.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/macros.h"
+#include "gtest/gtest.h"
+#include "trace_format.h"
+#include "trace_writer.h"
+
+class TraceReaderTest : public ::testing::Test {
+ public:
+  TraceReaderTest() {}
+
+  void SetUp() override {
+    char path[] = "/tmp/trace_reader_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    path_ = path;
+  }
+  void TearDown() override {
+    unlink(path_.c_str());
+  }
+
+ protected:
+  void Append(const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    contents_.insert(contents_.end(), bytes, bytes + size);
+  }
+  void AppendHeader(uint64_t addr, uint64_t size) {
+    Append(&addr, sizeof(addr));
+    Append(&size, sizeof(size));
+  }
+  void AppendAlloc(uint64_t ptr, uint32_t size,
+                   const std::vector<uint64_t>& stack) {
+    const uint32_t code_and_pad[] = { 0xdeadbeef, 0 };
+    const uint32_t depth = stack.size();
+    Append(code_and_pad, sizeof(code_and_pad));
+    Append(&ptr, sizeof(ptr));
+    Append(&size, sizeof(size));
+    Append(&depth, sizeof(depth));
+    Append(stack.data(), stack.size() * sizeof(uint64_t));
+  }
+  void AppendFree(uint64_t ptr) {
+    const uint32_t code_and_pad[] = { 0xcafebabe, 0 };
+    Append(code_and_pad, sizeof(code_and_pad));
+    Append(&ptr, sizeof(ptr));
+  }
+  void WriteFile() {
+    FILE* fp = fopen(path_.c_str(), "wb");
+    ASSERT_TRUE(fp);
+    if (!contents_.empty())
+      fwrite(contents_.data(), 1, contents_.size(), fp);
+    fclose(fp);
+  }
+
+  // Enough events for several blocks, with stacks reused across blocks.
+  static const int kNumVersion2Events = 100000;
+
+  void WriteVersion2Trace(bool compression) {
+    stacks_.resize(20);
+    for (size_t i = 0; i < stacks_.size(); ++i) {
+      stacks_[i].clear();
+      for (size_t j = 0; j <= i; ++j)
+        stacks_[i].push_back(reinterpret_cast<void*>(0x400000 + i * 0x100 + j));
+    }
+
+    TraceWriter writer;
+    ASSERT_TRUE(writer.Open(path_.c_str(), 0x400000, 0x100000));
+    writer.set_compression(compression);
+    for (int i = 0; i < kNumVersion2Events; ++i) {
+      writer.set_time(i * 1000ULL);
+      const void* ptr = reinterpret_cast<const void*>(0x7f0000000000ULL +
+                                                      (i / 2) * 48);
+      if (i % 2 == 0) {
+        const std::vector<void*>& stack = stacks_[(i / 2) % stacks_.size()];
+        writer.WriteAlloc(ptr, i * 1000ULL, stack.size(), stack.data());
+      } else {
+        writer.WriteFree(ptr);
+      }
+    }
+    ASSERT_TRUE(writer.Close());
+    EXPECT_EQ(stacks_.size(), writer.num_stacks());
+  }
+
+  // Check that |event| is event |i| of WriteVersion2Trace().
+  void ExpectVersion2Event(int i, const TraceReader::Event& event) {
+    EXPECT_EQ(reinterpret_cast<const void*>(0x7f0000000000ULL + (i / 2) * 48),
+              event.ptr);
+    if (i % 2 == 0) {
+      const std::vector<void*>& stack = stacks_[(i / 2) % stacks_.size()];
+      ASSERT_EQ(TraceReader::Event::kAlloc, event.type);
+      EXPECT_EQ(i * 1000ULL, event.size);
+      ASSERT_EQ(stack.size(), event.depth);
+      EXPECT_TRUE(std::equal(stack.begin(), stack.end(), event.stack));
+    } else {
+      EXPECT_EQ(TraceReader::Event::kFree, event.type);
+    }
+  }
+
+  // Check that |reader| returns exactly the events of WriteVersion2Trace().
+  void ExpectVersion2Events(TraceReader* reader) {
+    TraceReader::Event event;
+    for (int i = 0; i < kNumVersion2Events; ++i) {
+      ASSERT_TRUE(reader->Next(&event)) << reader->error();
+      ExpectVersion2Event(i, event);
+    }
+    EXPECT_FALSE(reader->Next(&event));
+    EXPECT_EQ(NULL, reader->error());
+    EXPECT_GT(event.offset, 0U);
+  }
+
+  std::string path_;
+  std::vector<char> contents_;
+  std::vector<std::vector<void*>> stacks_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(TraceReaderTest);
+};
+
+TEST_F(TraceReaderTest, ReadEvents) {
+  AppendHeader(0x400000, 0x100000);
+  AppendAlloc(0x1000, 32, {0x401000, 0x402000, 0x403000});
+  AppendAlloc(0x2000, 64, {});
+  AppendFree(0x1000);
+  WriteFile();
+
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  EXPECT_EQ(0x400000U, reader.mapping_addr());
+  EXPECT_EQ(0x100000U, reader.mapping_size());
+
+  TraceReader::Event event;
+  ASSERT_TRUE(reader.Next(&event));
+  EXPECT_EQ(TraceReader::Event::kAlloc, event.type);
+  EXPECT_EQ(reinterpret_cast<const void*>(0x1000), event.ptr);
+  EXPECT_EQ(32U, event.size);
+  ASSERT_EQ(3U, event.depth);
+  EXPECT_EQ(reinterpret_cast<void*>(0x402000), event.stack[1]);
+  EXPECT_EQ(16U, event.offset);
+
+  ASSERT_TRUE(reader.Next(&event));
+  EXPECT_EQ(TraceReader::Event::kAlloc, event.type);
+  EXPECT_EQ(64U, event.size);
+  EXPECT_EQ(0U, event.depth);
+
+  ASSERT_TRUE(reader.Next(&event));
+  EXPECT_EQ(TraceReader::Event::kFree, event.type);
+  EXPECT_EQ(reinterpret_cast<const void*>(0x1000), event.ptr);
+
+  EXPECT_FALSE(reader.Next(&event));
+  EXPECT_EQ(NULL, reader.error());
+  EXPECT_EQ(contents_.size(), reader.offset());
+}
+
+TEST_F(TraceReaderTest, TruncatedStack) {
+  AppendHeader(0x400000, 0x100000);
+  AppendAlloc(0x1000, 32, {0x401000, 0x402000});
+  contents_.resize(contents_.size() - 4);
+  WriteFile();
+
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  TraceReader::Event event;
+  EXPECT_FALSE(reader.Next(&event));
+  EXPECT_TRUE(reader.error());
+  EXPECT_EQ(16U, reader.offset());
+}
+
+TEST_F(TraceReaderTest, HugeDepth) {
+  // A corrupt depth must not make the reader run past the end of the file.
+  AppendHeader(0x400000, 0x100000);
+  AppendAlloc(0x1000, 32, {0x401000});
+  uint32_t depth = 0xffffffff;
+  memcpy(&contents_[16 + 20], &depth, sizeof(depth));
+  WriteFile();
+
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  TraceReader::Event event;
+  EXPECT_FALSE(reader.Next(&event));
+  EXPECT_TRUE(reader.error());
+}
+
+TEST_F(TraceReaderTest, UnknownCode) {
+  AppendHeader(0x400000, 0x100000);
+  AppendFree(0x1000);
+  const uint32_t bad_code[] = { 0x12345678, 0 };
+  Append(bad_code, sizeof(bad_code));
+  WriteFile();
+
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  TraceReader::Event event;
+  EXPECT_TRUE(reader.Next(&event));
+  EXPECT_FALSE(reader.Next(&event));
+  EXPECT_TRUE(reader.error());
+  EXPECT_EQ(32U, reader.offset());
+}
+
+TEST_F(TraceReaderTest, MissingHeader) {
+  AppendHeader(0x400000, 0x100000);
+  contents_.resize(8);
+  WriteFile();
+
+  TraceReader reader;
+  EXPECT_FALSE(reader.Open(path_.c_str()));
+  EXPECT_TRUE(reader.error());
+  EXPECT_FALSE(reader.Open("/nonexistent/trace"));
+}
+
+TEST_F(TraceReaderTest, Version2) {
+  WriteVersion2Trace(true);
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  EXPECT_EQ(trace_format::kVersion, reader.version());
+  EXPECT_EQ(trace_format::kHostByteOrder, reader.byte_order());
+  EXPECT_EQ(static_cast<int>(sizeof(void*)), reader.pointer_size());
+  EXPECT_EQ(0x400000U, reader.mapping_addr());
+  EXPECT_EQ(0x100000U, reader.mapping_size());
+  EXPECT_TRUE(reader.has_index());
+  EXPECT_GT(reader.num_blocks(), 1U);
+  ExpectVersion2Events(&reader);
+}
+
+TEST_F(TraceReaderTest, Version2Uncompressed) {
+  WriteVersion2Trace(false);
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str(), 2));
+  EXPECT_TRUE(reader.has_index());
+  ExpectVersion2Events(&reader);
+}
+
+TEST_F(TraceReaderTest, Version2Threads) {
+  WriteVersion2Trace(true);
+  for (int num_threads = 1; num_threads <= 4; ++num_threads) {
+    TraceReader reader;
+    ASSERT_TRUE(reader.Open(path_.c_str(), num_threads));
+    ExpectVersion2Events(&reader);
+  }
+
+  // Stop reading in the middle of the trace.
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str(), 2));
+  TraceReader::Event event;
+  for (int i = 0; i < kNumVersion2Events / 2; ++i)
+    ASSERT_TRUE(reader.Next(&event));
+  reader.Close();
+}
+
+TEST_F(TraceReaderTest, Version2WithoutIndex) {
+  WriteVersion2Trace(true);
+  struct stat st;
+  ASSERT_EQ(0, stat(path_.c_str(), &st));
+  ASSERT_EQ(0, truncate(path_.c_str(), st.st_size - 1));
+
+  // The blocks are found by scanning, and all events are still read before the
+  // truncated index block is reported.
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str(), 2));
+  EXPECT_FALSE(reader.has_index());
+  TraceReader::Event event;
+  for (int i = 0; i < kNumVersion2Events; ++i)
+    ASSERT_TRUE(reader.Next(&event)) << reader.error();
+  EXPECT_FALSE(reader.Next(&event));
+  EXPECT_TRUE(reader.error());
+}
+
+TEST_F(TraceReaderTest, Version2CorruptBlock) {
+  TraceWriter writer;
+  ASSERT_TRUE(writer.Open(path_.c_str(), 0x400000, 0x100000));
+  void* stack[] = { reinterpret_cast<void*>(0x401000) };
+  for (int i = 0; i < 1000; ++i)
+    writer.WriteAlloc(reinterpret_cast<void*>(0x1000), 16, 1, stack);
+  ASSERT_TRUE(writer.Close());
+
+  // Overwrite the start of the compressed payload.
+  FILE* fp = fopen(path_.c_str(), "r+b");
+  ASSERT_TRUE(fp);
+  fseek(fp, sizeof(trace_format::FileHeader) + sizeof(trace_format::BlockHeader),
+        SEEK_SET);
+  fputc(0xff, fp);
+  fclose(fp);
+
+  for (int num_threads = 0; num_threads <= 1; ++num_threads) {
+    TraceReader reader;
+    ASSERT_TRUE(reader.Open(path_.c_str(), num_threads));
+    TraceReader::Event event;
+    EXPECT_FALSE(reader.Next(&event));
+    EXPECT_TRUE(reader.error());
+  }
+}
+
+TEST_F(TraceReaderTest, EmptyIndexBlock) {
+  // A header padded to a page, followed by an empty block whose last fields
+  // read as an index trailer that points at the block itself, so that the
+  // block is taken for an index that is too small to hold the trailer.
+  const uint32_t kHeaderSize = 4096 - sizeof(trace_format::BlockHeader);
+  trace_format::FileHeader header = {};
+  memcpy(header.magic, trace_format::kMagic, sizeof(header.magic));
+  header.version = trace_format::kVersion;
+  header.header_size = kHeaderSize;
+  header.byte_order = trace_format::kHostByteOrder;
+  header.pointer_size = sizeof(void*);
+  Append(&header, sizeof(header));
+  contents_.resize(kHeaderSize);
+  trace_format::BlockHeader block = {};
+  block.first_event_index = kHeaderSize;
+  memcpy(&block.first_event_time, trace_format::kIndexMagic,
+         sizeof(block.first_event_time));
+  Append(&block, sizeof(block));
+  WriteFile();
+
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str())) << reader.error();
+  EXPECT_FALSE(reader.has_index());
+  TraceReader::Event event;
+  EXPECT_FALSE(reader.Next(&event));
+}
+
+TEST_F(TraceReaderTest, Version2Seek) {
+  WriteVersion2Trace(true);
+  const int kIndices[] = { 12345, 0, 1, kNumVersion2Events - 1, 54321, 54322 };
+  for (int num_threads = 0; num_threads <= 2; num_threads += 2) {
+    TraceReader reader;
+    ASSERT_TRUE(reader.Open(path_.c_str(), num_threads));
+    TraceReader::Event event;
+    for (int index : kIndices) {
+      ASSERT_TRUE(reader.SeekToEvent(index)) << reader.error();
+      EXPECT_EQ(static_cast<uint64_t>(index), reader.event_index());
+      ASSERT_TRUE(reader.Next(&event)) << reader.error();
+      ExpectVersion2Event(index, event);
+      EXPECT_EQ(static_cast<uint64_t>(index) + 1, reader.event_index());
+    }
+
+    // Seeking to the end leaves nothing to read.
+    ASSERT_TRUE(reader.SeekToEvent(kNumVersion2Events));
+    EXPECT_FALSE(reader.Next(&event));
+    EXPECT_EQ(NULL, reader.error());
+    EXPECT_FALSE(reader.SeekToEvent(kNumVersion2Events + 1));
+
+    // Events were timed 1000 ns apart.
+    const uint64_t kTime = 70000500;
+    ASSERT_TRUE(reader.SeekToTime(kTime));
+    EXPECT_LE(reader.event_index(), kTime / 1000);
+    while (reader.event_index() <= kTime / 1000)
+      ASSERT_TRUE(reader.Next(&event));
+    EXPECT_LE(reader.time(), kTime);
+    ExpectVersion2Event(kTime / 1000, event);
+  }
+}
+
+TEST_F(TraceReaderTest, LegacySeek) {
+  AppendHeader(0x400000, 0x100000);
+  for (int i = 0; i < 10; ++i)
+    AppendAlloc(0x1000 + i * 0x10, 16, std::vector<uint64_t>(1, 0x401000));
+  WriteFile();
+
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  TraceReader::Event event;
+  ASSERT_TRUE(reader.SeekToEvent(7));
+  ASSERT_TRUE(reader.Next(&event));
+  EXPECT_EQ(reinterpret_cast<const void*>(0x1070), event.ptr);
+  ASSERT_TRUE(reader.SeekToEvent(2));
+  ASSERT_TRUE(reader.Next(&event));
+  EXPECT_EQ(reinterpret_cast<const void*>(0x1020), event.ptr);
+  EXPECT_FALSE(reader.SeekToEvent(11));
+  EXPECT_FALSE(reader.SeekToTime(0));
+}
+
+TEST_F(TraceReaderTest, Version3Header) {
+  TraceWriter writer;
+  writer.set_clock(trace_format::kMonotonicClock);
+  writer.AddModule(0x400000, 0x100000, "/usr/bin/program");
+  writer.AddModule(0x7f0000001000, 0x2000, "/lib/libc.so.6");
+  writer.AddModule(0x7f0000100000, 0x1000, "");
+  ASSERT_TRUE(writer.Open(path_.c_str(), 0x400000, 0x100000));
+  writer.WriteFree(reinterpret_cast<void*>(0x1000));
+  ASSERT_TRUE(writer.Close());
+
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  EXPECT_EQ(trace_format::kMonotonicClock, reader.clock());
+  ASSERT_EQ(3U, reader.modules().size());
+  EXPECT_EQ(0x7f0000001000U, reader.modules()[1].addr);
+  EXPECT_EQ(0x2000U, reader.modules()[1].size);
+  EXPECT_EQ("/lib/libc.so.6", reader.modules()[1].name);
+  EXPECT_EQ("", reader.modules()[2].name);
+  TraceReader::Event event;
+  ASSERT_TRUE(reader.Next(&event)) << reader.error();
+  EXPECT_EQ(reinterpret_cast<const void*>(0x1000), event.ptr);
+}
+
+TEST_F(TraceReaderTest, Version3PointerSize4) {
+  // Deltas wrap around at 32 bits, so going from the top of the address space
+  // to the bottom is a small step.
+  const uintptr_t kPointers[] = { 0xfffffff0, 0x10, 0x80000000, 0x7ffffff8 };
+  void* stack[] = { reinterpret_cast<void*>(0xfffff000),
+                    reinterpret_cast<void*>(0x1000) };
+  TraceWriter writer;
+  writer.set_pointer_size(4);
+  ASSERT_TRUE(writer.Open(path_.c_str(), 0x10000, 0x1000));
+  for (uintptr_t ptr : kPointers)
+    writer.WriteAlloc(reinterpret_cast<void*>(ptr), 16, 2, stack);
+  ASSERT_TRUE(writer.Close());
+
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  EXPECT_EQ(4, reader.pointer_size());
+  TraceReader::Event event;
+  for (uintptr_t ptr : kPointers) {
+    ASSERT_TRUE(reader.Next(&event)) << reader.error();
+    EXPECT_EQ(reinterpret_cast<const void*>(ptr), event.ptr);
+    ASSERT_EQ(2U, event.depth);
+    EXPECT_EQ(stack[0], event.stack[0]);
+    EXPECT_EQ(stack[1], event.stack[1]);
+  }
+  EXPECT_FALSE(reader.Next(&event));
+  EXPECT_EQ(NULL, reader.error());
+}
+
+TEST_F(TraceReaderTest, Version3OtherByteOrder) {
+  // A trace without an index, written in the other byte order.
+  const uint8_t kRecords[] = {
+    trace_format::kStackRecord, 0, 1, 0x80, 0x80, 0x02,  // Stack 0: 0x4000.
+    trace_format::kAllocRecord, 0x80, 0x40, 32, 0,       // 0x1000, 32 bytes.
+    trace_format::kFreeRecord, 0,                        // 0x1000.
+  };
+  trace_format::FileHeader header = {};
+  memcpy(header.magic, trace_format::kMagic, sizeof(header.magic));
+  header.version = trace_format::ByteSwap(trace_format::kVersion);
+  header.header_size = trace_format::ByteSwap(
+      static_cast<uint32_t>(sizeof(header)));
+  header.mapping_addr = trace_format::ByteSwap(uint64_t(0x400000));
+  header.mapping_size = trace_format::ByteSwap(uint64_t(0x100000));
+  header.byte_order = trace_format::kHostByteOrder == trace_format::kLittleEndian
+                          ? trace_format::kBigEndian
+                          : trace_format::kLittleEndian;
+  header.pointer_size = 8;
+  header.clock = trace_format::ByteSwap(
+      static_cast<uint16_t>(trace_format::kRealtimeClock));
+  Append(&header, sizeof(header));
+  trace_format::BlockHeader block = {};
+  block.payload_size = block.raw_size = trace_format::ByteSwap(
+      static_cast<uint32_t>(sizeof(kRecords)));
+  block.num_events = trace_format::ByteSwap(uint32_t(2));
+  block.first_event_time = trace_format::ByteSwap(uint64_t(12345));
+  Append(&block, sizeof(block));
+  Append(kRecords, sizeof(kRecords));
+  WriteFile();
+
+  TraceReader reader;
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  EXPECT_EQ(header.byte_order, reader.byte_order());
+  EXPECT_EQ(0x400000U, reader.mapping_addr());
+  EXPECT_EQ(0x100000U, reader.mapping_size());
+  EXPECT_EQ(trace_format::kRealtimeClock, reader.clock());
+  EXPECT_FALSE(reader.has_index());
+  TraceReader::Event event;
+  ASSERT_TRUE(reader.Next(&event)) << reader.error();
+  EXPECT_EQ(TraceReader::Event::kAlloc, event.type);
+  EXPECT_EQ(reinterpret_cast<const void*>(0x1000), event.ptr);
+  EXPECT_EQ(32U, event.size);
+  ASSERT_EQ(1U, event.depth);
+  EXPECT_EQ(reinterpret_cast<void*>(0x4000), event.stack[0]);
+  EXPECT_EQ(12345U, reader.time());
+  ASSERT_TRUE(reader.Next(&event)) << reader.error();
+  EXPECT_EQ(TraceReader::Event::kFree, event.type);
+  EXPECT_EQ(reinterpret_cast<const void*>(0x1000), event.ptr);
+  EXPECT_FALSE(reader.Next(&event));
+  EXPECT_EQ(NULL, reader.error());
+}
+
+TEST_F(TraceReaderTest, Legacy32Bit) {
+  // Records from a 32-bit process are packed without padding.
+  AppendHeader(0x10000, 0x1000);
+  const uint32_t kAlloc[] = { 0xdeadbeef, 0x2000, 24, 2, 0x10100, 0x10200 };
+  const uint32_t kFree[] = { 0xcafebabe, 0x2000 };
+  Append(kAlloc, sizeof(kAlloc));
+  Append(kFree, sizeof(kFree));
+  WriteFile();
+
+  TraceReader reader;
+  reader.set_legacy_format(4, trace_format::kHostByteOrder);
+  ASSERT_TRUE(reader.Open(path_.c_str()));
+  EXPECT_EQ(4, reader.pointer_size());
+  TraceReader::Event event;
+  ASSERT_TRUE(reader.Next(&event)) << reader.error();
+  EXPECT_EQ(TraceReader::Event::kAlloc, event.type);
+  EXPECT_EQ(reinterpret_cast<const void*>(0x2000), event.ptr);
+  EXPECT_EQ(24U, event.size);
+  ASSERT_EQ(2U, event.depth);
+  EXPECT_EQ(reinterpret_cast<void*>(0x10200), event.stack[1]);
+  ASSERT_TRUE(reader.Next(&event)) << reader.error();
+  EXPECT_EQ(TraceReader::Event::kFree, event.type);
+  EXPECT_EQ(reinterpret_cast<const void*>(0x2000), event.ptr);
+  EXPECT_FALSE(reader.Next(&event));
+  EXPECT_EQ(NULL, reader.error());
+  EXPECT_EQ(contents_.size(), reader.offset());
+}
+
+TEST_F(TraceReaderTest, UnsupportedPointerSize) {
+  AppendHeader(0x10000, 0x1000);
+  WriteFile();
+
+  TraceReader reader;
+  reader.set_legacy_format(2, trace_format::kHostByteOrder);
+  EXPECT_FALSE(reader.Open(path_.c_str()));
+  EXPECT_TRUE(reader.error());
+}
+
+TEST_F(TraceReaderTest, Stream) {
+  WriteVersion2Trace(true);
+  FILE* fp = fopen(path_.c_str(), "rb");
+  ASSERT_TRUE(fp);
+  std::vector<char> trace(1 << 20);
+  trace.resize(fread(trace.data(), 1, trace.size(), fp));
+  fclose(fp);
+
+  // The pipe holds less than the trace, so the writer has to wait for the
+  // reader.
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  std::thread writer([&trace, fds] {
+    size_t done = 0;
+    while (done < trace.size()) {
+      ssize_t result = write(fds[1], &trace[done], trace.size() - done);
+      if (result <= 0)
+        break;
+      done += result;
+    }
+    close(fds[1]);
+  });
+
+  TraceReader reader;
+  ASSERT_TRUE(reader.OpenStream(fds[0])) << reader.error();
+  EXPECT_TRUE(reader.is_stream());
+  EXPECT_EQ(0x400000U, reader.mapping_addr());
+  ExpectVersion2Events(&reader);
+  EXPECT_FALSE(reader.SeekToEvent(0));
+  writer.join();
+}
+
+TEST_F(TraceReaderTest, StreamFromWriter) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  TraceWriter writer;
+  ASSERT_TRUE(writer.OpenFd(fds[1], 0x400000, 0x100000));
+  writer.WriteFree(reinterpret_cast<void*>(0x1000));
+  ASSERT_TRUE(writer.Flush());
+
+  // Flushed events can be read before the trace is complete.
+  TraceReader reader;
+  ASSERT_TRUE(reader.OpenStream(fds[0])) << reader.error();
+  TraceReader::Event event;
+  ASSERT_TRUE(reader.Next(&event)) << reader.error();
+  EXPECT_EQ(reinterpret_cast<const void*>(0x1000), event.ptr);
+
+  writer.WriteFree(reinterpret_cast<void*>(0x2000));
+  ASSERT_TRUE(writer.Close());
+  ASSERT_TRUE(reader.Next(&event)) << reader.error();
+  EXPECT_EQ(reinterpret_cast<const void*>(0x2000), event.ptr);
+  EXPECT_FALSE(reader.Next(&event));
+  EXPECT_EQ(NULL, reader.error());
+}
+
+TEST_F(TraceReaderTest, TruncatedStream) {
+  WriteVersion2Trace(true);
+  int fd = open(path_.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  struct stat st;
+  ASSERT_EQ(0, fstat(fd, &st));
+  ASSERT_EQ(0, truncate(path_.c_str(), st.st_size / 2));
+
+  TraceReader reader;
+  ASSERT_TRUE(reader.OpenStream(fd)) << reader.error();
+  TraceReader::Event event;
+  while (reader.Next(&event)) {
+  }
+  EXPECT_TRUE(reader.error());
+  EXPECT_GT(reader.event_index(), 0U);
+
+  // Closing the reader while it waits for more of a stream stops its thread.
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  TraceWriter writer;
+  ASSERT_TRUE(writer.OpenFd(fds[1], 0, 0));
+  ASSERT_TRUE(writer.Flush());
+  ASSERT_TRUE(reader.OpenStream(fds[0]));
+  reader.Close();
+
+  // The writer fails once the reader is gone.
+  signal(SIGPIPE, SIG_IGN);
+  EXPECT_FALSE(writer.Close());
+  signal(SIGPIPE, SIG_DFL);
+}
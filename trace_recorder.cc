@@ -0,0 +1,561 @@
+// Records the allocations of a process into a trace that the replay tool can
+// read. Build libtrace_recorder.so and preload it:
+//
+//   TRACE_RECORDER_FILE=out.trace LD_PRELOAD=./libtrace_recorder.so PROGRAM
+//
+// Options, read from the environment when the library is loaded:
+//   TRACE_RECORDER_FILE         Trace to write. A "%p" in it is replaced by
+//                               the process id, so that child processes that
+//                               inherit the environment write their own
+//                               traces. Defaults to trace.%p. "unix:PATH"
+//                               streams the trace to the replay tool that is
+//                               listening on the socket at PATH instead.
+//   TRACE_RECORDER_STACK_DEPTH  Number of call stack frames to record, at most
+//                               kMaxStackDepth. Defaults to 16.
+//   TRACE_RECORDER_MODULE       Record the mapping of the first loaded object
+//                               whose path contains this string, rather than
+//                               that of the main executable.
+//
+// Each thread appends its events to its own ring buffer, so recording an event
+// only costs a stack unwind and a few atomic operations. A background thread
+// drains the buffers and writes the events to the trace in the order they
+// happened, as given by a global sequence number. If a buffer is full, its
+// thread waits for the background thread to catch up. The same holds back the
+// process when it is streaming to a replay tool that falls behind.
+//
+// The trace lists the objects that are loaded when recording starts, and its
+// event times are from CLOCK_REALTIME. It is completed when the process exits
+// normally. Children created by fork() are not recorded.
+
+#include <errno.h>
+#include <execinfo.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <link.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+
+#include "trace_writer.h"
+
+// The allocator that the recording functions below wrap.
+extern "C" {
+void* __libc_malloc(size_t size);
+void __libc_free(void* ptr);
+void* __libc_calloc(size_t num, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+}
+
+namespace {
+
+const int kMaxStackDepth = 32;
+
+// Number of records in each thread's ring buffer. Must be a power of two.
+const uint64_t kRingSize = 1024;
+
+// How often the background thread drains the buffers.
+const useconds_t kDrainIntervalUs = 1000;
+
+// When streaming, events are flushed every this many drains, even if their
+// block is not full, so that the replay tool sees them promptly.
+const int kDrainsPerFlush = 100;
+
+// Frames of the recorder itself at the top of the stack: RecordEvent(),
+// RecordAlloc(), and the intercepted function.
+const int kRecorderFrames = 3;
+
+struct Record {
+  uint64_t seq;
+  const void* ptr;
+  uint64_t size;
+  bool is_alloc;
+  uint32_t depth;
+  void* stack[kMaxStackDepth];
+};
+
+struct ThreadBuffer {
+  enum State {
+    kInUse,
+    kExited,  // The thread exited, but not all of its records were written.
+    kFree,
+  };
+
+  Record records[kRingSize];
+
+  // Number of records added by the owning thread, and written by the
+  // background thread. Record |i| is at records[i % kRingSize].
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+
+  // Set while the owning thread has taken a sequence number but not yet
+  // published the record.
+  std::atomic<bool> recording;
+
+  std::atomic<int> state;
+
+  // All buffers, newest first. Buffers are never unlinked; those of exited
+  // threads are reused once they have been drained.
+  ThreadBuffer* next;
+};
+
+std::atomic<ThreadBuffer*> g_buffers(NULL);
+std::atomic<uint64_t> g_next_seq(0);
+std::atomic<bool> g_enabled(false);
+std::atomic<bool> g_stopping(false);
+
+int g_stack_depth = 16;
+pthread_key_t g_thread_key;
+pthread_t g_writer_thread;
+TraceWriter* g_writer = NULL;
+bool g_streaming = false;
+
+// Initial-exec TLS does not allocate, so these are safe to use from within
+// malloc.
+__thread ThreadBuffer* t_buffer __attribute__((tls_model("initial-exec")));
+
+// Set while the thread is inside the recorder, so that allocations made by the
+// recorder itself, by backtrace() for example, are not recorded.
+__thread bool t_in_recorder __attribute__((tls_model("initial-exec")));
+
+class ScopedRecorderGuard {
+ public:
+  ScopedRecorderGuard() {
+    t_in_recorder = true;
+  }
+  ~ScopedRecorderGuard() {
+    t_in_recorder = false;
+  }
+};
+
+void OnThreadExit(void* arg) {
+  ThreadBuffer* buffer = static_cast<ThreadBuffer*>(arg);
+  buffer->state.store(ThreadBuffer::kExited);
+  t_buffer = NULL;
+}
+
+ThreadBuffer* AcquireBuffer() {
+  ThreadBuffer* buffer = NULL;
+  for (ThreadBuffer* it = g_buffers.load(); it; it = it->next) {
+    int state = ThreadBuffer::kFree;
+    if (it->state.compare_exchange_strong(state, ThreadBuffer::kInUse)) {
+      buffer = it;
+      break;
+    }
+  }
+
+  if (!buffer) {
+    // Buffers are mapped directly so that they do not come from the allocator
+    // being recorded.
+    void* memory = mmap(NULL, sizeof(ThreadBuffer), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+      return NULL;
+    buffer = new (memory) ThreadBuffer;
+    buffer->head.store(0);
+    buffer->tail.store(0);
+    buffer->recording.store(false);
+    buffer->state.store(ThreadBuffer::kInUse);
+    buffer->next = g_buffers.load();
+    while (!g_buffers.compare_exchange_weak(buffer->next, buffer)) {}
+  }
+
+  pthread_setspecific(g_thread_key, buffer);
+  return buffer;
+}
+
+__attribute__((noinline)) void RecordEvent(bool is_alloc, const void* ptr,
+                                           size_t size) {
+  if (!g_enabled.load(std::memory_order_relaxed) || t_in_recorder)
+    return;
+  ScopedRecorderGuard guard;
+
+  ThreadBuffer* buffer = t_buffer;
+  if (!buffer) {
+    buffer = t_buffer = AcquireBuffer();
+    if (!buffer)
+      return;
+  }
+
+  // Wait for room in the buffer.
+  uint64_t head = buffer->head.load(std::memory_order_relaxed);
+  while (head - buffer->tail.load(std::memory_order_acquire) == kRingSize)
+    sched_yield();
+
+  Record* record = &buffer->records[head % kRingSize];
+  record->ptr = ptr;
+  record->size = size;
+  record->is_alloc = is_alloc;
+  record->depth = 0;
+  if (is_alloc) {
+    void* stack[kMaxStackDepth + kRecorderFrames];
+    int depth = backtrace(stack, g_stack_depth + kRecorderFrames);
+    int skip = std::min(depth, kRecorderFrames);
+    record->depth = depth - skip;
+    memcpy(record->stack, stack + skip, record->depth * sizeof(*stack));
+  }
+
+  // Between taking the sequence number and publishing the record, the
+  // background thread waits for this thread. See Drain().
+  buffer->recording.store(true);
+  record->seq = g_next_seq.fetch_add(1);
+  buffer->head.store(head + 1);
+  buffer->recording.store(false);
+}
+
+__attribute__((noinline)) void RecordAlloc(const void* ptr, size_t size) {
+  if (ptr)
+    RecordEvent(true, ptr, size);
+}
+
+__attribute__((noinline)) void RecordFree(const void* ptr) {
+  if (ptr)
+    RecordEvent(false, ptr, 0);
+}
+
+bool CompareSeq(const Record* a, const Record* b) {
+  return a->seq < b->seq;
+}
+
+// Write out all records whose sequence numbers are below a snapshot of
+// |g_next_seq|. They are timed as of the snapshot, so event times are only as
+// fine as |kDrainIntervalUs|.
+void Drain() {
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  g_writer->set_time(now.tv_sec * 1000000000ULL + now.tv_nsec);
+
+  // Every thread that took a sequence number below |end| has either published
+  // its record by now, or is still marked as recording.
+  const uint64_t end = g_next_seq.load();
+  std::vector<const Record*> records;
+  std::vector<std::pair<ThreadBuffer*, uint64_t>> new_tails;
+  for (ThreadBuffer* buffer = g_buffers.load(); buffer;
+       buffer = buffer->next) {
+    while (buffer->recording.load())
+      sched_yield();
+    const uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+    const uint64_t head = buffer->head.load();
+    uint64_t i = tail;
+    for (; i != head; ++i) {
+      const Record* record = &buffer->records[i % kRingSize];
+      if (record->seq >= end)
+        break;
+      records.push_back(record);
+    }
+    if (i != tail)
+      new_tails.push_back(std::make_pair(buffer, i));
+  }
+
+  std::sort(records.begin(), records.end(), CompareSeq);
+  for (const Record* record : records) {
+    if (record->is_alloc) {
+      g_writer->WriteAlloc(record->ptr, record->size, record->depth,
+                           record->stack);
+    } else {
+      g_writer->WriteFree(record->ptr);
+    }
+  }
+
+  for (const auto& new_tail : new_tails)
+    new_tail.first->tail.store(new_tail.second, std::memory_order_release);
+
+  // Buffers of exited threads can be reused once they are empty.
+  for (ThreadBuffer* buffer = g_buffers.load(); buffer;
+       buffer = buffer->next) {
+    int state = ThreadBuffer::kExited;
+    if (buffer->tail.load() == buffer->head.load())
+      buffer->state.compare_exchange_strong(state, ThreadBuffer::kFree);
+  }
+}
+
+void* WriterMain(void*) {
+  t_in_recorder = true;
+  // If the replay tool goes away, writes fail rather than killing the process.
+  sigset_t sigpipe;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+  for (int i = 1; !g_stopping.load(); ++i) {
+    Drain();
+    if (g_streaming && i % kDrainsPerFlush == 0)
+      g_writer->Flush();
+    usleep(kDrainIntervalUs);
+  }
+  Drain();
+  return NULL;
+}
+
+// Connect to the Unix domain socket at |path|. Returns -1 on failure.
+int Connect(const char* path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+struct Mapping {
+  const char* module;
+  uint64_t addr;
+  uint64_t size;
+};
+
+// Get the extent of the loadable segments of |info|. Returns false if it has
+// none.
+bool GetExtent(const struct dl_phdr_info* info, uint64_t* addr,
+               uint64_t* size) {
+  uint64_t begin = UINT64_MAX;
+  uint64_t end = 0;
+  for (int i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    if (phdr.p_type != PT_LOAD)
+      continue;
+    begin = std::min<uint64_t>(begin, phdr.p_vaddr);
+    end = std::max<uint64_t>(end, phdr.p_vaddr + phdr.p_memsz);
+  }
+  if (begin >= end)
+    return false;
+  *addr = info->dlpi_addr + begin;
+  *size = end - begin;
+  return true;
+}
+
+int FindMapping(struct dl_phdr_info* info, size_t, void* data) {
+  Mapping* mapping = static_cast<Mapping*>(data);
+  // The main executable comes first, and has an empty name.
+  if (mapping->module && !strstr(info->dlpi_name, mapping->module))
+    return 0;
+  return GetExtent(info, &mapping->addr, &mapping->size);
+}
+
+// Add |info| to the module table of the trace.
+int AddModule(struct dl_phdr_info* info, size_t, void* data) {
+  uint64_t addr;
+  uint64_t size;
+  if (GetExtent(info, &addr, &size)) {
+    const char* name =
+        info->dlpi_name[0] ? info->dlpi_name : program_invocation_name;
+    static_cast<TraceWriter*>(data)->AddModule(addr, size, name);
+  }
+  return 0;
+}
+
+void DisableInChild() {
+  g_enabled.store(false);
+}
+
+__attribute__((constructor)) void StartRecording() {
+  ScopedRecorderGuard guard;
+
+  const char* pattern = getenv("TRACE_RECORDER_FILE");
+  if (!pattern)
+    pattern = "trace.%p";
+  char path[PATH_MAX];
+  const char* pid = strstr(pattern, "%p");
+  if (pid) {
+    snprintf(path, sizeof(path), "%.*s%d%s", static_cast<int>(pid - pattern),
+             pattern, getpid(), pid + 2);
+  } else {
+    snprintf(path, sizeof(path), "%s", pattern);
+  }
+  if (const char* value = getenv("TRACE_RECORDER_STACK_DEPTH"))
+    g_stack_depth = std::max(0, std::min(kMaxStackDepth, atoi(value)));
+
+  Mapping mapping = { getenv("TRACE_RECORDER_MODULE"), 0, 0 };
+  dl_iterate_phdr(FindMapping, &mapping);
+
+  g_writer = new TraceWriter;
+  g_writer->set_clock(trace_format::kRealtimeClock);
+  dl_iterate_phdr(AddModule, g_writer);
+  static const char kSocketPrefix[] = "unix:";
+  if (strncmp(path, kSocketPrefix, sizeof(kSocketPrefix) - 1) == 0) {
+    int fd = Connect(path + sizeof(kSocketPrefix) - 1);
+    if (fd < 0 || !g_writer->OpenFd(fd, mapping.addr, mapping.size)) {
+      fprintf(stderr, "trace_recorder: could not connect to %s\n", path);
+      return;
+    }
+    g_streaming = true;
+  } else if (!g_writer->Open(path, mapping.addr, mapping.size)) {
+    fprintf(stderr, "trace_recorder: could not create %s\n", path);
+    return;
+  }
+
+  // backtrace() loads the unwinder the first time it is called.
+  void* stack[1];
+  backtrace(stack, 1);
+
+  pthread_key_create(&g_thread_key, OnThreadExit);
+  pthread_atfork(NULL, NULL, DisableInChild);
+  if (pthread_create(&g_writer_thread, NULL, WriterMain, NULL) != 0) {
+    fprintf(stderr, "trace_recorder: could not start the writer thread\n");
+    return;
+  }
+  g_enabled.store(true);
+}
+
+__attribute__((destructor)) void StopRecording() {
+  if (!g_enabled.exchange(false))
+    return;
+  ScopedRecorderGuard guard;
+
+  g_stopping.store(true);
+  pthread_join(g_writer_thread, NULL);
+  if (!g_writer->Close()) {
+    fprintf(stderr, "trace_recorder: could not write the trace\n");
+    return;
+  }
+  fprintf(stderr, "trace_recorder: recorded %" PRIu64 " events\n",
+          g_writer->num_events());
+}
+
+void* NewOrHandle(size_t size, bool nothrow) {
+  for (;;) {
+    void* ptr = __libc_malloc(size);
+    if (ptr)
+      return ptr;
+    std::new_handler handler = std::get_new_handler();
+    if (!handler) {
+      if (nothrow)
+        return NULL;
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+}  // namespace
+
+extern "C" {
+
+void* malloc(size_t size) {
+  void* ptr = __libc_malloc(size);
+  RecordAlloc(ptr, size);
+  return ptr;
+}
+
+void free(void* ptr) {
+  RecordFree(ptr);
+  __libc_free(ptr);
+}
+
+void* calloc(size_t num, size_t size) {
+  void* ptr = __libc_calloc(num, size);
+  RecordAlloc(ptr, num * size);
+  return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+  // Recorded as a free followed by a new allocation. The free has to be
+  // recorded before |ptr| is released, since another thread may get it right
+  // away. If the reallocation fails, |ptr| is recorded again.
+  size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+  RecordFree(ptr);
+  void* new_ptr = __libc_realloc(ptr, size);
+  if (new_ptr)
+    RecordAlloc(new_ptr, size);
+  else if (size != 0)
+    RecordAlloc(ptr, old_size);
+  return new_ptr;
+}
+
+void* memalign(size_t alignment, size_t size) {
+  void* ptr = __libc_memalign(alignment, size);
+  RecordAlloc(ptr, size);
+  return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  void* ptr = __libc_memalign(alignment, size);
+  RecordAlloc(ptr, size);
+  return ptr;
+}
+
+int posix_memalign(void** result, size_t alignment, size_t size) {
+  if (alignment == 0 || alignment % sizeof(void*) != 0 ||
+      (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  void* ptr = __libc_memalign(alignment, size);
+  if (!ptr)
+    return ENOMEM;
+  RecordAlloc(ptr, size);
+  *result = ptr;
+  return 0;
+}
+
+void* valloc(size_t size) {
+  void* ptr = __libc_memalign(sysconf(_SC_PAGESIZE), size);
+  RecordAlloc(ptr, size);
+  return ptr;
+}
+
+}  // extern "C"
+
+void* operator new(size_t size) {
+  void* ptr = NewOrHandle(size, false);
+  RecordAlloc(ptr, size);
+  return ptr;
+}
+
+void* operator new[](size_t size) {
+  void* ptr = NewOrHandle(size, false);
+  RecordAlloc(ptr, size);
+  return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  void* ptr = NewOrHandle(size, true);
+  RecordAlloc(ptr, size);
+  return ptr;
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  void* ptr = NewOrHandle(size, true);
+  RecordAlloc(ptr, size);
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+  RecordFree(ptr);
+  __libc_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  RecordFree(ptr);
+  __libc_free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  RecordFree(ptr);
+  __libc_free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  RecordFree(ptr);
+  __libc_free(ptr);
+}
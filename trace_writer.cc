@@ -0,0 +1,289 @@
+#include "trace_writer.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "lz4_block.h"
+#include "trace_format.h"
+
+using trace_format::BlockHeader;
+using trace_format::FileHeader;
+using trace_format::IndexEntry;
+using trace_format::IndexTrailer;
+using trace_format::ModuleEntry;
+using trace_format::PutVarint;
+using trace_format::ZigZagEncode;
+
+namespace {
+
+// Longest encoding of a varint.
+const size_t kMaxVarintSize = 10;
+
+// Module names are padded to a multiple of this.
+const size_t kModuleNameAlignment = 8;
+
+size_t PaddedSize(size_t size) {
+  return (size + kModuleNameAlignment - 1) / kModuleNameAlignment *
+         kModuleNameAlignment;
+}
+
+// The delta from |prev| to |value|, which wraps around at |pointer_size|.
+int64_t PointerDelta(uintptr_t value, uintptr_t prev, int pointer_size) {
+  if (pointer_size == 4)
+    return static_cast<int32_t>(value - prev);
+  return static_cast<intptr_t>(value - prev);
+}
+
+}  // namespace
+
+TraceWriter::TraceWriter()
+    : file_(NULL),
+      failed_(false),
+      compression_(true),
+      pointer_size_(sizeof(void*)),
+      clock_(trace_format::kUnknownClock),
+      file_offset_(0),
+      block_size_(0),
+      block_num_events_(0),
+      block_index_(0),
+      block_time_(0),
+      time_(0),
+      prev_ptr_(0),
+      num_events_(0) {}
+
+TraceWriter::~TraceWriter() {
+  Close();
+}
+
+bool TraceWriter::Open(const char* path,
+                       uint64_t mapping_addr,
+                       uint64_t mapping_size) {
+  Close();
+  file_ = fopen(path, "wb");
+  if (!file_)
+    return false;
+  WriteHeader(mapping_addr, mapping_size);
+  return true;
+}
+
+bool TraceWriter::OpenFd(int fd, uint64_t mapping_addr, uint64_t mapping_size) {
+  Close();
+  file_ = fdopen(fd, "wb");
+  if (!file_) {
+    close(fd);
+    return false;
+  }
+  WriteHeader(mapping_addr, mapping_size);
+  return true;
+}
+
+void TraceWriter::WriteHeader(uint64_t mapping_addr, uint64_t mapping_size) {
+  failed_ = false;
+  file_offset_ = 0;
+  index_.clear();
+  stack_ids_.clear();
+  stack_defined_in_block_.clear();
+  block_size_ = 0;
+  block_num_events_ = 0;
+  block_index_ = 0;
+  block_time_ = 0;
+  time_ = 0;
+  prev_ptr_ = 0;
+  num_events_ = 0;
+
+  FileHeader header = {};
+  memcpy(header.magic, trace_format::kMagic, sizeof(header.magic));
+  header.version = trace_format::kVersion;
+  header.header_size = sizeof(header);
+  for (const Module& module : modules_)
+    header.header_size += sizeof(ModuleEntry) + PaddedSize(module.name.size());
+  header.mapping_addr = mapping_addr;
+  header.mapping_size = mapping_size;
+  header.byte_order = trace_format::kHostByteOrder;
+  header.pointer_size = pointer_size_;
+  header.clock = clock_;
+  header.num_modules = modules_.size();
+  Write(&header, sizeof(header));
+
+  for (const Module& module : modules_) {
+    ModuleEntry entry = {};
+    entry.addr = module.addr;
+    entry.size = module.size;
+    entry.name_size = module.name.size();
+    Write(&entry, sizeof(entry));
+    std::string name = module.name;
+    name.resize(PaddedSize(name.size()));
+    Write(name.data(), name.size());
+  }
+}
+
+void TraceWriter::AddModule(uint64_t addr,
+                            uint64_t size,
+                            const std::string& name) {
+  modules_.push_back(Module{addr, size, name});
+}
+
+bool TraceWriter::Close() {
+  if (!file_)
+    return true;
+  FlushBlock();
+  WriteIndex();
+  if (fclose(file_) != 0)
+    failed_ = true;
+  file_ = NULL;
+  return !failed_;
+}
+
+bool TraceWriter::Flush() {
+  if (!file_)
+    return true;
+  FlushBlock();
+  if (fflush(file_) != 0)
+    failed_ = true;
+  return !failed_;
+}
+
+void TraceWriter::Write(const void* data, size_t size) {
+  if (fwrite(data, 1, size, file_) != size)
+    failed_ = true;
+  file_offset_ += size;
+}
+
+uint8_t* TraceWriter::Reserve(size_t size) {
+  if (block_.size() < block_size_ + size)
+    block_.resize(std::max(block_.size() * 2, block_size_ + size));
+  return &block_[block_size_];
+}
+
+uint8_t* TraceWriter::PutPointer(uint8_t* out, const void* ptr) {
+  uintptr_t value = reinterpret_cast<uintptr_t>(ptr);
+  out = PutVarint(out,
+                  ZigZagEncode(PointerDelta(value, prev_ptr_, pointer_size_)));
+  prev_ptr_ = value;
+  return out;
+}
+
+uint32_t TraceWriter::InternStack(uint32_t depth, void* const* stack) {
+  std::string key(reinterpret_cast<const char*>(stack),
+                  depth * sizeof(*stack));
+  auto result = stack_ids_.emplace(key, stack_ids_.size());
+  uint32_t id = result.first->second;
+  if (result.second)
+    stack_defined_in_block_.push_back(0);
+
+  if (stack_defined_in_block_[id] != block_index_ + 1) {
+    stack_defined_in_block_[id] = block_index_ + 1;
+    uint8_t* out = Reserve(1 + 2 * kMaxVarintSize + depth * kMaxVarintSize);
+    uint8_t* start = out;
+    *out++ = trace_format::kStackRecord;
+    out = PutVarint(out, id);
+    out = PutVarint(out, depth);
+    uintptr_t prev_frame = 0;
+    for (uint32_t i = 0; i < depth; ++i) {
+      uintptr_t frame = reinterpret_cast<uintptr_t>(stack[i]);
+      out = PutVarint(
+          out, ZigZagEncode(PointerDelta(frame, prev_frame, pointer_size_)));
+      prev_frame = frame;
+    }
+    block_size_ += out - start;
+  }
+  return id;
+}
+
+void TraceWriter::WriteAlloc(const void* ptr,
+                             uint64_t size,
+                             uint32_t depth,
+                             void* const* stack) {
+  StartEvent();
+  uint32_t stack_id = InternStack(depth, stack);
+  uint8_t* out = Reserve(1 + 3 * kMaxVarintSize);
+  uint8_t* start = out;
+  *out++ = trace_format::kAllocRecord;
+  out = PutPointer(out, ptr);
+  out = PutVarint(out, size);
+  out = PutVarint(out, stack_id);
+  block_size_ += out - start;
+  FinishEvent();
+}
+
+void TraceWriter::WriteFree(const void* ptr) {
+  StartEvent();
+  uint8_t* out = Reserve(1 + kMaxVarintSize);
+  uint8_t* start = out;
+  *out++ = trace_format::kFreeRecord;
+  out = PutPointer(out, ptr);
+  block_size_ += out - start;
+  FinishEvent();
+}
+
+void TraceWriter::StartEvent() {
+  if (block_num_events_ == 0)
+    block_time_ = time_;
+}
+
+void TraceWriter::FinishEvent() {
+  ++block_num_events_;
+  ++num_events_;
+  if (block_size_ >= trace_format::kTargetBlockSize)
+    FlushBlock();
+}
+
+void TraceWriter::FlushBlock() {
+  if (block_num_events_ == 0)
+    return;
+
+  BlockHeader header = {};
+  header.payload_size = block_size_;
+  header.raw_size = block_size_;
+  header.compression = trace_format::kNoCompression;
+  header.num_events = block_num_events_;
+  header.first_event_index = num_events_ - block_num_events_;
+  header.first_event_time = block_time_;
+
+  const uint8_t* payload = block_.data();
+  if (compression_) {
+    compressed_block_.resize(block_size_);
+    // Only keep the compressed payload if it is smaller.
+    size_t compressed_size = lz4::Compress(block_.data(), block_size_,
+                                           compressed_block_.data(),
+                                           block_size_ - 1);
+    if (compressed_size > 0) {
+      header.payload_size = compressed_size;
+      header.compression = trace_format::kLZ4Compression;
+      payload = compressed_block_.data();
+    }
+  }
+
+  index_.push_back(file_offset_);
+  index_.push_back(header.first_event_index);
+  index_.push_back(header.first_event_time);
+  Write(&header, sizeof(header));
+  Write(payload, header.payload_size);
+
+  block_size_ = 0;
+  block_num_events_ = 0;
+  ++block_index_;
+  prev_ptr_ = 0;
+}
+
+void TraceWriter::WriteIndex() {
+  static_assert(sizeof(IndexEntry) == 3 * sizeof(uint64_t),
+                "|index_| must have the layout of IndexEntry.");
+  IndexTrailer trailer = {};
+  trailer.index_offset = file_offset_;
+  memcpy(trailer.magic, trace_format::kIndexMagic, sizeof(trailer.magic));
+
+  BlockHeader header = {};
+  header.payload_size = index_.size() * sizeof(uint64_t) + sizeof(trailer);
+  header.raw_size = header.payload_size;
+  header.compression = trace_format::kNoCompression;
+  header.num_events = 0;
+  header.first_event_index = num_events_;
+  header.first_event_time = time_;
+  Write(&header, sizeof(header));
+  if (!index_.empty())
+    Write(index_.data(), index_.size() * sizeof(uint64_t));
+  Write(&trailer, sizeof(trailer));
+}
@@ -0,0 +1,144 @@
+#ifndef TRACE_WRITER_H_
+#define TRACE_WRITER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "trace_format.h"
+
+// Writes allocation traces in the compact version 3 format described in
+// trace_format.h. Call stacks are interned, so each distinct stack is written
+// at most once per block, and events only refer to it by id. Blocks are
+// LZ4-compressed unless that is turned off, and an index of the blocks is
+// written when the trace is closed.
+class TraceWriter {
+ public:
+  TraceWriter();
+  ~TraceWriter();
+
+  // Create the trace at |path|. Returns false on failure.
+  bool Open(const char* path, uint64_t mapping_addr, uint64_t mapping_size);
+
+  // Write the trace to |fd|, which may be a pipe or a socket, as the trace is
+  // only written front to back. Takes ownership of |fd|. Returns false on
+  // failure.
+  bool OpenFd(int fd, uint64_t mapping_addr, uint64_t mapping_size);
+
+  // Write out any buffered events and close the file. Returns false if any
+  // write failed.
+  bool Close();
+
+  // Write out the events so far, ending the current block early, so that a
+  // reader at the other end of a pipe sees them. Returns false if any write
+  // failed.
+  bool Flush();
+
+  // The settings below are written into the trace header, so they must be
+  // made before Open().
+
+  // Size of pointers in the recorded process. Defaults to that of this one.
+  void set_pointer_size(int pointer_size) {
+    pointer_size_ = pointer_size;
+  }
+
+  // What set_time() values are measured with. Unknown by default.
+  void set_clock(trace_format::ClockSource clock) {
+    clock_ = clock;
+  }
+
+  // Add a module that is loaded in the recorded process.
+  void AddModule(uint64_t addr, uint64_t size, const std::string& name);
+
+  // Whether to compress blocks. On by default.
+  void set_compression(bool compression) {
+    compression_ = compression;
+  }
+
+  // Set the time of the events that are written next, in nanoseconds. Each
+  // block records the time of its first event, so that readers can seek by
+  // time.
+  void set_time(uint64_t time) {
+    time_ = time;
+  }
+
+  void WriteAlloc(const void* ptr, uint64_t size, uint32_t depth,
+                  void* const* stack);
+  void WriteFree(const void* ptr);
+
+  uint64_t num_events() const {
+    return num_events_;
+  }
+  uint64_t num_stacks() const {
+    return stack_ids_.size();
+  }
+
+ private:
+  // Return the id of |stack|, adding it to the current block if it has not been
+  // defined there yet.
+  uint32_t InternStack(uint32_t depth, void* const* stack);
+
+  // Make room for |size| more bytes in the current block.
+  uint8_t* Reserve(size_t size);
+
+  // Append a pointer, as a delta from the previous one in the block.
+  uint8_t* PutPointer(uint8_t* out, const void* ptr);
+
+  // Called before and after each event. FinishEvent() writes out the current
+  // block once it is large enough.
+  void StartEvent();
+  void FinishEvent();
+  void FlushBlock();
+
+  // Write the block index, which ends the trace.
+  void WriteIndex();
+
+  // Write the trace header to |file_|, which has just been opened.
+  void WriteHeader(uint64_t mapping_addr, uint64_t mapping_size);
+
+  // Write |size| bytes to the file.
+  void Write(const void* data, size_t size);
+
+  FILE* file_;
+  bool failed_;
+  bool compression_;
+
+  int pointer_size_;
+  trace_format::ClockSource clock_;
+  struct Module {
+    uint64_t addr;
+    uint64_t size;
+    std::string name;
+  };
+  std::vector<Module> modules_;
+
+  // Number of bytes written so far.
+  uint64_t file_offset_;
+
+  // Offsets, first event indices and times of all blocks written so far, in
+  // the layout of trace_format::IndexEntry.
+  std::vector<uint64_t> index_;
+
+  // Ids of all stacks seen so far, keyed by their raw frames.
+  std::unordered_map<std::string, uint32_t> stack_ids_;
+
+  // For each stack id, 1 + the index of the last block it was defined in.
+  std::vector<uint64_t> stack_defined_in_block_;
+
+  // The block being built.
+  std::vector<uint8_t> block_;
+  size_t block_size_;
+  std::vector<uint8_t> compressed_block_;
+  uint32_t block_num_events_;
+  uint64_t block_index_;
+  uint64_t block_time_;
+  uint64_t time_;
+  uintptr_t prev_ptr_;
+
+  uint64_t num_events_;
+};
+
+#endif  // TRACE_WRITER_H_